@@ -0,0 +1,193 @@
+package main
+
+import (
+	"encoding/binary"
+	"errors"
+	"os"
+)
+
+// Fields of the ext2/3/4 superblock and group descriptors the block map is built from
+const (
+	ext4SuperblockOffset = 1024
+	ext4SuperblockSize   = 1024
+	ext4Magic            = 0xEF53
+
+	ext4FeatureCompatSparseSuper2   = 0x200
+	ext4FeatureIncompatMetaBg       = 0x10
+	ext4FeatureIncompat64Bit        = 0x80
+	ext4FeatureRoCompatSparseSuper  = 0x1
+	ext4FeatureRoCompatGdtCsum      = 0x10
+	ext4FeatureRoCompatMetadataCsum = 0x400
+
+	// The group's block bitmap was never written; only the group's metadata is in use
+	ext4GroupBlockUninit = 0x2
+)
+
+// Whether a group holds a backup of the superblock and the group descriptors
+func ext4GroupHasSuper(group uint64, sparseSuper bool) bool {
+	if !sparseSuper || group <= 1 {
+		return true
+	}
+	for _, base := range []uint64{3, 5, 7} {
+		power := base
+		for power < group {
+			power *= base
+		}
+		if power == group {
+			return true
+		}
+	}
+	return false
+}
+
+// Returns the value of the BlockMap extension for the ext2/3/4 filesystem in the image, like
+// bmaptool creates from it: block size, image length and the extents of blocks the filesystem
+// allocated, read from its block bitmaps, plus anything after the filesystem. The device only
+// writes those extents and discards the rest of the partition.
+func CreateBlockMap(fwImagePath string) ([]byte, error) {
+	image, err := os.Open(fwImagePath)
+	if err != nil {
+		return nil, err
+	}
+	defer image.Close()
+	info, err := image.Stat()
+	if err != nil {
+		return nil, err
+	}
+	imageLength := uint64(info.Size())
+
+	le := binary.LittleEndian
+	superblock := make([]byte, ext4SuperblockSize)
+	if _, err := image.ReadAt(superblock, ext4SuperblockOffset); err != nil || le.Uint16(superblock[0x38:]) != ext4Magic {
+		return nil, errors.New("image holds no ext2/3/4 filesystem")
+	}
+	logBlockSize := le.Uint32(superblock[0x18:])
+	if logBlockSize > 6 {
+		return nil, errors.New("unsupported filesystem block size")
+	}
+	blockSize := uint64(1024) << logBlockSize
+	compat := le.Uint32(superblock[0x5C:])
+	incompat := le.Uint32(superblock[0x60:])
+	roCompat := le.Uint32(superblock[0x64:])
+	// These place group descriptors and superblock backups where the bitmaps don't tell
+	if incompat&ext4FeatureIncompatMetaBg != 0 || compat&ext4FeatureCompatSparseSuper2 != 0 {
+		return nil, errors.New("unsupported filesystem layout (meta_bg or sparse_super2)")
+	}
+
+	blockCount := uint64(le.Uint32(superblock[0x04:]))
+	descriptorSize := uint64(32)
+	if incompat&ext4FeatureIncompat64Bit != 0 {
+		blockCount |= uint64(le.Uint32(superblock[0x150:])) << 32
+		descriptorSize = uint64(le.Uint16(superblock[0xFE:]))
+	}
+	firstDataBlock := uint64(le.Uint32(superblock[0x14:]))
+	blocksPerGroup := uint64(le.Uint32(superblock[0x20:]))
+	inodesPerGroup := uint64(le.Uint32(superblock[0x28:]))
+	inodeSize := uint64(128)
+	if le.Uint32(superblock[0x4C:]) >= 1 {
+		inodeSize = uint64(le.Uint16(superblock[0x58:]))
+	}
+	if descriptorSize < 32 || blocksPerGroup == 0 || blocksPerGroup > 8*blockSize || firstDataBlock >= blockCount {
+		return nil, errors.New("malformed ext2/3/4 superblock")
+	}
+	if blockCount*blockSize > imageLength {
+		return nil, errors.New("image is shorter than its filesystem")
+	}
+	groupCount := (blockCount - firstDataBlock + blocksPerGroup - 1) / blocksPerGroup
+	descriptorBlocks := (groupCount*descriptorSize + blockSize - 1) / blockSize
+	reservedDescriptorBlocks := uint64(le.Uint16(superblock[0xCE:]))
+	inodeTableBlocks := (inodesPerGroup*inodeSize + blockSize - 1) / blockSize
+	// Without group descriptor checksums the uninit flags aren't trusted, as by the kernel
+	checksummed := roCompat&(ext4FeatureRoCompatGdtCsum|ext4FeatureRoCompatMetadataCsum) != 0
+	sparseSuper := roCompat&ext4FeatureRoCompatSparseSuper != 0
+
+	allocated := make([]bool, blockCount)
+	mark := func(first uint64, count uint64) error {
+		if first > blockCount || count > blockCount-first {
+			return errors.New("malformed ext2/3/4 group descriptor")
+		}
+		for block := first; block < first+count; block++ {
+			allocated[block] = true
+		}
+		return nil
+	}
+	// A boot block in front of the filesystem, with 1 KiB blocks
+	mark(0, firstDataBlock)
+
+	descriptors := make([]byte, groupCount*descriptorSize)
+	if _, err := image.ReadAt(descriptors, int64((firstDataBlock+1)*blockSize)); err != nil {
+		return nil, err
+	}
+	bitmap := make([]byte, blockSize)
+	for group := uint64(0); group < groupCount; group++ {
+		descriptor := descriptors[group*descriptorSize : (group+1)*descriptorSize]
+		blockBitmap := uint64(le.Uint32(descriptor[0x00:]))
+		inodeBitmap := uint64(le.Uint32(descriptor[0x04:]))
+		inodeTable := uint64(le.Uint32(descriptor[0x08:]))
+		if descriptorSize >= 64 {
+			blockBitmap |= uint64(le.Uint32(descriptor[0x20:])) << 32
+			inodeBitmap |= uint64(le.Uint32(descriptor[0x24:])) << 32
+			inodeTable |= uint64(le.Uint32(descriptor[0x28:])) << 32
+		}
+		// With flex_bg a group's metadata may live in another, possibly uninitialized, group
+		for _, err := range []error{mark(blockBitmap, 1), mark(inodeBitmap, 1), mark(inodeTable, inodeTableBlocks)} {
+			if err != nil {
+				return nil, err
+			}
+		}
+
+		groupStart := firstDataBlock + group*blocksPerGroup
+		groupBlocks := blocksPerGroup
+		if blockCount-groupStart < groupBlocks {
+			groupBlocks = blockCount - groupStart
+		}
+		if checksummed && le.Uint16(descriptor[0x12:])&ext4GroupBlockUninit != 0 {
+			if ext4GroupHasSuper(group, sparseSuper) {
+				if err := mark(groupStart, 1+descriptorBlocks+reservedDescriptorBlocks); err != nil {
+					return nil, err
+				}
+			}
+			continue
+		}
+		if _, err := image.ReadAt(bitmap, int64(blockBitmap*blockSize)); err != nil {
+			return nil, err
+		}
+		for i := uint64(0); i < groupBlocks; i++ {
+			if bitmap[i/8]&(1<<(i%8)) != 0 {
+				allocated[groupStart+i] = true
+			}
+		}
+	}
+
+	blockMap := binary.LittleEndian.AppendUint32(nil, uint32(blockSize))
+	blockMap = binary.LittleEndian.AppendUint64(blockMap, imageLength)
+	addExtent := func(first uint64, count uint64) {
+		blockMap = binary.LittleEndian.AppendUint64(blockMap, first)
+		blockMap = binary.LittleEndian.AppendUint64(blockMap, count)
+	}
+	for block := uint64(0); block < blockCount; {
+		if !allocated[block] {
+			block++
+			continue
+		}
+		first := block
+		for block < blockCount && allocated[block] {
+			block++
+		}
+		if block == blockCount {
+			// Merged with what follows the filesystem
+			break
+		}
+		addExtent(first, block-first)
+	}
+	// Whatever follows the filesystem in the image is written as it is
+	imageBlocks := (imageLength + blockSize - 1) / blockSize
+	tailStart := blockCount
+	for tailStart > 0 && allocated[tailStart-1] {
+		tailStart--
+	}
+	if imageBlocks > tailStart {
+		addExtent(tailStart, imageBlocks-tailStart)
+	}
+	return blockMap, nil
+}
@@ -2,6 +2,7 @@ package main
 
 import (
 	"bufio"
+	"bytes"
 	"crypto/sha256"
 	"encoding/binary"
 	"errors"
@@ -10,9 +11,34 @@ import (
 	"io"
 	"io/ioutil"
 	"os"
+	"os/exec"
 	"strconv"
 )
 
+// TLV types of the header's extension block
+const (
+	ExtensionPayloadCompression uint16 = 1
+	// 8 byte compressed and 8 byte decompressed length of each frame
+	ExtensionPayloadFrameIndex uint16 = 2
+	// 8 byte length and SHA-256 of the image the payload is a delta against
+	ExtensionDeltaSource uint16 = 3
+	// 8 byte length of the image the payload is a sparse representation of
+	ExtensionSparseImage uint16 = 4
+	// 4 byte block size, 8 byte image length, then 8 byte first block and 8 byte block count of
+	// each extent of the image its filesystem allocated
+	ExtensionBlockMap uint16 = 5
+)
+
+// Values of the ExtensionPayloadCompression TLV
+const (
+	CompressionNone byte = 0
+	CompressionXz   byte = 1
+)
+
+// Devices reject frames longer than 16 MiB, compressed or not; half of that leaves room for
+// frames that don't compress
+const MaxFrameSize int64 = 8 * 1024 * 1024
+
 type UpdateArtifact struct {
 	Header      UpdateHeader
 	PayloadPath string
@@ -66,6 +92,9 @@ type UpdateHeader struct {
 	HardwareUUID   [16]byte
 	URILength      [2]byte
 	URIData        []byte
+	// Length of Extensions, followed by TLVs of a 2 byte type, a 4 byte length and the value
+	ExtensionsLength [4]byte
+	Extensions       []byte
 
 	Signature [256]byte
 }
@@ -86,6 +115,8 @@ func (header *UpdateHeader) CalcSHA256ArtifactDigest(file *os.File, imageChunkSi
 	hashbuilder.Write(header.HardwareUUID[:])
 	hashbuilder.Write(header.URILength[:])
 	hashbuilder.Write(header.URIData)
+	hashbuilder.Write(header.ExtensionsLength[:])
+	hashbuilder.Write(header.Extensions)
 
 	buffer := make([]byte, imageChunkSize)
 	reader := bufio.NewReader(file)
@@ -111,10 +142,94 @@ func (header *UpdateHeader) CalcSHA256ArtifactDigest(file *os.File, imageChunkSi
 	return &buff, nil
 }
 
+func (header *UpdateHeader) AddExtension(extensionType uint16, value []byte) {
+	tlv := make([]byte, 6, 6+len(value))
+	binary.LittleEndian.PutUint16(tlv[0:2], extensionType)
+	binary.LittleEndian.PutUint32(tlv[2:6], uint32(len(value)))
+	header.Extensions = append(header.Extensions, append(tlv, value...)...)
+	binary.LittleEndian.PutUint32(header.ExtensionsLength[:], uint32(len(header.Extensions)))
+}
+
+func compressXz(input io.Reader, output io.Writer) error {
+	cmd := exec.Command("xz", "--compress", "--stdout", "--check=crc32", "-6")
+	cmd.Stdin = input
+	cmd.Stdout = output
+	cmd.Stderr = os.Stderr
+	return cmd.Run()
+}
+
+// Compresses the image with xz(1) into a temporary file and returns its path. The default
+// preset keeps the window at 8 MiB, well below what the device allows for decompression.
+// With a frameSize, every frameSize bytes of the image are compressed independently, so the
+// device can decompress them in parallel; the frame index for the header is returned as well.
+func CompressImageXz(fwImagePath string, frameSize int64) (string, []byte, error) {
+	image, err := os.Open(fwImagePath)
+	if err != nil {
+		return "", nil, err
+	}
+	defer image.Close()
+
+	compressed, err := ioutil.TempFile("", "artifact-payload-*.xz")
+	if err != nil {
+		return "", nil, err
+	}
+	defer compressed.Close()
+
+	if frameSize <= 0 {
+		if err := compressXz(image, compressed); err != nil {
+			os.Remove(compressed.Name())
+			return "", nil, err
+		}
+		return compressed.Name(), nil, nil
+	}
+
+	if frameSize > MaxFrameSize {
+		return "", nil, errors.New("frames can't be larger than 8 MiB")
+	}
+	var frameIndex []byte
+	frame := make([]byte, frameSize)
+	var compressedLength int64
+	for {
+		read, err := io.ReadFull(image, frame)
+		if err == io.EOF {
+			break
+		}
+		if err != nil && err != io.ErrUnexpectedEOF {
+			os.Remove(compressed.Name())
+			return "", nil, err
+		}
+		if err := compressXz(bytes.NewReader(frame[:read]), compressed); err != nil {
+			os.Remove(compressed.Name())
+			return "", nil, err
+		}
+		end, err := compressed.Seek(0, io.SeekCurrent)
+		if err != nil {
+			os.Remove(compressed.Name())
+			return "", nil, err
+		}
+
+		entry := [16]byte{}
+		binary.LittleEndian.PutUint64(entry[0:8], uint64(end-compressedLength))
+		binary.LittleEndian.PutUint64(entry[8:16], uint64(read))
+		frameIndex = append(frameIndex, entry[:]...)
+		compressedLength = end
+	}
+	return compressed.Name(), frameIndex, nil
+}
+
 /* Creates an UpdateArtifact.
 	If URI is empty, the firmware image will be integrated into the artifact.
+	compression is "" or "xz"; a compressed image is decompressed by the device while it is written.
+	frameSize > 0 splits it into independently compressed frames of that many bytes.
+	With a deltaSourcePath, the payload is a delta of the image against that one, which the device
+	applies to its active root partition.
+	sparse is "", "fill" or "dontcare"; the payload then consists of data chunks and chunks the device
+	fills or leaves alone instead, see CreateSparseImage.
+	With bmap, the header carries the blocks the image's ext2/3/4 filesystem allocated; the device
+	writes only those and discards the rest of the partition, see CreateBlockMap.
 */
-func CreateArtifact(sequenceNumber uint64, hardwareUUID [16]byte, fwImagePath string, URI string, sigKeyPath string) (*UpdateArtifact, error) {
+func CreateArtifact(sequenceNumber uint64, hardwareUUID [16]byte, fwImagePath string, URI string, sigKeyPath string,
+	compression string, frameSize int64, deltaSourcePath string, sparse string, bmap bool) (*UpdateArtifact, error) {
 	if fwImagePath == "" {
 		return nil, errors.New("must provide fwImagePath")
 	}
@@ -138,6 +253,59 @@ func CreateArtifact(sequenceNumber uint64, hardwareUUID [16]byte, fwImagePath st
 			HardwareUUID: hardwareUUID, URILength: ulBuff, URIData: []byte(URI)}
 	}
 
+	if deltaSourcePath != "" && sparse != "" {
+		return nil, errors.New("a delta can't be sparse")
+	}
+	// Of the image itself, which the delta or sparse representation turn back into
+	if bmap {
+		blockMap, err := CreateBlockMap(fwImagePath)
+		if err != nil {
+			return nil, err
+		}
+		header.AddExtension(ExtensionBlockMap, blockMap)
+	}
+	if deltaSourcePath != "" {
+		deltaPath, deltaSource, err := CreateDelta(deltaSourcePath, fwImagePath)
+		if err != nil {
+			return nil, err
+		}
+		fwImagePath = deltaPath
+		header.AddExtension(ExtensionDeltaSource, deltaSource)
+	}
+
+	switch sparse {
+	case "":
+	case "fill", "dontcare":
+		sparsePath, imageLength, err := CreateSparseImage(fwImagePath, sparse == "dontcare")
+		if err != nil {
+			return nil, err
+		}
+		fwImagePath = sparsePath
+		header.AddExtension(ExtensionSparseImage, imageLength)
+	default:
+		return nil, errors.New("unsupported sparse mode " + sparse)
+	}
+
+	// The artifact's payload is the compressed image then
+	switch compression {
+	case "":
+	case "xz":
+		compressedPath, frameIndex, err := CompressImageXz(fwImagePath, frameSize)
+		if deltaSourcePath != "" || sparse != "" {
+			os.Remove(fwImagePath)
+		}
+		if err != nil {
+			return nil, err
+		}
+		fwImagePath = compressedPath
+		header.AddExtension(ExtensionPayloadCompression, []byte{CompressionXz})
+		if frameIndex != nil {
+			header.AddExtension(ExtensionPayloadFrameIndex, frameIndex)
+		}
+	default:
+		return nil, errors.New("unsupported compression " + compression)
+	}
+
 	image, err := os.Open(fwImagePath)
 	defer image.Close()
 
@@ -167,6 +335,14 @@ func main() {
 	seqFlag := flag.String("seq", "", "Specify sequence number")
 	imageFlag := flag.String("image", "", "Specify firmware image")
 	uuidFlag := flag.String("uuid", "", "Specify uuid")
+	compressFlag := flag.String("compress", "", "Compress the firmware image (xz)")
+	frameSizeFlag := flag.Int64("frameSize", 4, "Compress in independent frames of this many MiB, 0 for one stream")
+	deltaFlag := flag.String("delta", "", "Create a delta against this image, i.e. the installed root partition")
+	aesKeyFlag := flag.String("aesKey", "", "Specify the aes-key, e.g. the one of the full artifact for a delta")
+	blockSizeFlag := flag.Uint("blockSize", 4096, "Block size of the manifest of an uncompressed image, 0 for none")
+	sparseFlag := flag.String("sparse", "", "Send blocks of a repeated pattern, e.g. zeroes, as fill chunks (fill), "+
+		"or zero blocks as unused space the device doesn't write (dontcare)")
+	bmapFlag := flag.Bool("bmap", false, "Have the device write only the blocks the image's ext2/3/4 filesystem allocated")
 
 	flag.Parse()
 
@@ -180,7 +356,12 @@ func main() {
 	var uuidBuffer [16]byte
 	copy(uuidBuffer[:], *uuidFlag)
 	fmt.Println("imageflag", imageFlag)
-	art, err = CreateArtifact(sequenceNum, uuidBuffer, *imageFlag, *uriFlag, *keyFlag)
+	art, err = CreateArtifact(sequenceNum, uuidBuffer, *imageFlag, *uriFlag, *keyFlag, *compressFlag, *frameSizeFlag*1024*1024, *deltaFlag,
+		*sparseFlag, *bmapFlag)
+	if err == nil && (*compressFlag != "" || *deltaFlag != "" || *sparseFlag != "") {
+		// The compressed copy, delta or sparse representation of the image
+		defer os.Remove(art.PayloadPath)
+	}
 
 	if err != nil {
 		flag.PrintDefaults()
@@ -190,10 +371,17 @@ func main() {
 	if *outFlag != "" {
 
 		fmt.Println(art)
-		blob, err := art.EncryptAndSerialize("", *outFlag)
+		blob, err := art.EncryptAndSerialize(*aesKeyFlag, *outFlag)
 		if err != nil {
 			panic(err)
 		}
+		// Devices can only find blocks of the plain image on their root partition
+		if *compressFlag == "" && *deltaFlag == "" && *sparseFlag == "" && *uriFlag == "" && *blockSizeFlag > 0 {
+			err = art.WriteBlockManifest(fmt.Sprintf("%s/manifest", *outFlag), uint32(*blockSizeFlag))
+			if err != nil {
+				panic(err)
+			}
+		}
 		fmt.Println(blob)
 	}
 }
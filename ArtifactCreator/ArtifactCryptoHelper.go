@@ -67,11 +67,22 @@ func loadRSAPrivateKey(path string) (*rsa.PrivateKey, error) {
 	return parseRSAPrivateKey(data)
 }
 
+// Encrypts with the aes-key at AESKeyPath, e.g. to give the delta artifact of an update the key
+// of its full artifact, or with a new random key if AESKeyPath is empty
 func EncryptArtifact(AESKeyPath string, artifact UpdateArtifact) ([]byte, []byte, []byte, error) {
 
 	key := make([]byte, 16)
 
-	if _, err := io.ReadFull(rand.Reader, key); err != nil {
+	if AESKeyPath != "" {
+		keyBytes, err := ioutil.ReadFile(AESKeyPath)
+		if err != nil {
+			return nil, nil, nil, err
+		}
+		if len(keyBytes) != len(key) {
+			return nil, nil, nil, errors.New("aes-key must be 16 bytes")
+		}
+		copy(key, keyBytes)
+	} else if _, err := io.ReadFull(rand.Reader, key); err != nil {
 		return nil, nil, nil, err
 	}
 	ciph, err := aes.NewCipher(key)
@@ -101,6 +112,8 @@ func EncryptArtifact(AESKeyPath string, artifact UpdateArtifact) ([]byte, []byte
 	artifactBlob = append(artifactBlob, artifact.Header.HardwareUUID[:]...)
 	artifactBlob = append(artifactBlob, artifact.Header.URILength[:]...)
 	artifactBlob = append(artifactBlob, artifact.Header.URIData[:]...)
+	artifactBlob = append(artifactBlob, artifact.Header.ExtensionsLength[:]...)
+	artifactBlob = append(artifactBlob, artifact.Header.Extensions...)
 	artifactBlob = append(artifactBlob, fwImageBytes[:]...)
 
 	cipherText = gcm.Seal(cipherText, nonce, artifactBlob, nil)
@@ -0,0 +1,170 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"crypto/sha256"
+	"encoding/binary"
+	"io"
+	"io/ioutil"
+	"os"
+)
+
+// Instructions of a delta payload, see DeltaApplier on the device
+const (
+	DeltaOpCopy   byte = 1
+	DeltaOpAdd    byte = 2
+	DeltaOpInsert byte = 3
+)
+
+// Granularity at which the image is matched against the source
+const deltaBlockSize = 4096
+
+// A block of the image that differs from the source block at the same offset in at most this
+// many bytes is encoded as ADD; its differences compress to almost nothing
+const deltaMaxChangedBytes = deltaBlockSize / 8
+
+// Instructions carrying data are split at this length, so they aren't held in memory as a whole
+const deltaMaxInstructionData = 1024 * 1024
+
+type deltaWriter struct {
+	out *bufio.Writer
+	// The pending instruction, which the next block is merged into if possible
+	op        byte
+	srcOffset uint64
+	length    uint64
+	data      []byte
+}
+
+func (writer *deltaWriter) flush() error {
+	if writer.length == 0 {
+		return nil
+	}
+	instruction := []byte{writer.op}
+	if writer.op != DeltaOpInsert {
+		instruction = binary.LittleEndian.AppendUint64(instruction, writer.srcOffset)
+	}
+	instruction = binary.LittleEndian.AppendUint64(instruction, writer.length)
+	if _, err := writer.out.Write(instruction); err != nil {
+		return err
+	}
+	if _, err := writer.out.Write(writer.data); err != nil {
+		return err
+	}
+	writer.length = 0
+	writer.data = writer.data[:0]
+	return nil
+}
+
+func (writer *deltaWriter) add(op byte, srcOffset uint64, length uint64, data []byte) error {
+	contiguous := writer.op == op && (op == DeltaOpInsert || writer.srcOffset+writer.length == srcOffset)
+	if writer.length == 0 || !contiguous {
+		if err := writer.flush(); err != nil {
+			return err
+		}
+		writer.op = op
+		writer.srcOffset = srcOffset
+	}
+	writer.length += length
+	writer.data = append(writer.data, data...)
+	if len(writer.data) >= deltaMaxInstructionData {
+		return writer.flush()
+	}
+	return nil
+}
+
+func countChangedBytes(a []byte, b []byte) int {
+	changed := 0
+	for i := range a {
+		if a[i] != b[i] {
+			changed++
+		}
+	}
+	return changed
+}
+
+// Creates a delta of the image against sourcePath, e.g. the root partition currently installed on
+// the devices, in a temporary file and returns its path and the value of the DeltaSource extension.
+// Each block of the image is copied from the source where the source contains it, at the same or
+// any other block offset, encoded as bytewise differences to the source block at the same offset if
+// that one is similar, and inserted as it is otherwise.
+func CreateDelta(sourcePath string, fwImagePath string) (string, []byte, error) {
+	source, err := ioutil.ReadFile(sourcePath)
+	if err != nil {
+		return "", nil, err
+	}
+	image, err := os.Open(fwImagePath)
+	if err != nil {
+		return "", nil, err
+	}
+	defer image.Close()
+
+	// First offset of each distinct block of the source
+	sourceBlocks := make(map[[32]byte]uint64)
+	for offset := 0; offset+deltaBlockSize <= len(source); offset += deltaBlockSize {
+		hash := sha256.Sum256(source[offset : offset+deltaBlockSize])
+		if _, found := sourceBlocks[hash]; !found {
+			sourceBlocks[hash] = uint64(offset)
+		}
+	}
+
+	delta, err := ioutil.TempFile("", "artifact-delta-*")
+	if err != nil {
+		return "", nil, err
+	}
+	defer delta.Close()
+	writer := deltaWriter{out: bufio.NewWriter(delta)}
+	fail := func(err error) (string, []byte, error) {
+		os.Remove(delta.Name())
+		return "", nil, err
+	}
+
+	block := make([]byte, deltaBlockSize)
+	diff := make([]byte, deltaBlockSize)
+	var offset uint64
+	for {
+		read, err := io.ReadFull(image, block)
+		if err == io.EOF {
+			break
+		}
+		if err != nil && err != io.ErrUnexpectedEOF {
+			return fail(err)
+		}
+		data := block[:read]
+		length := uint64(read)
+
+		var sameOffset []byte
+		if offset+length <= uint64(len(source)) {
+			sameOffset = source[offset : offset+length]
+		}
+		matchOffset, found := sourceBlocks[sha256.Sum256(data)]
+		switch {
+		case sameOffset != nil && bytes.Equal(data, sameOffset):
+			err = writer.add(DeltaOpCopy, offset, length, nil)
+		case found && read == deltaBlockSize:
+			err = writer.add(DeltaOpCopy, matchOffset, length, nil)
+		case sameOffset != nil && countChangedBytes(data, sameOffset) <= deltaMaxChangedBytes:
+			for i := range data {
+				diff[i] = data[i] - sameOffset[i]
+			}
+			err = writer.add(DeltaOpAdd, offset, length, diff[:read])
+		default:
+			err = writer.add(DeltaOpInsert, 0, length, data)
+		}
+		if err != nil {
+			return fail(err)
+		}
+		offset += length
+	}
+	if err := writer.flush(); err != nil {
+		return fail(err)
+	}
+	if err := writer.out.Flush(); err != nil {
+		return fail(err)
+	}
+
+	sourceHash := sha256.Sum256(source)
+	deltaSource := binary.LittleEndian.AppendUint64(nil, uint64(len(source)))
+	deltaSource = append(deltaSource, sourceHash[:]...)
+	return delta.Name(), deltaSource, nil
+}
@@ -0,0 +1,73 @@
+package main
+
+import (
+	"bufio"
+	"crypto/sha256"
+	"encoding/binary"
+	"io"
+	"os"
+)
+
+// rsync's rolling checksum over a block; must match RollingChecksum on the device
+func weakChecksum(block []byte) uint32 {
+	var a, b uint32
+	for i, value := range block {
+		a += uint32(value)
+		b += uint32(len(block)-i) * uint32(value)
+	}
+	return (a & 0xffff) | (b << 16)
+}
+
+// Writes the block manifest of the artifact's payload, which lets devices rebuild the artifact
+// from the blocks their active root partition has already and download only the others.
+// Layout, little-endian: 8 byte offset of the payload within the artifact, 8 byte payload
+// length, 4 byte block size, then per block its weak checksum (4 bytes) and its SHA-256.
+// Only meaningful for payloads that are the plain image, i.e. neither compressed nor a delta.
+func (artifact *UpdateArtifact) WriteBlockManifest(manifestPath string, blockSize uint32) error {
+	payload, err := os.Open(artifact.PayloadPath)
+	if err != nil {
+		return err
+	}
+	defer payload.Close()
+	info, err := payload.Stat()
+	if err != nil {
+		return err
+	}
+
+	header := artifact.Header
+	payloadOffset := len(header.Signature) + len(header.SequenceNumber) + len(header.HardwareUUID) +
+		len(header.URILength) + len(header.URIData) + len(header.ExtensionsLength) + len(header.Extensions)
+
+	manifest, err := os.Create(manifestPath)
+	if err != nil {
+		return err
+	}
+	defer manifest.Close()
+	writer := bufio.NewWriter(manifest)
+
+	fixed := make([]byte, 20)
+	binary.LittleEndian.PutUint64(fixed[0:8], uint64(payloadOffset))
+	binary.LittleEndian.PutUint64(fixed[8:16], uint64(info.Size()))
+	binary.LittleEndian.PutUint32(fixed[16:20], blockSize)
+	if _, err := writer.Write(fixed); err != nil {
+		return err
+	}
+
+	block := make([]byte, blockSize)
+	reader := bufio.NewReader(payload)
+	for {
+		read, err := io.ReadFull(reader, block)
+		if err == io.EOF {
+			break
+		}
+		if err != nil && err != io.ErrUnexpectedEOF {
+			return err
+		}
+		entry := binary.LittleEndian.AppendUint32(nil, weakChecksum(block[:read]))
+		strong := sha256.Sum256(block[:read])
+		if _, err := writer.Write(append(entry, strong[:]...)); err != nil {
+			return err
+		}
+	}
+	return writer.Flush()
+}
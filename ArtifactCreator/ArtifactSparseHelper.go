@@ -0,0 +1,133 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/binary"
+	"io"
+	"io/ioutil"
+	"os"
+)
+
+// Chunks of a sparse payload, see SparseImageExpander on the device
+const (
+	SparseChunkData     byte = 1
+	SparseChunkFill     byte = 2
+	SparseChunkDontCare byte = 3
+)
+
+// Granularity at which the image is checked for fill patterns
+const sparseBlockSize = 4096
+
+// Data chunks are split at this length, so they aren't held in memory as a whole
+const sparseMaxChunkData = 1024 * 1024
+
+type sparseWriter struct {
+	out *bufio.Writer
+	// The pending chunk, which the next block is merged into if possible
+	chunk   byte
+	pattern uint32
+	length  uint64
+	data    []byte
+}
+
+func (writer *sparseWriter) flush() error {
+	if writer.length == 0 {
+		return nil
+	}
+	chunk := []byte{writer.chunk}
+	chunk = binary.LittleEndian.AppendUint64(chunk, writer.length)
+	if writer.chunk == SparseChunkFill {
+		chunk = binary.LittleEndian.AppendUint32(chunk, writer.pattern)
+	}
+	if _, err := writer.out.Write(chunk); err != nil {
+		return err
+	}
+	if _, err := writer.out.Write(writer.data); err != nil {
+		return err
+	}
+	writer.length = 0
+	writer.data = writer.data[:0]
+	return nil
+}
+
+func (writer *sparseWriter) add(chunk byte, pattern uint32, data []byte) error {
+	if writer.length == 0 || writer.chunk != chunk || writer.pattern != pattern {
+		if err := writer.flush(); err != nil {
+			return err
+		}
+		writer.chunk = chunk
+		writer.pattern = pattern
+	}
+	writer.length += uint64(len(data))
+	if chunk == SparseChunkData {
+		writer.data = append(writer.data, data...)
+		if len(writer.data) >= sparseMaxChunkData {
+			return writer.flush()
+		}
+	}
+	return nil
+}
+
+// Whether block repeats its first 4 bytes throughout. bytes.Equal is the runtime's vectorized
+// memequal (SSE/AVX2 on amd64, NEON on arm64), so this runs at memory speed.
+func isFillBlock(block []byte) bool {
+	return len(block) == sparseBlockSize && bytes.Equal(block[4:], block[:len(block)-4])
+}
+
+// Creates a sparse representation of the image in a temporary file and returns its path and the
+// image's length, the value of the SparseImage extension. Blocks repeating a 4 byte pattern, above
+// all zeroes, become fill chunks the device writes without them being transferred. With dontCare,
+// zero blocks become don't-care chunks instead, which the device doesn't write at all; only for
+// images whose zero blocks are unused space, as the partition then holds whatever was there before.
+func CreateSparseImage(fwImagePath string, dontCare bool) (string, []byte, error) {
+	image, err := os.Open(fwImagePath)
+	if err != nil {
+		return "", nil, err
+	}
+	defer image.Close()
+
+	sparse, err := ioutil.TempFile("", "artifact-sparse-*")
+	if err != nil {
+		return "", nil, err
+	}
+	defer sparse.Close()
+	writer := sparseWriter{out: bufio.NewWriter(sparse)}
+	fail := func(err error) (string, []byte, error) {
+		os.Remove(sparse.Name())
+		return "", nil, err
+	}
+
+	block := make([]byte, sparseBlockSize)
+	var imageLength uint64
+	for {
+		read, err := io.ReadFull(image, block)
+		if err == io.EOF {
+			break
+		}
+		if err != nil && err != io.ErrUnexpectedEOF {
+			return fail(err)
+		}
+		data := block[:read]
+		imageLength += uint64(read)
+
+		switch {
+		case !isFillBlock(data):
+			err = writer.add(SparseChunkData, 0, data)
+		case dontCare && binary.LittleEndian.Uint32(data) == 0:
+			err = writer.add(SparseChunkDontCare, 0, data)
+		default:
+			err = writer.add(SparseChunkFill, binary.LittleEndian.Uint32(data), data)
+		}
+		if err != nil {
+			return fail(err)
+		}
+	}
+	if err := writer.flush(); err != nil {
+		return fail(err)
+	}
+	if err := writer.out.Flush(); err != nil {
+		return fail(err)
+	}
+	return sparse.Name(), binary.LittleEndian.AppendUint64(nil, imageLength), nil
+}
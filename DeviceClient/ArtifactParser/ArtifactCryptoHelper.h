@@ -14,6 +14,7 @@
 #include <array>
 #include <algorithm>
 #include <openssl/rsa.h>
+#include <sys/types.h>
 
 class verify_signature_exception : public std::runtime_error {
 public:
@@ -25,7 +26,187 @@ public:
     explicit decryption_exception(const char* message) : std::runtime_error(message) {}
 };
 
+// Decrypts an AES-128-GCM artifact that arrives in arbitrarily sized chunks, using a single
+// cipher context for its whole lifetime. Fed through Update(), the last 16 bytes of the stream
+// are taken as the authentication tag and held back until Finalize(), so the tag may be split
+// across any number of chunks. Callers that have the tag separately use UpdateCiphertext() and
+// Finalize(tag) instead; the two ways of feeding it must not be mixed.
+class AESGCMDecryptor {
+private:
+    EVP_CIPHER_CTX* ctx = nullptr;
+    std::array<unsigned char, 16> tail{};
+    size_t tailLength = 0;
+
+    // EVP_DecryptUpdate takes an int length, large mappings are handed over in pieces
+    void Decrypt(const unsigned char* in, size_t length, unsigned char* out) {
+        const size_t maxPiece = 1 << 30;
+        while (length > 0) {
+            size_t piece = std::min(length, maxPiece);
+            int len;
+            if (!EVP_DecryptUpdate(ctx, out, &len, in, (int) piece)) {
+                ERR_print_errors_fp(stderr);
+                throw decryption_exception("decryption failed");
+            }
+            in += piece;
+            out += piece;
+            length -= piece;
+        }
+    }
+
+    bool CheckTag(const unsigned char* tag) {
+        if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16, (void*) tag)) {
+            ERR_print_errors_fp(stderr);
+            throw decryption_exception("decryption failed");
+        }
+
+        unsigned char finalBlock[16];
+        int len;
+        return EVP_DecryptFinal_ex(ctx, finalBlock, &len) == 1;
+    }
+
+public:
+    AESGCMDecryptor(const std::array<unsigned char, 16>& key, const std::array<unsigned char, 12>& iv) {
+        if (!(ctx = EVP_CIPHER_CTX_new())) {
+            ERR_print_errors_fp(stderr);
+            throw decryption_exception("decryption failed");
+        }
+
+        if (1 != EVP_DecryptInit_ex(ctx, EVP_aes_128_gcm(), nullptr, nullptr, nullptr) ||
+            1 != EVP_DecryptInit_ex(ctx, nullptr, nullptr, key.data(), iv.data())) {
+            ERR_print_errors_fp(stderr);
+            EVP_CIPHER_CTX_free(ctx);
+            throw decryption_exception("decryption failed");
+        }
+    }
+
+    ~AESGCMDecryptor() {
+        EVP_CIPHER_CTX_free(ctx);
+    }
+
+    AESGCMDecryptor(const AESGCMDecryptor&) = delete;
+
+    AESGCMDecryptor& operator=(const AESGCMDecryptor&) = delete;
+
+    // Decrypts the next chunk of the stream into out and returns the number of plaintext
+    // bytes written, which is never more than length. in and out must not overlap.
+    size_t Update(const unsigned char* in, size_t length, unsigned char* out) {
+        size_t total = tailLength + length;
+        if (total <= tail.size()) {
+            std::copy(in, in + length, tail.begin() + tailLength);
+            tailLength = total;
+            return 0;
+        }
+
+        size_t emit = total - tail.size();
+        size_t fromTail = std::min(tailLength, emit);
+        size_t fromIn = emit - fromTail;
+
+        if (fromTail > 0) {
+            Decrypt(tail.data(), fromTail, out);
+        }
+        if (fromIn > 0) {
+            Decrypt(in, fromIn, out + fromTail);
+        }
+
+        size_t keep = tailLength - fromTail;
+        std::copy(tail.begin() + fromTail, tail.begin() + tailLength, tail.begin());
+        std::copy(in + fromIn, in + length, tail.begin() + keep);
+        tailLength = tail.size();
+
+        return emit;
+    }
+
+    // Decrypts ciphertext that doesn't contain the tag; out may be the same buffer as in
+    size_t UpdateCiphertext(const unsigned char* in, size_t length, unsigned char* out) {
+        Decrypt(in, length, out);
+        return length;
+    }
+
+    // Returns whether the withheld tag authenticates everything passed to Update().
+    bool Finalize() {
+        if (tailLength != tail.size()) {
+            return false;
+        }
+        return CheckTag(tail.data());
+    }
+
+    // Returns whether tag authenticates everything passed to UpdateCiphertext().
+    bool Finalize(const std::array<unsigned char, 16>& tag) {
+        return CheckTag(tag.data());
+    }
+};
+
+// Encrypts (or decrypts) any range of an AES-128-GCM artifact on its own, by running the
+// counter mode GCM is built on from that range's counter block: the ciphertext of the plaintext
+// byte at offset i is the same as in the artifact. Nothing is authenticated, so a ciphertext
+// put together from such ranges still has to go through AESGCMDecryptor to be trusted.
+class AESGCMRangeCipher {
+private:
+    EVP_CIPHER_CTX* ctx = nullptr;
+    std::array<unsigned char, 16> key;
+    std::array<unsigned char, 12> iv;
+
+public:
+    AESGCMRangeCipher(const std::array<unsigned char, 16>& key, const std::array<unsigned char, 12>& iv) :
+            key(key), iv(iv) {
+        if (!(ctx = EVP_CIPHER_CTX_new())) {
+            ERR_print_errors_fp(stderr);
+            throw decryption_exception("decryption failed");
+        }
+    }
+
+    ~AESGCMRangeCipher() {
+        EVP_CIPHER_CTX_free(ctx);
+    }
+
+    AESGCMRangeCipher(const AESGCMRangeCipher&) = delete;
+
+    AESGCMRangeCipher& operator=(const AESGCMRangeCipher&) = delete;
+
+    // offset is the position of the range within the artifact; in and out may be the same buffer
+    void Apply(uint64_t offset, const unsigned char* in, size_t length, unsigned char* out) {
+        // GCM only increments the last 32 bits of the counter block, which start at 2 for the
+        // first block of plaintext; AES-CTR carries into the iv once they wrap, after 64 GiB
+        uint64_t firstBlock = offset / 16 + 2;
+        uint64_t lastBlock = (offset + length + 15) / 16 + 2;
+        if (lastBlock > 0xffffffffULL) {
+            throw decryption_exception("range beyond the gcm counter");
+        }
+
+        std::array<unsigned char, 16> counter{};
+        std::copy(iv.begin(), iv.end(), counter.begin());
+        for (int i = 0; i < 4; i++) {
+            counter[15 - i] = (unsigned char) (firstBlock >> (8 * i));
+        }
+        if (1 != EVP_EncryptInit_ex(ctx, EVP_aes_128_ctr(), nullptr, key.data(), counter.data())) {
+            ERR_print_errors_fp(stderr);
+            throw decryption_exception("decryption failed");
+        }
+
+        // The keystream of the range's first block is only partly used
+        unsigned char skipped[16] = {};
+        int len;
+        if (offset % 16 != 0 && 1 != EVP_EncryptUpdate(ctx, skipped, &len, skipped, (int) (offset % 16))) {
+            ERR_print_errors_fp(stderr);
+            throw decryption_exception("decryption failed");
+        }
+
+        const size_t maxPiece = 1 << 30;
+        while (length > 0) {
+            size_t piece = std::min(length, maxPiece);
+            if (1 != EVP_EncryptUpdate(ctx, out, &len, in, (int) piece)) {
+                ERR_print_errors_fp(stderr);
+                throw decryption_exception("decryption failed");
+            }
+            in += piece;
+            out += piece;
+            length -= piece;
+        }
+    }
+};
+
 class ArtifactCryptoHelper {
+    friend class ArtifactSignatureVerifier;
 
 private:
     static RSA* LoadPrivateKey(const std::string& path) {
@@ -86,77 +267,127 @@ public:
                   const std::array<unsigned char, 16>& key,
                   const std::array<unsigned char, 12>& iv) {
 
-        EVP_CIPHER_CTX* ctx;
-
-        if (!(ctx = EVP_CIPHER_CTX_new())) {
-            ERR_print_errors_fp(stderr);
-            throw decryption_exception("decryption failed");
-        }
-
-        if (1 != EVP_DecryptInit_ex(ctx, EVP_aes_128_gcm(), nullptr, nullptr, nullptr)) {
-            ERR_print_errors_fp(stderr);
-            throw decryption_exception("decryption failed");
+        if (ciphertext.size() < 16) {
+            return {};
         }
 
-        if (!EVP_DecryptInit_ex(ctx, nullptr, nullptr, key.data(), iv.data())) {
-            ERR_print_errors_fp(stderr);
-            throw decryption_exception("decryption failed");
-        }
-
-        int len;
+        AESGCMDecryptor decryptor(key, iv);
         std::vector<unsigned char> plaintext(ciphertext.size() - 16, 0);
+        decryptor.UpdateCiphertext(ciphertext.data(), plaintext.size(), plaintext.data());
 
-        if (!EVP_DecryptUpdate(ctx, plaintext.data(), &len, ciphertext.data(), ciphertext.size() - 16)) {
-            ERR_print_errors_fp(stderr);
-            throw decryption_exception("decryption failed");
+        std::array<unsigned char, 16> tag{};
+        std::copy(ciphertext.end() - 16, ciphertext.end(), tag.begin());
+
+        if (!decryptor.Finalize(tag)) {
+            // Authentication-Tag can't be validated -> return empty plaintext
+            plaintext.resize(0);
         }
+        return plaintext;
+    }
 
-        if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16,
-                                 (void*) (ciphertext.data() + ciphertext.size() - 16))) {
-            ERR_print_errors_fp(stderr);
-            throw decryption_exception("decryption failed");
+    // Decrypts ciphertext (followed by its 16-byte tag) into memory the caller already owns, which
+    // needs room for length - 16 bytes; plaintext may be the ciphertext itself. Returns the
+    // plaintext length, or -1 if the tag doesn't authenticate the ciphertext.
+    static ssize_t AESGCMDecryptInto(const unsigned char* ciphertext, size_t length,
+                                     unsigned char* plaintext, size_t capacity,
+                                     const std::array<unsigned char, 16>& key,
+                                     const std::array<unsigned char, 12>& iv) {
+        if (length < 16) {
+            return -1;
+        }
+        size_t plaintextLength = length - 16;
+        if (capacity < plaintextLength) {
+            throw decryption_exception("plaintext buffer too small");
         }
 
-        int ok = EVP_DecryptFinal_ex(ctx, plaintext.data() + len, &len);
+        std::array<unsigned char, 16> tag{};
+        std::copy(ciphertext + plaintextLength, ciphertext + length, tag.begin());
 
-        EVP_CIPHER_CTX_free(ctx);
-        if (!ok) {
-            // Authentication-Tag can't be validated -> return empty plaintext
-            plaintext.resize(0);
+        AESGCMDecryptor decryptor(key, iv);
+        decryptor.UpdateCiphertext(ciphertext, plaintextLength, plaintext);
+
+        if (!decryptor.Finalize(tag)) {
+            return -1;
         }
-        return plaintext;
+        return (ssize_t) plaintextLength;
     }
 
-    static bool VerifyArtifactSignature(const std::string& keyPath, const std::vector<unsigned char>& msg) {
+    // Decrypts without a second artifact-sized buffer; afterwards the first n bytes of buffer
+    // hold the plaintext, with n being the return value (-1 if not authentic)
+    static ssize_t AESGCMDecryptInPlace(unsigned char* buffer, size_t length,
+                                        const std::array<unsigned char, 16>& key,
+                                        const std::array<unsigned char, 12>& iv) {
+        return AESGCMDecryptInto(buffer, length, buffer, length, key, iv);
+    }
+
+    static bool VerifyArtifactSignature(const std::string& keyPath, const std::vector<unsigned char>& msg);
+};
+
+// Verifies the publisher signature over a plaintext artifact that is fed in chunks.
+// The first 256 bytes are taken as the signature, everything after them is hashed.
+class ArtifactSignatureVerifier {
+private:
+    EVP_PKEY* pkey = nullptr;
+    EVP_MD_CTX* mdctx = nullptr;
+    std::array<unsigned char, 256> signature{};
+    size_t signatureLength = 0;
 
-        auto pkey = ArtifactCryptoHelper::LoadPublicKey(keyPath);
+public:
+    explicit ArtifactSignatureVerifier(const std::string& keyPath) {
+        pkey = ArtifactCryptoHelper::LoadPublicKey(keyPath);
 
         if (pkey == nullptr) {
             throw verify_signature_exception("failed to load key");
         }
 
-        EVP_MD_CTX* mdctx;
-
         if (!(mdctx = EVP_MD_CTX_create())) {
             ERR_print_errors_fp(stderr);
+            ArtifactCryptoHelper::FreePublicKey(pkey);
             throw verify_signature_exception("signature verification failed");
         }
 
         if (1 != EVP_DigestVerifyInit(mdctx, nullptr, EVP_sha256(), nullptr, pkey)) {
             ERR_print_errors_fp(stderr);
+            EVP_MD_CTX_free(mdctx);
+            ArtifactCryptoHelper::FreePublicKey(pkey);
             throw verify_signature_exception("signature verification failed");
         }
+    }
+
+    ~ArtifactSignatureVerifier() {
+        EVP_MD_CTX_free(mdctx);
+        ArtifactCryptoHelper::FreePublicKey(pkey);
+    }
 
-        if (1 != EVP_DigestVerifyUpdate(mdctx, msg.data() + 256, msg.size() - 256)) {
+    ArtifactSignatureVerifier(const ArtifactSignatureVerifier&) = delete;
+
+    ArtifactSignatureVerifier& operator=(const ArtifactSignatureVerifier&) = delete;
+
+    void Update(const unsigned char* data, size_t length) {
+        size_t sigPart = std::min(length, signature.size() - signatureLength);
+        std::copy(data, data + sigPart, signature.begin() + signatureLength);
+        signatureLength += sigPart;
+
+        if (sigPart < length &&
+            1 != EVP_DigestVerifyUpdate(mdctx, data + sigPart, length - sigPart)) {
             ERR_print_errors_fp(stderr);
             throw verify_signature_exception("signature verification failed");
         }
+    }
 
-        bool ok = EVP_DigestVerifyFinal(mdctx, msg.data(), 256);
-        FreePublicKey(pkey);
-        EVP_MD_CTX_free(mdctx);
-        return ok;
+    bool Finalize() {
+        if (signatureLength != signature.size()) {
+            return false;
+        }
+        return EVP_DigestVerifyFinal(mdctx, signature.data(), signature.size()) == 1;
     }
 };
 
+inline bool ArtifactCryptoHelper::VerifyArtifactSignature(const std::string& keyPath,
+                                                          const std::vector<unsigned char>& msg) {
+    ArtifactSignatureVerifier verifier(keyPath);
+    verifier.Update(msg.data(), msg.size());
+    return verifier.Finalize();
+}
+
 #endif //UPDATECLIENT_ARTIFACTCRYPTOHELPER_H
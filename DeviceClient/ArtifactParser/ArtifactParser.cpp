@@ -5,47 +5,218 @@ std::vector<unsigned char> ArtifactParser::DecryptArtifact(const std::vector<uns
     return ArtifactCryptoHelper::AESGCMDecrypt(artifact, decryptionKey, iv);
 }
 
+std::vector<unsigned char> ArtifactParser::DecryptArtifact(std::vector<unsigned char>&& artifact) {
+    std::vector<unsigned char> plaintext(std::move(artifact));
+    ssize_t length = ArtifactCryptoHelper::AESGCMDecryptInPlace(plaintext.data(), plaintext.size(),
+                                                                decryptionKey, iv);
+    plaintext.resize(length < 0 ? 0 : length);
+    return plaintext;
+}
+
+ssize_t ArtifactParser::DecryptArtifact(const unsigned char* artifact, size_t length,
+                                        unsigned char* plaintext, size_t capacity) {
+    return ArtifactCryptoHelper::AESGCMDecryptInto(artifact, length, plaintext, capacity, decryptionKey, iv);
+}
+
 bool ArtifactParser::VerifySignature(const std::vector<unsigned char>& artifactPlaintext) {
-    return ArtifactCryptoHelper::VerifyArtifactSignature(verifyKeyPath, artifactPlaintext);
+    BeginVerification();
+    UpdateVerification(artifactPlaintext.data(), artifactPlaintext.size());
+    return FinishVerification();
+}
+
+void ArtifactParser::BeginVerification() {
+    verifier = std::make_unique<ArtifactSignatureVerifier>(verifyKeyPath);
+}
+
+void ArtifactParser::UpdateVerification(const unsigned char* artifactPlaintext, size_t length) {
+    if (!verifier) {
+        throw verify_signature_exception("signature verification not started");
+    }
+    verifier->Update(artifactPlaintext, length);
+}
+
+bool ArtifactParser::FinishVerification() {
+    if (!verifier) {
+        throw verify_signature_exception("signature verification not started");
+    }
+    bool ok = verifier->Finalize();
+    verifier.reset();
+    return ok;
 }
 
+// memcpy instead of a cast: views may start at any address, which ARM doesn't forgive
 ushort ArtifactParser::ParseURILength(const unsigned char* uriLength) {
-    return *(static_cast<const ushort*>(static_cast<const void*>(uriLength)));
+    ushort value;
+    std::memcpy(&value, uriLength, sizeof(value));
+    return value;
 }
 
 ulong ArtifactParser::ParseSequenceNumber(const unsigned char* sequenceNumber) {
-    return *(static_cast<const ulong*>(static_cast<const void*>(sequenceNumber)));
+    ulong value;
+    std::memcpy(&value, sequenceNumber, sizeof(value));
+    return value;
 }
 
-UpdateArtifact ArtifactParser::ParseArtifact(const std::vector<unsigned char>& verifiedPlaintext) {
+UpdateArtifactView ArtifactParser::ParseArtifactView(const unsigned char* verifiedPlaintext, size_t length) {
 
-    if (verifiedPlaintext.size() < URI_OFFSET) {
+    if (length < URI_OFFSET) {
         throw parse_exception("malformed artifact binary");
     }
 
-    UpdateArtifact artifact;
-    std::copy(verifiedPlaintext.begin() + SIGNATURE_OFFSET, verifiedPlaintext.begin() + SEQUENCE_NUMBER_OFFSET,
-              artifact.rsaSignature.begin());
-
-    artifact.header.sequenceNumber = ParseSequenceNumber(verifiedPlaintext.data() + SEQUENCE_NUMBER_OFFSET);
+    UpdateArtifactView artifact{};
+    artifact.rsaSignature = {verifiedPlaintext + SIGNATURE_OFFSET, SEQUENCE_NUMBER_OFFSET - SIGNATURE_OFFSET};
+    artifact.header.sequenceNumber = ParseSequenceNumber(verifiedPlaintext + SEQUENCE_NUMBER_OFFSET);
+    artifact.header.hardwareUUID = {verifiedPlaintext + HARDWARE_UUID_OFFSET, URI_LENGTH_OFFSET - HARDWARE_UUID_OFFSET};
+    artifact.header.uriLength = ParseURILength(verifiedPlaintext + URI_LENGTH_OFFSET);
 
-    std::copy(verifiedPlaintext.begin() + HARDWARE_UUID_OFFSET, verifiedPlaintext.begin() + URI_LENGTH_OFFSET,
-              artifact.header.hardwareUUID.begin());
+    // All in size_t, and subtracted from length instead of added to an offset, so an untrusted
+    // length can't overflow past the check
+    size_t remaining = length - URI_OFFSET;
+    if (remaining < artifact.header.uriLength ||
+        remaining - artifact.header.uriLength < (size_t) EXTENSIONS_LENGTH_SIZE) {
+        throw parse_exception("malformed artifact binary");
+    }
 
-    artifact.header.uriLength = ParseURILength(verifiedPlaintext.data() + URI_LENGTH_OFFSET);
+    artifact.header.uri = std::string_view((const char*) verifiedPlaintext + URI_OFFSET, artifact.header.uriLength);
 
-    if (verifiedPlaintext.size() < URI_OFFSET + artifact.header.uriLength) {
+    size_t extensionsOffset = (size_t) URI_OFFSET + artifact.header.uriLength + EXTENSIONS_LENGTH_SIZE;
+    uint32_t extensionsLength;
+    std::memcpy(&extensionsLength, verifiedPlaintext + extensionsOffset - EXTENSIONS_LENGTH_SIZE,
+                sizeof(extensionsLength));
+    if (extensionsLength > MAX_EXTENSIONS_LENGTH || length - extensionsOffset < extensionsLength) {
         throw parse_exception("malformed artifact binary");
     }
+    artifact.header.extensions = {verifiedPlaintext + extensionsOffset, extensionsLength};
+    ParseExtensions(artifact.header);
 
-    artifact.header.uri = std::string(verifiedPlaintext.begin() + URI_OFFSET,
-                                      verifiedPlaintext.begin() + URI_OFFSET + artifact.header.uriLength);
+    size_t payloadOffset = extensionsOffset + extensionsLength;
+    artifact.firmwarePayload = {verifiedPlaintext + payloadOffset, length - payloadOffset};
 
-    artifact.firmwarePayload.resize(verifiedPlaintext.size() - (URI_OFFSET + artifact.header.uriLength));
+    return artifact;
+}
 
+std::vector<ArtifactExtension> ArtifactParser::SplitExtensions(ByteView extensions) {
+    std::vector<ArtifactExtension> split;
+    size_t offset = 0;
+    while (offset < extensions.size) {
+        if (extensions.size - offset < EXTENSION_HEADER_SIZE) {
+            throw parse_exception("malformed artifact extension");
+        }
+        ArtifactExtension extension{};
+        uint32_t length;
+        std::memcpy(&extension.type, extensions.data + offset, sizeof(extension.type));
+        std::memcpy(&length, extensions.data + offset + sizeof(extension.type), sizeof(length));
+        offset += EXTENSION_HEADER_SIZE;
+        if (extensions.size - offset < length) {
+            throw parse_exception("malformed artifact extension");
+        }
+        extension.value = {extensions.data + offset, length};
+        offset += length;
+        split.push_back(extension);
+    }
+    return split;
+}
+
+BlockMap ArtifactParser::ParseBlockMap(ByteView value) {
+    BlockMap map{};
+    const size_t headerLength = sizeof(map.blockSize) + sizeof(map.imageLength);
+    const size_t extentLength = 2 * sizeof(uint64_t);
+    if (value.size < headerLength || (value.size - headerLength) % extentLength != 0) {
+        throw parse_exception("malformed block map");
+    }
+    std::memcpy(&map.blockSize, value.data, sizeof(map.blockSize));
+    std::memcpy(&map.imageLength, value.data + sizeof(map.blockSize), sizeof(map.imageLength));
+    if (map.blockSize < 512 || map.blockSize > 64 * 1024 || (map.blockSize & (map.blockSize - 1)) != 0) {
+        throw parse_exception("unsupported block map block size");
+    }
+    const uint64_t imageBlocks = map.imageLength / map.blockSize + (map.imageLength % map.blockSize != 0);
+    uint64_t nextBlock = 0;
+    map.extents.resize((value.size - headerLength) / extentLength);
+    for (size_t i = 0; i < map.extents.size(); i++) {
+        const unsigned char* entry = value.data + headerLength + i * extentLength;
+        std::memcpy(&map.extents[i].firstBlock, entry, sizeof(uint64_t));
+        std::memcpy(&map.extents[i].blockCount, entry + sizeof(uint64_t), sizeof(uint64_t));
+        // In order, without overlaps, and within the image
+        if (map.extents[i].firstBlock < nextBlock || map.extents[i].firstBlock > imageBlocks ||
+            map.extents[i].blockCount > imageBlocks - map.extents[i].firstBlock) {
+            throw parse_exception("malformed block map");
+        }
+        nextBlock = map.extents[i].firstBlock + map.extents[i].blockCount;
+    }
+    return map;
+}
 
-    std::copy(verifiedPlaintext.begin() + URI_OFFSET + artifact.header.uriLength, verifiedPlaintext.end(),
-              artifact.firmwarePayload.begin());
+void ArtifactParser::ParseExtensions(ArtifactHeaderView& header) {
+    header.payloadCompression = PayloadCompression::None;
+    for (const auto& extension : SplitExtensions(header.extensions)) {
+        if (extension.type == (ushort) ExtensionType::PayloadCompression) {
+            if (extension.value.size != 1 || extension.value.data[0] > (unsigned char) PayloadCompression::Xz) {
+                throw parse_exception("unsupported payload compression");
+            }
+            header.payloadCompression = (PayloadCompression) extension.value.data[0];
+        } else if (extension.type == (ushort) ExtensionType::PayloadFrameIndex) {
+            if (extension.value.size % (2 * sizeof(uint64_t)) != 0) {
+                throw parse_exception("malformed payload frame index");
+            }
+            header.payloadFrames.resize(extension.value.size / (2 * sizeof(uint64_t)));
+            for (size_t i = 0; i < header.payloadFrames.size(); i++) {
+                const unsigned char* entry = extension.value.data + i * 2 * sizeof(uint64_t);
+                std::memcpy(&header.payloadFrames[i].compressedLength, entry, sizeof(uint64_t));
+                std::memcpy(&header.payloadFrames[i].decompressedLength, entry + sizeof(uint64_t),
+                            sizeof(uint64_t));
+            }
+        } else if (extension.type == (ushort) ExtensionType::DeltaSource) {
+            DeltaSource source{};
+            if (extension.value.size != sizeof(source.length) + source.sha256.size()) {
+                throw parse_exception("malformed delta source");
+            }
+            std::memcpy(&source.length, extension.value.data, sizeof(source.length));
+            std::copy(extension.value.begin() + sizeof(source.length), extension.value.end(), source.sha256.begin());
+            header.deltaSource = source;
+        } else if (extension.type == (ushort) ExtensionType::SparseImage) {
+            uint64_t imageLength = 0;
+            if (extension.value.size != sizeof(imageLength)) {
+                throw parse_exception("malformed sparse image length");
+            }
+            std::memcpy(&imageLength, extension.value.data, sizeof(imageLength));
+            header.sparseImageLength = imageLength;
+        } else if (extension.type == (ushort) ExtensionType::BlockMap) {
+            header.blockMap = ParseBlockMap(extension.value);
+        }
+    }
+}
+
+UpdateArtifactView ArtifactParser::ParseArtifactView(const std::vector<unsigned char>& verifiedPlaintext) {
+    return ParseArtifactView(verifiedPlaintext.data(), verifiedPlaintext.size());
+}
+
+UpdateArtifactView ArtifactParser::ParseArtifactView(const MappedFile& verifiedPlaintext) {
+    return ParseArtifactView(verifiedPlaintext.data(), verifiedPlaintext.size());
+}
+
+static ArtifactHeader CopyHeader(const ArtifactHeaderView& view) {
+    ArtifactHeader header;
+    header.sequenceNumber = view.sequenceNumber;
+    std::copy(view.hardwareUUID.begin(), view.hardwareUUID.end(), header.hardwareUUID.begin());
+    header.uriLength = view.uriLength;
+    header.uri = std::string(view.uri);
+    header.extensions.assign(view.extensions.begin(), view.extensions.end());
+    header.payloadCompression = view.payloadCompression;
+    header.payloadFrames = view.payloadFrames;
+    header.deltaSource = view.deltaSource;
+    header.sparseImageLength = view.sparseImageLength;
+    header.blockMap = view.blockMap;
+    return header;
+}
+
+UpdateArtifact ArtifactParser::ParseArtifact(const std::vector<unsigned char>& verifiedPlaintext) {
+
+    auto view = ParseArtifactView(verifiedPlaintext);
+
+    UpdateArtifact artifact;
+    std::copy(view.rsaSignature.begin(), view.rsaSignature.end(), artifact.rsaSignature.begin());
+    artifact.header = CopyHeader(view.header);
+    artifact.firmwarePayload.assign(view.firmwarePayload.begin(), view.firmwarePayload.end());
 
     return artifact;
 }
@@ -57,3 +228,133 @@ ArtifactParser::ArtifactParser(std::string verifyKeyPath,
         decryptionKey(decryptionKey),
         iv(iv) {}
 
+ArtifactStreamParser::ArtifactStreamParser(const std::string& verifyKeyPath,
+                                           const std::array<unsigned char, 16>& decryptionKey,
+                                           const std::array<unsigned char, 12>& iv,
+                                           PayloadSink sink) :
+        parser(verifyKeyPath, decryptionKey, iv),
+        decryptor(decryptionKey, iv),
+        sink(std::move(sink)),
+        decompressionThreads(std::max(1u, std::thread::hardware_concurrency())) {
+    parser.BeginVerification();
+}
+
+void ArtifactStreamParser::Update(const unsigned char* ciphertext, size_t length) {
+    // Bound the scratch buffer no matter how large the caller's chunks are
+    while (length > 0) {
+        size_t slice = std::min(length, STREAM_CHUNK_SIZE);
+        if (plaintextBuffer.size() < slice) {
+            plaintextBuffer.resize(slice);
+        }
+
+        size_t decrypted = decryptor.Update(ciphertext, slice, plaintextBuffer.data());
+        ConsumePlaintext(plaintextBuffer.data(), decrypted);
+
+        ciphertext += slice;
+        length -= slice;
+    }
+}
+
+void ArtifactStreamParser::ConsumePlaintext(const unsigned char* data, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    parser.UpdateVerification(data, length);
+
+    if (!headerComplete) {
+        size_t consumed = ConsumeHeader(data, length);
+        data += consumed;
+        length -= consumed;
+    }
+
+    if (headerComplete && length > 0) {
+        ConsumePayload(data, length);
+    }
+}
+
+void ArtifactStreamParser::ConsumePayload(const unsigned char* data, size_t length) {
+    if (header.payloadCompression == PayloadCompression::None) {
+        payloadLength += length;
+        sink(data, length);
+        return;
+    }
+    if (!decompressor) {
+        decompressor = std::make_unique<PayloadDecompressor>(
+                header.payloadCompression, [this](const unsigned char* decompressed, size_t decompressedLength) {
+                    payloadLength += decompressedLength;
+                    sink(decompressed, decompressedLength);
+                }, header.payloadFrames, decompressionThreads);
+    }
+    decompressor->Update(data, length);
+}
+
+size_t ArtifactStreamParser::HeaderBytesNeeded() const {
+    size_t needed = URI_OFFSET;
+    if (headerBuffer.size() < needed) {
+        return needed;
+    }
+    ushort uriLength;
+    std::memcpy(&uriLength, headerBuffer.data() + URI_LENGTH_OFFSET, sizeof(uriLength));
+    needed += uriLength + EXTENSIONS_LENGTH_SIZE;
+    if (headerBuffer.size() < needed) {
+        return needed;
+    }
+    uint32_t extensionsLength;
+    std::memcpy(&extensionsLength, headerBuffer.data() + needed - EXTENSIONS_LENGTH_SIZE, sizeof(extensionsLength));
+    if (extensionsLength > MAX_EXTENSIONS_LENGTH) {
+        throw parse_exception("malformed artifact binary");
+    }
+    return needed + extensionsLength;
+}
+
+size_t ArtifactStreamParser::ConsumeHeader(const unsigned char* data, size_t length) {
+    size_t consumed = 0;
+    while (!headerComplete && consumed < length) {
+        size_t needed = HeaderBytesNeeded();
+        size_t take = std::min(length - consumed, needed - headerBuffer.size());
+        headerBuffer.insert(headerBuffer.end(), data + consumed, data + consumed + take);
+        consumed += take;
+
+        // Complete once the buffered fields don't announce any further ones
+        if (headerBuffer.size() == HeaderBytesNeeded()) {
+            header = CopyHeader(parser.ParseArtifactView(headerBuffer).header);
+            headerComplete = true;
+            headerBuffer.clear();
+            headerBuffer.shrink_to_fit();
+        }
+    }
+    return consumed;
+}
+
+bool ArtifactStreamParser::Finish() {
+    bool tagOk = decryptor.Finalize();
+    bool signatureOk = parser.FinishVerification();
+    bool payloadOk = true;
+    if (decompressor) {
+        try {
+            decompressor->Finish();
+        } catch (decompression_exception& e) {
+            payloadOk = false;
+        }
+    } else if (header.payloadCompression != PayloadCompression::None) {
+        // Not a single byte of the compressed payload arrived
+        payloadOk = false;
+    }
+    return tagOk && signatureOk && headerComplete && payloadOk;
+}
+
+bool ArtifactStreamParser::HeaderComplete() const {
+    return headerComplete;
+}
+
+const ArtifactHeader& ArtifactStreamParser::Header() const {
+    return header;
+}
+
+unsigned long long ArtifactStreamParser::PayloadLength() const {
+    return payloadLength;
+}
+
+void ArtifactStreamParser::SetDecompressionThreads(unsigned int threads) {
+    decompressionThreads = threads;
+}
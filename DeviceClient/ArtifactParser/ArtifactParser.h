@@ -18,6 +18,14 @@
 #include <algorithm>
 #include "ArtifactCryptoHelper.h"
 #include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include "MappedFile.h"
+#include "PayloadDecompressor.h"
+#include "DeltaApplier.h"
+#include "SparseImage.h"
 
 class parse_exception : public std::runtime_error {
 public:
@@ -29,12 +37,56 @@ const int SEQUENCE_NUMBER_OFFSET = 256;
 const int HARDWARE_UUID_OFFSET = 264;
 const int URI_LENGTH_OFFSET = 280;
 const int URI_OFFSET = 282;
+// The uri is followed by the length of the extension block and the block itself, which holds
+// TLVs of a 2 byte type, a 4 byte length and the value. Like the rest of the header it is
+// covered by the signature.
+const int EXTENSIONS_LENGTH_SIZE = 4;
+const int EXTENSION_HEADER_SIZE = 6;
+// Upper bound for the extension block, which is parsed before the signature could be checked
+const uint32_t MAX_EXTENSIONS_LENGTH = 16 * 1024 * 1024;
+
+// Types of the TLVs in the extension block; unknown types are skipped
+enum class ExtensionType : ushort {
+    // 1 byte PayloadCompression
+    PayloadCompression = 1,
+    // PayloadFrames: 8 byte compressed and 8 byte decompressed length of each frame
+    PayloadFrameIndex = 2,
+    // DeltaSource: 8 byte length and the SHA-256 of the source image; the (decompressed) payload
+    // is a delta against that image
+    DeltaSource = 3,
+    // SparseImage: 8 byte length of the image; the (decompressed) payload consists of
+    // SparseChunks
+    SparseImage = 4,
+    // BlockMap: 4 byte block size, 8 byte image length, then 8 byte first block and 8 byte block
+    // count of each extent of the image that holds data; the rest needn't be written
+    BlockMap = 5
+};
+
+// Blocks of the image its filesystem allocated, like a bmaptool map, in ascending order
+struct BlockMap {
+    struct Extent {
+        uint64_t firstBlock;
+        uint64_t blockCount;
+    };
+    uint32_t blockSize;
+    uint64_t imageLength;
+    std::vector<Extent> extents;
+};
+
+// Upper bound for the plaintext ArtifactStreamParser decrypts at once
+const size_t STREAM_CHUNK_SIZE = 64 * 1024;
 
 struct ArtifactHeader {
     ulong sequenceNumber;
     std::array<unsigned char, 16> hardwareUUID;
     ushort uriLength;
     std::string uri;
+    std::vector<unsigned char> extensions;
+    PayloadCompression payloadCompression;
+    std::vector<PayloadFrame> payloadFrames;
+    std::optional<DeltaSource> deltaSource;
+    std::optional<uint64_t> sparseImageLength;
+    std::optional<BlockMap> blockMap;
 };
 
 struct UpdateArtifact {
@@ -44,25 +96,102 @@ struct UpdateArtifact {
 
 };
 
+// Non-owning view of a byte range
+struct ByteView {
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+
+    const unsigned char* begin() const { return data; }
+
+    const unsigned char* end() const { return data + size; }
+};
+
+struct ArtifactHeaderView {
+    ulong sequenceNumber;
+    ByteView hardwareUUID;
+    ushort uriLength;
+    std::string_view uri;
+    ByteView extensions;
+    PayloadCompression payloadCompression;
+    // Empty unless the payload consists of independently compressed frames
+    std::vector<PayloadFrame> payloadFrames;
+    // Set if the payload is a delta, which DeltaApplier turns into the image
+    std::optional<DeltaSource> deltaSource;
+    // Set if the payload is sparse, which SparseImageExpander turns into the image
+    std::optional<uint64_t> sparseImageLength;
+    // Set if only the image's extents in the map need to be written
+    std::optional<BlockMap> blockMap;
+};
+
+struct ArtifactExtension {
+    ushort type;
+    ByteView value;
+};
+
+// Same fields as UpdateArtifact, but pointing into the plaintext that was parsed instead of
+// copying it. A view is only valid as long as that buffer (vector, MappedFile, ...) is alive
+// and neither modified nor reallocated.
+struct UpdateArtifactView {
+    ByteView rsaSignature;
+    ArtifactHeaderView header;
+    ByteView firmwarePayload;
+};
+
 class ArtifactParser {
 private:
     std::array<unsigned char, 16> decryptionKey{};
     std::string verifyKeyPath;
     std::array<unsigned char, 12> iv{};
+    std::unique_ptr<ArtifactSignatureVerifier> verifier;
 
 
     ushort ParseURILength(const unsigned char* uriLength);
 
     ulong ParseSequenceNumber(const unsigned char* sequenceNumber);
 
+    // Applies the known extensions to the header
+    void ParseExtensions(ArtifactHeaderView& header);
+
+    // Throws parse_exception unless the extents are in order and within the image
+    static BlockMap ParseBlockMap(ByteView value);
+
 public:
 
+    // The TLVs of an extension block; throws parse_exception if one overruns the block
+    static std::vector<ArtifactExtension> SplitExtensions(ByteView extensions);
+
     std::vector<unsigned char> DecryptArtifact(const std::vector<unsigned char>& artifact);
 
+    // Decrypts in place and hands the buffer back shortened to the plaintext, so no second
+    // artifact-sized buffer is needed. Empty if the ciphertext couldn't be authenticated.
+    std::vector<unsigned char> DecryptArtifact(std::vector<unsigned char>&& artifact);
+
+    // Decrypts into caller-owned memory; returns the plaintext length, -1 if not authentic
+    ssize_t DecryptArtifact(const unsigned char* artifact, size_t length,
+                            unsigned char* plaintext, size_t capacity);
+
     bool VerifySignature(const std::vector<unsigned char>& artifactPlaintext);
 
+    // Incremental counterpart to VerifySignature: the plaintext is fed in order as it gets
+    // decrypted, so hashing overlaps with download and flashing instead of needing the
+    // whole artifact in memory. The first 256 bytes fed are taken as the signature.
+    void BeginVerification();
+
+    void UpdateVerification(const unsigned char* artifactPlaintext, size_t length);
+
+    bool FinishVerification();
+
     UpdateArtifact ParseArtifact(const std::vector<unsigned char>& verifiedPlaintext);
 
+    UpdateArtifactView ParseArtifactView(const unsigned char* verifiedPlaintext, size_t length);
+
+    UpdateArtifactView ParseArtifactView(const std::vector<unsigned char>& verifiedPlaintext);
+
+    // A view into a temporary would dangle immediately
+    UpdateArtifactView ParseArtifactView(std::vector<unsigned char>&& verifiedPlaintext) = delete;
+
+    UpdateArtifactView ParseArtifactView(const MappedFile& verifiedPlaintext);
+
     explicit ArtifactParser(std::string verifyKeyPath,
                             const std::array<unsigned char, 16>& decryptionKey,
                             const std::array<unsigned char, 12>& iv) noexcept;
@@ -70,5 +199,59 @@ public:
 
 };
 
+// Streaming counterpart to DecryptArtifact/VerifySignature/ParseArtifact for artifacts too
+// large to hold in memory. Ciphertext is fed in arbitrarily sized chunks; the header is parsed
+// as soon as it is complete and every payload byte after it is handed to the sink, decompressed
+// first if the header says so. Nothing passed to the sink may be trusted before Finish()
+// returned true.
+class ArtifactStreamParser {
+public:
+    using PayloadSink = std::function<void(const unsigned char* data, size_t length)>;
+
+private:
+    ArtifactParser parser;
+    AESGCMDecryptor decryptor;
+    PayloadSink sink;
+    std::unique_ptr<PayloadDecompressor> decompressor;
+    unsigned int decompressionThreads;
+    std::vector<unsigned char> plaintextBuffer;
+    std::vector<unsigned char> headerBuffer;
+    ArtifactHeader header{};
+    bool headerComplete = false;
+    unsigned long long payloadLength = 0;
+
+    void ConsumePlaintext(const unsigned char* data, size_t length);
+
+    size_t ConsumeHeader(const unsigned char* data, size_t length);
+
+    // Length of the header as far as the buffered part of it tells
+    size_t HeaderBytesNeeded() const;
+
+    void ConsumePayload(const unsigned char* data, size_t length);
+
+public:
+
+    void Update(const unsigned char* ciphertext, size_t length);
+
+    // Checks the GCM tag, the publisher signature and that a compressed payload was complete;
+    // call once after the last chunk. Update throws decompression_exception for corrupt payloads.
+    bool Finish();
+
+    bool HeaderComplete() const;
+
+    const ArtifactHeader& Header() const;
+
+    // Bytes handed to the sink, i.e. after decompression
+    unsigned long long PayloadLength() const;
+
+    // Threads decompressing the frames of a framed payload; one per core by default
+    void SetDecompressionThreads(unsigned int threads);
+
+    explicit ArtifactStreamParser(const std::string& verifyKeyPath,
+                                  const std::array<unsigned char, 16>& decryptionKey,
+                                  const std::array<unsigned char, 12>& iv,
+                                  PayloadSink sink);
+};
+
 
 #endif //UPDATECLIENT_ARTIFACTPARSER_H
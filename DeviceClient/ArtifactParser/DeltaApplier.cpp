@@ -0,0 +1,168 @@
+#include "DeltaApplier.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+
+// Source data hashed at once by VerifySource
+static const size_t SOURCE_HASH_CHUNK_SIZE = 1024 * 1024;
+
+DeltaApplier::DeltaApplier(const std::string& sourcePath, const DeltaSource& expectedSource, Sink sink) :
+        expectedSource(expectedSource),
+        sink(std::move(sink)),
+        sourceBuffer(DELTA_CHUNK_SIZE) {
+    source = open(sourcePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (source == -1) {
+        const std::string errorMsg = "Unable to open delta source " + sourcePath + ": " + strerror(errno);
+        throw delta_source_exception(errorMsg.c_str());
+    }
+}
+
+DeltaApplier::~DeltaApplier() {
+    if (source != -1) {
+        close(source);
+    }
+}
+
+bool DeltaApplier::VerifySource() {
+    std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> context(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+    if (!context || EVP_DigestInit_ex(context.get(), EVP_sha256(), nullptr) != 1) {
+        throw delta_exception("Unable to hash delta source");
+    }
+
+    std::vector<unsigned char> buffer(SOURCE_HASH_CHUNK_SIZE);
+    uint64_t offset = 0;
+    while (offset < expectedSource.length) {
+        size_t length = std::min<uint64_t>(buffer.size(), expectedSource.length - offset);
+        ssize_t n = pread(source, buffer.data(), length, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // Smaller than the image the delta was made against
+            return false;
+        }
+        EVP_DigestUpdate(context.get(), buffer.data(), n);
+        offset += n;
+    }
+
+    std::array<unsigned char, 32> digest{};
+    unsigned int digestLength = 0;
+    EVP_DigestFinal_ex(context.get(), digest.data(), &digestLength);
+    return digest == expectedSource.sha256;
+}
+
+size_t DeltaApplier::OperandsLength() const {
+    return op == DeltaOp::Insert ? sizeof(uint64_t) : 2 * sizeof(uint64_t);
+}
+
+void DeltaApplier::ReadSource(uint64_t offset, size_t length) {
+    size_t read = 0;
+    while (read < length) {
+        ssize_t n = pread(source, sourceBuffer.data() + read, length - read, offset + read);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            const std::string errorMsg = std::string("Unable to read delta source: ") + strerror(errno);
+            throw delta_exception(errorMsg.c_str());
+        }
+        if (n == 0) {
+            throw delta_exception("delta source is shorter than expected");
+        }
+        read += n;
+    }
+}
+
+size_t DeltaApplier::Execute(const unsigned char* data, size_t length) {
+    size_t consumed = 0;
+    if (op == DeltaOp::Copy) {
+        while (remaining > 0) {
+            size_t n = std::min<uint64_t>(remaining, sourceBuffer.size());
+            ReadSource(sourceOffset, n);
+            outputLength += n;
+            sink(sourceBuffer.data(), n);
+            sourceOffset += n;
+            remaining -= n;
+        }
+    } else if (op == DeltaOp::Add) {
+        while (remaining > 0 && consumed < length) {
+            size_t n = std::min<uint64_t>(std::min(remaining, (uint64_t) (length - consumed)), sourceBuffer.size());
+            ReadSource(sourceOffset, n);
+            for (size_t i = 0; i < n; i++) {
+                sourceBuffer[i] += data[consumed + i];
+            }
+            outputLength += n;
+            sink(sourceBuffer.data(), n);
+            sourceOffset += n;
+            remaining -= n;
+            consumed += n;
+        }
+    } else {
+        while (remaining > 0 && consumed < length) {
+            size_t n = std::min<uint64_t>(std::min(remaining, (uint64_t) (length - consumed)), DELTA_CHUNK_SIZE);
+            outputLength += n;
+            sink(data + consumed, n);
+            remaining -= n;
+            consumed += n;
+        }
+    }
+
+    if (remaining == 0) {
+        instruction.clear();
+        operandsComplete = false;
+    }
+    return consumed;
+}
+
+void DeltaApplier::Update(const unsigned char* delta, size_t length) {
+    while (length > 0) {
+        if (operandsComplete) {
+            size_t consumed = Execute(delta, length);
+            delta += consumed;
+            length -= consumed;
+            continue;
+        }
+
+        if (instruction.empty()) {
+            op = (DeltaOp) delta[0];
+            if (op != DeltaOp::Copy && op != DeltaOp::Add && op != DeltaOp::Insert) {
+                throw delta_exception("malformed delta instruction");
+            }
+        }
+        size_t take = std::min(length, 1 + OperandsLength() - instruction.size());
+        instruction.insert(instruction.end(), delta, delta + take);
+        delta += take;
+        length -= take;
+        if (instruction.size() < 1 + OperandsLength()) {
+            continue;
+        }
+
+        if (op == DeltaOp::Insert) {
+            std::memcpy(&remaining, instruction.data() + 1, sizeof(remaining));
+        } else {
+            std::memcpy(&sourceOffset, instruction.data() + 1, sizeof(sourceOffset));
+            std::memcpy(&remaining, instruction.data() + 1 + sizeof(sourceOffset), sizeof(remaining));
+            // Only the part of the source covered by its hash may be used
+            if (sourceOffset > expectedSource.length || remaining > expectedSource.length - sourceOffset) {
+                throw delta_exception("delta instruction exceeds its source");
+            }
+        }
+        operandsComplete = true;
+        // Copy needs no further data, and empty instructions are done right away
+        Execute(delta, 0);
+    }
+}
+
+void DeltaApplier::Finish() {
+    if (!instruction.empty()) {
+        throw delta_exception("delta ends within an instruction");
+    }
+}
+
+unsigned long long DeltaApplier::OutputLength() const {
+    return outputLength;
+}
@@ -0,0 +1,97 @@
+#ifndef UPDATECLIENT_DELTAAPPLIER_H
+#define UPDATECLIENT_DELTAAPPLIER_H
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class delta_exception : public std::runtime_error {
+public:
+    explicit delta_exception(const char* message) : std::runtime_error(message) {}
+};
+
+// The delta can't be applied on this device, e.g. because its source image differs from the
+// one the delta was made against; the full artifact has to be installed instead
+class delta_source_exception : public std::runtime_error {
+public:
+    explicit delta_source_exception(const char* message) : std::runtime_error(message) {}
+};
+
+// Value of the DELTA_SOURCE extension: the image a delta payload was made against
+struct DeltaSource {
+    uint64_t length;
+    std::array<unsigned char, 32> sha256;
+};
+
+// Instructions of a delta payload; each is an opcode byte followed by little-endian operands
+enum class DeltaOp : unsigned char {
+    // 8 byte source offset, 8 byte length: copies that range of the source
+    Copy = 1,
+    // 8 byte source offset, 8 byte length, then length bytes that are added to that range of the
+    // source byte by byte (bsdiff-style; mostly zeroes for a slightly changed block)
+    Add = 2,
+    // 8 byte length, then length bytes that are written as they are
+    Insert = 3
+};
+
+// Upper bound for the output handed to the sink at once
+const size_t DELTA_CHUNK_SIZE = 64 * 1024;
+
+// Rebuilds an image from a delta payload and the source image it was made against, e.g. the
+// active root partition. The delta is fed in arbitrarily sized chunks, and the image is handed
+// to the sink in order as it is rebuilt.
+class DeltaApplier {
+public:
+    using Sink = std::function<void(const unsigned char* data, size_t length)>;
+
+private:
+    int source = -1;
+    DeltaSource expectedSource;
+    Sink sink;
+
+    // The instruction being parsed or executed
+    std::vector<unsigned char> instruction;
+    DeltaOp op{};
+    uint64_t sourceOffset = 0;
+    uint64_t remaining = 0;
+    bool operandsComplete = false;
+
+    std::vector<unsigned char> sourceBuffer;
+    unsigned long long outputLength = 0;
+
+    size_t OperandsLength() const;
+
+    void ReadSource(uint64_t offset, size_t length);
+
+    // Runs the parsed instruction on data (Add, Insert) or on the source alone (Copy); returns
+    // how much of data was consumed
+    size_t Execute(const unsigned char* data, size_t length);
+
+public:
+
+    // Hashes the first expectedSource.length bytes of the source; true if they are the image
+    // the delta was made against
+    bool VerifySource();
+
+    // Throws delta_exception for malformed instructions or ranges outside of the source
+    void Update(const unsigned char* delta, size_t length);
+
+    // Throws delta_exception if the delta ended within an instruction
+    void Finish();
+
+    unsigned long long OutputLength() const;
+
+    // Throws delta_source_exception if the source can't be opened
+    DeltaApplier(const std::string& sourcePath, const DeltaSource& expectedSource, Sink sink);
+
+    ~DeltaApplier();
+
+    DeltaApplier(const DeltaApplier&) = delete;
+
+    DeltaApplier& operator=(const DeltaApplier&) = delete;
+};
+
+#endif //UPDATECLIENT_DELTAAPPLIER_H
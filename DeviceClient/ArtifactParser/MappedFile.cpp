@@ -0,0 +1,74 @@
+#include "MappedFile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+MappedFile::MappedFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        std::string errorMsg = "unable to open " + path + ": " + strerror(errno);
+        throw map_file_exception(errorMsg.c_str());
+    }
+
+    struct stat st{};
+    if (fstat(fd, &st) == -1) {
+        std::string errorMsg = "unable to stat " + path + ": " + strerror(errno);
+        close(fd);
+        throw map_file_exception(errorMsg.c_str());
+    }
+    length = st.st_size;
+
+    // mmap refuses empty mappings, an empty file is simply an empty view
+    if (length > 0) {
+        void* addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            std::string errorMsg = "unable to map " + path + ": " + strerror(errno);
+            close(fd);
+            throw map_file_exception(errorMsg.c_str());
+        }
+        mapping = static_cast<unsigned char*>(addr);
+        // Artifacts are read front to back exactly once
+        madvise(mapping, length, MADV_SEQUENTIAL);
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    Unmap();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept: mapping(other.mapping), length(other.length) {
+    other.mapping = nullptr;
+    other.length = 0;
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    if (this != &other) {
+        Unmap();
+        mapping = other.mapping;
+        length = other.length;
+        other.mapping = nullptr;
+        other.length = 0;
+    }
+    return *this;
+}
+
+void MappedFile::Unmap() noexcept {
+    if (mapping != nullptr) {
+        munmap(mapping, length);
+        mapping = nullptr;
+        length = 0;
+    }
+}
+
+const unsigned char* MappedFile::data() const {
+    return mapping;
+}
+
+size_t MappedFile::size() const {
+    return length;
+}
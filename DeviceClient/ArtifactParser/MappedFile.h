@@ -0,0 +1,40 @@
+#ifndef UPDATECLIENT_MAPPEDFILE_H
+#define UPDATECLIENT_MAPPEDFILE_H
+
+#include <string>
+#include <stdexcept>
+
+class map_file_exception : public std::runtime_error {
+public:
+    explicit map_file_exception(const char* message) : std::runtime_error(message) {}
+};
+
+// Read-only mapping of a whole file, e.g. a staged artifact. Lets the kernel page cache hold
+// the data instead of a heap buffer; views into data() are valid as long as the mapping lives.
+class MappedFile {
+private:
+    unsigned char* mapping = nullptr;
+    size_t length = 0;
+
+    void Unmap() noexcept;
+
+public:
+
+    const unsigned char* data() const;
+
+    size_t size() const;
+
+    explicit MappedFile(const std::string& path);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept;
+
+    MappedFile& operator=(MappedFile&& other) noexcept;
+};
+
+#endif //UPDATECLIENT_MAPPEDFILE_H
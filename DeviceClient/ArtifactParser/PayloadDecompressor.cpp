@@ -0,0 +1,227 @@
+#include "PayloadDecompressor.h"
+#include <algorithm>
+
+static const char* DescribeLzmaError(lzma_ret ret) {
+    switch (ret) {
+        case LZMA_MEMLIMIT_ERROR:
+            return "compressed payload needs more memory than allowed";
+        case LZMA_FORMAT_ERROR:
+            return "compressed payload is not in xz format";
+        case LZMA_OPTIONS_ERROR:
+            return "compressed payload uses unsupported options";
+        case LZMA_DATA_ERROR:
+            return "compressed payload is corrupt";
+        case LZMA_BUF_ERROR:
+            return "compressed payload is truncated";
+        case LZMA_MEM_ERROR:
+            return "out of memory while decompressing payload";
+        default:
+            return "decompressing payload failed";
+    }
+}
+
+PayloadDecompressor::PayloadDecompressor(PayloadCompression compression, Sink sink) :
+        sink(std::move(sink)),
+        outputBuffer(DECOMPRESSION_CHUNK_SIZE) {
+    if (compression != PayloadCompression::Xz) {
+        throw decompression_exception("unsupported payload compression");
+    }
+    // Concatenated: payloads may consist of several independently compressed streams
+    lzma_ret ret = lzma_stream_decoder(&stream, DECOMPRESSION_MEMORY_LIMIT, LZMA_CONCATENATED);
+    if (ret != LZMA_OK) {
+        throw decompression_exception(DescribeLzmaError(ret));
+    }
+}
+
+PayloadDecompressor::PayloadDecompressor(PayloadCompression compression, Sink sink,
+                                         std::vector<PayloadFrame> frames, unsigned int threads) :
+        PayloadDecompressor(compression, std::move(sink)) {
+    // One thread decodes the frames as a single concatenated stream, without copying them
+    if (threads <= 1 || frames.empty()) {
+        return;
+    }
+    for (const auto& frame : frames) {
+        if (frame.compressedLength > MAX_FRAME_LENGTH || frame.decompressedLength > MAX_FRAME_LENGTH) {
+            throw decompression_exception("payload frame too large");
+        }
+    }
+    this->frames = std::move(frames);
+    maxInFlight = threads * FRAMES_IN_FLIGHT_PER_THREAD;
+    for (unsigned int i = 0; i < threads; i++) {
+        workers.emplace_back(&PayloadDecompressor::WorkerLoop, this);
+    }
+}
+
+PayloadDecompressor::~PayloadDecompressor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    queued.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    lzma_end(&stream);
+}
+
+void PayloadDecompressor::WorkerLoop() {
+    while (true) {
+        std::shared_ptr<FrameJob> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queued.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
+            }
+            job = queue.front();
+            queue.pop_front();
+        }
+
+        DecompressFrame(*job);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job->done = true;
+        }
+        decompressed.notify_all();
+    }
+}
+
+// decompressed is sized to what the frame index announced; anything else is an error
+void PayloadDecompressor::DecompressFrame(FrameJob& job) {
+    uint64_t memoryLimit = DECOMPRESSION_MEMORY_LIMIT;
+    size_t inputPosition = 0;
+    size_t outputPosition = 0;
+    lzma_ret ret = lzma_stream_buffer_decode(&memoryLimit, 0, nullptr,
+                                             job.compressed.data(), &inputPosition, job.compressed.size(),
+                                             job.decompressed.data(), &outputPosition, job.decompressed.size());
+    if (ret != LZMA_OK) {
+        // Output that doesn't fit reports a truncated buffer as well
+        job.error = DescribeLzmaError(ret == LZMA_BUF_ERROR && outputPosition == job.decompressed.size()
+                                      ? LZMA_DATA_ERROR : ret);
+    } else if (outputPosition != job.decompressed.size() || inputPosition != job.compressed.size()) {
+        job.error = "payload frame doesn't match its index";
+    }
+    job.compressed = {};
+}
+
+void PayloadDecompressor::EmitOldestFrame() {
+    auto job = inFlight.front();
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        decompressed.wait(lock, [&job] { return job->done; });
+    }
+    inFlight.pop_front();
+    inFlightBytes -= job->bytes;
+    if (!job->error.empty()) {
+        throw decompression_exception(job->error.c_str());
+    }
+
+    for (size_t offset = 0; offset < job->decompressed.size(); offset += DECOMPRESSION_CHUNK_SIZE) {
+        size_t length = std::min(DECOMPRESSION_CHUNK_SIZE, job->decompressed.size() - offset);
+        decompressedLength += length;
+        sink(job->decompressed.data() + offset, length);
+    }
+}
+
+void PayloadDecompressor::UpdateFramed(const unsigned char* compressed, size_t length) {
+    while (length > 0) {
+        if (nextFrame == frames.size()) {
+            throw decompression_exception("compressed payload is longer than its frame index says");
+        }
+        const PayloadFrame& frame = frames[nextFrame];
+        if (!collecting) {
+            collecting = std::make_shared<FrameJob>();
+            collecting->compressed.reserve(frame.compressedLength);
+        }
+
+        size_t take = std::min<uint64_t>(length, frame.compressedLength - collecting->compressed.size());
+        collecting->compressed.insert(collecting->compressed.end(), compressed, compressed + take);
+        compressed += take;
+        length -= take;
+        if (collecting->compressed.size() < frame.compressedLength) {
+            break;
+        }
+
+        // Only the decompressed frames waiting to be written are held, not the whole payload
+        collecting->bytes = frame.compressedLength + frame.decompressedLength;
+        while (!inFlight.empty() &&
+               (inFlight.size() >= maxInFlight || inFlightBytes + collecting->bytes > MAX_BYTES_IN_FLIGHT)) {
+            EmitOldestFrame();
+        }
+        collecting->decompressed.resize(frame.decompressedLength);
+        inFlightBytes += collecting->bytes;
+        inFlight.push_back(collecting);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(std::move(collecting));
+        }
+        queued.notify_one();
+        collecting.reset();
+        nextFrame++;
+    }
+
+    // Write whatever is ready without waiting for the rest
+    while (!inFlight.empty()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!inFlight.front()->done) {
+                break;
+            }
+        }
+        EmitOldestFrame();
+    }
+}
+
+lzma_ret PayloadDecompressor::Decode(lzma_action action) {
+    lzma_ret ret;
+    do {
+        stream.next_out = outputBuffer.data();
+        stream.avail_out = outputBuffer.size();
+        ret = lzma_code(&stream, action);
+
+        size_t produced = outputBuffer.size() - stream.avail_out;
+        if (produced > 0) {
+            decompressedLength += produced;
+            sink(outputBuffer.data(), produced);
+        }
+        // A full output buffer may mean more output is pending even without further input
+    } while (ret == LZMA_OK && (stream.avail_in > 0 || stream.avail_out == 0));
+    return ret;
+}
+
+void PayloadDecompressor::Update(const unsigned char* compressed, size_t length) {
+    if (!workers.empty()) {
+        UpdateFramed(compressed, length);
+        return;
+    }
+    stream.next_in = compressed;
+    stream.avail_in = length;
+    lzma_ret ret = Decode(LZMA_RUN);
+    if (ret != LZMA_OK) {
+        throw decompression_exception(DescribeLzmaError(ret));
+    }
+}
+
+void PayloadDecompressor::Finish() {
+    if (!workers.empty()) {
+        while (!inFlight.empty()) {
+            EmitOldestFrame();
+        }
+        if (nextFrame != frames.size()) {
+            throw decompression_exception(DescribeLzmaError(LZMA_BUF_ERROR));
+        }
+        return;
+    }
+    stream.next_in = nullptr;
+    stream.avail_in = 0;
+    lzma_ret ret = Decode(LZMA_FINISH);
+    if (ret != LZMA_STREAM_END) {
+        // Without further input, a decoder that still waits for data reports success
+        throw decompression_exception(DescribeLzmaError(ret == LZMA_OK ? LZMA_BUF_ERROR : ret));
+    }
+}
+
+unsigned long long PayloadDecompressor::DecompressedLength() const {
+    return decompressedLength;
+}
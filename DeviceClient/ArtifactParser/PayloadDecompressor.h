@@ -0,0 +1,128 @@
+#ifndef UPDATECLIENT_PAYLOADDECOMPRESSOR_H
+#define UPDATECLIENT_PAYLOADDECOMPRESSOR_H
+
+#include <lzma.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+class decompression_exception : public std::runtime_error {
+public:
+    explicit decompression_exception(const char* message) : std::runtime_error(message) {}
+};
+
+// Value of the PAYLOAD_COMPRESSION extension of an artifact
+enum class PayloadCompression : unsigned char {
+    None = 0,
+    // .xz stream(s), as written by xz(1)
+    Xz = 1
+};
+
+// Upper bound for the memory the decoder may use, i.e. for the dictionary ("window") a payload
+// was compressed with. xz -6 needs 9 MiB; payloads needing more are rejected.
+const uint64_t DECOMPRESSION_MEMORY_LIMIT = 32 * 1024 * 1024;
+
+// Upper bound for the decompressed data handed to the sink at once
+const size_t DECOMPRESSION_CHUNK_SIZE = 64 * 1024;
+
+// Upper bound for either length of a frame, as each one is held in memory as a whole. The
+// artifact creator frames payloads in 4 MiB by default.
+const uint64_t MAX_FRAME_LENGTH = 16 * 1024 * 1024;
+
+// Frames queued or being decompressed per worker thread
+const size_t FRAMES_IN_FLIGHT_PER_THREAD = 2;
+
+// Upper bound for the compressed and decompressed lengths of all frames queued or being
+// decompressed, so the memory of a framed payload doesn't grow with the number of threads.
+// Holds at least one frame of MAX_FRAME_LENGTH either way.
+const uint64_t MAX_BYTES_IN_FLIGHT = 32 * 1024 * 1024;
+
+// A payload that consists of independently compressed frames, back to back, as listed by the
+// PAYLOAD_FRAME_INDEX extension
+struct PayloadFrame {
+    uint64_t compressedLength;
+    uint64_t decompressedLength;
+};
+
+// Streaming decompression of a firmware payload: compressed data is fed in arbitrarily sized
+// chunks, and the decompressed data is handed to the sink as it is produced, so neither needs
+// to be held in memory as a whole.
+// A payload with a frame index is decompressed by a pool of worker threads, one frame each;
+// the sink is still called in order, and only by the thread calling Update and Finish.
+class PayloadDecompressor {
+public:
+    using Sink = std::function<void(const unsigned char* data, size_t length)>;
+
+private:
+    struct FrameJob {
+        std::vector<unsigned char> compressed;
+        std::vector<unsigned char> decompressed;
+        // Both lengths from the frame index, counted against MAX_BYTES_IN_FLIGHT
+        uint64_t bytes = 0;
+        bool done = false;
+        std::string error;
+    };
+
+    lzma_stream stream = LZMA_STREAM_INIT;
+    Sink sink;
+    std::vector<unsigned char> outputBuffer;
+    unsigned long long decompressedLength = 0;
+
+    std::vector<PayloadFrame> frames;
+    // The frame whose compressed data is being collected
+    size_t nextFrame = 0;
+    std::shared_ptr<FrameJob> collecting;
+    // Frames handed to the workers, in payload order
+    std::deque<std::shared_ptr<FrameJob>> inFlight;
+    size_t maxInFlight = 0;
+    uint64_t inFlightBytes = 0;
+    std::vector<std::thread> workers;
+    std::deque<std::shared_ptr<FrameJob>> queue;
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::condition_variable decompressed;
+    bool stopping = false;
+
+    // Runs the decoder until it needs more input; returns the decoder's last result
+    lzma_ret Decode(lzma_action action);
+
+    void UpdateFramed(const unsigned char* compressed, size_t length);
+
+    void WorkerLoop();
+
+    static void DecompressFrame(FrameJob& job);
+
+    // Hands the oldest frame to the sink once it is decompressed
+    void EmitOldestFrame();
+
+public:
+
+    // Throws decompression_exception if the data is corrupt or needs too much memory
+    void Update(const unsigned char* compressed, size_t length);
+
+    // Throws decompression_exception unless the compressed data ended exactly with the input
+    void Finish();
+
+    unsigned long long DecompressedLength() const;
+
+    PayloadDecompressor(PayloadCompression compression, Sink sink);
+
+    // With more than one thread, frames are decompressed in parallel; throws
+    // decompression_exception if a frame exceeds MAX_FRAME_LENGTH
+    PayloadDecompressor(PayloadCompression compression, Sink sink, std::vector<PayloadFrame> frames,
+                        unsigned int threads);
+
+    ~PayloadDecompressor();
+
+    PayloadDecompressor(const PayloadDecompressor&) = delete;
+
+    PayloadDecompressor& operator=(const PayloadDecompressor&) = delete;
+};
+
+#endif //UPDATECLIENT_PAYLOADDECOMPRESSOR_H
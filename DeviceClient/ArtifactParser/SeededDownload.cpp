@@ -0,0 +1,271 @@
+#include "SeededDownload.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <unordered_map>
+
+// Bits of the filter that rules out most weak checksums before the hash map is consulted
+static const int WEAK_FILTER_BITS = 20;
+
+void RollingChecksum::Reset(const unsigned char* window, size_t windowLength) {
+    a = 0;
+    b = 0;
+    length = windowLength;
+    for (size_t i = 0; i < windowLength; i++) {
+        a += window[i];
+        b += (windowLength - i) * window[i];
+    }
+}
+
+BlockManifest BlockManifest::Parse(const unsigned char* data, size_t length) {
+    if (length < MANIFEST_HEADER_SIZE) {
+        throw seed_exception("manifest too short");
+    }
+    BlockManifest manifest{};
+    std::memcpy(&manifest.payloadOffset, data, sizeof(manifest.payloadOffset));
+    std::memcpy(&manifest.payloadLength, data + 8, sizeof(manifest.payloadLength));
+    std::memcpy(&manifest.blockSize, data + 16, sizeof(manifest.blockSize));
+    if (manifest.blockSize < MIN_MANIFEST_BLOCK_SIZE || manifest.blockSize > MAX_MANIFEST_BLOCK_SIZE) {
+        throw seed_exception("unsupported manifest block size");
+    }
+    // Well below anything that could overflow the offsets computed from them
+    if (manifest.payloadOffset > UINT32_MAX || manifest.payloadLength > UINT64_MAX / 4) {
+        throw seed_exception("manifest lengths out of range");
+    }
+
+    uint64_t blocks = (manifest.payloadLength + manifest.blockSize - 1) / manifest.blockSize;
+    if (blocks != (length - MANIFEST_HEADER_SIZE) / MANIFEST_ENTRY_SIZE ||
+        (length - MANIFEST_HEADER_SIZE) % MANIFEST_ENTRY_SIZE != 0) {
+        throw seed_exception("manifest doesn't match its payload length");
+    }
+
+    manifest.weakChecksums.resize(blocks);
+    manifest.strongChecksums.resize(blocks);
+    const unsigned char* entry = data + MANIFEST_HEADER_SIZE;
+    for (size_t i = 0; i < blocks; i++, entry += MANIFEST_ENTRY_SIZE) {
+        std::memcpy(&manifest.weakChecksums[i], entry, sizeof(uint32_t));
+        std::copy(entry + 4, entry + MANIFEST_ENTRY_SIZE, manifest.strongChecksums[i].begin());
+    }
+    return manifest;
+}
+
+size_t BlockManifest::BlockCount() const {
+    return weakChecksums.size();
+}
+
+size_t BlockManifest::BlockLength(size_t block) const {
+    return std::min<uint64_t>(blockSize, payloadLength - (uint64_t) block * blockSize);
+}
+
+static uint32_t WeakFilterIndex(uint32_t weak) {
+    return (weak * 0x9e3779b1u) >> (32 - WEAK_FILTER_BITS);
+}
+
+std::vector<uint64_t> BlockManifest::FindBlocks(const std::string& sourcePath) const {
+    std::vector<uint64_t> found(BlockCount(), SEED_NOT_FOUND);
+
+    // Blocks with the same content (e.g. zeroes) are found at once
+    struct Content {
+        std::array<unsigned char, 32> strong;
+        std::vector<size_t> blocks;
+        bool found;
+    };
+    std::vector<Content> contents;
+    std::map<std::array<unsigned char, 32>, size_t> contentIndex;
+    std::unordered_map<uint32_t, std::vector<size_t>> byWeak;
+    std::vector<bool> weakFilter(1u << WEAK_FILTER_BITS);
+    for (size_t block = 0; block < BlockCount(); block++) {
+        if (BlockLength(block) != blockSize) {
+            continue;
+        }
+        auto inserted = contentIndex.emplace(strongChecksums[block], contents.size());
+        if (inserted.second) {
+            contents.push_back({strongChecksums[block], {}, false});
+            byWeak[weakChecksums[block]].push_back(inserted.first->second);
+            weakFilter[WeakFilterIndex(weakChecksums[block])] = true;
+        }
+        contents[inserted.first->second].blocks.push_back(block);
+    }
+    size_t remaining = contents.size();
+    if (remaining == 0) {
+        return found;
+    }
+
+    int source = open(sourcePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (source == -1) {
+        const std::string errorMsg = "Unable to open seed source " + sourcePath + ": " + strerror(errno);
+        throw seed_exception(errorMsg.c_str());
+    }
+
+    // Holds the source from bufferStart on; the window starts at position
+    std::vector<unsigned char> buffer;
+    uint64_t bufferStart = 0;
+    uint64_t position = 0;
+    bool eof = false;
+    // Makes the source up to end available, unless it is shorter
+    auto fill = [&](uint64_t end) {
+        while (bufferStart + buffer.size() < end) {
+            if (eof) {
+                return false;
+            }
+            buffer.erase(buffer.begin(), buffer.begin() + (position - bufferStart));
+            bufferStart = position;
+            size_t filled = buffer.size();
+            buffer.resize(filled + SEED_READ_SIZE);
+            ssize_t n;
+            do {
+                n = read(source, buffer.data() + filled, SEED_READ_SIZE);
+            } while (n == -1 && errno == EINTR);
+            if (n == -1) {
+                const std::string errorMsg = std::string("Unable to read seed source: ") + strerror(errno);
+                close(source);
+                throw seed_exception(errorMsg.c_str());
+            }
+            buffer.resize(filled + n);
+            eof = n == 0;
+        }
+        return true;
+    };
+
+    RollingChecksum checksum;
+    bool rolling = false;
+    std::array<unsigned char, 32> strong{};
+    while (remaining > 0 && fill(position + blockSize)) {
+        const unsigned char* window = buffer.data() + (position - bufferStart);
+        if (!rolling) {
+            checksum.Reset(window, blockSize);
+            rolling = true;
+        }
+
+        uint32_t weak = checksum.Value();
+        bool matched = false;
+        auto candidates = weakFilter[WeakFilterIndex(weak)] ? byWeak.find(weak) : byWeak.end();
+        if (candidates != byWeak.end()) {
+            SHA256(window, blockSize, strong.data());
+            for (size_t index : candidates->second) {
+                Content& content = contents[index];
+                if (content.strong != strong) {
+                    continue;
+                }
+                matched = true;
+                if (!content.found) {
+                    content.found = true;
+                    remaining--;
+                    for (size_t block : content.blocks) {
+                        found[block] = position;
+                    }
+                }
+                break;
+            }
+        }
+
+        // A block of the payload is skipped as a whole, as zsync does; unchanged parts of the
+        // source cost one hash per block that way
+        if (matched) {
+            position += blockSize;
+            rolling = false;
+            continue;
+        }
+        if (!fill(position + blockSize + 1)) {
+            break;
+        }
+        window = buffer.data() + (position - bufferStart);
+        checksum.Roll(window[0], window[blockSize]);
+        position++;
+    }
+
+    close(source);
+    return found;
+}
+
+std::vector<SeedRange> PlanSeededDownload(const BlockManifest& manifest, const std::vector<uint64_t>& blocks,
+                                          uint64_t mergeGap) {
+    std::vector<SeedRange> ranges;
+    auto append = [&ranges](uint64_t offset, uint64_t length, bool local, uint64_t sourceOffset) {
+        if (length == 0) {
+            return;
+        }
+        if (!ranges.empty()) {
+            SeedRange& last = ranges.back();
+            if (last.local == local && (!local || last.sourceOffset + last.length == sourceOffset)) {
+                last.length += length;
+                return;
+            }
+        }
+        ranges.push_back({offset, length, local, sourceOffset});
+    };
+
+    // Signature and header come from the server, as nothing on the device has them
+    append(0, manifest.payloadOffset, false, 0);
+    for (size_t block = 0; block < manifest.BlockCount(); block++) {
+        uint64_t offset = manifest.payloadOffset + (uint64_t) block * manifest.blockSize;
+        bool local = block < blocks.size() && blocks[block] != SEED_NOT_FOUND;
+        append(offset, manifest.BlockLength(block), local, local ? blocks[block] : 0);
+    }
+    // GCM tag
+    append(manifest.payloadOffset + manifest.payloadLength, 16, false, 0);
+
+    // A short local range between two downloads is downloaded along with them
+    std::vector<SeedRange> merged;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        SeedRange range = ranges[i];
+        bool gap = range.local && range.length < mergeGap && !merged.empty() && !merged.back().local &&
+                   i + 1 < ranges.size() && !ranges[i + 1].local;
+        if (gap || (!range.local && !merged.empty() && !merged.back().local)) {
+            merged.back().length += range.length;
+            continue;
+        }
+        if (range.local) {
+            merged.push_back(range);
+        } else {
+            merged.push_back({range.offset, range.length, false, 0});
+        }
+    }
+    return merged;
+}
+
+SeedSource::SeedSource(const std::string& sourcePath, const std::array<unsigned char, 16>& key,
+                       const std::array<unsigned char, 12>& iv) :
+        cipher(key, iv),
+        buffer(SEED_READ_SIZE) {
+    source = open(sourcePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (source == -1) {
+        const std::string errorMsg = "Unable to open seed source " + sourcePath + ": " + strerror(errno);
+        throw seed_exception(errorMsg.c_str());
+    }
+}
+
+SeedSource::~SeedSource() {
+    if (source != -1) {
+        close(source);
+    }
+}
+
+void SeedSource::Emit(const SeedRange& range, const Sink& sink) {
+    uint64_t done = 0;
+    while (done < range.length) {
+        size_t length = std::min<uint64_t>(buffer.size(), range.length - done);
+        size_t read = 0;
+        while (read < length) {
+            ssize_t n = pread(source, buffer.data() + read, length - read, range.sourceOffset + done + read);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1) {
+                const std::string errorMsg = std::string("Unable to read seed source: ") + strerror(errno);
+                throw seed_exception(errorMsg.c_str());
+            }
+            if (n == 0) {
+                throw seed_exception("seed source is shorter than expected");
+            }
+            read += n;
+        }
+        cipher.Apply(range.offset + done, buffer.data(), length, buffer.data());
+        sink(buffer.data(), length);
+        done += length;
+    }
+}
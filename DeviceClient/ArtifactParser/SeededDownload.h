@@ -0,0 +1,127 @@
+#ifndef UPDATECLIENT_SEEDEDDOWNLOAD_H
+#define UPDATECLIENT_SEEDEDDOWNLOAD_H
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "ArtifactCryptoHelper.h"
+
+// The manifest is malformed or the source can't be read; the artifact has to be downloaded as a
+// whole instead
+class seed_exception : public std::runtime_error {
+public:
+    explicit seed_exception(const char* message) : std::runtime_error(message) {}
+};
+
+// Size of the fixed part of a manifest and of each block's entry in it
+const size_t MANIFEST_HEADER_SIZE = 20;
+const size_t MANIFEST_ENTRY_SIZE = 4 + 32;
+
+const uint32_t MIN_MANIFEST_BLOCK_SIZE = 512;
+const uint32_t MAX_MANIFEST_BLOCK_SIZE = 16 * 1024 * 1024;
+
+// Source data read at once while scanning or rebuilding
+const size_t SEED_READ_SIZE = 4 * 1024 * 1024;
+
+// Ranges to download that are separated by less than this many bytes of the source are
+// fetched with one request; a round trip costs more than transferring that gap
+const uint64_t SEED_MERGE_GAP = 16 * 1024;
+
+// Entry of FindBlocks for a block the source doesn't contain
+const uint64_t SEED_NOT_FOUND = UINT64_MAX;
+
+// rsync's rolling checksum over a window of fixed length: moving the window by one byte costs
+// a few additions instead of summing it anew
+class RollingChecksum {
+private:
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t length = 0;
+
+public:
+    void Reset(const unsigned char* window, size_t length);
+
+    // Moves the window by one byte: out leaves it at the front, in enters it at the back
+    void Roll(unsigned char out, unsigned char in) {
+        a += in - out;
+        b += a - length * out;
+    }
+
+    uint32_t Value() const {
+        return (a & 0xffff) | (b << 16);
+    }
+};
+
+// Block checksums of the uncompressed payload of a full artifact, as written by ArtifactCreator
+// next to it. Layout, little-endian: 8 byte offset of the payload within the artifact, 8 byte
+// payload length, 4 byte block size, then for every block its 4 byte RollingChecksum and its
+// SHA-256. The last block may be short.
+// A manifest is not signed: it only tells which blocks the device may have already, and the
+// artifact rebuilt with its help is authenticated as a whole like any other.
+struct BlockManifest {
+    uint64_t payloadOffset;
+    uint64_t payloadLength;
+    uint32_t blockSize;
+    std::vector<uint32_t> weakChecksums;
+    std::vector<std::array<unsigned char, 32>> strongChecksums;
+
+    // Throws seed_exception if the manifest is malformed
+    static BlockManifest Parse(const unsigned char* data, size_t length);
+
+    size_t BlockCount() const;
+
+    size_t BlockLength(size_t block) const;
+
+    // Scans the source, e.g. the active rootfs, at every byte offset for the blocks of the
+    // payload, like zsync does. Returns for each block the source offset of the same content,
+    // or SEED_NOT_FOUND; a short last block is never looked for. Throws seed_exception if the
+    // source can't be read.
+    std::vector<uint64_t> FindBlocks(const std::string& sourcePath) const;
+};
+
+// A range of the artifact: downloaded, or rebuilt from the source at sourceOffset
+struct SeedRange {
+    uint64_t offset;
+    uint64_t length;
+    bool local;
+    uint64_t sourceOffset;
+};
+
+// The whole artifact, i.e. header, payload and tag, as ranges in order. Adjacent blocks are
+// merged into one range, and ranges to download that are less than mergeGap apart are
+// downloaded together.
+std::vector<SeedRange> PlanSeededDownload(const BlockManifest& manifest, const std::vector<uint64_t>& blocks,
+                                          uint64_t mergeGap = SEED_MERGE_GAP);
+
+// Rebuilds the local ranges of a seeded download: the source is read and encrypted just like
+// the artifact has that part of the payload
+class SeedSource {
+public:
+    using Sink = std::function<void(const unsigned char* data, size_t length)>;
+
+private:
+    int source = -1;
+    AESGCMRangeCipher cipher;
+    std::vector<unsigned char> buffer;
+
+public:
+
+    // Hands the range's ciphertext to the sink in chunks; throws seed_exception if the source
+    // can't be read
+    void Emit(const SeedRange& range, const Sink& sink);
+
+    // Throws seed_exception if the source can't be opened
+    SeedSource(const std::string& sourcePath, const std::array<unsigned char, 16>& key,
+               const std::array<unsigned char, 12>& iv);
+
+    ~SeedSource();
+
+    SeedSource(const SeedSource&) = delete;
+
+    SeedSource& operator=(const SeedSource&) = delete;
+};
+
+#endif //UPDATECLIENT_SEEDEDDOWNLOAD_H
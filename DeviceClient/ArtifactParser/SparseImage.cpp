@@ -0,0 +1,70 @@
+#include "SparseImage.h"
+#include <algorithm>
+#include <cstring>
+
+SparseImageExpander::SparseImageExpander(uint64_t imageLength, DataSink data, FillSink fill, DontCareSink dontCare) :
+        imageLength(imageLength),
+        data(std::move(data)),
+        fill(std::move(fill)),
+        dontCare(std::move(dontCare)) {}
+
+size_t SparseImageExpander::ChunkHeaderLength() const {
+    return 1 + sizeof(uint64_t) + (chunk == SparseChunk::Fill ? sizeof(uint32_t) : 0);
+}
+
+void SparseImageExpander::Update(const unsigned char* sparse, size_t length) {
+    while (length > 0) {
+        if (remaining > 0) {
+            size_t n = std::min<uint64_t>(remaining, length);
+            data(sparse, n);
+            sparse += n;
+            length -= n;
+            remaining -= n;
+            continue;
+        }
+
+        if (chunkHeader.empty()) {
+            chunk = (SparseChunk) sparse[0];
+            if (chunk != SparseChunk::Data && chunk != SparseChunk::Fill && chunk != SparseChunk::DontCare) {
+                throw sparse_exception("malformed sparse chunk");
+            }
+        }
+        size_t take = std::min(length, ChunkHeaderLength() - chunkHeader.size());
+        chunkHeader.insert(chunkHeader.end(), sparse, sparse + take);
+        sparse += take;
+        length -= take;
+        if (chunkHeader.size() < ChunkHeaderLength()) {
+            continue;
+        }
+
+        uint64_t chunkLength = 0;
+        std::memcpy(&chunkLength, chunkHeader.data() + 1, sizeof(chunkLength));
+        if (chunkLength > imageLength - outputLength) {
+            throw sparse_exception("sparse chunk exceeds the image");
+        }
+        outputLength += chunkLength;
+        if (chunk == SparseChunk::Data) {
+            remaining = chunkLength;
+        } else if (chunk == SparseChunk::Fill) {
+            uint32_t pattern = 0;
+            std::memcpy(&pattern, chunkHeader.data() + 1 + sizeof(chunkLength), sizeof(pattern));
+            fill(pattern, chunkLength);
+        } else {
+            dontCare(chunkLength);
+        }
+        chunkHeader.clear();
+    }
+}
+
+void SparseImageExpander::Finish() {
+    if (!chunkHeader.empty() || remaining > 0) {
+        throw sparse_exception("sparse payload ends within a chunk");
+    }
+    if (outputLength != imageLength) {
+        throw sparse_exception("sparse payload is shorter than its image");
+    }
+}
+
+uint64_t SparseImageExpander::OutputLength() const {
+    return outputLength;
+}
@@ -0,0 +1,63 @@
+#ifndef UPDATECLIENT_SPARSEIMAGE_H
+#define UPDATECLIENT_SPARSEIMAGE_H
+
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+class sparse_exception : public std::runtime_error {
+public:
+    explicit sparse_exception(const char* message) : std::runtime_error(message) {}
+};
+
+// Chunks of a sparse payload, in the spirit of Android sparse images; each is a type byte
+// followed by little-endian operands
+enum class SparseChunk : unsigned char {
+    // 8 byte length, then length bytes of the image
+    Data = 1,
+    // 8 byte length, 4 byte pattern: length bytes of the pattern repeated from the chunk's start,
+    // e.g. zeroes
+    Fill = 2,
+    // 8 byte length: bytes whose content doesn't matter, e.g. unused blocks of a filesystem
+    DontCare = 3
+};
+
+// Turns a sparse payload back into its image while it is fed in arbitrarily sized chunks. Data
+// is handed to the data sink as it arrives; fill and don't-care chunks are handed on as a whole,
+// so the writer can fill or skip them without the image being materialized.
+class SparseImageExpander {
+public:
+    using DataSink = std::function<void(const unsigned char* data, size_t length)>;
+    using FillSink = std::function<void(uint32_t pattern, uint64_t length)>;
+    using DontCareSink = std::function<void(uint64_t length)>;
+
+private:
+    uint64_t imageLength;
+    DataSink data;
+    FillSink fill;
+    DontCareSink dontCare;
+
+    // The chunk header being parsed
+    std::vector<unsigned char> chunkHeader;
+    SparseChunk chunk{};
+    // Data bytes left of the current chunk
+    uint64_t remaining = 0;
+    uint64_t outputLength = 0;
+
+    size_t ChunkHeaderLength() const;
+
+public:
+
+    // Throws sparse_exception for malformed chunks or chunks beyond the image length
+    void Update(const unsigned char* sparse, size_t length);
+
+    // Throws sparse_exception if the payload ended within a chunk or short of the image length
+    void Finish();
+
+    uint64_t OutputLength() const;
+
+    SparseImageExpander(uint64_t imageLength, DataSink data, FillSink fill, DontCareSink dontCare);
+};
+
+#endif //UPDATECLIENT_SPARSEIMAGE_H
@@ -1,15 +1,23 @@
 #include <iostream>
 #include "log.h"
 #include "ArtifactParser.h"
+#include "SeededDownload.h"
 #include "UpdateDownloadClient.h"
+#include "block_index.h"
 #include "writer.h"
 #include <thread>
 #include <memory>
+#include <algorithm>
 #include <map>
+#include <set>
 #include <chrono>
+#include <future>
 #include "writer.h"
 #include <unistd.h>
+#include <dirent.h>
 #include <sys/reboot.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 class bootenv_exception : public std::runtime_error {
 public:
@@ -19,16 +27,22 @@ public:
 class BootEnvWriter {
 private:
     // adapted from: https://stackoverflow.com/questions/478898/how-do-i-execute-a-command-and-get-the-output-of-the-command-within-c-using-po
+    // Throws if the command fails, so a boot environment that wasn't written is noticed
     std::string execCmd(const std::string& cmd) {
         std::array<char, 128> buffer{};
         std::string result;
-        std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd.c_str(), "r"), pclose);
-        if (!pipe) {
+        FILE* pipe = popen(cmd.c_str(), "r");
+        if (pipe == nullptr) {
             throw bootenv_exception("popen() failed.");
         }
-        while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
+        while (fgets(buffer.data(), buffer.size(), pipe) != nullptr) {
             result += buffer.data();
         }
+        int status = pclose(pipe);
+        if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            std::string errorMsg = "'" + cmd + "' failed.";
+            throw bootenv_exception(errorMsg.c_str());
+        }
         return result;
     }
 
@@ -36,8 +50,10 @@ public:
 
     std::string ReadVar(const std::string& var) {
         std::ostringstream cmdStream;
-        cmdStream << "fw_printenv " << var;
-        return execCmd(cmdStream.str());
+        cmdStream << "fw_printenv -n " << var;
+        std::string value = execCmd(cmdStream.str());
+        value.erase(value.find_last_not_of("\r\n") + 1);
+        return value;
     }
 
     void WriteVar(const std::string& var, const std::string& val) {
@@ -45,6 +61,57 @@ public:
         cmdStream << "fw_setenv " << var << " " << val;
         execCmd(cmdStream.str());
     }
+
+    // Sets all variables with a single write of the environment, so a power loss
+    // can't leave it half-updated
+    void WriteVars(const std::map<std::string, std::string>& vars) {
+        char scriptPath[] = "/tmp/fw_setenv_XXXXXX";
+        int fd = mkstemp(scriptPath);
+        if (fd == -1) {
+            throw bootenv_exception("creating fw_setenv script failed.");
+        }
+        std::ostringstream script;
+        for (auto const&[var, val] : vars) {
+            script << var << " " << val << "\n";
+        }
+        std::string content = script.str();
+        bool ok = write(fd, content.data(), content.size()) == (ssize_t) content.size();
+        close(fd);
+        if (!ok) {
+            unlink(scriptPath);
+            throw bootenv_exception("writing fw_setenv script failed.");
+        }
+        std::ostringstream cmdStream;
+        cmdStream << "fw_setenv -s " << scriptPath;
+        try {
+            execCmd(cmdStream.str());
+        } catch (bootenv_exception&) {
+            unlink(scriptPath);
+            throw;
+        }
+        unlink(scriptPath);
+    }
+};
+
+// Payload is collected into writes of this size instead of one write per network chunk
+const size_t INSTALL_WRITE_CHUNK_SIZE = 1024 * 1024;
+
+enum class InstallMode {
+    // Whole artifact in RAM, decrypted in place
+    Buffered,
+    // Download piped through decryption and verification onto the partition
+    Streaming,
+    // Downloaded to a file on /data first, installed from a mapping of that file
+    Staged
+};
+
+// Hands the encrypted artifact to a sink and returns the http-response code
+using ArtifactSource = std::function<long(const BodySink& sink)>;
+
+// AES key and iv of an artifact, once the key response arrived and the key was unwrapped
+struct ArtifactKey {
+    std::array<unsigned char, 16> key;
+    std::array<unsigned char, 12> iv;
 };
 
 class UpdateDriver {
@@ -58,8 +125,38 @@ private:
     std::string privateKeyPath;
     std::string publisherKeyPath;
     std::string logDir;
+    std::string rootfsDevicePrefix;
+    std::string stagingDir;
+    std::string tlsSessionCachePath;
+    // Block indexes of the rootfs partitions, built while they are written; empty to disable
+    std::string blockIndexDir;
+    // Leave blocks of the inactive partition alone that the update doesn't change
+    bool skipUnchangedBlocks;
+    // Write the inactive partition past the page cache
+    bool directIO;
+    // Milliseconds between two /whatsNew requests the server doesn't hold
     int pollInterval;
+    // Seconds the server may hold a /whatsNew request until an update is published
+    int longPollWait;
+    int connectionRetries;
+    int downloadConnections;
+    // Bytes of segments a segmented download may hold in RAM until the earlier ones arrived
+    curl_off_t downloadWindowSize;
+    // Threads decompressing the frames of a framed payload
+    unsigned int decompressionThreads;
+    int blacklistRetrySeconds;
+    InstallMode installMode;
+    // Ask for delta artifacts, which are applied against the active rootfs
+    bool deltaUpdates;
     std::map<unsigned int, int> blacklist;
+    // Updates whose delta didn't fit the active rootfs, or that have none
+    std::set<unsigned int> fullArtifactOnly;
+    // Rebuild full artifacts from the blocks the active rootfs has, and download only the rest
+    bool seededDownloads;
+    // Updates whose seeded download was tried once already; a retry downloads the whole artifact
+    std::set<unsigned int> unseeded;
+    // Until the next poll after a failed update
+    std::chrono::minutes retryDelay{5};
     LogType loglevel;
     BootEnvWriter envWriter;
 
@@ -68,37 +165,498 @@ private:
         reboot(RB_AUTOBOOT);
     }
 
+    // Gives up on the update; doPoll polls again after the delay once the install has returned,
+    // which also closes the inactive partition the install held open
     void restartPoll(const std::chrono::minutes& after, unsigned int updateId) {
         Logger::Warn() << "restarting poll in " << after.count() << " minutes\n";
         blacklist[updateId] = (int) time(nullptr);
-        std::this_thread::sleep_for(after);
-        doPoll();
+        retryDelay = after;
     }
 
-    void doInstall(const UpdateArtifact& artifact, unsigned int id) {
-        std::string partB;
+    // Partition numbers as set up by boot.cmd: the device boots ROOTFS_PART_A and
+    // falls back to ROOTFS_PART_B once bootlimit is exceeded
+    bool readRootfsSlots(std::string& partA, std::string& partB) {
         try {
+            partA = envWriter.ReadVar("ROOTFS_PART_A");
             partB = envWriter.ReadVar("ROOTFS_PART_B");
         } catch (bootenv_exception& e) {
             Logger::Error() << e.what() << "\n";
+            return false;
+        }
+        if (partA.empty() || partB.empty()) {
+            Logger::Error() << "rootfs partitions missing in boot environment\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Boots the freshly written partition next; the old one stays the fallback
+    // should the new image exceed bootlimit
+    bool activateUpdatedSlot(const std::string& partA, const std::string& partB) {
+        try {
+            envWriter.WriteVars({{"ROOTFS_PART_A",     partB},
+                                 {"ROOTFS_PART_B",     partA},
+                                 {"upgrade_available", "1"},
+                                 {"bootcount",         "0"}});
+        } catch (bootenv_exception& e) {
+            Logger::Error() << e.what() << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool openInactiveSlot(ImageWriter& writer, const std::string& partB) {
+        try {
+            writer.openBlockDevice(rootfsDevicePrefix + partB);
+        } catch (BlockdeviceException& e) {
+            Logger::Error() << e.what() << "\n";
+            return false;
+        }
+        writer.setSkipUnchanged(skipUnchangedBlocks);
+        if (directIO && !writer.setDirectIO(true)) {
+            Logger::Warn() << "writing " << writer.getDevicePath() << " through the page cache\n";
+        }
+        if (!blockIndexDir.empty()) {
+            mkdir(blockIndexDir.c_str(), 0700);
+            try {
+                writer.buildBlockIndex(blockIndexPath(partB));
+            } catch (BlockIndexException& e) {
+                Logger::Warn() << e.what() << "\n";
+            }
+        }
+        return true;
+    }
+
+    std::string blockIndexPath(const std::string& part) {
+        return blockIndexDir + "/rootfs" + part + ".index";
+    }
+
+    // The partition's block index, if it still describes what the partition holds; nullptr otherwise
+    std::unique_ptr<BlockIndex> openValidBlockIndex(const std::string& part) {
+        if (blockIndexDir.empty()) {
+            return nullptr;
+        }
+        try {
+            auto index = std::make_unique<BlockIndex>(blockIndexPath(part));
+            if (index->isValidFor(rootfsDevicePrefix + part)) {
+                return index;
+            }
+            Logger::Info() << "partition " << part << " changed since its block index was built\n";
+        } catch (BlockIndexException& e) {
+            Logger::Info() << e.what() << "\n";
+        }
+        return nullptr;
+    }
+
+    void finishInstall(ImageWriter& writer, const std::string& partA, const std::string& partB, unsigned int id) {
+        WriteStatistics statistics = writer.getWriteStatistics();
+        Logger::Info() << "wrote " << statistics.bytesWritten << " bytes, skipped " << statistics.bytesSkipped
+                       << " unchanged bytes, read back " << statistics.bytesRead << " bytes, discarded "
+                       << statistics.bytesDiscarded << " bytes\n";
+        try {
+            writer.syncBlockDevice();
+            writer.closeBlockDevice();
+        } catch (BlockdeviceException& e) {
+            Logger::Error() << e.what() << "\n";
+            restartPoll(std::chrono::minutes(5), id);
+            return;
+        }
+
+        if (!activateUpdatedSlot(partA, partB)) {
+            Logger::Error() << "switching rootfs partitions failed\n";
+            restartPoll(std::chrono::minutes(5), id);
+            return;
+        }
+
+        Logger::Info() << "update installed, rebooting\n";
+        rebootDevice();
+    }
+
+    void doInstall(const UpdateArtifactView& artifact, unsigned int id) {
+        std::string partA;
+        std::string partB;
+        if (!readRootfsSlots(partA, partB)) {
             restartPoll(std::chrono::minutes(5), id);
+            return;
         }
+
         ImageWriter writer{};
-        // TODO: actually insall the image
+        if (!openInactiveSlot(writer, partB)) {
+            restartPoll(std::chrono::minutes(5), id);
+            return;
+        }
+
+        Logger::Info() << "writing firmware to " << writer.getDevicePath() << "\n";
+        try {
+            applyBlockMap(writer, artifact.header.blockMap);
+            off_t written = 0;
+            auto writeImage = [&](const unsigned char* data, size_t length) {
+                written += writer.writeChunk(data, length, written);
+            };
+            std::unique_ptr<SparseImageExpander> sparse;
+            if (artifact.header.sparseImageLength) {
+                sparse = expandSparseImage(*artifact.header.sparseImageLength, writer, written, writeImage, [] {});
+            }
+            auto writePayload = [&](const unsigned char* data, size_t length) {
+                if (sparse) {
+                    sparse->Update(data, length);
+                } else {
+                    writeImage(data, length);
+                }
+            };
+
+            if (artifact.header.payloadCompression == PayloadCompression::None) {
+                writePayload(artifact.firmwarePayload.data, artifact.firmwarePayload.size);
+            } else {
+                PayloadDecompressor decompressor(artifact.header.payloadCompression, writePayload,
+                                                 artifact.header.payloadFrames, decompressionThreads);
+                decompressor.Update(artifact.firmwarePayload.data, artifact.firmwarePayload.size);
+                decompressor.Finish();
+            }
+            if (sparse) {
+                sparse->Finish();
+            }
+        } catch (std::runtime_error& e) {
+            Logger::Error() << e.what() << "\n";
+            restartPoll(std::chrono::minutes(5), id);
+            return;
+        }
+
+        finishInstall(writer, partA, partB, id);
     }
 
-    void doParse(const std::vector<unsigned char>& artifactData,
-                 const DecryptionKeyServerResponse& keyResp, unsigned int id) {
+    // Expands a sparse payload onto the writer: data chunks go to writeImage like a plain image
+    // would, fill and don't-care chunks to the writer at the offset written has reached, once
+    // flush has written what writeImage holds back
+    std::unique_ptr<SparseImageExpander> expandSparseImage(uint64_t imageLength, const ImageWriter& writer,
+                                                           off_t& written,
+                                                           const SparseImageExpander::DataSink& writeImage,
+                                                           const std::function<void()>& flush) {
+        if (imageLength > writer.getBlockDeviceSize()) {
+            throw sparse_exception("sparse image exceeds the partition");
+        }
+        return std::make_unique<SparseImageExpander>(
+                imageLength, writeImage,
+                [&writer, &written, flush](uint32_t pattern, uint64_t length) {
+                    flush();
+                    written += writer.fillRange(pattern, length, written);
+                },
+                [&writer, &written, flush](uint64_t length) {
+                    flush();
+                    written += writer.discardRange(length, written);
+                });
+    }
 
-        Logger::Info() << "decrypting aes-key\n";
-        std::array<unsigned char, 16> keyPlain{};
+    // Has the writer write only the extents of the artifact's block map, if it has one, and
+    // discard the blocks its filesystem doesn't use
+    void applyBlockMap(ImageWriter& writer, const std::optional<BlockMap>& blockMap) {
+        std::vector<ImageExtent> extents;
+        if (blockMap) {
+            if (blockMap->imageLength > writer.getBlockDeviceSize()) {
+                throw parse_exception("block map exceeds the partition");
+            }
+            uint64_t mapped = 0;
+            for (const auto& extent : blockMap->extents) {
+                uint64_t offset = extent.firstBlock * blockMap->blockSize;
+                if (offset >= blockMap->imageLength) {
+                    break;
+                }
+                uint64_t length = std::min(extent.blockCount * blockMap->blockSize, blockMap->imageLength - offset);
+                extents.push_back({offset, length});
+                mapped += length;
+            }
+            // An empty map would have the whole image written
+            if (extents.empty()) {
+                extents.push_back({blockMap->imageLength, 0});
+            }
+            Logger::Info() << "block map: writing " << mapped << " of " << blockMap->imageLength << " bytes\n";
+        }
+        writer.setBlockMap(std::move(extents));
+    }
 
+    bool decryptArtifactKey(const DecryptionKeyServerResponse& keyResp, std::array<unsigned char, 16>& keyPlain) {
+        Logger::Info() << "decrypting aes-key\n";
         try {
             keyPlain = ArtifactCryptoHelper::decryptAESKey(privateKeyPath, keyResp.key);
         } catch (decryption_exception& e) {
             Logger::Error() << e.what() << "\n";
             Logger::Error() << "decryption of aes-key failed\n";
+            return false;
+        }
+        return true;
+    }
+
+    std::string stagedArtifactPath(unsigned int id) {
+        return stagingDir + "/" + std::to_string(id) + ".artifact";
+    }
+
+    bool hasPartialDownload(unsigned int id) {
+        return installMode == InstallMode::Staged &&
+               UpdateDownloadClient::HasPartialDownload(id, stagedArtifactPath(id));
+    }
+
+    // Only the artifact currently being installed, or its interrupted download, is kept on /data
+    void removeStagedArtifacts(unsigned int keepId) {
+        DIR* dir = opendir(stagingDir.c_str());
+        if (dir == nullptr) {
+            return;
+        }
+        std::string keep = std::to_string(keepId) + ".artifact";
+        while (auto entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name != "." && name != ".." && name.compare(0, keep.size(), keep) != 0) {
+                unlink((stagingDir + "/" + name).c_str());
+            }
+        }
+        closedir(dir);
+    }
+
+    // A staged artifact that failed to decrypt, parse or verify is corrupt and would fail the
+    // same way on every retry; the next attempt downloads it again instead
+    void discardStagedArtifact(unsigned int id) {
+        if (installMode != InstallMode::Staged) {
+            return;
+        }
+        Logger::Warn() << "discarding staged artifact, the next attempt downloads it again\n";
+        UpdateDownloadClient::DiscardStagedArtifact(stagedArtifactPath(id));
+    }
+
+    // Failures writing the inactive partition, as opposed to ones of the artifact itself
+    static bool isPartitionError(const std::exception& e) {
+        return dynamic_cast<const BlockdeviceException*>(&e) != nullptr ||
+               dynamic_cast<const ImageFileException*>(&e) != nullptr ||
+               dynamic_cast<const BlockIndexException*>(&e) != nullptr;
+    }
+
+    // The artifact is downloaded into a file once; retries after a failure of the partition
+    // install from that file instead of downloading it again
+    void doStagedInstall(const DecryptionKeyServerResponse& keyResp, unsigned int id) {
+        std::string path = stagedArtifactPath(id);
+        removeStagedArtifacts(id);
+
+        if (access(path.c_str(), F_OK) == 0) {
+            Logger::Info() << "installing previously staged artifact " << path << "\n";
+        } else {
+            Logger::Info() << "staging artifact to " << path << "\n";
+            mkdir(stagingDir.c_str(), 0700);
+            long httpCode = 0;
+            try {
+                httpCode = client->FetchArtifactToFile(id, path);
+            } catch (fetch_exception& e) {
+                Logger::Error() << e.what() << "\n";
+                Logger::Error() << "staging artifact failed, the next attempt continues the download\n";
+                restartPoll(std::chrono::minutes(5), id);
+                return;
+            }
+            if (httpCode != 200) {
+                Logger::Error() << "fetching artifact failed with http-response code " << httpCode << "\n";
+                restartPoll(std::chrono::minutes(5), id);
+                return;
+            }
+        }
+
+        doStreamingInstall(id, unwrapArtifactKey(keyResp), [&path](const BodySink& sink) {
+            MappedFile staged(path);
+            sink(staged.data(), staged.size());
+            return 200L;
+        });
+    }
+
+    // The RSA unwrap runs on its own thread, so it overlaps with the download
+    std::shared_future<ArtifactKey> unwrapArtifactKey(const DecryptionKeyServerResponse& keyResp) {
+        return std::async(std::launch::async, [keyPath = privateKeyPath, keyResp]() {
+            return ArtifactKey{ArtifactCryptoHelper::decryptAESKey(keyPath, keyResp.key), keyResp.iv};
+        }).share();
+    }
+
+    // Decryption, signature check and writing to the inactive partition all happen chunk by
+    // chunk as source delivers the artifact, so memory use doesn't depend on the size of the
+    // image. The partitions are only switched once tag and signature have been checked.
+    // artifactKey may only become valid while source runs; ciphertext that arrives before the
+    // key is ready is held back, up to downloadWindowSize. Beyond that the sink waits for a key
+    // that is being unwrapped, and fails if there is none yet.
+    // A delta payload is applied against the active partition, which the caller checked to be
+    // verifiedSource before the download; the full artifact is fetched instead should the delta
+    // name another source after all.
+    void doStreamingInstall(unsigned int id, const std::shared_future<ArtifactKey>& artifactKey,
+                            const ArtifactSource& source,
+                            const std::optional<DeltaSource>& verifiedSource = std::nullopt) {
+        std::string partA;
+        std::string partB;
+        if (!readRootfsSlots(partA, partB)) {
+            restartPoll(std::chrono::minutes(5), id);
+            return;
+        }
+
+        ImageWriter writer{};
+        if (!openInactiveSlot(writer, partB)) {
+            restartPoll(std::chrono::minutes(5), id);
+            return;
+        }
+
+        std::vector<unsigned char> pending(INSTALL_WRITE_CHUNK_SIZE);
+        size_t pendingLength = 0;
+        off_t written = 0;
+        auto flush = [&]() {
+            written += writer.writeChunk(pending.data(), pendingLength, written);
+            pendingLength = 0;
+        };
+
+        auto writePayload = [&](const unsigned char* data, size_t length) {
+            while (length > 0) {
+                size_t take = std::min(length, pending.size() - pendingLength);
+                std::copy(data, data + take, pending.begin() + pendingLength);
+                pendingLength += take;
+                data += take;
+                length -= take;
+                if (pendingLength == pending.size()) {
+                    flush();
+                }
+            }
+        };
+
+        Logger::Info() << "streaming artifact to " << writer.getDevicePath() << "\n";
+        long httpCode = 0;
+        std::unique_ptr<ArtifactStreamParser> parser;
+
+        // Set up with the first payload byte, when the header is known
+        bool payloadStarted = false;
+        std::unique_ptr<DeltaApplier> deltaApplier;
+        std::unique_ptr<SparseImageExpander> sparse;
+        auto startPayload = [&]() {
+            payloadStarted = true;
+            const auto& sparseImageLength = parser->Header().sparseImageLength;
+            const auto& deltaSource = parser->Header().deltaSource;
+            if (sparseImageLength && deltaSource) {
+                throw sparse_exception("a delta payload can't be sparse");
+            }
+            if (sparseImageLength) {
+                sparse = expandSparseImage(*sparseImageLength, writer, written, writePayload, flush);
+            }
+            applyBlockMap(writer, parser->Header().blockMap);
+            if (!deltaSource) {
+                return;
+            }
+            if (!verifiedSource || verifiedSource->length != deltaSource->length ||
+                verifiedSource->sha256 != deltaSource->sha256) {
+                throw delta_source_exception("delta was made against another image than announced");
+            }
+            std::string sourcePath = rootfsDevicePrefix + partA;
+            Logger::Info() << "applying delta against " << sourcePath << "\n";
+            deltaApplier = std::make_unique<DeltaApplier>(sourcePath, *deltaSource, writePayload);
+        };
+
+        std::vector<unsigned char> early;
+        auto startParser = [&]() {
+            ArtifactKey key = artifactKey.get();
+            Logger::Info() << "decrypted aes-key, " << early.size() << " bytes of ciphertext were held back\n";
+            parser = std::make_unique<ArtifactStreamParser>(
+                    publisherKeyPath, key.key, key.iv,
+                    [&](const unsigned char* data, size_t length) {
+                        if (!payloadStarted) {
+                            startPayload();
+                        }
+                        if (deltaApplier) {
+                            deltaApplier->Update(data, length);
+                        } else if (sparse) {
+                            sparse->Update(data, length);
+                        } else {
+                            writePayload(data, length);
+                        }
+                    });
+            parser->SetDecompressionThreads(decompressionThreads);
+            parser->Update(early.data(), early.size());
+            early = {};
+        };
+
+        try {
+            httpCode = source([&](const unsigned char* data, size_t length) {
+                bool overflow = early.size() + length > (size_t) downloadWindowSize;
+                if (!parser && artifactKey.valid() &&
+                    (overflow || artifactKey.wait_for(std::chrono::seconds(0)) == std::future_status::ready)) {
+                    startParser();
+                }
+                if (!parser) {
+                    if (overflow) {
+                        throw fetch_exception("too much ciphertext arrived before the key");
+                    }
+                    early.insert(early.end(), data, data + length);
+                    return true;
+                }
+                parser->Update(data, length);
+                return true;
+            });
+
+            if (httpCode == 200) {
+                if (!parser) {
+                    if (!artifactKey.valid()) {
+                        throw fetch_exception("artifact arrived without a key");
+                    }
+                    startParser();
+                }
+                if (deltaApplier) {
+                    deltaApplier->Finish();
+                }
+                if (sparse) {
+                    sparse->Finish();
+                }
+                flush();
+            }
+        } catch (delta_source_exception& e) {
+            Logger::Warn() << e.what() << "\n";
+            Logger::Warn() << "falling back to the full artifact\n";
+            fullArtifactOnly.insert(id);
+            try {
+                writer.closeBlockDevice();
+            } catch (BlockdeviceException& e) {
+                Logger::Error() << e.what() << "\n";
+            }
+            doFetch(id);
+            return;
+        } catch (std::runtime_error& e) {
+            Logger::Error() << e.what() << "\n";
+            Logger::Error() << "streaming artifact failed\n";
+            if (!isPartitionError(e)) {
+                discardStagedArtifact(id);
+            }
+            restartPoll(std::chrono::minutes(5), id);
+            return;
+        }
+
+        if (httpCode != 200) {
+            Logger::Error() << "fetching artifact failed with http-response code " << httpCode << "\n";
+            restartPoll(std::chrono::minutes(5), id);
+            return;
+        }
+
+        bool ok = false;
+        try {
+            ok = parser->Finish();
+        } catch (std::runtime_error& e) {
+            Logger::Error() << e.what() << "\n";
+        }
+
+        if (!ok) {
+            Logger::Error() << "artifact could not be authenticated or verified\n";
+            discardStagedArtifact(id);
+            restartPoll(std::chrono::minutes(5), id);
+            return;
+        }
+
+        Logger::Info() << "successfully verified artifact, wrote " << written << " bytes\n";
+        if (installMode == InstallMode::Staged) {
+            unlink(stagedArtifactPath(id).c_str());
+        }
+        finishInstall(writer, partA, partB, id);
+    }
+
+    void doParse(std::vector<unsigned char> artifactData,
+                 const DecryptionKeyServerResponse& keyResp, unsigned int id) {
+
+        std::array<unsigned char, 16> keyPlain{};
+        if (!decryptArtifactKey(keyResp, keyPlain)) {
             restartPoll(std::chrono::minutes(5), id);
+            return;
         }
 
         ArtifactParser parser(publisherKeyPath, keyPlain, keyResp.iv);
@@ -107,16 +665,19 @@ private:
         std::vector<unsigned char> artifactPlain;
 
         try {
-            artifactPlain = parser.DecryptArtifact(artifactData);
+            // In place: the ciphertext buffer becomes the plaintext
+            artifactPlain = parser.DecryptArtifact(std::move(artifactData));
         } catch (decryption_exception& e) {
             Logger::Error() << e.what() << "\n";
             Logger::Error() << "decryption of artifact failed\n";
             restartPoll(std::chrono::minutes(5), id);
+            return;
         }
 
         if (artifactPlain.empty()) {
             Logger::Error() << "artifact ciphertext could not be authenticated\n";
             restartPoll(std::chrono::minutes(5), id);
+            return;
         }
 
         Logger::Info() << "verifying artifact signature\n";
@@ -128,28 +689,31 @@ private:
             Logger::Error() << e.what() << "\n";
             Logger::Error() << "verifying of artifact failed\n";
             restartPoll(std::chrono::minutes(5), id);
+            return;
         }
 
         if (!ok) {
             Logger::Error() << "artifact could not be verified\n";
             restartPoll(std::chrono::minutes(5), id);
+            return;
         }
 
         Logger::Info() << "successfully verified artifact\n";
         Logger::Info() << "parsing artifact\n";
 
-        UpdateArtifact artifact{};
+        // Views into artifactPlain, which outlives the install
+        UpdateArtifactView artifact{};
 
         try {
-            artifact = parser.ParseArtifact(artifactPlain);
+            artifact = parser.ParseArtifactView(artifactPlain);
         } catch (parse_exception& e) {
             Logger::Error() << e.what() << "\n";
             Logger::Error() << "parsing of artifact failed\n";
             restartPoll(std::chrono::minutes(5), id);
+            return;
         }
 
-        std::string asString{artifact.firmwarePayload.begin(), artifact.firmwarePayload.end()};
-        std::cout << asString << "\n";
+        doInstall(artifact, id);
     }
 
     /*
@@ -167,7 +731,36 @@ private:
         rootCACertPath = "/usr/UpdateCrypto/rootCA/caCert.pem";
         publisherKeyPath = "/usr/UpdateCrypto/publisher/publisherPubkey.pem";
         logDir = "/usr/UpdateLogs";
+        rootfsDevicePrefix = "/dev/mmcblk0p";
+        stagingDir = "/data/staging";
+        tlsSessionCachePath = "/data/tls_session";
+        blockIndexDir = "/data/blockindex";
+        // Reading the flash back is cheaper than writing it, and with a valid block index the
+        // partition isn't read at all
+        skipUnchangedBlocks = true;
+        // The image would otherwise push the running system out of the page cache and stall
+        // it on writeback
+        directIO = true;
         loglevel = LogType::Info;
+        pollInterval = 5000;
+        longPollWait = 60;
+        connectionRetries = 5;
+        // More connections fill high-latency links a single transfer can't, but then key and
+        // artifact are fetched one after another instead of over one HTTP/2 connection
+        downloadConnections = 1;
+        // A 32nd of the RAM, so the window never crowds out the running system on small devices,
+        // and no more than the 32 MiB that keep a few connections busy on fast links
+        long pages = sysconf(_SC_PHYS_PAGES);
+        curl_off_t memory = pages > 0 ? (curl_off_t) pages * sysconf(_SC_PAGESIZE) : 0;
+        downloadWindowSize = std::clamp<curl_off_t>(memory / 32, 2 * 1024 * 1024, 32 * 1024 * 1024);
+        // All cores; the flash is written by the thread feeding the parser meanwhile
+        decompressionThreads = std::max(1u, std::thread::hardware_concurrency());
+        blacklistRetrySeconds = 3600;
+        installMode = InstallMode::Streaming;
+        // Only streaming installs apply deltas
+        deltaUpdates = true;
+        // Streaming installs of full artifacts only, as the artifact is rebuilt in order
+        seededDownloads = true;
     }
 
 public:
@@ -179,10 +772,23 @@ public:
         Logger::Info().setFlushThreshold(0);
         Logger::Error().setFlushThreshold(0);
         Logger::setStdout(true);
-        UpdateDownloadClient cl(serverAddr, std::chrono::milliseconds(5000), rootCACertPath,
-                                certificatePath, privateKeyPath);
+        client = std::make_unique<UpdateDownloadClient>(serverAddr, std::chrono::milliseconds(pollInterval),
+                                                        rootCACertPath, certificatePath, privateKeyPath,
+                                                        connectionRetries);
+        client->SetLongPoll(std::chrono::seconds(longPollWait));
 
-        client = std::make_unique<UpdateDownloadClient>(cl);
+        SegmentedDownloadOptions segmented;
+        segmented.connections = downloadConnections;
+        segmented.windowSize = downloadWindowSize;
+        // A single segment may overshoot the window
+        segmented.maxSegmentSize = std::clamp(downloadWindowSize / 4, segmented.minSegmentSize,
+                                              segmented.maxSegmentSize);
+        client->SetSegmentedDownload(segmented);
+
+        // The first poll after a restart then resumes the last session instead of a full handshake
+        if (!client->SetTlsSessionCache(tlsSessionCachePath)) {
+            Logger::Warn() << "libcurl doesn't use OpenSSL, tls sessions are not persisted\n";
+        }
     }
 
     explicit UpdateDriver(std::string configPath) noexcept: configPath(std::move(configPath)), client{nullptr},
@@ -190,7 +796,203 @@ public:
                                                             envWriter{} {}
 
 
+    // Key and artifact are requested together; the key is unwrapped while the artifact streams in
+    void doConcurrentFetch(unsigned id) {
+        Logger::Info() << "fetching decryption key and artifact\n";
+        std::shared_future<ArtifactKey> artifactKey;
+        doStreamingInstall(id, artifactKey, [this, id, &artifactKey](const BodySink& sink) {
+            return client->FetchKeyAndArtifact(
+                    id,
+                    [this, &artifactKey](const DecryptionKeyServerResponse& keyResp) {
+                        if (keyResp.httpCode != 200) {
+                            std::string errorMsg = "fetching decryption key failed with http-response code " +
+                                                   std::to_string(keyResp.httpCode);
+                            throw fetch_exception(errorMsg.c_str());
+                        }
+                        artifactKey = unwrapArtifactKey(keyResp);
+                    },
+                    sink, downloadWindowSize);
+        });
+    }
+
+    // Looks the blocks up in the partition's block index if it is valid; only blocks at the
+    // offsets the index was built at are found that way, but the partition isn't read at all.
+    // Scans the partition otherwise.
+    std::vector<uint64_t> findSeedBlocks(const BlockManifest& manifest, const std::string& part) {
+        auto blockIndex = openValidBlockIndex(part);
+        if (!blockIndex || blockIndex->getBlockSize() != manifest.blockSize) {
+            Logger::Info() << "scanning " << rootfsDevicePrefix + part << " for blocks of the update\n";
+            return manifest.FindBlocks(rootfsDevicePrefix + part);
+        }
+        Logger::Info() << "looking up blocks of the update in the block index of partition " << part << "\n";
+        std::vector<uint64_t> blocks(manifest.BlockCount(), SEED_NOT_FOUND);
+        for (size_t block = 0; block < manifest.BlockCount(); block++) {
+            if (manifest.BlockLength(block) != manifest.blockSize) {
+                continue;
+            }
+            uint64_t offset = blockIndex->find(manifest.strongChecksums[block]);
+            if (offset != BLOCK_INDEX_NOT_FOUND) {
+                blocks[block] = offset;
+            }
+        }
+        return blocks;
+    }
+
+    // Finds the blocks the artifact's manifest lists in the active rootfs, rebuilds those
+    // locally and downloads only the rest of the artifact with Range requests. The rebuilt
+    // artifact is streamed into the install like a downloaded one, so its tag and signature are
+    // checked all the same. Returns false, before anything was installed, if the artifact has
+    // no manifest or nothing of it was found; it is downloaded as a whole then.
+    bool doSeededFetch(unsigned id) {
+        ManifestServerResponse manifestResp{};
+        try {
+            manifestResp = client->FetchManifest(id);
+        } catch (fetch_exception& e) {
+            Logger::Warn() << e.what() << "\n";
+            return false;
+        }
+        if (manifestResp.httpCode != 200) {
+            Logger::Info() << "no block manifest for this update, fetching the whole artifact\n";
+            return false;
+        }
+
+        std::string partA;
+        std::string partB;
+        if (!readRootfsSlots(partA, partB)) {
+            return false;
+        }
+        std::string sourcePath = rootfsDevicePrefix + partA;
+
+        BlockManifest manifest{};
+        std::vector<uint64_t> blocks;
+        try {
+            manifest = BlockManifest::Parse(manifestResp.manifest.data(), manifestResp.manifest.size());
+            blocks = findSeedBlocks(manifest, partA);
+        } catch (seed_exception& e) {
+            Logger::Warn() << e.what() << "\n";
+            return false;
+        }
+
+        auto ranges = PlanSeededDownload(manifest, blocks);
+        uint64_t localBytes = 0;
+        uint64_t totalBytes = 0;
+        for (const auto& range : ranges) {
+            localBytes += range.local ? range.length : 0;
+            totalBytes += range.length;
+        }
+        if (localBytes == 0) {
+            Logger::Info() << "no blocks of the update found, fetching the whole artifact\n";
+            return false;
+        }
+        Logger::Info() << "found " << localBytes << " of " << totalBytes << " bytes of the artifact in "
+                       << sourcePath << "\n";
+
+        Logger::Info() << "fetching decryption key\n";
+        DecryptionKeyServerResponse keyResp{};
+        try {
+            keyResp = client->FetchDecryptionKey(id);
+        } catch (fetch_exception& e) {
+            Logger::Warn() << e.what() << "\n";
+            return false;
+        }
+        if (keyResp.httpCode != 200) {
+            return false;
+        }
+
+        // Should the rebuilt artifact fail, the retry doesn't rely on the manifest again
+        unseeded.insert(id);
+        auto artifactKey = unwrapArtifactKey(keyResp);
+        doStreamingInstall(id, artifactKey, [&](const BodySink& sink) {
+            ArtifactKey key = artifactKey.get();
+            SeedSource seedSource(sourcePath, key.key, key.iv);
+            std::string etag;
+            for (const auto& range : ranges) {
+                if (range.local) {
+                    seedSource.Emit(range, sink);
+                    continue;
+                }
+                long httpCode = client->FetchArtifactRange(id, range.offset, range.offset + range.length - 1,
+                                                           etag, sink);
+                if (httpCode != 206) {
+                    return httpCode;
+                }
+            }
+            return 200L;
+        });
+        return true;
+    }
+
+    // Whether the partition holds the image source names. A rootfs that was mounted read-write
+    // differs from the published image as well; its block index, if still valid, tells so
+    // without hashing the partition.
+    bool isDeltaSource(const std::string& part, const DeltaSource& source) {
+        auto blockIndex = openValidBlockIndex(part);
+        if (blockIndex && blockIndex->getImageLength() == source.length) {
+            return blockIndex->getImageDigest() == source.sha256;
+        }
+        try {
+            return DeltaApplier(rootfsDevicePrefix + part, source, nullptr).VerifySource();
+        } catch (std::runtime_error& e) {
+            Logger::Warn() << e.what() << "\n";
+            return false;
+        }
+    }
+
+    // The key of the delta artifact names the image the delta was made against, so the active
+    // rootfs is checked before any of the delta is downloaded. Returns false if the full artifact
+    // has to be installed instead.
+    bool doDeltaFetch(unsigned id) {
+        std::string partA;
+        std::string partB;
+        if (!readRootfsSlots(partA, partB)) {
+            return false;
+        }
+
+        client->SetDeltaArtifact(true);
+        Logger::Info() << "fetching decryption key of the delta artifact\n";
+        DecryptionKeyServerResponse keyResp{};
+        try {
+            keyResp = client->FetchDecryptionKey(id);
+        } catch (fetch_exception& e) {
+            Logger::Warn() << e.what() << "\n";
+            return false;
+        }
+        if (keyResp.httpCode != 200 || !keyResp.deltaSource) {
+            Logger::Warn() << "no delta artifact for this update\n";
+            return false;
+        }
+        if (!isDeltaSource(partA, *keyResp.deltaSource)) {
+            Logger::Warn() << "active rootfs is not the source image of the delta\n";
+            return false;
+        }
+
+        doStreamingInstall(id, unwrapArtifactKey(keyResp), [this, id](const BodySink& sink) {
+            return client->FetchArtifact(id, sink);
+        }, keyResp.deltaSource);
+        return true;
+    }
+
     void doFetch(unsigned id) {
+        if (deltaUpdates && installMode == InstallMode::Streaming && fullArtifactOnly.count(id) == 0) {
+            if (doDeltaFetch(id)) {
+                return;
+            }
+            Logger::Warn() << "falling back to the full artifact\n";
+            fullArtifactOnly.insert(id);
+        }
+        client->SetDeltaArtifact(false);
+
+        // Deltas are smaller still, so a manifest is only used for updates without a fitting one
+        if (seededDownloads && installMode == InstallMode::Streaming && unseeded.count(id) == 0 &&
+            doSeededFetch(id)) {
+            return;
+        }
+
+        if (installMode == InstallMode::Streaming && downloadConnections <= 1) {
+            doConcurrentFetch(id);
+            return;
+        }
+
         Logger::Info() << "fetching decryption key\n";
         DecryptionKeyServerResponse keyResp{};
         try {
@@ -199,11 +1001,25 @@ public:
             Logger::Error() << e.what() << "\n";
             Logger::Error() << "fetching decryption key failed\n";
             restartPoll(std::chrono::minutes(5), id);
+            return;
         }
 
         if (keyResp.httpCode != 200) {
             Logger::Error() << "fetching decryption key failed with http-response code " << keyResp.httpCode << "\n";
             restartPoll(std::chrono::minutes(5), id);
+            return;
+        }
+
+        if (installMode == InstallMode::Streaming) {
+            doStreamingInstall(id, unwrapArtifactKey(keyResp), [this, id](const BodySink& sink) {
+                return client->FetchArtifact(id, sink);
+            });
+            return;
+        }
+
+        if (installMode == InstallMode::Staged) {
+            doStagedInstall(keyResp, id);
+            return;
         }
 
         Logger::Info() << "fetching artifact\n";
@@ -216,41 +1032,53 @@ public:
             Logger::Error() << e.what() << "\n";
             Logger::Error() << "fetching artifact failed\n";
             restartPoll(std::chrono::minutes(5), id);
+            return;
         }
 
-        if (keyResp.httpCode != 200) {
-            Logger::Error() << "fetching artifact failed with http-response code " << keyResp.httpCode << "\n";
+        if (artifactResp.httpCode != 200) {
+            Logger::Error() << "fetching artifact failed with http-response code " << artifactResp.httpCode << "\n";
             restartPoll(std::chrono::minutes(5), id);
+            return;
         }
         Logger::Info() << "successfully fetched key and artifact\n";
 
-        doParse(artifactResp.artifact, keyResp, id);
+        doParse(std::move(artifactResp.artifact), keyResp, id);
     }
 
 
     void doPoll() {
+        while (true) {
+            auto availableUpdates = client->StartPolling();
 
-        auto availableUpdates = client->StartPolling();
-
-        // Choose the latest, non-blacklisted Update
-        unsigned int* newest = nullptr;
-        for (auto upd : availableUpdates) {
-            if (blacklist.find(upd) == blacklist.end()) {
-                newest = &upd;
-            } else {
-                // TODO: Check how much time has passed
+            // Choose the latest, non-blacklisted Update
+            const unsigned int* newest = nullptr;
+            for (auto& upd : availableUpdates) {
+                auto entry = blacklist.find(upd);
+                if (entry == blacklist.end()) {
+                    newest = &upd;
+                } else if (time(nullptr) - entry->second > blacklistRetrySeconds || hasPartialDownload(upd)) {
+                    // Failed updates get another chance once in a while; a staged artifact is reused then.
+                    // An interrupted download is continued right away, before its progress goes stale.
+                    blacklist.erase(entry);
+                    newest = &upd;
+                }
             }
-        }
 
-        if (newest == nullptr) {
-            std::this_thread::sleep_for((std::chrono::minutes(5));
-            doPoll();
-        }
+            if (newest == nullptr) {
+                std::this_thread::sleep_for(std::chrono::minutes(5));
+                continue;
+            }
 
-        Logger::newLogfile();
-        Logger::Info() << "initializing update with id=" << *newest << "\n";
+            Logger::newLogfile();
+            Logger::Info() << "initializing update with id=" << *newest << "\n";
+            auto tlsStats = client->GetTlsSessionStats();
+            Logger::Info() << "tls sessions resumed in " << tlsStats.resumed << " of " << tlsStats.handshakes
+                           << " handshakes\n";
 
-        doFetch(*newest);
+            // Returns once the update failed, with everything the attempt held released
+            doFetch(*newest);
+            std::this_thread::sleep_for(retryDelay);
+        }
     }
 };
 
@@ -1,4 +1,12 @@
 #include "UpdateDownloadClient.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+#include <fstream>
 
 const std::string ENDPOINT_WHATS_NEW = "/whatsNew";
 const std::string ENDPOINT_GET_UPDATE = "/getUpdate";
@@ -8,6 +16,12 @@ const std::string ENDPOINT_GET_DECRYPTION_KEY = "/getDecryptionKey";
 void from_json(const nlohmann::json& j, DecryptionKeyServerResponse& pair) {
     j.at("ct").get_to(pair.key);
     j.at("iv").get_to(pair.iv);
+    if (j.contains("source")) {
+        DeltaSource source{};
+        j.at("source").at("length").get_to(source.length);
+        j.at("source").at("sha256").get_to(source.sha256);
+        pair.deltaSource = source;
+    }
 }
 
 std::string UpdateDownloadClient::BuildParameterString(const std::map<std::string, std::string>& params) {
@@ -37,10 +51,14 @@ bool UpdateDownloadClient::DoStandardCurlSetup(CURL* curl, const std::string& en
         return false;
     }
 
+    std::map<std::string, std::string> allParams;
     if (params != nullptr) {
-        auto paramString = BuildParameterString(*params);
-        uri += paramString;
+        allParams = *params;
+    }
+    if (deltaArtifact && endpoint != ENDPOINT_WHATS_NEW) {
+        allParams["delta"] = "1";
     }
+    uri += BuildParameterString(allParams);
 
     curl_easy_setopt(curl, CURLOPT_URL, uri.c_str());
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
@@ -57,9 +75,155 @@ bool UpdateDownloadClient::DoStandardCurlSetup(CURL* curl, const std::string& en
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &writeBuffer);
     curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorBuffer.data());
 
+    if (!tlsSessionPath.empty()) {
+        curl_easy_setopt(curl, CURLOPT_SSL_CTX_FUNCTION, SslContextCallback);
+        curl_easy_setopt(curl, CURLOPT_SSL_CTX_DATA, this);
+    }
+
     return true;
 }
 
+// Slots for the client and libCURL's new-session callback in SSL_CTX, and for "handshake
+// counted" in SSL
+static int SslCtxClientIndex() {
+    static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+static int SslCtxCurlCallbackIndex() {
+    static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+static int SslCountedIndex() {
+    static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+using NewSessionFunction = int (*)(SSL*, SSL_SESSION*);
+
+// The slot itself stays empty; OpenSSL runs the slot's new-callback for every SSL created once
+// it is registered, which is the only point between SSL_new and the handshake libCURL leaves
+static int SslOfferSessionIndex(CRYPTO_EX_new* newSsl) {
+    static int index = SSL_get_ex_new_index(0, nullptr, newSsl, nullptr, nullptr);
+    return index;
+}
+
+CURLcode UpdateDownloadClient::SslContextCallback(CURL*, void* sslCtx, void* userp) {
+    auto ctx = (SSL_CTX*) sslCtx;
+    SSL_CTX_set_ex_data(ctx, SslCtxClientIndex(), userp);
+    SSL_CTX_set_info_callback(ctx, SslInfoCallback);
+    // Before libCURL creates the connection's SSL from ctx
+    SslOfferSessionIndex(NewSslCallback);
+
+    // libCURL only installs its callback if session caching is on; then sessions go to both. It
+    // is kept with the SSL_CTX, as other handles or TLS backends may install other callbacks.
+    auto curlCallback = SSL_CTX_sess_get_new_cb(ctx);
+    if (curlCallback != NewSessionCallback) {
+        SSL_CTX_set_ex_data(ctx, SslCtxCurlCallbackIndex(), reinterpret_cast<void*>(curlCallback));
+    }
+    SSL_CTX_set_session_cache_mode(ctx, SSL_CTX_get_session_cache_mode(ctx) | SSL_SESS_CACHE_CLIENT);
+    SSL_CTX_sess_set_new_cb(ctx, NewSessionCallback);
+    return CURLE_OK;
+}
+
+void UpdateDownloadClient::NewSslCallback(void* ssl, void*, CRYPTO_EX_DATA*, int, long, void*) {
+    SSL_CTX* ctx = SSL_get_SSL_CTX((SSL*) ssl);
+    auto client = ctx == nullptr ? nullptr
+                                 : (UpdateDownloadClient*) SSL_CTX_get_ex_data(ctx, SslCtxClientIndex());
+    // libCURL replaces it with the session from its in-memory cache, if it has one, so only the
+    // first connection after a restart resumes the persisted session
+    if (client != nullptr && client->tlsSession != nullptr) {
+        SSL_set_session((SSL*) ssl, client->tlsSession);
+    }
+}
+
+void UpdateDownloadClient::SslInfoCallback(const SSL* ssl, int where, int) {
+    auto client = (UpdateDownloadClient*) SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), SslCtxClientIndex());
+    if (client == nullptr) {
+        return;
+    }
+
+    // With TLS 1.3 this is signalled again for every session ticket; count the handshake once
+    if ((where & SSL_CB_HANDSHAKE_DONE) && SSL_get_ex_data(ssl, SslCountedIndex()) == nullptr) {
+        SSL_set_ex_data((SSL*) ssl, SslCountedIndex(), client);
+        client->tlsSessionStats.handshakes++;
+        if (SSL_session_reused((SSL*) ssl)) {
+            client->tlsSessionStats.resumed++;
+        }
+    }
+}
+
+int UpdateDownloadClient::NewSessionCallback(SSL* ssl, SSL_SESSION* session) {
+    auto client = (UpdateDownloadClient*) SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), SslCtxClientIndex());
+    if (client != nullptr) {
+        client->StoreTlsSession(session);
+    }
+    // libCURL keeps the reference if it returns 1, the client holds its own
+    auto curlCallback = (NewSessionFunction) SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), SslCtxCurlCallbackIndex());
+    return curlCallback != nullptr ? curlCallback(ssl, session) : 0;
+}
+
+void UpdateDownloadClient::StoreTlsSession(SSL_SESSION* session) {
+    SSL_SESSION_up_ref(session);
+    if (tlsSession != nullptr) {
+        SSL_SESSION_free(tlsSession);
+    }
+    tlsSession = session;
+
+    int length = i2d_SSL_SESSION(session, nullptr);
+    if (length <= 0) {
+        return;
+    }
+    std::vector<unsigned char> serialized(length);
+    unsigned char* out = serialized.data();
+    i2d_SSL_SESSION(session, &out);
+
+    // The session holds the master secret; written aside and renamed so a crash leaves either
+    // the previous or the new session
+    std::string tmpPath = tlsSessionPath + ".tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return;
+    }
+    bool written = write(fd, serialized.data(), serialized.size()) == (ssize_t) serialized.size();
+    close(fd);
+    if (!written || rename(tmpPath.c_str(), tlsSessionPath.c_str()) != 0) {
+        unlink(tmpPath.c_str());
+    }
+}
+
+bool UpdateDownloadClient::SetTlsSessionCache(const std::string& path) {
+    const char* sslVersion = curl_version_info(CURLVERSION_NOW)->ssl_version;
+    if (sslVersion == nullptr || std::string(sslVersion).compare(0, 7, "OpenSSL") != 0) {
+        return false;
+    }
+    tlsSessionPath = path;
+
+    std::ifstream file(path, std::ios::binary);
+    std::vector<unsigned char> serialized((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    const unsigned char* in = serialized.data();
+    SSL_SESSION* session = serialized.empty() ? nullptr : d2i_SSL_SESSION(nullptr, &in, (long) serialized.size());
+    if (session == nullptr) {
+        return true;
+    }
+
+    // An expired session would only cost a useless attempt
+    if (SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < time(nullptr)) {
+        SSL_SESSION_free(session);
+        return true;
+    }
+    if (tlsSession != nullptr) {
+        SSL_SESSION_free(tlsSession);
+    }
+    tlsSession = session;
+    return true;
+}
+
+TlsSessionStats UpdateDownloadClient::GetTlsSessionStats() const {
+    return tlsSessionStats;
+}
+
 long UpdateDownloadClient::GetHttpResponseCode(CURL* curl) {
     long httpCode = 0;
     auto curlCode = curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
@@ -71,45 +235,727 @@ long UpdateDownloadClient::GetHttpResponseCode(CURL* curl) {
 
 UpdateDownloadClient::UpdateDownloadClient(std::string serverAddr, std::chrono::milliseconds pollInterval,
                                            std::string caCertPath, std::string certPath,
-                                           std::string keyPat, int retries) noexcept: serverAddr(std::move(serverAddr)),
+                                           std::string keyPath, int retries) noexcept: serverAddr(std::move(serverAddr)),
                                                                           pollInterval(pollInterval),
+                                                                          longPollWait{0},
                                                                           caCertPath(std::move(caCertPath)),
                                                                           certPath(std::move(certPath)),
                                                                           keyPath(std::move(keyPath)),
-                                                                          retries{retries} {}
+                                                                          retries{retries},
+                                                                          handle{nullptr},
+                                                                          share{nullptr},
+                                                                          tlsSession{nullptr},
+                                                                          tlsSessionStats{} {}
 
+UpdateDownloadClient::~UpdateDownloadClient() {
+    if (handle != nullptr) {
+        curl_easy_cleanup(handle);
+    }
+    if (share != nullptr) {
+        curl_share_cleanup(share);
+    }
+    if (tlsSession != nullptr) {
+        SSL_SESSION_free(tlsSession);
+    }
+}
+
+// Created on first use, after GlobalInit. With connection, DNS and TLS-session caches shared, a
+// poll, key and artifact request cost one mutual-TLS handshake instead of three, and a closed
+// connection is reopened with an abbreviated handshake.
+CURL* UpdateDownloadClient::PrepareHandle() {
+    if (share == nullptr) {
+        share = curl_share_init();
+        if (share == nullptr) {
+            throw fetch_exception("unable to create curl share");
+        }
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+    if (handle == nullptr) {
+        handle = curl_easy_init();
+        if (handle == nullptr) {
+            throw fetch_exception("unable to create curl handle");
+        }
+    } else {
+        curl_easy_reset(handle);
+    }
+    curl_easy_setopt(handle, CURLOPT_SHARE, share);
+    return handle;
+}
+
+// The body is written straight into the response's vector, reserved once from Content-Length,
+// instead of growing a string and copying it at the end
 UpdateArtifactServerResponse UpdateDownloadClient::FetchArtifact(uint updateId) {
-    auto curl = curl_easy_init();
+    UpdateArtifactServerResponse resp{};
+
+    resp.httpCode = FetchArtifact(
+            updateId,
+            [&resp](const unsigned char* data, size_t length) {
+                resp.artifact.insert(resp.artifact.end(), data, data + length);
+                return true;
+            },
+            [&resp](curl_off_t length) {
+                resp.artifact.reserve(length);
+            });
+
+    if (resp.httpCode != 200) {
+        resp.artifact.clear();
+    }
+    return resp;
+}
+
+bool UpdateDownloadClient::IsSuccessfulResponse(long httpCode) {
+    return httpCode == 200 || httpCode == 206;
+}
+
+size_t UpdateDownloadClient::HeaderCallback(char* buffer, size_t size, size_t nitems, void* userp) {
+    auto context = (StreamContext*) userp;
+    size_t length = size * nitems;
+
+    std::string header(buffer, length);
+    // A new status line, e.g. after a redirect; the headers before it belong to another response
+    if (header.compare(0, 5, "HTTP/") == 0) {
+        context->headers.clear();
+        return length;
+    }
+
+    auto colon = header.find(':');
+    if (colon == std::string::npos) {
+        return length;
+    }
+    std::string name = header.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    auto valueStart = header.find_first_not_of(" \t", colon + 1);
+    auto valueEnd = header.find_last_not_of(" \t\r\n");
+    context->headers[name] = valueStart == std::string::npos || valueEnd < valueStart
+                             ? "" : header.substr(valueStart, valueEnd - valueStart + 1);
+    return length;
+}
+
+size_t UpdateDownloadClient::StreamCallback(void* contents, size_t size, size_t nmemb, void* userp) {
+    auto context = (StreamContext*) userp;
+    size_t length = size * nmemb;
+
+    // Bodies of error responses are not part of the artifact
+    auto httpCode = GetHttpResponseCode(context->curl);
+    if (!IsSuccessfulResponse(httpCode)) {
+        return length;
+    }
+
+    // libCURL hands the same data again once the transfer is continued
+    if (context->budget != nullptr && *context->budget < (curl_off_t) length) {
+        context->paused = true;
+        return CURL_WRITEFUNC_PAUSE;
+    }
+    if (context->budget != nullptr) {
+        *context->budget -= (curl_off_t) length;
+    }
+
+    // Exceptions must not unwind through libCURL; rethrown once the transfer stopped
+    try {
+        if (!context->started) {
+            context->started = true;
+            if (*context->responseStart) {
+                (*context->responseStart)(httpCode, context->headers);
+            }
+        }
+        if (!(*context->sink)((const unsigned char*) contents, length)) {
+            return 0;
+        }
+    } catch (...) {
+        context->error = std::current_exception();
+        return 0;
+    }
+    return length;
+}
+
+long UpdateDownloadClient::FetchArtifact(uint updateId, const BodySink& sink, const LengthHint& lengthHint) {
+    return FetchArtifactFrom(updateId, 0, "", sink,
+                             [&lengthHint](long, const std::map<std::string, std::string>& headers) {
+                                 auto contentLength = headers.find("content-length");
+                                 if (lengthHint && contentLength != headers.end()) {
+                                     lengthHint(std::stoll(contentLength->second));
+                                 }
+                             });
+}
+
+long UpdateDownloadClient::FetchArtifact(uint updateId, const std::vector<std::string>& requestHeaders,
+                                         const BodySink& sink, const ResponseStart& responseStart,
+                                         const std::map<std::string, std::string>& params) {
+    auto curl = PrepareHandle();
 
     std::string writeBuffer;
     std::string errorBuffer;
     errorBuffer.resize(CURL_ERROR_SIZE);
 
-    std::map<std::string, std::string> params;
-    params["updateId"] = std::to_string(updateId);
+    std::map<std::string, std::string> allParams = params;
+    allParams["updateId"] = std::to_string(updateId);
 
-    DoStandardCurlSetup(curl, ENDPOINT_GET_UPDATE, writeBuffer, errorBuffer, &params);
+    DoStandardCurlSetup(curl, ENDPOINT_GET_UPDATE, writeBuffer, errorBuffer, &allParams);
+
+    struct curl_slist* headerList = nullptr;
+    for (auto const& header : requestHeaders) {
+        headerList = curl_slist_append(headerList, header.c_str());
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerList);
+
+    StreamContext context{curl, &sink, &responseStart, {}, false, nullptr};
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, StreamCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &context);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &context);
 
     auto code = curl_easy_perform(curl);
+    auto httpCode = GetHttpResponseCode(curl);
+    curl_slist_free_all(headerList);
 
+    if (context.error) {
+        std::rethrow_exception(context.error);
+    }
     if (code != 0) {
         throw fetch_exception(errorBuffer.c_str());
     }
-    auto httpCode = GetHttpResponseCode(curl);
+    // An empty body still starts a response
+    if (IsSuccessfulResponse(httpCode) && !context.started && responseStart) {
+        responseStart(httpCode, context.headers);
+    }
+    return httpCode;
+}
 
-    UpdateArtifactServerResponse resp{};
+// How much of a staged download is written between two updates of its progress file
+const off_t DOWNLOAD_PROGRESS_INTERVAL = 4 * 1024 * 1024;
+
+// Progress of an interrupted FetchArtifactToFile. The validator is "etag <strong ETag>" or
+// "length <artifact size>" and tells whether the artifact on the server is still the one the
+// partial file was downloaded from.
+struct DownloadProgress {
+    uint updateId;
+    off_t offset;
+    std::string validator;
+};
 
+static bool ReadDownloadProgress(const std::string& path, DownloadProgress& progress) {
+    std::ifstream file(path);
+    file >> progress.updateId >> progress.offset;
+    file.ignore(1);
+    std::getline(file, progress.validator);
+    return !file.fail() && progress.offset > 0 && !progress.validator.empty();
+}
+
+// The partial file must be synced up to progress.offset before; the rename makes sure a crash
+// leaves either the previous or the new progress behind
+static void WriteDownloadProgress(const std::string& path, const DownloadProgress& progress) {
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::trunc);
+        file << progress.updateId << " " << progress.offset << " " << progress.validator << "\n";
+        if (!file.flush()) {
+            return;
+        }
+    }
+    rename(tmpPath.c_str(), path.c_str());
+}
+
+// If-Range only accepts strong ETags
+static bool IsStrongETag(const std::string& etag) {
+    return etag.size() >= 2 && etag.front() == '"' && etag.back() == '"';
+}
+
+long UpdateDownloadClient::FetchArtifactRange(uint updateId, curl_off_t first, curl_off_t last, std::string& etag,
+                                              const BodySink& sink) {
+    std::vector<std::string> requestHeaders{"Range: bytes=" + std::to_string(first) + "-" + std::to_string(last)};
+    if (IsStrongETag(etag)) {
+        requestHeaders.push_back("If-Range: " + etag);
+    }
+
+    auto httpCode = FetchArtifact(
+            updateId, requestHeaders, sink,
+            [&](long httpCode, const std::map<std::string, std::string>& headers) {
+                // The whole artifact, because the server doesn't support ranges or it changed
+                if (httpCode != 206) {
+                    throw fetch_exception("range of the artifact was answered with the whole artifact");
+                }
+                auto contentRange = headers.find("content-range");
+                long long rangeFirst = -1;
+                long long rangeLast = -1;
+                if (contentRange == headers.end() ||
+                    sscanf(contentRange->second.c_str(), "bytes %lld-%lld/", &rangeFirst, &rangeLast) != 2 ||
+                    rangeFirst != first || rangeLast != last) {
+                    throw fetch_exception("unexpected Content-Range in range of the artifact");
+                }
+                auto responseETag = headers.find("etag");
+                if (etag.empty() && responseETag != headers.end()) {
+                    etag = responseETag->second;
+                }
+            });
     if (httpCode == 200) {
-        std::vector<unsigned char> artifact(writeBuffer.begin(), writeBuffer.end());
-        resp.artifact = std::move(artifact);
+        throw fetch_exception("range of the artifact was answered with the whole artifact");
     }
-    resp.httpCode = httpCode;
+    return httpCode;
+}
 
+ManifestServerResponse UpdateDownloadClient::FetchManifest(uint updateId) {
+    ManifestServerResponse resp{};
+
+    resp.httpCode = FetchArtifact(
+            updateId, {},
+            [&resp](const unsigned char* data, size_t length) {
+                resp.manifest.insert(resp.manifest.end(), data, data + length);
+                return true;
+            },
+            nullptr, {{"manifest", "1"}});
+
+    if (resp.httpCode != 200) {
+        resp.manifest.clear();
+    }
     return resp;
+}
+
+// The progress of an interrupted download of updateId, if its partial file holds what it claims
+static bool ReadPartialDownload(uint updateId, const std::string& stagingPath, DownloadProgress& progress) {
+    struct stat partStat{};
+    return ReadDownloadProgress(stagingPath + ".progress", progress) && progress.updateId == updateId &&
+           stat((stagingPath + ".part").c_str(), &partStat) == 0 && partStat.st_size >= progress.offset;
+}
+
+bool UpdateDownloadClient::HasPartialDownload(uint updateId, const std::string& stagingPath) {
+    DownloadProgress progress{};
+    return ReadPartialDownload(updateId, stagingPath, progress);
+}
+
+long UpdateDownloadClient::FetchArtifactToFile(uint updateId, const std::string& stagingPath) {
+    std::string partPath = stagingPath + ".part";
+    std::string progressPath = stagingPath + ".progress";
+
+    DownloadProgress progress{};
+    bool resume = ReadPartialDownload(updateId, stagingPath, progress);
+    if (!resume) {
+        progress = DownloadProgress{updateId, 0, ""};
+        unlink(progressPath.c_str());
+    }
+
+    int fd = open(partPath.c_str(), O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC) | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        std::string errorMsg = "unable to create " + partPath + ": " + strerror(errno);
+        throw fetch_exception(errorMsg.c_str());
+    }
+
+    // The server answers with the whole artifact instead if it changed in the meantime
+    std::string ifRange;
+    if (resume && progress.validator.compare(0, 5, "etag ") == 0) {
+        ifRange = progress.validator.substr(5);
+    }
+
+    off_t written = progress.offset;
+    // Set once the partial file turned out to belong to another artifact
+    bool stale = false;
+    long httpCode = 0;
+    try {
+        httpCode = FetchArtifactFrom(
+                updateId, progress.offset, ifRange,
+                [&](const unsigned char* data, size_t length) {
+                    while (length > 0) {
+                        ssize_t n = pwrite(fd, data, length, written);
+                        if (n == -1 && errno == EINTR) {
+                            continue;
+                        }
+                        if (n == -1) {
+                            std::string errorMsg = "unable to write " + partPath + ": " + strerror(errno);
+                            throw fetch_exception(errorMsg.c_str());
+                        }
+                        data += n;
+                        length -= n;
+                        written += n;
+                    }
+                    if (!progress.validator.empty() && written - progress.offset >= DOWNLOAD_PROGRESS_INTERVAL &&
+                        fdatasync(fd) == 0) {
+                        progress.offset = written;
+                        WriteDownloadProgress(progressPath, progress);
+                    }
+                    return true;
+                },
+                [&](long code, const std::map<std::string, std::string>& headers) {
+                    auto header = [&headers](const std::string& name) {
+                        auto it = headers.find(name);
+                        return it == headers.end() ? std::string() : it->second;
+                    };
+                    std::string etag = header("etag");
+                    std::string contentLength = header("content-length");
+                    off_t remaining = contentLength.empty() ? -1 : std::stoll(contentLength);
+                    off_t total = remaining;
+
+                    if (code == 206) {
+                        // Content-Range: bytes <first>-<last>/<total>
+                        long long first = -1;
+                        long long last = -1;
+                        long long size = -1;
+                        std::string contentRange = header("content-range");
+                        if (sscanf(contentRange.c_str(), "bytes %lld-%lld/%lld", &first, &last, &size) != 3 ||
+                            first != progress.offset) {
+                            stale = true;
+                            throw fetch_exception("unexpected Content-Range in resumed download");
+                        }
+                        total = size;
+                        std::string validator = IsStrongETag(etag) ? "etag " + etag : "length " + std::to_string(total);
+                        if (validator != progress.validator) {
+                            stale = true;
+                            throw fetch_exception("artifact changed since the download was interrupted");
+                        }
+                    } else {
+                        // The whole artifact, because the server doesn't support ranges or it changed
+                        written = 0;
+                        progress.offset = 0;
+                        if (ftruncate(fd, 0) == -1) {
+                            std::string errorMsg = "unable to truncate " + partPath + ": " + strerror(errno);
+                            throw fetch_exception(errorMsg.c_str());
+                        }
+                        progress.validator = IsStrongETag(etag) ? "etag " + etag
+                                             : total >= 0 ? "length " + std::to_string(total) : "";
+                    }
+
+                    // Fail early instead of filling /data up halfway through the download
+                    if (remaining > 0 && fallocate(fd, 0, written, remaining) == -1 && errno != EOPNOTSUPP) {
+                        std::string errorMsg = "unable to allocate " + partPath + ": " + strerror(errno);
+                        throw fetch_exception(errorMsg.c_str());
+                    }
+                });
+    } catch (...) {
+        // Keep what arrived so far for the next attempt
+        if (!stale && !progress.validator.empty() && written > progress.offset && fdatasync(fd) == 0) {
+            progress.offset = written;
+            WriteDownloadProgress(progressPath, progress);
+        }
+        close(fd);
+        if (stale) {
+            unlink(partPath.c_str());
+            unlink(progressPath.c_str());
+        }
+        throw;
+    }
+
+    if (!IsSuccessfulResponse(httpCode)) {
+        close(fd);
+        unlink(partPath.c_str());
+        unlink(progressPath.c_str());
+        // The recorded progress didn't fit the artifact; start over
+        if (httpCode == 416 && resume) {
+            return FetchArtifactToFile(updateId, stagingPath);
+        }
+        return httpCode;
+    }
+
+    bool stored = ftruncate(fd, written) == 0 && fsync(fd) == 0 &&
+                  rename(partPath.c_str(), stagingPath.c_str()) == 0;
+    int error = errno;
+    close(fd);
+    unlink(progressPath.c_str());
+
+    if (!stored) {
+        unlink(partPath.c_str());
+        std::string errorMsg = "unable to store " + stagingPath + ": " + strerror(error);
+        throw fetch_exception(errorMsg.c_str());
+    }
+    return 200;
+}
+
+void UpdateDownloadClient::DiscardStagedArtifact(const std::string& stagingPath) {
+    unlink(stagingPath.c_str());
+    unlink((stagingPath + ".part").c_str());
+    unlink((stagingPath + ".progress").c_str());
+}
+
+long UpdateDownloadClient::FetchArtifactFrom(uint updateId, curl_off_t firstByte, const std::string& ifRange,
+                                             const BodySink& sink, const ResponseStart& responseStart) {
+    if (segmentedDownload.connections > 1) {
+        return FetchArtifactSegmented(updateId, firstByte, ifRange, sink, responseStart);
+    }
+
+    std::vector<std::string> requestHeaders;
+    if (firstByte > 0) {
+        requestHeaders.push_back("Range: bytes=" + std::to_string(firstByte) + "-");
+        if (!ifRange.empty()) {
+            requestHeaders.push_back("If-Range: " + ifRange);
+        }
+    }
+    return FetchArtifact(updateId, requestHeaders, sink, responseStart);
+}
+
+struct UpdateDownloadClient::Segment {
+    CURL* curl;
+    // First and last byte of the segment within the artifact
+    curl_off_t first;
+    curl_off_t last;
+    curl_off_t received;
+    // Received while an earlier segment was incomplete
+    std::vector<unsigned char> buffer;
+    bool done;
+    int failures;
+    curl_off_t attemptStart;
+    std::chrono::steady_clock::time_point started;
+    const BodySink* sink;
+    // Bytes of the artifact the sink has seen, shared by all segments
+    curl_off_t* delivered;
+    std::exception_ptr error;
 };
 
+size_t UpdateDownloadClient::SegmentCallback(void* contents, size_t size, size_t nmemb, void* userp) {
+    auto segment = (Segment*) userp;
+    size_t length = size * nmemb;
+
+    // Anything but the requested range means the artifact changed or the server failed
+    if (GetHttpResponseCode(segment->curl) != 206) {
+        segment->error = std::make_exception_ptr(fetch_exception("segment was not answered with its range"));
+        return 0;
+    }
+    if (segment->first + segment->received + (curl_off_t) length > segment->last + 1) {
+        segment->error = std::make_exception_ptr(fetch_exception("segment longer than requested"));
+        return 0;
+    }
+
+    auto data = (const unsigned char*) contents;
+    try {
+        // All bytes before these reached the sink already, so they can follow right away
+        if (*segment->delivered == segment->first + segment->received) {
+            if (!(*segment->sink)(data, length)) {
+                segment->error = std::make_exception_ptr(fetch_exception("transfer aborted by sink"));
+                return 0;
+            }
+            *segment->delivered += length;
+        } else {
+            segment->buffer.insert(segment->buffer.end(), data, data + length);
+        }
+    } catch (...) {
+        segment->error = std::current_exception();
+        return 0;
+    }
+    segment->received += length;
+    return length;
+}
+
+long UpdateDownloadClient::FetchArtifactSegmented(uint updateId, curl_off_t firstByte, const std::string& ifRange,
+                                                  const BodySink& sink, const ResponseStart& responseStart) {
+    const SegmentedDownloadOptions& options = segmentedDownload;
+
+    // The first segment is fetched on its own; its Content-Range tells the size of the artifact
+    curl_off_t total = -1;
+    curl_off_t probed = firstByte;
+    std::string etag;
+    auto probeStart = std::chrono::steady_clock::now();
+    std::vector<std::string> requestHeaders{
+            "Range: bytes=" + std::to_string(firstByte) + "-" +
+            std::to_string(firstByte + options.initialSegmentSize - 1)};
+    if (!ifRange.empty()) {
+        requestHeaders.push_back("If-Range: " + ifRange);
+    }
+
+    long httpCode = FetchArtifact(
+            updateId, requestHeaders, sink,
+            [&](long code, const std::map<std::string, std::string>& headers) {
+                auto header = [&headers](const std::string& name) {
+                    auto it = headers.find(name);
+                    return it == headers.end() ? std::string() : it->second;
+                };
+                // The whole artifact, because the server doesn't support ranges or it changed
+                if (code == 200) {
+                    responseStart(code, headers);
+                    return;
+                }
+
+                long long first = -1;
+                long long last = -1;
+                long long size = -1;
+                if (sscanf(header("content-range").c_str(), "bytes %lld-%lld/%lld", &first, &last, &size) != 3 ||
+                    first != firstByte) {
+                    throw fetch_exception("unexpected Content-Range in segmented download");
+                }
+                total = size;
+                probed = last + 1;
+                etag = header("etag");
+
+                // Announced as if the rest of the artifact was fetched in one transfer
+                std::map<std::string, std::string> announced = headers;
+                announced["content-length"] = std::to_string(total - firstByte);
+                if (firstByte > 0) {
+                    announced["content-range"] = "bytes " + std::to_string(firstByte) + "-" +
+                                                 std::to_string(total - 1) + "/" + std::to_string(total);
+                    responseStart(206, announced);
+                } else {
+                    announced.erase("content-range");
+                    responseStart(200, announced);
+                }
+            });
+
+    if (httpCode != 206) {
+        return httpCode;
+    }
+    long result = firstByte > 0 ? 206 : 200;
+
+    curl_off_t delivered = probed;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - probeStart).count();
+    // Throughput of one connection in bytes per second
+    double rate = (double) (delivered - firstByte) / std::max(elapsed, 1e-3);
+    if (delivered == total) {
+        return result;
+    }
+
+    // Each connection keeps its handle for later segments; the connections themselves go back to
+    // the share afterwards
+    struct Connection {
+        CURL* curl;
+        std::string writeBuffer;
+        std::string errorBuffer;
+    };
+    std::vector<std::unique_ptr<Connection>> connections;
+    std::vector<Connection*> idle;
+    std::string ifRangeHeader = IsStrongETag(etag) ? "If-Range: " + etag : "";
+    struct curl_slist* headerList = nullptr;
+    if (!ifRangeHeader.empty()) {
+        headerList = curl_slist_append(headerList, ifRangeHeader.c_str());
+    }
+
+    std::map<std::string, std::string> params;
+    params["updateId"] = std::to_string(updateId);
+    for (int i = 0; i < options.connections; i++) {
+        auto connection = std::make_unique<Connection>();
+        connection->curl = curl_easy_init();
+        connection->errorBuffer.resize(CURL_ERROR_SIZE);
+        DoStandardCurlSetup(connection->curl, ENDPOINT_GET_UPDATE, connection->writeBuffer,
+                            connection->errorBuffer, &params);
+        curl_easy_setopt(connection->curl, CURLOPT_WRITEFUNCTION, SegmentCallback);
+        curl_easy_setopt(connection->curl, CURLOPT_HTTPHEADER, headerList);
+        curl_easy_setopt(connection->curl, CURLOPT_SHARE, share);
+        idle.push_back(connection.get());
+        connections.push_back(std::move(connection));
+    }
+
+    CURLM* multi = curl_multi_init();
+    // Segments that are not completely handed to the sink yet, ordered by their first byte
+    std::map<curl_off_t, std::unique_ptr<Segment>> pending;
+    std::map<CURL*, Connection*> byHandle;
+    for (auto& connection : connections) {
+        byHandle[connection->curl] = connection.get();
+    }
+    curl_off_t nextByte = delivered;
+
+    auto start = [&](Segment& segment, Connection* connection) {
+        segment.curl = connection->curl;
+        segment.attemptStart = segment.received;
+        segment.started = std::chrono::steady_clock::now();
+        std::string range = std::to_string(segment.first + segment.received) + "-" + std::to_string(segment.last);
+        curl_easy_setopt(connection->curl, CURLOPT_RANGE, range.c_str());
+        curl_easy_setopt(connection->curl, CURLOPT_WRITEDATA, &segment);
+        curl_easy_setopt(connection->curl, CURLOPT_PRIVATE, &segment);
+        curl_multi_add_handle(multi, connection->curl);
+    };
+
+    // Hands completed data to the sink in order
+    auto flush = [&]() {
+        while (!pending.empty()) {
+            Segment& head = *pending.begin()->second;
+            if (!head.buffer.empty()) {
+                if (!sink(head.buffer.data(), head.buffer.size())) {
+                    throw fetch_exception("transfer aborted by sink");
+                }
+                delivered += head.buffer.size();
+                head.buffer = {};
+            }
+            if (!head.done) {
+                break;
+            }
+            pending.erase(pending.begin());
+        }
+    };
+
+    auto canStart = [&]() {
+        return !idle.empty() && nextByte < total && nextByte - delivered < options.windowSize;
+    };
+
+    try {
+        while (delivered < total) {
+            while (canStart()) {
+                // About segmentDuration of work, but split the tail evenly over the connections
+                auto size = (curl_off_t) (rate * std::chrono::duration<double>(options.segmentDuration).count());
+                size = std::min(size, (total - nextByte + options.connections - 1) / options.connections);
+                size = std::max(options.minSegmentSize, std::min(options.maxSegmentSize, size));
+                size = std::min(size, total - nextByte);
+
+                auto segment = std::make_unique<Segment>(
+                        Segment{nullptr, nextByte, nextByte + size - 1, 0, {}, false, 0, 0, {}, &sink,
+                                &delivered, nullptr});
+                start(*segment, idle.back());
+                idle.pop_back();
+                pending[nextByte] = std::move(segment);
+                nextByte += size;
+            }
+
+            int running = 0;
+            curl_multi_perform(multi, &running);
+
+            int queued = 0;
+            while (CURLMsg* msg = curl_multi_info_read(multi, &queued)) {
+                if (msg->msg != CURLMSG_DONE) {
+                    continue;
+                }
+                CURL* curl = msg->easy_handle;
+                CURLcode code = msg->data.result;
+                Segment* segment = nullptr;
+                curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**) &segment);
+                curl_multi_remove_handle(multi, curl);
+                Connection* connection = byHandle[curl];
+
+                if (segment->error) {
+                    std::rethrow_exception(segment->error);
+                }
+                curl_off_t size = segment->last - segment->first + 1;
+                if (code == CURLE_OK && segment->received == size) {
+                    segment->done = true;
+                    double seconds = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - segment->started).count();
+                    double segmentRate = (double) (size - segment->attemptStart) / std::max(seconds, 1e-3);
+                    rate = (rate + segmentRate) / 2;
+                    idle.push_back(connection);
+                    continue;
+                }
+
+                // Lost connections and short segments are continued where they stopped
+                if (++segment->failures > retries) {
+                    throw fetch_exception(code != CURLE_OK ? connection->errorBuffer.c_str()
+                                                           : "segment ended early");
+                }
+                start(*segment, connection);
+            }
+            flush();
+
+            // Connections that finished a segment get the next one right away
+            if (delivered < total && !canStart()) {
+                curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+            }
+        }
+    } catch (...) {
+        for (auto& connection : connections) {
+            curl_multi_remove_handle(multi, connection->curl);
+            curl_easy_cleanup(connection->curl);
+        }
+        curl_multi_cleanup(multi);
+        curl_slist_free_all(headerList);
+        throw;
+    }
+
+    for (auto& connection : connections) {
+        curl_easy_cleanup(connection->curl);
+    }
+    curl_multi_cleanup(multi);
+    curl_slist_free_all(headerList);
+    return result;
+}
+
+void UpdateDownloadClient::SetSegmentedDownload(const SegmentedDownloadOptions& options) {
+    segmentedDownload = options;
+}
+
 DecryptionKeyServerResponse UpdateDownloadClient::FetchDecryptionKey(uint updateId) {
-    auto curl = curl_easy_init();
+    auto curl = PrepareHandle();
 
     std::string writeBuffer;
     std::string errorBuffer;
@@ -126,11 +972,14 @@ DecryptionKeyServerResponse UpdateDownloadClient::FetchDecryptionKey(uint update
         throw fetch_exception(errorBuffer.c_str());
     }
 
-    auto httpCode = GetHttpResponseCode(curl);
+    return ParseDecryptionKeyResponse(GetHttpResponseCode(curl), writeBuffer);
+}
+
+DecryptionKeyServerResponse UpdateDownloadClient::ParseDecryptionKeyResponse(long httpCode, const std::string& body) {
     DecryptionKeyServerResponse response{};
 
     if (httpCode == 200) {
-        auto j = nlohmann::json::parse(writeBuffer);
+        auto j = nlohmann::json::parse(body);
         response = j.get<DecryptionKeyServerResponse>();
     }
     response.httpCode = httpCode;
@@ -138,22 +987,150 @@ DecryptionKeyServerResponse UpdateDownloadClient::FetchDecryptionKey(uint update
     return response;
 }
 
+long UpdateDownloadClient::FetchKeyAndArtifact(uint updateId, const KeyHandler& keyHandler, const BodySink& sink,
+                                               curl_off_t maxBeforeKey) {
+    std::map<std::string, std::string> params;
+    params["updateId"] = std::to_string(updateId);
+
+    auto keyCurl = PrepareHandle();
+    std::string keyBuffer;
+    std::string keyErrorBuffer;
+    keyErrorBuffer.resize(CURL_ERROR_SIZE);
+    DoStandardCurlSetup(keyCurl, ENDPOINT_GET_DECRYPTION_KEY, keyBuffer, keyErrorBuffer, &params);
+    curl_easy_setopt(keyCurl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+
+    auto artifactCurl = curl_easy_init();
+    if (artifactCurl == nullptr) {
+        throw fetch_exception("unable to create curl handle");
+    }
+    std::string artifactBuffer;
+    std::string artifactErrorBuffer;
+    artifactErrorBuffer.resize(CURL_ERROR_SIZE);
+    DoStandardCurlSetup(artifactCurl, ENDPOINT_GET_UPDATE, artifactBuffer, artifactErrorBuffer, &params);
+    curl_easy_setopt(artifactCurl, CURLOPT_SHARE, share);
+    curl_easy_setopt(artifactCurl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    // Waits for the key request's connection to negotiate HTTP/2 via ALPN, instead of opening a
+    // second one right away. Plain HTTP never multiplexes, waiting would only serialize the two.
+    if (serverAddr.compare(0, 8, "https://") == 0) {
+        curl_easy_setopt(artifactCurl, CURLOPT_PIPEWAIT, 1L);
+    }
+
+    ResponseStart noResponseStart;
+    StreamContext context{artifactCurl, &sink, &noResponseStart, {}, false, nullptr};
+    curl_off_t beforeKey = maxBeforeKey;
+    context.budget = &beforeKey;
+    curl_easy_setopt(artifactCurl, CURLOPT_WRITEFUNCTION, StreamCallback);
+    curl_easy_setopt(artifactCurl, CURLOPT_WRITEDATA, &context);
+    curl_easy_setopt(artifactCurl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+    curl_easy_setopt(artifactCurl, CURLOPT_HEADERDATA, &context);
+
+    CURLM* multi = curl_multi_init();
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_add_handle(multi, keyCurl);
+    curl_multi_add_handle(multi, artifactCurl);
+
+    int running = 2;
+    CURLcode artifactCode = CURLE_OK;
+    std::exception_ptr error;
+    while (running > 0 && !error && !context.error) {
+        curl_multi_perform(multi, &running);
+
+        int queued = 0;
+        while (CURLMsg* msg = curl_multi_info_read(multi, &queued)) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            if (msg->easy_handle == artifactCurl) {
+                artifactCode = msg->data.result;
+                continue;
+            }
+            // Exceptions must not unwind past the handles; rethrown once they are cleaned up
+            try {
+                if (msg->data.result != CURLE_OK) {
+                    throw fetch_exception(keyErrorBuffer.c_str());
+                }
+                keyHandler(ParseDecryptionKeyResponse(GetHttpResponseCode(keyCurl), keyBuffer));
+                context.budget = nullptr;
+                if (context.paused) {
+                    context.paused = false;
+                    curl_easy_pause(artifactCurl, CURLPAUSE_CONT);
+                }
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }
+
+        if (running > 0 && !error && !context.error) {
+            curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+        }
+    }
+
+    auto httpCode = GetHttpResponseCode(artifactCurl);
+    curl_multi_remove_handle(multi, keyCurl);
+    curl_multi_remove_handle(multi, artifactCurl);
+    curl_easy_cleanup(artifactCurl);
+    curl_multi_cleanup(multi);
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    if (context.error) {
+        std::rethrow_exception(context.error);
+    }
+    if (artifactCode != CURLE_OK) {
+        throw fetch_exception(artifactErrorBuffer.c_str());
+    }
+    return httpCode;
+}
+
 std::vector<unsigned int> UpdateDownloadClient::StartPolling() {
 
-    auto curl = curl_easy_init();
+    auto curl = PrepareHandle();
 
     std::string writeBuffer;
     std::string errorBuffer;
     errorBuffer.resize(CURL_ERROR_SIZE);
 
-    DoStandardCurlSetup(curl, ENDPOINT_WHATS_NEW, writeBuffer, errorBuffer);
-
-    std::vector<unsigned int> updates;
+    if (longPollWait.count() > 0) {
+        // A held request that outlives the wait by far went missing somewhere on the way
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long) (longPollWait + std::chrono::seconds(30)).count() * 1000);
+        // Keeps NAT mappings of the idle connection alive while the request is held. Probes start
+        // well within the wait, as mappings of idle connections may expire after 30 s already.
+        long keepAlive = std::clamp<long>(longPollWait.count() / 4, 1, 15);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, keepAlive);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, keepAlive);
+    }
 
     while (true) {
 
+        std::map<std::string, std::string> params;
+        if (longPollWait.count() > 0) {
+            params["wait"] = std::to_string(longPollWait.count());
+        }
+        if (!knownUpdates.empty()) {
+            params["since"] = std::to_string(knownUpdates.back());
+        }
+        DoStandardCurlSetup(curl, ENDPOINT_WHATS_NEW, writeBuffer, errorBuffer, &params);
+
+        curl_slist* requestHeaders = nullptr;
+        if (!whatsNewETag.empty()) {
+            requestHeaders = curl_slist_append(requestHeaders, ("If-None-Match: " + whatsNewETag).c_str());
+        }
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, requestHeaders);
+
+        StreamContext context{curl, nullptr, nullptr, {}, false, nullptr};
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &context);
+
         writeBuffer.clear();
+        auto requestStart = std::chrono::steady_clock::now();
         auto code = curl_easy_perform(curl);
+        // A request the server held for a while is followed by the next one right away
+        auto nextRequest = requestStart + pollInterval;
+
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, nullptr);
+        curl_slist_free_all(requestHeaders);
 
         if (code != 0) {
             std::cout << std::string(errorBuffer) << "\n";
@@ -165,20 +1142,53 @@ std::vector<unsigned int> UpdateDownloadClient::StartPolling() {
 
         if (httpCode == 200) {
             nlohmann::json j = nlohmann::json::parse(writeBuffer);
-            updates = j.get<std::vector<unsigned int>>();
+            auto newUpdates = j.get<std::vector<unsigned int>>();
+            auto etag = context.headers.find("etag");
+            whatsNewETag = etag != context.headers.end() ? etag->second : "";
+
+            if (newUpdates.empty() && !knownUpdates.empty()) {
+                // The list changed without a newer update, so some were withdrawn; start over
+                knownUpdates.clear();
+                whatsNewETag.clear();
+                continue;
+            }
+
+            // Servers that don't know the cursor list the known updates again
+            std::vector<unsigned int> merged;
+            std::sort(newUpdates.begin(), newUpdates.end());
+            std::set_union(knownUpdates.begin(), knownUpdates.end(), newUpdates.begin(), newUpdates.end(),
+                           std::back_inserter(merged));
+            knownUpdates = std::move(merged);
             break;
         }
 
-        std::this_thread::sleep_for(pollInterval);
+        // Nothing changed since the last list
+        if (httpCode == 304 && !knownUpdates.empty()) {
+            break;
+        }
+
+        if (httpCode == 204) {
+            knownUpdates.clear();
+            whatsNewETag.clear();
+        }
+
+        std::this_thread::sleep_until(nextRequest);
     }
 
-    curl_easy_cleanup(curl);
-    return updates;
+    return knownUpdates;
+}
+
+void UpdateDownloadClient::SetDeltaArtifact(bool delta) {
+    deltaArtifact = delta;
+}
+
+void UpdateDownloadClient::SetLongPoll(std::chrono::seconds wait) {
+    longPollWait = wait;
 }
 
 std::string UpdateDownloadClient::DoConnectionTest() {
 
-    auto curl = curl_easy_init();
+    auto curl = PrepareHandle();
 
     std::string writeBuffer;
     std::string errorBuffer;
@@ -8,7 +8,9 @@
 #include <thread>
 #include <array>
 #include <map>
+#include <functional>
 #include <curl/curl.h>
+#include <openssl/ssl.h>
 #include "nlohmann/json.hpp"
 #include "ArtifactCryptoHelper.h"
 #include "ArtifactParser.h"
@@ -25,6 +27,8 @@ struct DecryptionKeyServerResponse {
     std::array<unsigned char, 256> key;
     std::array<unsigned char, 12> iv;
     long httpCode;
+    // For the key of a delta artifact, the image the delta was made against
+    std::optional<DeltaSource> deltaSource;
 };
 
 struct UpdateArtifactServerResponse {
@@ -32,15 +36,86 @@ struct UpdateArtifactServerResponse {
     long httpCode;
 };
 
+struct ManifestServerResponse {
+    std::vector<unsigned char> manifest;
+    long httpCode;
+};
+
+// Receives the body of a successful response chunk by chunk; returning false aborts the transfer
+using BodySink = std::function<bool(const unsigned char* data, size_t length)>;
+
+// Told the Content-Length of a successful response before its first chunk arrives
+using LengthHint = std::function<void(curl_off_t length)>;
+
+// Gets the key response of FetchKeyAndArtifact as soon as it arrived; throwing aborts the artifact
+using KeyHandler = std::function<void(const DecryptionKeyServerResponse& response)>;
+
+// Splits the artifact into byte ranges fetched over several connections at once, which fills
+// high-latency links a single transfer can't. Segments are sized so that one takes about
+// segmentDuration at the throughput measured so far, and are handed to the sink in order.
+struct SegmentedDownloadOptions {
+    // 1 downloads the artifact in a single transfer
+    int connections = 1;
+    curl_off_t initialSegmentSize = 1024 * 1024;
+    curl_off_t minSegmentSize = 256 * 1024;
+    curl_off_t maxSegmentSize = 8 * 1024 * 1024;
+    std::chrono::milliseconds segmentDuration{1000};
+    // Limits how far downloads may run ahead of the data handed to the sink, and so the memory
+    // used for segments that completed out of order: at most windowSize plus one segment. The
+    // default suits a gateway with a few hundred MiB of RAM; smaller devices size it to theirs.
+    curl_off_t windowSize = 32 * 1024 * 1024;
+};
+
+// How many TLS handshakes of a client resumed a session instead of doing a full handshake
+struct TlsSessionStats {
+    unsigned int handshakes;
+    unsigned int resumed;
+};
+
 class UpdateDownloadClient {
 private:
 
     std::string serverAddr;
     std::chrono::milliseconds pollInterval;
+    // How long the server may hold a /whatsNew request until an update is available; 0 polls
+    std::chrono::seconds longPollWait;
+    // The updates /whatsNew listed so far, ascending; the last one is the cursor for the next
+    // request, so only newer ones are sent. whatsNewETag identifies the server's list behind them.
+    std::vector<unsigned int> knownUpdates;
+    std::string whatsNewETag;
     std::string caCertPath;
     std::string certPath;
     std::string keyPath;
     int retries;
+    SegmentedDownloadOptions segmentedDownload;
+    // Artifacts and keys are requested with delta=1
+    bool deltaArtifact = false;
+
+    // Reused by every request, so the connection to the server stays open between them
+    CURL* handle;
+    // Connections, DNS results and TLS sessions, shared with the handles of segmented downloads
+    CURLSH* share;
+
+    // The last TLS session, also kept in tlsSessionPath so it survives restarts of the client
+    std::string tlsSessionPath;
+    SSL_SESSION* tlsSession;
+    TlsSessionStats tlsSessionStats;
+
+    // Used by libCURL (OpenSSL backend) for every new SSL_CTX; hooks the callbacks below into it
+    static CURLcode SslContextCallback(CURL* curl, void* sslCtx, void* userp);
+
+    // Run by OpenSSL for every new SSL; offers the persisted session to the connections of an
+    // SSL_CTX hooked by SslContextCallback, before the ClientHello is built
+    static void NewSslCallback(void* ssl, void* data, CRYPTO_EX_DATA* exData, int index, long argl,
+                               void* argp);
+
+    // Counts handshakes and how many of them resumed a session
+    static void SslInfoCallback(const SSL* ssl, int where, int ret);
+
+    // Chained in front of libCURL's own new-session callback to persist every new session
+    static int NewSessionCallback(SSL* ssl, SSL_SESSION* session);
+
+    void StoreTlsSession(SSL_SESSION* session);
 
     // Used by libCURL to write the content of HTTP-Responses into the configured buffer
     static size_t WriteCallback(void* contents, size_t size, size_t nmemb, void* userp) {
@@ -48,10 +123,62 @@ private:
         return size * nmemb;
     }
 
+    // Told the status and the headers (names lower-cased) of a successful response before its
+    // first chunk arrives
+    using ResponseStart = std::function<void(long httpCode, const std::map<std::string, std::string>& headers)>;
+
+    struct StreamContext {
+        CURL* curl;
+        const BodySink* sink;
+        const ResponseStart* responseStart;
+        std::map<std::string, std::string> headers;
+        bool started;
+        std::exception_ptr error;
+        // If set, the bytes the sink may still get; the transfer pauses instead of exceeding it
+        curl_off_t* budget = nullptr;
+        bool paused = false;
+    };
+
+    // 200, or 206 for a Range request
+    static bool IsSuccessfulResponse(long httpCode);
+
+    // Used by libCURL for every response header; collects them for a ResponseStart
+    static size_t HeaderCallback(char* buffer, size_t size, size_t nitems, void* userp);
+
+    // Used by libCURL to hand the content of HTTP-Responses to a BodySink as it arrives
+    static size_t StreamCallback(void* contents, size_t size, size_t nmemb, void* userp);
+
     static std::string BuildParameterString(const std::map<std::string, std::string>& params);
 
     static long GetHttpResponseCode(CURL* curl);
 
+    static DecryptionKeyServerResponse ParseDecryptionKeyResponse(long httpCode, const std::string& body);
+
+    // The client's handle, reset to the default options and attached to the share
+    CURL* PrepareHandle();
+
+    // Streams the artifact, or the part of it selected by a Range in requestHeaders, into sink.
+    // params are added to the request, e.g. to ask for the artifact's manifest instead.
+    long FetchArtifact(uint updateId, const std::vector<std::string>& requestHeaders,
+                       const BodySink& sink, const ResponseStart& responseStart,
+                       const std::map<std::string, std::string>& params = {});
+
+    // Streams the artifact from firstByte on, with as many connections as configured. The range
+    // is only sent if the artifact's ETag is still ifRange, if that isn't empty.
+    long FetchArtifactFrom(uint updateId, curl_off_t firstByte, const std::string& ifRange,
+                           const BodySink& sink, const ResponseStart& responseStart);
+
+    struct Segment;
+
+    // Used by libCURL to hand the content of a segment to the sink, or to hold it back while an
+    // earlier segment is incomplete
+    static size_t SegmentCallback(void* contents, size_t size, size_t nmemb, void* userp);
+
+    // A first segment tells the artifact's size, the rest is fetched over the multi interface.
+    // Responds like a single transfer: 200 for the whole artifact, 206 if firstByte > 0.
+    long FetchArtifactSegmented(uint updateId, curl_off_t firstByte, const std::string& ifRange,
+                                const BodySink& sink, const ResponseStart& responseStart);
+
     bool DoStandardCurlSetup(CURL* curl, const std::string& endpoint,
                              const std::string& writeBuffer, const std::string& errorBuffer,
                              const std::map<std::string, std::string>* params = nullptr);
@@ -64,13 +191,77 @@ public:
 
     UpdateArtifactServerResponse FetchArtifact(uint updateId);
 
+    // Streams the artifact into sink instead of buffering it; returns the http-response code
+    long FetchArtifact(uint updateId, const BodySink& sink, const LengthHint& lengthHint = nullptr);
+
+    // Downloads the artifact into stagingPath, for artifacts larger than the free RAM. The file
+    // is preallocated from Content-Length and only appears under stagingPath once complete.
+    // An interrupted download leaves its partial file and progress behind, and the next call for
+    // the same updateId continues it with a Range request. Returns 200 once the file is complete.
+    long FetchArtifactToFile(uint updateId, const std::string& stagingPath);
+
+    // Whether FetchArtifactToFile would continue an interrupted download of updateId into
+    // stagingPath instead of starting over
+    static bool HasPartialDownload(uint updateId, const std::string& stagingPath);
+
+    // Removes the artifact staged under stagingPath, and any partial download and progress of it,
+    // e.g. because it failed its tag or signature check. The next FetchArtifactToFile then
+    // downloads the whole artifact again instead of reusing or continuing the corrupt file.
+    static void DiscardStagedArtifact(const std::string& stagingPath);
+
+    // Streams the bytes first to last of the artifact into sink, for seeded downloads. etag is
+    // sent as If-Range and set from the first response, so all ranges come from the same
+    // artifact. Returns 206; throws fetch_exception for anything but the range asked for.
+    long FetchArtifactRange(uint updateId, curl_off_t first, curl_off_t last, std::string& etag,
+                            const BodySink& sink);
+
+    // The block manifest of the artifact (see BlockManifest); 404 if the publisher uploaded none
+    ManifestServerResponse FetchManifest(uint updateId);
+
     DecryptionKeyServerResponse FetchDecryptionKey(uint updateId);
 
+    // Requests key and artifact at once, multiplexed over one HTTP/2 connection if the server
+    // speaks it, so the key arrives while the artifact already streams into sink. Until keyHandler
+    // returned, at most maxBeforeKey bytes go to sink; the artifact transfer pauses after that.
+    // Returns the artifact's http-response code once both transfers are done.
+    long FetchKeyAndArtifact(uint updateId, const KeyHandler& keyHandler, const BodySink& sink,
+                             curl_off_t maxBeforeKey);
+
+    // Applies to all following artifact downloads
+    void SetSegmentedDownload(const SegmentedDownloadOptions& options);
+
+    // Following fetches of artifacts and keys ask for the delta artifact of an update instead of
+    // the full one; the server answers 404 for updates without one
+    void SetDeltaArtifact(bool delta);
+
+    // Restores the TLS session kept in path and keeps every new one there, so the first request
+    // after a restart resumes with an abbreviated handshake. Returns false if libCURL doesn't
+    // use OpenSSL.
+    bool SetTlsSessionCache(const std::string& path);
+
+    TlsSessionStats GetTlsSessionStats() const;
+
+    // Returns once /whatsNew lists updates. With a long-poll wait the server holds each request
+    // until an update is published; requests are spaced by at least pollInterval either way, so
+    // servers that answer right away are polled as before.
+    // Only updates newer than the known ones are requested, and the ETag of the last list is sent
+    // along, so an unchanged list costs a 304 without body. The known updates are returned then.
     std::vector<unsigned int> StartPolling();
 
+    // Applies to all following calls of StartPolling
+    void SetLongPoll(std::chrono::seconds wait);
+
     explicit UpdateDownloadClient(std::string serverAddr, std::chrono::milliseconds pollInterval,
                                   std::string caCertPath, std::string certPath,
                                   std::string keyPath, int retries) noexcept;
+
+    // Owns libCURL handles; a client is used by one thread at a time
+    UpdateDownloadClient(const UpdateDownloadClient&) = delete;
+
+    UpdateDownloadClient& operator=(const UpdateDownloadClient&) = delete;
+
+    ~UpdateDownloadClient();
+
     std::string DoConnectionTest();
 };
 
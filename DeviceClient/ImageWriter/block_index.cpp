@@ -0,0 +1,341 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <openssl/sha.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "block_index.h"
+
+static const char BLOCK_INDEX_MAGIC[8] = {'B', 'L', 'K', 'I', 'N', 'D', 'E', 'X'};
+static const uint32_t BLOCK_INDEX_VERSION = 1;
+static const size_t BLOCK_INDEX_HEADER_SIZE = 128;
+
+// Offsets within the header
+static const size_t HEADER_VERSION = 8;
+static const size_t HEADER_BLOCK_SIZE = 12;
+static const size_t HEADER_IMAGE_LENGTH = 16;
+static const size_t HEADER_IMAGE_DIGEST = 24;
+static const size_t HEADER_STAMP = 56;
+
+// The ext2/3/4 superblock, 1024 bytes into the partition
+static const off_t SUPERBLOCK_OFFSET = 1024;
+static const size_t SUPERBLOCK_SIZE = 1024;
+static const size_t SUPERBLOCK_MAGIC = 0x38;
+static const uint16_t EXT_MAGIC = 0xEF53;
+// s_mtime up to and including s_lastcheck, and s_kbytes_written
+static const size_t SUPERBLOCK_TIMES = 0x2C;
+static const size_t SUPERBLOCK_TIMES_SIZE = 0x44 - 0x2C;
+static const size_t SUPERBLOCK_KBYTES_WRITTEN = 0x178;
+
+BlockIndexException::BlockIndexException(const char* message)
+    : std::runtime_error(message) {}
+
+static void preadFully(int fd, unsigned char* buffer, size_t nBytes,
+                       off_t offset) {
+    size_t done = 0;
+    while (done < nBytes) {
+        ssize_t n = pread(fd, buffer + done, nBytes - done, offset + done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            const std::string errorMsg =
+                std::string("Unable to read partition: ") + strerror(errno);
+            throw BlockIndexException(errorMsg.c_str());
+        }
+        if (n == 0) {
+            throw BlockIndexException("Partition is too small.");
+        }
+        done += n;
+    }
+}
+
+static uint64_t obtainPartitionSize(int device) {
+    struct stat status {};
+    if (fstat(device, &status) == -1) {
+        const std::string errorMsg =
+            std::string("Unable to stat partition: ") + strerror(errno);
+        throw BlockIndexException(errorMsg.c_str());
+    }
+    if (!S_ISBLK(status.st_mode)) {
+        return status.st_size;
+    }
+    uint64_t size = 0;
+    if (ioctl(device, BLKGETSIZE64, &size) == -1) {
+        const std::string errorMsg =
+            std::string("Unable to retreive partition size: ") +
+            strerror(errno);
+        throw BlockIndexException(errorMsg.c_str());
+    }
+    return size;
+}
+
+bool readPartitionStamp(int device, PartitionStamp& stamp) {
+    uint64_t size = obtainPartitionSize(device);
+    if (size < SUPERBLOCK_OFFSET + SUPERBLOCK_SIZE) {
+        return false;
+    }
+    std::array<unsigned char, SUPERBLOCK_SIZE> superblock{};
+    preadFully(device, superblock.data(), superblock.size(), SUPERBLOCK_OFFSET);
+    uint16_t magic = 0;
+    memcpy(&magic, superblock.data() + SUPERBLOCK_MAGIC, sizeof(magic));
+    if (magic != EXT_MAGIC) {
+        return false;
+    }
+
+    unsigned char* out = stamp.data();
+    out = std::copy_n(superblock.data() + SUPERBLOCK_TIMES,
+                      SUPERBLOCK_TIMES_SIZE, out);
+    out = std::copy_n(superblock.data() + SUPERBLOCK_KBYTES_WRITTEN,
+                      sizeof(uint64_t), out);
+    memcpy(out, &size, sizeof(size));
+    return true;
+}
+
+BlockIndexBuilder::BlockIndexBuilder(uint32_t blockSize)
+    : blockSize_{blockSize},
+      imageLength_{0},
+      imageDigest_{EVP_MD_CTX_new(), EVP_MD_CTX_free} {
+    if (blockSize_ == 0) {
+        throw BlockIndexException("Block size must not be zero.");
+    }
+    if (!imageDigest_ ||
+        EVP_DigestInit_ex(imageDigest_.get(), EVP_sha256(), nullptr) != 1) {
+        throw BlockIndexException("Unable to hash image.");
+    }
+    partialBlock_.reserve(blockSize_);
+}
+
+void BlockIndexBuilder::update(const unsigned char* data, size_t nBytes) {
+    EVP_DigestUpdate(imageDigest_.get(), data, nBytes);
+    imageLength_ += nBytes;
+
+    if (!partialBlock_.empty()) {
+        size_t take = std::min(nBytes, blockSize_ - partialBlock_.size());
+        partialBlock_.insert(partialBlock_.end(), data, data + take);
+        data += take;
+        nBytes -= take;
+        if (partialBlock_.size() < blockSize_) {
+            return;
+        }
+        blockHashes_.emplace_back();
+        SHA256(partialBlock_.data(), blockSize_, blockHashes_.back().data());
+        partialBlock_.clear();
+    }
+    // Whole blocks are hashed in place
+    for (; nBytes >= blockSize_; data += blockSize_, nBytes -= blockSize_) {
+        blockHashes_.emplace_back();
+        SHA256(data, blockSize_, blockHashes_.back().data());
+    }
+    partialBlock_.insert(partialBlock_.end(), data, data + nBytes);
+}
+
+uint64_t BlockIndexBuilder::getImageLength() const { return imageLength_; }
+
+size_t BlockIndexBuilder::getBlockCount() const { return blockHashes_.size(); }
+
+const BlockHash& BlockIndexBuilder::getBlockHash(size_t block) const {
+    return blockHashes_.at(block);
+}
+
+void BlockIndexBuilder::store(const std::string& indexPath, int device) {
+    PartitionStamp stamp{};
+    if (!readPartitionStamp(device, stamp)) {
+        throw BlockIndexException(
+            "Partition holds no ext filesystem, its index couldn't be "
+            "validated.");
+    }
+
+    if (!partialBlock_.empty()) {
+        blockHashes_.emplace_back();
+        SHA256(partialBlock_.data(), partialBlock_.size(),
+               blockHashes_.back().data());
+        partialBlock_.clear();
+    }
+    BlockHash digest{};
+    unsigned int digestLength = 0;
+    EVP_DigestFinal_ex(imageDigest_.get(), digest.data(), &digestLength);
+
+    std::vector<unsigned char> header(BLOCK_INDEX_HEADER_SIZE, 0);
+    memcpy(header.data(), BLOCK_INDEX_MAGIC, sizeof(BLOCK_INDEX_MAGIC));
+    memcpy(header.data() + HEADER_VERSION, &BLOCK_INDEX_VERSION,
+           sizeof(BLOCK_INDEX_VERSION));
+    memcpy(header.data() + HEADER_BLOCK_SIZE, &blockSize_, sizeof(blockSize_));
+    memcpy(header.data() + HEADER_IMAGE_LENGTH, &imageLength_,
+           sizeof(imageLength_));
+    std::copy(digest.begin(), digest.end(),
+              header.begin() + HEADER_IMAGE_DIGEST);
+    std::copy(stamp.begin(), stamp.end(), header.begin() + HEADER_STAMP);
+
+    // Written next to the old index and renamed over it, so a crash leaves
+    // either of them
+    const std::string tmpPath = indexPath + ".tmp";
+    int file = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0600);
+    if (file == -1) {
+        const std::string errorMsg = "Unable to create block index " +
+                                     tmpPath + ": " + strerror(errno);
+        throw BlockIndexException(errorMsg.c_str());
+    }
+    auto writeAll = [file](const unsigned char* data, size_t nBytes) {
+        while (nBytes > 0) {
+            ssize_t n = write(file, data, nBytes);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1) {
+                return false;
+            }
+            data += n;
+            nBytes -= n;
+        }
+        return true;
+    };
+    bool ok = writeAll(header.data(), header.size()) &&
+              writeAll(blockHashes_.empty() ? nullptr
+                                            : blockHashes_.front().data(),
+                       blockHashes_.size() * sizeof(BlockHash)) &&
+              fsync(file) == 0;
+    const std::string reason = strerror(errno);
+    close(file);
+    if (!ok || rename(tmpPath.c_str(), indexPath.c_str()) == -1) {
+        unlink(tmpPath.c_str());
+        const std::string errorMsg = "Unable to store block index " +
+                                     indexPath + ": " +
+                                     (ok ? strerror(errno) : reason);
+        throw BlockIndexException(errorMsg.c_str());
+    }
+}
+
+BlockIndex::BlockIndex(const std::string& indexPath)
+    : map_{nullptr},
+      mapLength_{0},
+      blockSize_{0},
+      imageLength_{0},
+      blockCount_{0} {
+    int file = open(indexPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file == -1) {
+        const std::string errorMsg = "Unable to open block index " +
+                                     indexPath + ": " + strerror(errno);
+        throw BlockIndexException(errorMsg.c_str());
+    }
+    struct stat status {};
+    if (fstat(file, &status) == -1 ||
+        (size_t)status.st_size < BLOCK_INDEX_HEADER_SIZE) {
+        close(file);
+        throw BlockIndexException("Block index is truncated.");
+    }
+    mapLength_ = status.st_size;
+    void* map = mmap(nullptr, mapLength_, PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    if (map == MAP_FAILED) {
+        const std::string errorMsg =
+            std::string("Unable to map block index: ") + strerror(errno);
+        throw BlockIndexException(errorMsg.c_str());
+    }
+    map_ = static_cast<unsigned char*>(map);
+
+    uint32_t version = 0;
+    memcpy(&version, map_ + HEADER_VERSION, sizeof(version));
+    memcpy(&blockSize_, map_ + HEADER_BLOCK_SIZE, sizeof(blockSize_));
+    memcpy(&imageLength_, map_ + HEADER_IMAGE_LENGTH, sizeof(imageLength_));
+    const char* error = nullptr;
+    if (memcmp(map_, BLOCK_INDEX_MAGIC, sizeof(BLOCK_INDEX_MAGIC)) != 0 ||
+        version != BLOCK_INDEX_VERSION) {
+        error = "Not a block index of this version.";
+    } else if (blockSize_ == 0) {
+        error = "Block index has no block size.";
+    } else {
+        uint64_t blocks = imageLength_ / blockSize_ +
+                          (imageLength_ % blockSize_ != 0 ? 1 : 0);
+        if (blocks != (mapLength_ - BLOCK_INDEX_HEADER_SIZE) / sizeof(BlockHash) ||
+            (mapLength_ - BLOCK_INDEX_HEADER_SIZE) % sizeof(BlockHash) != 0) {
+            error = "Block index doesn't match its image length.";
+        }
+        blockCount_ = blocks;
+    }
+    if (error != nullptr) {
+        munmap(map_, mapLength_);
+        throw BlockIndexException(error);
+    }
+}
+
+BlockIndex::~BlockIndex() noexcept { munmap(map_, mapLength_); }
+
+bool BlockIndex::isValidFor(const std::string& devicePath) const {
+    int device = open(devicePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (device == -1) {
+        const std::string errorMsg = "Unable to open partition " + devicePath +
+                                     ": " + strerror(errno);
+        throw BlockIndexException(errorMsg.c_str());
+    }
+    try {
+        bool valid = isValidFor(device);
+        close(device);
+        return valid;
+    } catch (BlockIndexException& e) {
+        close(device);
+        throw;
+    }
+}
+
+bool BlockIndex::isValidFor(int device) const {
+    PartitionStamp stamp{};
+    if (!readPartitionStamp(device, stamp)) {
+        return false;
+    }
+    return std::equal(stamp.begin(), stamp.end(), map_ + HEADER_STAMP);
+}
+
+uint32_t BlockIndex::getBlockSize() const { return blockSize_; }
+
+uint64_t BlockIndex::getImageLength() const { return imageLength_; }
+
+size_t BlockIndex::getBlockCount() const { return blockCount_; }
+
+BlockHash BlockIndex::getImageDigest() const {
+    BlockHash digest{};
+    std::copy_n(map_ + HEADER_IMAGE_DIGEST, digest.size(), digest.begin());
+    return digest;
+}
+
+const unsigned char* BlockIndex::blockHashAt(size_t block) const {
+    return map_ + BLOCK_INDEX_HEADER_SIZE + block * sizeof(BlockHash);
+}
+
+BlockHash BlockIndex::getBlockHash(size_t block) const {
+    if (block >= blockCount_) {
+        throw BlockIndexException("Block is out of range of the index.");
+    }
+    BlockHash hash{};
+    std::copy_n(blockHashAt(block), hash.size(), hash.begin());
+    return hash;
+}
+
+uint64_t BlockIndex::find(const BlockHash& hash) const {
+    if (blocksByHash_.empty()) {
+        // A short last block can't stand in for a full one
+        size_t fullBlocks = imageLength_ / blockSize_;
+        blocksByHash_.reserve(fullBlocks);
+        for (size_t block = 0; block < fullBlocks; block++) {
+            uint64_t key = 0;
+            memcpy(&key, blockHashAt(block), sizeof(key));
+            blocksByHash_.emplace(key, block);
+        }
+    }
+    uint64_t key = 0;
+    memcpy(&key, hash.data(), sizeof(key));
+    auto found = blocksByHash_.find(key);
+    // Blocks whose hashes merely share the key are missed, which is harmless
+    if (found == blocksByHash_.end() ||
+        !std::equal(hash.begin(), hash.end(), blockHashAt(found->second))) {
+        return BLOCK_INDEX_NOT_FOUND;
+    }
+    return (uint64_t)found->second * blockSize_;
+}
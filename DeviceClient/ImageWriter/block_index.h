@@ -0,0 +1,123 @@
+#include <openssl/evp.h>
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef BLOCK_INDEX
+#define BLOCK_INDEX
+
+// Granularity of the index, the same as that of the block manifests of
+// seeded downloads, so manifest blocks can be looked up in it directly.
+const uint32_t BLOCK_INDEX_BLOCK_SIZE = 4096;
+
+// Returned by BlockIndex::find for blocks the image doesn't contain.
+const uint64_t BLOCK_INDEX_NOT_FOUND = UINT64_MAX;
+
+// Superblock fields of an ext2/3/4 filesystem plus the partition size, see
+// readPartitionStamp.
+const size_t PARTITION_STAMP_SIZE = 40;
+
+using BlockHash = std::array<unsigned char, 32>;
+using PartitionStamp = std::array<unsigned char, PARTITION_STAMP_SIZE>;
+
+class BlockIndexException : public std::runtime_error {
+   public:
+    BlockIndexException(const char* message);
+};
+
+// Reads what identifies the state of the ext2/3/4 filesystem on a partition:
+// mount and write time, mount count and state from its superblock, the
+// kilobytes ever written to it, and the size of the partition. Mounting the
+// filesystem read-write changes the stamp, mounting it read-only doesn't.
+// Returns false if the partition holds no such filesystem; throws
+// BlockIndexException if it can't be read.
+bool readPartitionStamp(int device, PartitionStamp& stamp);
+
+// Hashes an image block by block while it is written to a partition, and
+// stores the result as a BlockIndex once the image is complete.
+class BlockIndexBuilder {
+   public:
+    explicit BlockIndexBuilder(uint32_t blockSize = BLOCK_INDEX_BLOCK_SIZE);
+
+    BlockIndexBuilder(BlockIndexBuilder& other) = delete;
+
+    BlockIndexBuilder& operator=(BlockIndexBuilder& other) = delete;
+
+    // Hashes the next bytes of the image.
+    void update(const unsigned char* data, size_t nBytes);
+
+    uint64_t getImageLength() const;
+
+    // Number of blocks hashed so far; a trailing partial block isn't yet.
+    size_t getBlockCount() const;
+
+    const BlockHash& getBlockHash(size_t block) const;
+
+    // Writes the index of the image hashed so far to indexPath, stamped with
+    // the current state of the partition it was written to; the file is
+    // replaced atomically. Throws BlockIndexException if the partition has no
+    // stamp or the index can't be written. The builder is done afterwards.
+    void store(const std::string& indexPath, int device);
+
+   private:
+    uint32_t blockSize_;
+    uint64_t imageLength_;
+    std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> imageDigest_;
+    std::vector<unsigned char> partialBlock_;
+    std::vector<BlockHash> blockHashes_;
+};
+
+// The SHA-256 of each block of the image last written to a partition and of
+// the image as a whole, as stored by BlockIndexBuilder. The file is mapped
+// instead of read, so only the hashes actually looked at are paged in.
+// Layout, little-endian: 8 byte magic, 4 byte version, 4 byte block size,
+// 8 byte image length, image digest, partition stamp, padding to 128 bytes,
+// then the hash of every block; the last block may be short.
+class BlockIndex {
+   public:
+    // Throws BlockIndexException if the index is missing or malformed.
+    explicit BlockIndex(const std::string& indexPath);
+
+    ~BlockIndex() noexcept;
+
+    BlockIndex(BlockIndex& other) = delete;
+
+    BlockIndex& operator=(BlockIndex& other) = delete;
+
+    // Whether the partition is still in the state the index was stored in,
+    // i.e. its hashes can be trusted without reading the partition.
+    bool isValidFor(const std::string& devicePath) const;
+
+    bool isValidFor(int device) const;
+
+    uint32_t getBlockSize() const;
+
+    uint64_t getImageLength() const;
+
+    size_t getBlockCount() const;
+
+    BlockHash getImageDigest() const;
+
+    BlockHash getBlockHash(size_t block) const;
+
+    // Image offset of a full block with the given hash, or
+    // BLOCK_INDEX_NOT_FOUND.
+    uint64_t find(const BlockHash& hash) const;
+
+   private:
+    unsigned char* map_;
+    size_t mapLength_;
+    uint32_t blockSize_;
+    uint64_t imageLength_;
+    size_t blockCount_;
+    // Built on the first call of find; keyed by the first 8 bytes of a hash
+    mutable std::unordered_map<uint64_t, size_t> blocksByHash_;
+
+    const unsigned char* blockHashAt(size_t block) const;
+};
+#endif
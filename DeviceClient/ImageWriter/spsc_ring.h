@@ -0,0 +1,51 @@
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+#ifndef SPSC_RING
+#define SPSC_RING
+
+// Bounded queue between exactly one producer and one consumer thread, without
+// locks: each side only writes its own index and reads the other's. The slots
+// are allocated once, so passing values through it never allocates.
+template <typename T>
+class SpscRing {
+   public:
+    explicit SpscRing(size_t capacity)
+        : slots_(capacity + 1), head_{0}, tail_{0} {}
+
+    SpscRing(SpscRing& other) = delete;
+
+    SpscRing& operator=(SpscRing& other) = delete;
+
+    // Producer side; false if the ring is full.
+    bool tryPush(const T& value) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t next = tail + 1 == slots_.size() ? 0 : tail + 1;
+        if (next == head_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        slots_[tail] = value;
+        tail_.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side; false if the ring is empty.
+    bool tryPop(T& value) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = slots_[head];
+        head_.store(head + 1 == slots_.size() ? 0 : head + 1,
+                    std::memory_order_release);
+        return true;
+    }
+
+   private:
+    std::vector<T> slots_;
+    // On separate cache lines, so the two threads don't contend for one
+    alignas(64) std::atomic<size_t> head_;
+    alignas(64) std::atomic<size_t> tail_;
+};
+#endif
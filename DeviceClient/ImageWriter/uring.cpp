@@ -0,0 +1,203 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include "uring.h"
+
+IoUringException::IoUringException(const char* message)
+    : std::runtime_error(message) {}
+
+static unsigned* ringField(void* ring, uint32_t offset) {
+    return reinterpret_cast<unsigned*>(static_cast<char*>(ring) + offset);
+}
+
+static void* mapRing(int ring, size_t size, off_t offset) {
+    void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring, offset);
+    if (map == MAP_FAILED) {
+        const std::string errorMsg =
+            std::string("Unable to map io_uring: ") + strerror(errno);
+        throw IoUringException(errorMsg.c_str());
+    }
+    return map;
+}
+
+IoUring::IoUring(unsigned entries)
+    : ring_{-1},
+      entries_{0},
+      buffersRegistered_{false},
+      queued_{0},
+      submissionRing_{MAP_FAILED},
+      submissionRingSize_{0},
+      completionRing_{MAP_FAILED},
+      completionRingSize_{0},
+      submissionEntries_{MAP_FAILED},
+      submissionEntriesSize_{0} {
+    io_uring_params params{};
+    ring_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_ == -1) {
+        const std::string errorMsg =
+            std::string("Unable to set up io_uring: ") + strerror(errno);
+        throw IoUringException(errorMsg.c_str());
+    }
+    try {
+        submissionRingSize_ =
+            params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        completionRingSize_ =
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        // Both rings in one mapping since Linux 5.4
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            submissionRingSize_ =
+                std::max(submissionRingSize_, completionRingSize_);
+            completionRingSize_ = 0;
+        }
+        submissionRing_ =
+            mapRing(ring_, submissionRingSize_, IORING_OFF_SQ_RING);
+        completionRing_ = completionRingSize_ == 0
+                              ? submissionRing_
+                              : mapRing(ring_, completionRingSize_,
+                                        IORING_OFF_CQ_RING);
+        submissionEntriesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+        submissionEntries_ =
+            mapRing(ring_, submissionEntriesSize_, IORING_OFF_SQES);
+    } catch (IoUringException& e) {
+        release();
+        throw;
+    }
+    entries_ = params.sq_entries;
+    submissionHead_ = ringField(submissionRing_, params.sq_off.head);
+    submissionTail_ = ringField(submissionRing_, params.sq_off.tail);
+    submissionMask_ = ringField(submissionRing_, params.sq_off.ring_mask);
+    submissionArray_ = ringField(submissionRing_, params.sq_off.array);
+    completionHead_ = ringField(completionRing_, params.cq_off.head);
+    completionTail_ = ringField(completionRing_, params.cq_off.tail);
+    completionMask_ = ringField(completionRing_, params.cq_off.ring_mask);
+    completions_ = ringField(completionRing_, params.cq_off.cqes);
+}
+
+IoUring::~IoUring() noexcept { release(); }
+
+void IoUring::release() noexcept {
+    if (submissionEntries_ != MAP_FAILED) {
+        munmap(submissionEntries_, submissionEntriesSize_);
+    }
+    if (completionRing_ != MAP_FAILED && completionRingSize_ != 0) {
+        munmap(completionRing_, completionRingSize_);
+    }
+    if (submissionRing_ != MAP_FAILED) {
+        munmap(submissionRing_, submissionRingSize_);
+    }
+    if (ring_ != -1) {
+        close(ring_);
+    }
+}
+
+unsigned IoUring::getEntries() const { return entries_; }
+
+bool IoUring::supportsReadWrite() const {
+    std::vector<unsigned char> buffer(
+        sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op));
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+    // The probe is as recent as the plain reads and writes
+    if (syscall(__NR_io_uring_register, ring_, IORING_REGISTER_PROBE, probe,
+                IORING_OP_LAST) != 0) {
+        return false;
+    }
+    for (uint8_t opcode : {IORING_OP_READ, IORING_OP_WRITE,
+                           IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED}) {
+        if (opcode > probe->last_op ||
+            !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool IoUring::registerBuffers(const std::vector<iovec>& buffers) {
+    buffersRegistered_ =
+        syscall(__NR_io_uring_register, ring_, IORING_REGISTER_BUFFERS,
+                buffers.data(), buffers.size()) == 0;
+    return buffersRegistered_;
+}
+
+bool IoUring::buffersRegistered() const { return buffersRegistered_; }
+
+void IoUring::unregisterBuffers() {
+    if (buffersRegistered_) {
+        syscall(__NR_io_uring_register, ring_, IORING_UNREGISTER_BUFFERS,
+                nullptr, 0);
+        buffersRegistered_ = false;
+    }
+}
+
+bool IoUring::prepare(bool write, int fd, const unsigned char* data,
+                      size_t nBytes, off_t offset, unsigned bufferIndex,
+                      uint64_t userData) {
+    unsigned tail = *submissionTail_;
+    if (tail - __atomic_load_n(submissionHead_, __ATOMIC_ACQUIRE) >=
+        entries_) {
+        return false;
+    }
+    unsigned index = tail & *submissionMask_;
+    io_uring_sqe* entry =
+        static_cast<io_uring_sqe*>(submissionEntries_) + index;
+    memset(entry, 0, sizeof(*entry));
+    if (buffersRegistered_) {
+        entry->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        entry->buf_index = bufferIndex;
+    } else {
+        entry->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    entry->fd = fd;
+    entry->addr = reinterpret_cast<uint64_t>(data);
+    entry->len = nBytes;
+    entry->off = offset;
+    entry->user_data = userData;
+    submissionArray_[index] = index;
+    __atomic_store_n(submissionTail_, tail + 1, __ATOMIC_RELEASE);
+    queued_++;
+    return true;
+}
+
+void IoUring::submit(unsigned minCompletions) {
+    while (queued_ > 0 || minCompletions > 0) {
+        int submitted = syscall(__NR_io_uring_enter, ring_, queued_,
+                                minCompletions,
+                                minCompletions ? IORING_ENTER_GETEVENTS : 0,
+                                nullptr, 0);
+        if (submitted == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            const std::string errorMsg =
+                std::string("Unable to submit to io_uring: ") +
+                strerror(errno);
+            throw IoUringException(errorMsg.c_str());
+        }
+        queued_ -= submitted;
+        // Waited, if asked to, once everything was submitted
+        if (queued_ == 0) {
+            return;
+        }
+    }
+}
+
+bool IoUring::nextCompletion(uint64_t& userData, int32_t& result) {
+    unsigned head = *completionHead_;
+    if (head == __atomic_load_n(completionTail_, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    const io_uring_cqe* completion =
+        static_cast<const io_uring_cqe*>(completions_) +
+        (head & *completionMask_);
+    userData = completion->user_data;
+    result = completion->res;
+    __atomic_store_n(completionHead_, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
@@ -0,0 +1,81 @@
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#ifndef URING
+#define URING
+
+class IoUringException : public std::runtime_error {
+   public:
+    IoUringException(const char* message);
+};
+
+// One io_uring submission and completion queue, set up through the raw
+// system calls; the target's libc has no wrappers and liburing isn't part of
+// its image. Only what ImageWriter needs: reads and writes, optionally from
+// registered buffers, and their completions.
+class IoUring {
+   public:
+    // Throws IoUringException if the kernel has no io_uring or forbids it.
+    explicit IoUring(unsigned entries);
+
+    ~IoUring() noexcept;
+
+    IoUring(IoUring& other) = delete;
+
+    IoUring& operator=(IoUring& other) = delete;
+
+    unsigned getEntries() const;
+
+    // Whether the kernel has the reads and writes prepare queues; io_uring
+    // itself came with Linux 5.1, plain reads and writes only with 5.6.
+    bool supportsReadWrite() const;
+
+    // Registers buffers the kernel maps once instead of per request; returns
+    // false if it refuses, e.g. over the locked memory limit.
+    bool registerBuffers(const std::vector<iovec>& buffers);
+
+    bool buffersRegistered() const;
+
+    // Required before other buffers can be registered.
+    void unregisterBuffers();
+
+    // Queues a read into or a write from data, which lies in the registered
+    // buffer bufferIndex if buffers are registered. Returns false if the
+    // submission queue is full.
+    bool prepare(bool write, int fd, const unsigned char* data, size_t nBytes,
+                 off_t offset, unsigned bufferIndex, uint64_t userData);
+
+    // Submits what was queued and waits until at least minCompletions
+    // requests completed. Throws IoUringException if submitting fails.
+    void submit(unsigned minCompletions = 0);
+
+    // Takes the next completion, if there is one; result is what the read or
+    // write returned, or -errno.
+    bool nextCompletion(uint64_t& userData, int32_t& result);
+
+   private:
+    int ring_;
+    unsigned entries_;
+    bool buffersRegistered_;
+    unsigned queued_;
+    void* submissionRing_;
+    size_t submissionRingSize_;
+    void* completionRing_;
+    size_t completionRingSize_;
+    void* submissionEntries_;
+    size_t submissionEntriesSize_;
+    unsigned* submissionHead_;
+    unsigned* submissionTail_;
+    unsigned* submissionMask_;
+    unsigned* submissionArray_;
+    unsigned* completionHead_;
+    unsigned* completionTail_;
+    unsigned* completionMask_;
+    void* completions_;
+
+    void release() noexcept;
+};
+#endif
@@ -3,14 +3,24 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <exception>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <thread>
 #include <vector>
 
+#include "spsc_ring.h"
 #include "writer.h"
 
 BlockdeviceException::BlockdeviceException(const char* message)
@@ -19,6 +29,47 @@ BlockdeviceException::BlockdeviceException(const char* message)
 ImageFileException::ImageFileException(const char* message)
     : std::runtime_error(message) {}
 
+// From linux/fs.h, which clashes with sys/mount.h
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12, 119)
+#endif
+
+// Fill patterns are written in pieces of this size
+static const size_t FILL_BUFFER_SIZE = 1024 * 1024;
+
+// Direct writes are staged in an aligned buffer of this size
+static const size_t DIRECT_BUFFER_SIZE = 1024 * 1024;
+
+// Marks completions of reads in the io_uring engine; writes carry the index of
+// their slot
+static const uint64_t ASYNC_READ = 1ull << 32;
+
+// Most of the device read at once to compare it with a chunk; a chunk may be
+// a whole image
+static const size_t MAX_READ_BACK_SIZE = 1024 * 1024;
+
+// memcmp that only tells equal from different, 64 bytes per step with NEON.
+static bool blocksEqual(const unsigned char* a, const unsigned char* b,
+                        size_t nBytes) {
+    size_t i = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 64 <= nBytes; i += 64) {
+        uint8x16_t diff = veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        diff = vorrq_u8(diff, veorq_u8(vld1q_u8(a + i + 16),
+                                       vld1q_u8(b + i + 16)));
+        diff = vorrq_u8(diff, veorq_u8(vld1q_u8(a + i + 32),
+                                       vld1q_u8(b + i + 32)));
+        diff = vorrq_u8(diff, veorq_u8(vld1q_u8(a + i + 48),
+                                       vld1q_u8(b + i + 48)));
+        uint64x2_t diff64 = vreinterpretq_u64_u8(diff);
+        if ((vgetq_lane_u64(diff64, 0) | vgetq_lane_u64(diff64, 1)) != 0) {
+            return false;
+        }
+    }
+#endif
+    return memcmp(a + i, b + i, nBytes - i) == 0;
+}
+
 ImageWriter::~ImageWriter() noexcept {
     try {
         closeBlockDevice();
@@ -28,7 +79,18 @@ ImageWriter::~ImageWriter() noexcept {
 }
 
 ImageWriter::ImageWriter(const std::string& devicePath)
-    : devicePath_{devicePath}, blockDevice_{-1}, blockDevSize_{0} {
+    : devicePath_{devicePath},
+      blockDevice_{-1},
+      blockDevSize_{0},
+      skipUnchanged_{false},
+      statistics_{},
+      directIO_{false},
+      directDevice_{-1},
+      logicalBlockSize_{0},
+      directBuffer_{nullptr, &free},
+      engine_{WriteEngine::Synchronous},
+      queueDepth_{0},
+      asyncWrite_{nullptr} {
     try {
         openBlockDevice();
         this->blockDevSize_ = obtainBlockDeviceSize();
@@ -39,13 +101,39 @@ ImageWriter::ImageWriter(const std::string& devicePath)
 }
 
 ImageWriter::ImageWriter()
-    : devicePath_{}, blockDevice_{-1}, blockDevSize_{0} {}
+    : devicePath_{},
+      blockDevice_{-1},
+      blockDevSize_{0},
+      skipUnchanged_{false},
+      statistics_{},
+      directIO_{false},
+      directDevice_{-1},
+      logicalBlockSize_{0},
+      directBuffer_{nullptr, &free},
+      engine_{WriteEngine::Synchronous},
+      queueDepth_{0},
+      asyncWrite_{nullptr} {}
 
 ImageWriter::ImageWriter(ImageWriter&& other) noexcept
     : devicePath_{std::move(other.devicePath_)},
       blockDevice_{std::move(other.blockDevice_)},
-      blockDevSize_{std::move(other.blockDevSize_)} {
+      blockDevSize_{std::move(other.blockDevSize_)},
+      blockIndexPath_{std::move(other.blockIndexPath_)},
+      blockIndex_{std::move(other.blockIndex_)},
+      previousIndex_{std::move(other.previousIndex_)},
+      skipUnchanged_{other.skipUnchanged_},
+      statistics_{other.statistics_},
+      blockMap_{std::move(other.blockMap_)},
+      directIO_{other.directIO_},
+      directDevice_{other.directDevice_},
+      logicalBlockSize_{other.logicalBlockSize_},
+      directBuffer_{std::move(other.directBuffer_)},
+      engine_{other.engine_},
+      queueDepth_{other.queueDepth_},
+      ring_{std::move(other.ring_)},
+      asyncWrite_{nullptr} {
     other.blockDevice_ = -1;
+    other.directDevice_ = -1;
 }
 
 ImageWriter& ImageWriter::operator=(ImageWriter&& other) noexcept {
@@ -54,10 +142,25 @@ ImageWriter& ImageWriter::operator=(ImageWriter&& other) noexcept {
     } catch (BlockdeviceException& e) {
         std::cout << e.what() << std::endl;
     }
+    closeDirectDevice();
     this->devicePath_ = std::move(other.devicePath_);
     this->blockDevice_ = std::move(other.blockDevice_);
     this->blockDevSize_ = std::move(other.blockDevSize_);
+    this->blockIndexPath_ = std::move(other.blockIndexPath_);
+    this->blockIndex_ = std::move(other.blockIndex_);
+    this->previousIndex_ = std::move(other.previousIndex_);
+    this->skipUnchanged_ = other.skipUnchanged_;
+    this->statistics_ = other.statistics_;
+    this->blockMap_ = std::move(other.blockMap_);
+    this->directIO_ = other.directIO_;
+    this->directDevice_ = other.directDevice_;
+    this->logicalBlockSize_ = other.logicalBlockSize_;
+    this->directBuffer_ = std::move(other.directBuffer_);
+    this->engine_ = other.engine_;
+    this->queueDepth_ = other.queueDepth_;
+    this->ring_ = std::move(other.ring_);
     other.blockDevSize_ = -1;
+    other.directDevice_ = -1;
     return *this;
 }
 
@@ -85,6 +188,9 @@ void ImageWriter::openBlockDevice(const std::string& devicePath) {
     } catch (BlockdeviceException& e) {
         std::cout << "Could not close old blockdevice handle." << std::endl;
     }
+    dropBlockIndex();
+    statistics_ = {};
+    openDirectDevice();
 }
 
 ssize_t ImageWriter::writeImageFile(const std::string& imagePath,
@@ -92,6 +198,12 @@ ssize_t ImageWriter::writeImageFile(const std::string& imagePath,
     if (!blockDeviceIsOpen()) {
         return 0;
     }
+    if (ring_) {
+        return writeImageFileAsync(imagePath, bufferSize);
+    }
+    if (engine_ == WriteEngine::Threaded) {
+        return writeImageFileThreaded(imagePath, bufferSize);
+    }
     std::ifstream imageStream = obtainImageStream(imagePath);
     std::vector<char> buffer(bufferSize, 0);
     imageStream.seekg(0, std::ios::beg);
@@ -100,23 +212,872 @@ ssize_t ImageWriter::writeImageFile(const std::string& imagePath,
             "Aborting write, reason: Unable to seekg to beginning of image "
             "file.");
     }
-    if (lseek(blockDevice_, 0, SEEK_SET) == -1) {
-        throw BlockdeviceException(
-            "aborting write, reason: Unable to lseek to beginning of "
-            "blockdevice file");
+    if (!blockMap_.empty()) {
+        return writeMappedImageFile(imageStream, buffer);
     }
     ssize_t written = 0;
-    while (!imageStream.eof()) {
-        imageStream.read(&buffer.front(), bufferSize);
+    // A short read at the end sets eof and fail; a failed read doesn't reach
+    // eof at all
+    while (imageStream.read(&buffer.front(), bufferSize) ||
+           imageStream.gcount() > 0) {
+        written += writeChunk(
+            reinterpret_cast<const unsigned char*>(&buffer.front()),
+            imageStream.gcount(), written);
+    }
+    if (!imageStream.eof()) {
+        throw ImageFileException(
+            "Aborting write, reason: Unable to read image file.");
+    }
+    return written;
+}
+
+ssize_t ImageWriter::writeMappedImageFile(std::ifstream& imageStream,
+                                          std::vector<char>& buffer) const {
+    imageStream.seekg(0, std::ios::end);
+    uint64_t imageLength = imageStream.tellg();
+    if (imageLength > getBlockDeviceSize()) {
+        throw BlockdeviceException(
+            "Aborting write, reason: Image exceeds blockdevice size.");
+    }
+    uint64_t position = 0;
+    for (const ImageExtent& extent : blockMap_) {
+        if (extent.offset >= imageLength) {
+            break;
+        }
+        if (extent.offset > position) {
+            discardRange(extent.offset - position, position);
+        }
+        position = extent.offset;
+        uint64_t end = std::min(imageLength, extent.offset + extent.length);
+        imageStream.seekg(position, std::ios::beg);
+        while (position < end) {
+            size_t n = std::min<uint64_t>(buffer.size(), end - position);
+            if (!imageStream.read(&buffer.front(), n)) {
+                throw ImageFileException(
+                    "Aborting write, reason: Unable to read image file.");
+            }
+            position += writeChunk(
+                reinterpret_cast<const unsigned char*>(&buffer.front()), n,
+                position);
+        }
+    }
+    if (position < imageLength) {
+        discardRange(imageLength - position, position);
+    }
+    return imageLength;
+}
+
+// The io_uring engine of writeImageFile. The image is read into a ring of
+// registered buffers ahead of time, and each buffer is handed to writeChunk in
+// order once read, so indexing, skipping unchanged blocks and the block map
+// work as with synchronous writes; only the writes are queued instead of
+// waited for. A buffer is read into again once all of its writes completed.
+// A failed read or write stops the image there: what is in flight is waited
+// for, the block index of the image is dropped, and writeImageFile throws.
+class ImageWriter::AsyncImageWrite {
+   public:
+    AsyncImageWrite(const ImageWriter& writer, IoUring& ring, int image,
+                    size_t bufferSize, unsigned queueDepth);
+
+    // Waits for what is in flight, so no buffer is freed under the kernel.
+    ~AsyncImageWrite() noexcept;
+
+    AsyncImageWrite(AsyncImageWrite& other) = delete;
+
+    AsyncImageWrite& operator=(AsyncImageWrite& other) = delete;
+
+    // Reads these ranges of the image, each at most a buffer, and writes
+    // them; what lies between them is discarded.
+    void run(const std::vector<ImageExtent>& reads, uint64_t imageLength);
+
+    // Queues a write of data, which lies in the buffer handed to writeChunk.
+    void write(const unsigned char* data, size_t nBytes, off_t offset);
+
+   private:
+    struct Buffer {
+        std::unique_ptr<unsigned char, decltype(&free)> data;
+        off_t offset;
+        size_t length;
+        size_t read;
+        bool reading;
+        unsigned writes;
+    };
+
+    struct Write {
+        const unsigned char* data;
+        size_t nBytes;
+        off_t offset;
+        int device;
+        unsigned buffer;
+    };
+
+    const ImageWriter& writer_;
+    IoUring& ring_;
+    int image_;
+    std::vector<Buffer> buffers_;
+    // Indexed by the user data of their requests
+    std::vector<Write> writes_;
+    std::vector<size_t> freeWrites_;
+    unsigned inFlight_;
+    unsigned current_;
+    int readError_;
+    int writeError_;
+    // The device refused a direct write; the direct descriptor is only
+    // closed once no write queued on it is in flight any more
+    bool directRefused_;
+
+    void queue(bool write, int fd, const unsigned char* data, size_t nBytes,
+               off_t offset, unsigned buffer, uint64_t userData);
+
+    void complete(unsigned minCompletions);
+
+    void drain();
+};
+
+ImageWriter::AsyncImageWrite::AsyncImageWrite(const ImageWriter& writer,
+                                              IoUring& ring, int image,
+                                              size_t bufferSize,
+                                              unsigned queueDepth)
+    : writer_{writer},
+      ring_{ring},
+      image_{image},
+      writes_(ring.getEntries()),
+      inFlight_{0},
+      current_{0},
+      readError_{0},
+      writeError_{0},
+      directRefused_{false} {
+    std::vector<iovec> registered;
+    size_t alignment = sysconf(_SC_PAGESIZE);
+    for (unsigned i = 0; i < queueDepth; i++) {
+        void* data = nullptr;
+        if (posix_memalign(&data, alignment, bufferSize) != 0) {
+            throw ImageFileException("Unable to allocate image buffers.");
+        }
+        buffers_.push_back(
+            Buffer{{(unsigned char*)data, &free}, 0, 0, 0, false, 0});
+        registered.push_back(iovec{data, bufferSize});
+    }
+    for (size_t i = 0; i < writes_.size(); i++) {
+        freeWrites_.push_back(i);
+    }
+    // Unregistered buffers only cost a mapping per request
+    ring_.registerBuffers(registered);
+}
+
+ImageWriter::AsyncImageWrite::~AsyncImageWrite() noexcept {
+    try {
+        drain();
+        ring_.unregisterBuffers();
+    } catch (std::runtime_error& e) {
+        // The kernel may still use them
+        for (Buffer& buffer : buffers_) {
+            buffer.data.release();
+        }
+        std::cout << e.what() << std::endl;
+    }
+}
+
+void ImageWriter::AsyncImageWrite::run(const std::vector<ImageExtent>& reads,
+                                       uint64_t imageLength) {
+    uint64_t position = 0;
+    size_t nextRead = 0;
+    size_t next = 0;
+    while (next < reads.size() && readError_ == 0 && writeError_ == 0) {
+        // Buffers whose writes completed are read into ahead
+        while (nextRead < reads.size() && nextRead < next + buffers_.size()) {
+            unsigned index = nextRead % buffers_.size();
+            Buffer& buffer = buffers_[index];
+            if (buffer.writes > 0) {
+                break;
+            }
+            buffer.offset = reads[nextRead].offset;
+            buffer.length = reads[nextRead].length;
+            buffer.read = 0;
+            buffer.reading = true;
+            queue(false, image_, buffer.data.get(), buffer.length,
+                  buffer.offset, index, ASYNC_READ | index);
+            nextRead++;
+        }
+        current_ = next % buffers_.size();
+        Buffer& buffer = buffers_[current_];
+        if (next >= nextRead || buffer.reading) {
+            complete(1);
+            continue;
+        }
+        if ((uint64_t)buffer.offset > position) {
+            writer_.discardRange(buffer.offset - position, position);
+        }
+        writer_.asyncWrite_ = this;
         try {
-            written += writeBuffer(buffer, imageStream.gcount());
-        } catch (BlockdeviceException& e) {
-            std::string errorMsg =
-                std::string("Aborting write, reason: ") + e.what();
+            writer_.writeChunk(buffer.data.get(), buffer.length,
+                               buffer.offset);
+        } catch (...) {
+            writer_.asyncWrite_ = nullptr;
+            throw;
+        }
+        writer_.asyncWrite_ = nullptr;
+        position = buffer.offset + buffer.length;
+        next++;
+        ring_.submit();
+    }
+    drain();
+    if (readError_ != 0) {
+        const std::string errorMsg =
+            std::string("Aborting write, reason: Unable to read image file: ") +
+            strerror(readError_);
+        throw ImageFileException(errorMsg.c_str());
+    }
+    if (writeError_ != 0) {
+        const std::string errorMsg =
+            std::string("Aborting write, reason: Unable to write chunk to "
+                        "device: ") +
+            strerror(writeError_);
+        throw BlockdeviceException(errorMsg.c_str());
+    }
+    if (position < imageLength) {
+        writer_.discardRange(imageLength - position, position);
+    }
+}
+
+void ImageWriter::AsyncImageWrite::write(const unsigned char* data,
+                                         size_t nBytes, off_t offset) {
+    if (nBytes == 0 || writeError_ != 0) {
+        return;
+    }
+    int device = writer_.blockDevice_;
+    if (writer_.directDevice_ != -1 && !directRefused_) {
+        size_t blockSize = writer_.logicalBlockSize_;
+        if (offset % blockSize != 0 || nBytes % blockSize != 0 ||
+            (uintptr_t)data % blockSize != 0) {
+            // Merged with the partial blocks around it synchronously, after
+            // the writes in flight
+            drain();
+            writer_.writeRangeSync(data, nBytes, offset);
+            return;
+        }
+        device = writer_.directDevice_;
+    }
+    while (freeWrites_.empty()) {
+        complete(1);
+    }
+    size_t slot = freeWrites_.back();
+    freeWrites_.pop_back();
+    writes_[slot] = Write{data, nBytes, offset, device, current_};
+    buffers_[current_].writes++;
+    queue(true, device, data, nBytes, offset, current_, slot);
+}
+
+void ImageWriter::AsyncImageWrite::queue(bool write, int fd,
+                                         const unsigned char* data,
+                                         size_t nBytes, off_t offset,
+                                         unsigned buffer, uint64_t userData) {
+    while (inFlight_ >= ring_.getEntries()) {
+        complete(1);
+    }
+    if (!ring_.prepare(write, fd, data, nBytes, offset, buffer, userData)) {
+        ring_.submit();
+        ring_.prepare(write, fd, data, nBytes, offset, buffer, userData);
+    }
+    inFlight_++;
+}
+
+void ImageWriter::AsyncImageWrite::complete(unsigned minCompletions) {
+    ring_.submit(minCompletions);
+    uint64_t userData;
+    int32_t result;
+    while (ring_.nextCompletion(userData, result)) {
+        inFlight_--;
+        if (userData & ASYNC_READ) {
+            Buffer& buffer = buffers_[userData & ~ASYNC_READ];
+            if (result <= 0) {
+                readError_ = result < 0 ? -result : EIO;
+                buffer.reading = false;
+                continue;
+            }
+            buffer.read += result;
+            if (buffer.read < buffer.length) {
+                queue(false, image_, buffer.data.get() + buffer.read,
+                      buffer.length - buffer.read, buffer.offset + buffer.read,
+                      userData & ~ASYNC_READ, userData);
+            } else {
+                buffer.reading = false;
+            }
+            continue;
+        }
+
+        Write& write = writes_[userData];
+        if (result == -EINVAL && write.device == writer_.directDevice_) {
+            if (!directRefused_) {
+                std::cout << "Device refuses direct writes, writing through "
+                             "the page cache."
+                          << std::endl;
+                directRefused_ = true;
+            }
+            write.device = writer_.blockDevice_;
+            result = 0;
+        } else if (result < 0) {
+            if (writeError_ == 0) {
+                writeError_ = -result;
+            }
+            result = write.nBytes;
+        }
+        if ((size_t)result < write.nBytes) {
+            write.data += result;
+            write.nBytes -= result;
+            write.offset += result;
+            queue(true, write.device, write.data, write.nBytes, write.offset,
+                  write.buffer, userData);
+            continue;
+        }
+        buffers_[write.buffer].writes--;
+        freeWrites_.push_back(userData);
+    }
+    if (directRefused_ && inFlight_ == 0 && writer_.directDevice_ != -1) {
+        writer_.closeDirectDevice();
+    }
+}
+
+void ImageWriter::AsyncImageWrite::drain() {
+    while (inFlight_ > 0) {
+        complete(1);
+    }
+}
+
+// Opens the image file for the io_uring and threaded engines, which read it
+// with pread.
+int ImageWriter::openImageFile(const std::string& imagePath,
+                               uint64_t& imageLength) const {
+    int image = open(imagePath.c_str(), O_RDONLY);
+    struct stat status {};
+    if (image == -1 || fstat(image, &status) == -1) {
+        if (image != -1) {
+            close(image);
+        }
+        throw ImageFileException("Unable to open image file.");
+    }
+    imageLength = status.st_size;
+    if (imageLength > getBlockDeviceSize()) {
+        close(image);
+        throw BlockdeviceException(
+            "Aborting write, reason: Image exceeds blockdevice size.");
+    }
+    return image;
+}
+
+// The ranges of the image file to read, each at most bufferSize; with a block
+// map only its extents.
+std::vector<ImageExtent> ImageWriter::splitImageReads(
+    uint64_t imageLength, size_t bufferSize) const {
+    std::vector<ImageExtent> extents = blockMap_;
+    if (extents.empty()) {
+        extents.push_back({0, imageLength});
+    }
+    std::vector<ImageExtent> reads;
+    for (const ImageExtent& extent : extents) {
+        uint64_t end = std::min(imageLength, extent.offset + extent.length);
+        for (uint64_t offset = extent.offset; offset < end;
+             offset += bufferSize) {
+            reads.push_back(
+                {offset, std::min<uint64_t>(bufferSize, end - offset)});
+        }
+    }
+    return reads;
+}
+
+ssize_t ImageWriter::writeImageFileAsync(const std::string& imagePath,
+                                         size_t bufferSize) const {
+    uint64_t imageLength = 0;
+    int image = openImageFile(imagePath, imageLength);
+    std::vector<ImageExtent> reads = splitImageReads(imageLength, bufferSize);
+    try {
+        AsyncImageWrite write(*this, *ring_, image, bufferSize, queueDepth_);
+        write.run(reads, imageLength);
+    } catch (std::runtime_error& e) {
+        close(image);
+        dropBlockIndex();
+        throw;
+    }
+    close(image);
+    return imageLength;
+}
+
+// Waits for the other side of an SpscRing: briefly by yielding, as a buffer
+// usually turns up within a read or write, then by sleeping, so a reader
+// ahead of a slow device doesn't burn a core.
+static void backOff(unsigned& attempts) {
+    if (attempts++ < 100) {
+        std::this_thread::yield();
+    } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+}
+
+// The threaded engine of writeImageFile: a reader thread fills a fixed set of
+// buffers with pread and passes them on through one SpscRing, this thread
+// hands them to writeChunk and passes them back through another. Reading the
+// next buffers thus overlaps writing the current one, and nothing is
+// allocated per buffer.
+ssize_t ImageWriter::writeImageFileThreaded(const std::string& imagePath,
+                                            size_t bufferSize) const {
+    uint64_t imageLength = 0;
+    int image = openImageFile(imagePath, imageLength);
+    std::vector<ImageExtent> reads = splitImageReads(imageLength, bufferSize);
+
+    // Which buffer holds which read, or why it doesn't
+    struct FilledBuffer {
+        unsigned buffer;
+        int error;
+    };
+    const unsigned bufferCount = std::max(2u, queueDepth_);
+    std::vector<std::vector<unsigned char>> buffers(
+        bufferCount, std::vector<unsigned char>(bufferSize));
+    SpscRing<unsigned> emptyBuffers(bufferCount);
+    SpscRing<FilledBuffer> filledBuffers(bufferCount);
+    for (unsigned i = 0; i < bufferCount; i++) {
+        emptyBuffers.tryPush(i);
+    }
+    std::atomic<bool> stop{false};
+
+    std::thread reader([&] {
+        for (const ImageExtent& read : reads) {
+            unsigned buffer = 0;
+            for (unsigned attempts = 0; !emptyBuffers.tryPop(buffer);) {
+                if (stop.load(std::memory_order_relaxed)) {
+                    return;
+                }
+                backOff(attempts);
+            }
+            int error = 0;
+            size_t done = 0;
+            while (done < read.length) {
+                ssize_t n = pread(image, buffers[buffer].data() + done,
+                                  read.length - done, read.offset + done);
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    error = n == -1 ? errno : EIO;
+                    break;
+                }
+                done += n;
+            }
+            // Always room, there are no more buffers than slots
+            filledBuffers.tryPush({buffer, error});
+            if (error != 0) {
+                return;
+            }
+        }
+    });
+
+    uint64_t position = 0;
+    try {
+        for (const ImageExtent& read : reads) {
+            FilledBuffer filled{};
+            for (unsigned attempts = 0; !filledBuffers.tryPop(filled);) {
+                backOff(attempts);
+            }
+            if (filled.error != 0) {
+                const std::string errorMsg =
+                    std::string(
+                        "Aborting write, reason: Unable to read image file: ") +
+                    strerror(filled.error);
+                throw ImageFileException(errorMsg.c_str());
+            }
+            if (read.offset > position) {
+                discardRange(read.offset - position, position);
+            }
+            writeChunk(buffers[filled.buffer].data(), read.length,
+                       read.offset);
+            position = read.offset + read.length;
+            emptyBuffers.tryPush(filled.buffer);
+        }
+        if (position < imageLength) {
+            discardRange(imageLength - position, position);
+        }
+    } catch (std::runtime_error& e) {
+        stop.store(true, std::memory_order_relaxed);
+        reader.join();
+        close(image);
+        dropBlockIndex();
+        throw;
+    }
+    reader.join();
+    close(image);
+    return imageLength;
+}
+
+// Writes a chunk of an image that arrives as a stream instead of a file,
+// e.g. while it is still being downloaded.
+size_t ImageWriter::writeChunk(const unsigned char* data, size_t nBytes,
+                               off_t offset) const {
+    if (!blockDeviceIsOpen()) {
+        return 0;
+    }
+    if (offset < 0 || (unsigned long)offset + nBytes > getBlockDeviceSize()) {
+        throw BlockdeviceException(
+            "Aborting write, reason: Image exceeds blockdevice size.");
+    }
+    if (blockMap_.empty()) {
+        writeMappedChunk(data, nBytes, offset);
+        return nBytes;
+    }
+
+    // The first extent that doesn't end before the chunk
+    auto extent = std::upper_bound(
+        blockMap_.begin(), blockMap_.end(), (uint64_t)offset,
+        [](uint64_t position, const ImageExtent& extent) {
+            return position < extent.offset + extent.length;
+        });
+    size_t done = 0;
+    while (done < nBytes) {
+        uint64_t position = offset + done;
+        if (extent == blockMap_.end() || position < extent->offset) {
+            size_t length = extent == blockMap_.end()
+                                ? nBytes - done
+                                : std::min<uint64_t>(nBytes - done,
+                                                     extent->offset - position);
+            discardRange(length, position);
+            done += length;
+            continue;
+        }
+        size_t length = std::min<uint64_t>(
+            nBytes - done, extent->offset + extent->length - position);
+        writeMappedChunk(data + done, length, position);
+        done += length;
+        extent++;
+    }
+    return nBytes;
+}
+
+// The part of writeChunk for ranges the block map, if any, holds.
+void ImageWriter::writeMappedChunk(const unsigned char* data, size_t nBytes,
+                                   off_t offset) const {
+    // Hashed first, so the hashes of the new blocks are there to compare
+    indexWritten(data, nBytes, offset);
+    if (!skipUnchanged_) {
+        writeRange(data, nBytes, offset);
+        return;
+    }
+
+    // Blocks that differ are written in runs, so a chunk that differs
+    // throughout costs as few writes as without comparing
+    size_t runStart = 0;
+    size_t readStart = 0;
+    size_t readEnd = 0;
+    size_t done = 0;
+    while (done < nBytes) {
+        off_t position = offset + done;
+        size_t length = std::min<size_t>(
+            nBytes - done,
+            BLOCK_INDEX_BLOCK_SIZE - position % BLOCK_INDEX_BLOCK_SIZE);
+        int same = compareWithPreviousIndex(length, position);
+        if (same == -1) {
+            // Blocks the indexes can't tell about are read in runs as well
+            if (done >= readEnd) {
+                readStart = done;
+                readEnd = done + length;
+                while (readEnd < nBytes &&
+                       readEnd - readStart < MAX_READ_BACK_SIZE) {
+                    size_t next = std::min<size_t>(
+                        nBytes - readEnd,
+                        BLOCK_INDEX_BLOCK_SIZE -
+                            (offset + readEnd) % BLOCK_INDEX_BLOCK_SIZE);
+                    if (compareWithPreviousIndex(next, offset + readEnd) !=
+                        -1) {
+                        break;
+                    }
+                    readEnd += next;
+                }
+                readRange(readEnd - readStart, offset + readStart);
+            }
+            same = blocksEqual(data + done,
+                               readBuffer_.data() + (done - readStart), length);
+        }
+        if (same == 1) {
+            writeRange(data + runStart, done - runStart, offset + runStart);
+            runStart = done + length;
+            statistics_.bytesSkipped += length;
+        }
+        done += length;
+    }
+    writeRange(data + runStart, nBytes - runStart, offset + runStart);
+}
+
+uint64_t ImageWriter::fillRange(uint32_t pattern, uint64_t nBytes,
+                                off_t offset) const {
+    if (!blockDeviceIsOpen()) {
+        return 0;
+    }
+    if (offset < 0 || (unsigned long)offset + nBytes > getBlockDeviceSize()) {
+        throw BlockdeviceException(
+            "Aborting write, reason: Image exceeds blockdevice size.");
+    }
+    // A multiple of 4, so the pattern continues across pieces
+    std::vector<unsigned char> fill(
+        std::min<uint64_t>(FILL_BUFFER_SIZE, (nBytes + 3) / 4 * 4));
+    for (size_t i = 0; i < fill.size(); i++) {
+        fill[i] = (unsigned char)(pattern >> (8 * (i % 4)));
+    }
+    uint64_t done = 0;
+    while (done < nBytes) {
+        size_t n = std::min<uint64_t>(fill.size(), nBytes - done);
+        done += writeChunk(fill.data(), n, offset + done);
+    }
+    return nBytes;
+}
+
+uint64_t ImageWriter::discardRange(uint64_t nBytes, off_t offset) const {
+    if (!blockDeviceIsOpen()) {
+        return 0;
+    }
+    if (offset < 0 || (unsigned long)offset + nBytes > getBlockDeviceSize()) {
+        throw BlockdeviceException(
+            "Aborting write, reason: Image exceeds blockdevice size.");
+    }
+    dropBlockIndex();
+    statistics_.bytesDiscarded += nBytes;
+
+    // Only whole blocks can be discarded; a device or kernel without discard
+    // support leaves the range as it is, which is just as fine
+    uint64_t range[2];
+    range[0] = (offset + BLOCK_INDEX_BLOCK_SIZE - 1) / BLOCK_INDEX_BLOCK_SIZE *
+               BLOCK_INDEX_BLOCK_SIZE;
+    uint64_t end =
+        (offset + nBytes) / BLOCK_INDEX_BLOCK_SIZE * BLOCK_INDEX_BLOCK_SIZE;
+    if (end > range[0]) {
+        range[1] = end - range[0];
+        ioctl(blockDevice_, BLKDISCARD, &range);
+    }
+    return nBytes;
+}
+
+void ImageWriter::writeRange(const unsigned char* data, size_t nBytes,
+                             off_t offset) const {
+    if (asyncWrite_) {
+        asyncWrite_->write(data, nBytes, offset);
+    } else {
+        writeRangeSync(data, nBytes, offset);
+    }
+    statistics_.bytesWritten += nBytes;
+}
+
+void ImageWriter::writeRangeSync(const unsigned char* data, size_t nBytes,
+                                 off_t offset) const {
+    if (directDevice_ != -1) {
+        if (writeRangeDirect(data, nBytes, offset)) {
+            return;
+        }
+        // Written once more as a whole; parts may already be
+        std::cout << "Device refuses direct writes, writing through the page "
+                     "cache."
+                  << std::endl;
+        closeDirectDevice();
+    }
+    size_t written = 0;
+    while (written < nBytes) {
+        ssize_t n = pwrite(blockDevice_, data + written, nBytes - written,
+                           offset + written);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            const std::string errorMsg =
+                std::string("Aborting write, reason: Unable to write chunk to "
+                            "device: ") +
+                strerror(errno);
             throw BlockdeviceException(errorMsg.c_str());
         }
+        written += n;
     }
-    return written;
+}
+
+void ImageWriter::readRange(size_t nBytes, off_t offset) const {
+    readBuffer_.resize(nBytes);
+    // The page cache doesn't see what direct writes changed, and reading
+    // through it would fill it with the partition all the same
+    if (directDevice_ != -1 && readRangeDirect(nBytes, offset)) {
+        statistics_.bytesRead += nBytes;
+        return;
+    }
+    size_t read = 0;
+    while (read < nBytes) {
+        ssize_t n =
+            pread(blockDevice_, readBuffer_.data() + read, nBytes - read,
+                  offset + read);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            const std::string errorMsg =
+                std::string("Aborting write, reason: Unable to read back "
+                            "device: ") +
+                (n == -1 ? strerror(errno) : "unexpected end");
+            throw BlockdeviceException(errorMsg.c_str());
+        }
+        read += n;
+    }
+    statistics_.bytesRead += nBytes;
+}
+
+// Reads through the aligned buffer in whole logical blocks; false if the
+// device refuses direct reads.
+bool ImageWriter::readRangeDirect(size_t nBytes, off_t offset) const {
+    unsigned char* buffer = directBuffer_.get();
+    size_t done = 0;
+    while (done < nBytes) {
+        off_t position = offset + done;
+        off_t start = position / logicalBlockSize_ * logicalBlockSize_;
+        size_t head = position - start;
+        size_t n = std::min(nBytes - done, DIRECT_BUFFER_SIZE - head);
+        size_t length = (head + n + logicalBlockSize_ - 1) /
+                        logicalBlockSize_ * logicalBlockSize_;
+        if (!transferDirect(false, buffer, length, start)) {
+            return false;
+        }
+        memcpy(readBuffer_.data() + done, buffer + head, n);
+        done += n;
+    }
+    return true;
+}
+
+// Writes through the aligned buffer in whole logical blocks; false if the
+// device turned out not to take direct I/O after all.
+bool ImageWriter::writeRangeDirect(const unsigned char* data, size_t nBytes,
+                                   off_t offset) const {
+    unsigned char* buffer = directBuffer_.get();
+    size_t done = 0;
+    while (done < nBytes) {
+        off_t position = offset + done;
+        off_t start = position / logicalBlockSize_ * logicalBlockSize_;
+        size_t head = position - start;
+        size_t n = std::min(nBytes - done, DIRECT_BUFFER_SIZE - head);
+        size_t length = (head + n + logicalBlockSize_ - 1) /
+                        logicalBlockSize_ * logicalBlockSize_;
+        size_t lastBlock = length - logicalBlockSize_;
+        if (head != 0 &&
+            !transferDirect(false, buffer, logicalBlockSize_, start)) {
+            return false;
+        }
+        if ((head + n) % logicalBlockSize_ != 0 &&
+            (head == 0 || lastBlock != 0) &&
+            !transferDirect(false, buffer + lastBlock, logicalBlockSize_,
+                            start + lastBlock)) {
+            return false;
+        }
+        memcpy(buffer + head, data + done, n);
+        if (!transferDirect(true, buffer, length, start)) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// pread or pwrite on the direct descriptor; false if it refuses the request.
+bool ImageWriter::transferDirect(bool write, unsigned char* buffer,
+                                 size_t nBytes, off_t offset) const {
+    size_t done = 0;
+    while (done < nBytes) {
+        ssize_t n = write ? pwrite(directDevice_, buffer + done,
+                                   nBytes - done, offset + done)
+                          : pread(directDevice_, buffer + done, nBytes - done,
+                                  offset + done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && errno == EINVAL) {
+            return false;
+        }
+        if (n <= 0) {
+            const std::string errorMsg =
+                std::string("Aborting write, reason: Unable to ") +
+                (write ? "write chunk to" : "read back") + " device: " +
+                (n == -1 ? strerror(errno) : "unexpected end");
+            throw BlockdeviceException(errorMsg.c_str());
+        }
+        done += n;
+    }
+    return true;
+}
+
+// 1 if the part of a block at offset is the same as in the previous image, 0
+// if not, -1 if the indexes can't tell; they can once the whole block has been
+// hashed.
+int ImageWriter::compareWithPreviousIndex(size_t nBytes, off_t offset) const {
+    if (!previousIndex_ || !blockIndex_ || nBytes == 0) {
+        return -1;
+    }
+    size_t block = offset / BLOCK_INDEX_BLOCK_SIZE;
+    // A short last block of the previous image is followed by unknown bytes
+    if (block >= blockIndex_->getBlockCount() ||
+        block >= previousIndex_->getImageLength() / BLOCK_INDEX_BLOCK_SIZE) {
+        return -1;
+    }
+    return blockIndex_->getBlockHash(block) ==
+           previousIndex_->getBlockHash(block);
+}
+
+
+void ImageWriter::syncBlockDevice() const {
+    if (!blockDeviceIsOpen()) {
+        return;
+    }
+    if (fsync(blockDevice_) == -1) {
+        const std::string errorMsg =
+            std::string("Unable to sync device: ") + strerror(errno);
+        throw BlockdeviceException(errorMsg.c_str());
+    }
+    if (!blockIndex_) {
+        return;
+    }
+    // The install doesn't depend on the index; without one the partition is
+    // hashed when needed
+    try {
+        blockIndex_->store(blockIndexPath_, blockDevice_);
+    } catch (BlockIndexException& e) {
+        std::cout << e.what() << std::endl;
+    }
+    dropBlockIndex();
+}
+
+void ImageWriter::buildBlockIndex(const std::string& indexPath) {
+    // Stays mapped for skipping unchanged blocks once the file is gone
+    previousIndex_.reset();
+    try {
+        auto previousIndex = std::make_unique<BlockIndex>(indexPath);
+        if (blockDeviceIsOpen() &&
+            previousIndex->getBlockSize() == BLOCK_INDEX_BLOCK_SIZE &&
+            previousIndex->isValidFor(blockDevice_)) {
+            previousIndex_ = std::move(previousIndex);
+        }
+    } catch (BlockIndexException& e) {
+        // No usable index of the device's content, blocks are read instead
+    }
+    if (unlink(indexPath.c_str()) == -1 && errno != ENOENT) {
+        const std::string errorMsg = "Unable to remove block index " +
+                                     indexPath + ": " + strerror(errno);
+        throw BlockIndexException(errorMsg.c_str());
+    }
+    blockIndexPath_ = indexPath;
+    blockIndex_ = std::make_unique<BlockIndexBuilder>();
+}
+
+void ImageWriter::dropBlockIndex() const {
+    blockIndex_.reset();
+    previousIndex_.reset();
+}
+
+void ImageWriter::indexWritten(const unsigned char* data, size_t nBytes,
+                               off_t offset) const {
+    if (!blockIndex_) {
+        return;
+    }
+    if ((uint64_t)offset != blockIndex_->getImageLength()) {
+        dropBlockIndex();
+        return;
+    }
+    blockIndex_->update(data, nBytes);
 }
 
 void ImageWriter::openBlockDevice() {
@@ -173,6 +1134,8 @@ void ImageWriter::closeBlockDevice() {
     blockDevice_ = -1;
     blockDevSize_ = 0;
     devicePath_ = "";
+    dropBlockIndex();
+    closeDirectDevice();
 }
 
 unsigned long ImageWriter::obtainBlockDeviceSize() const {
@@ -188,18 +1151,92 @@ unsigned long ImageWriter::obtainBlockDeviceSize() const {
     return blockDevSize;
 }
 
-size_t ImageWriter::writeBuffer(const std::vector<char>& buffer,
-                                size_t nBytes) const {
-    if (!blockDeviceIsOpen()) {
-        return 0;
+void ImageWriter::setSkipUnchanged(bool skipUnchanged) {
+    skipUnchanged_ = skipUnchanged;
+}
+
+WriteStatistics ImageWriter::getWriteStatistics() const { return statistics_; }
+
+bool ImageWriter::setDirectIO(bool directIO) {
+    directIO_ = directIO;
+    return openDirectDevice();
+}
+
+// The device is opened a second time for direct writes; the first descriptor
+// keeps the exclusive claim and serves everything else.
+bool ImageWriter::openDirectDevice() {
+    closeDirectDevice();
+    if (!directIO_ || !blockDeviceIsOpen()) {
+        return false;
     }
-    ssize_t written = write(blockDevice_, &buffer.front(), nBytes);
-    if (written == -1) {
-        const std::string errorMsg =
-            std::string("Unable to write buffer to device: ") + strerror(errno);
-        throw BlockdeviceException(errorMsg.c_str());
+    int logicalBlockSize = 0;
+    if (ioctl(blockDevice_, BLKSSZGET, &logicalBlockSize) == -1 ||
+        logicalBlockSize <= 0 ||
+        DIRECT_BUFFER_SIZE % (size_t)logicalBlockSize != 0) {
+        std::cout << "Unable to get the logical block size, writing through "
+                     "the page cache."
+                  << std::endl;
+        return false;
     }
-    return written;
+    // Aligned to pages as well, which some controllers' DMA needs
+    void* buffer = nullptr;
+    size_t alignment = std::max<size_t>(logicalBlockSize, sysconf(_SC_PAGESIZE));
+    if (posix_memalign(&buffer, alignment, DIRECT_BUFFER_SIZE) != 0) {
+        throw BlockdeviceException("Unable to allocate direct I/O buffer.");
+    }
+    directBuffer_.reset((unsigned char*)buffer);
+    directDevice_ = open(devicePath_.c_str(), O_RDWR | O_DIRECT);
+    if (directDevice_ == -1) {
+        std::cout << "Unable to open device for direct I/O, writing through "
+                     "the page cache: "
+                  << strerror(errno) << std::endl;
+        return false;
+    }
+    logicalBlockSize_ = logicalBlockSize;
+    return true;
+}
+
+void ImageWriter::closeDirectDevice() const {
+    if (directDevice_ != -1) {
+        close(directDevice_);
+        directDevice_ = -1;
+    }
+}
+
+bool ImageWriter::setWriteEngine(WriteEngine engine, unsigned queueDepth) {
+    ring_.reset();
+    engine_ = engine;
+    queueDepth_ = queueDepth;
+    if (engine != WriteEngine::IoUring) {
+        return true;
+    }
+    try {
+        // Room for a read and a write of each buffer
+        ring_ = std::make_unique<IoUring>(2 * queueDepth);
+    } catch (IoUringException& e) {
+        std::cout << e.what() << ", writing synchronously." << std::endl;
+        engine_ = WriteEngine::Synchronous;
+        return false;
+    }
+    if (!ring_->supportsReadWrite()) {
+        std::cout << "io_uring has no reads and writes, writing synchronously."
+                  << std::endl;
+        ring_.reset();
+        engine_ = WriteEngine::Synchronous;
+        return false;
+    }
+    return true;
+}
+
+void ImageWriter::setBlockMap(std::vector<ImageExtent> blockMap) {
+    for (size_t i = 1; i < blockMap.size(); i++) {
+        if (blockMap[i].offset <
+            blockMap[i - 1].offset + blockMap[i - 1].length) {
+            throw ImageFileException(
+                "Block map extents are unsorted or overlap.");
+        }
+    }
+    blockMap_ = std::move(blockMap);
 }
 
 std::ifstream ImageWriter::obtainImageStream(
@@ -1,7 +1,12 @@
+#include <cstdlib>
 #include <exception>
 #include <iostream>
+#include <memory>
 #include <vector>
 
+#include "block_index.h"
+#include "uring.h"
+
 #ifndef FLASH_WRITER
 #define FLASH_WRITER
 
@@ -15,6 +20,33 @@ class ImageFileException : public std::runtime_error {
     ImageFileException(const char* message);
 };
 
+// Bytes the writes since the device was opened wrote, skipped as the device
+// held them already, read from the device to find that out, and left alone as
+// the image doesn't care about them.
+struct WriteStatistics {
+    uint64_t bytesWritten;
+    uint64_t bytesSkipped;
+    uint64_t bytesRead;
+    uint64_t bytesDiscarded;
+};
+
+// How writeImageFile moves an image from its file to the device.
+enum class WriteEngine {
+    // Reads a buffer of the image, then writes it
+    Synchronous,
+    // Keeps reads of the image and writes to the device in flight together
+    IoUring,
+    // Reads the image in a thread of its own while writing, for kernels
+    // without io_uring
+    Threaded
+};
+
+// A range of an image that holds data, e.g. blocks its filesystem allocated.
+struct ImageExtent {
+    uint64_t offset;
+    uint64_t length;
+};
+
 class ImageWriter {
     friend class FlashWriterTest;
 
@@ -46,10 +78,139 @@ class ImageWriter {
     ssize_t writeImageFile(const std::string& imagePath,
                            ssize_t bufferSize) const;
 
+    size_t writeChunk(const unsigned char* data, size_t nBytes,
+                      off_t offset) const;
+
+    // Writes nBytes of the 4 byte pattern, repeated from offset on, like a
+    // chunk of that content.
+    uint64_t fillRange(uint32_t pattern, uint64_t nBytes, off_t offset) const;
+
+    // Leaves a range the image doesn't care about unwritten, and discards it
+    // where the device supports that, so the flash can reuse its blocks. What
+    // the device holds there is undefined afterwards, so the image gets no
+    // block index.
+    uint64_t discardRange(uint64_t nBytes, off_t offset) const;
+
+    // Flushes the device; also stores the block index of the image written,
+    // if one is being built.
+    void syncBlockDevice() const;
+
+    // Builds the block index of the image written to the device from now on,
+    // stored at indexPath by syncBlockDevice. The index of what the device
+    // held before is removed right away. Only an image written in order from
+    // offset 0 is indexed; closing the device or writing out of order drops
+    // the index.
+    void buildBlockIndex(const std::string& indexPath);
+
+    // Writes only the blocks that differ from what the device holds, which
+    // saves time and flash wear when the device has an earlier version of the
+    // image. A block is compared by hash while the device's block index is
+    // valid and the index of the new image is being built, and by reading it
+    // back from the device otherwise.
+    void setSkipUnchanged(bool skipUnchanged);
+
+    WriteStatistics getWriteStatistics() const;
+
+    // Writes only the given extents of images from now on and discards the
+    // rest of them, like bmaptool does, so blocks their filesystem doesn't use
+    // cost neither time nor flash wear. writeImageFile doesn't even read the
+    // rest of the file. Throws ImageFileException unless the extents are
+    // sorted and don't overlap; an empty map writes images as a whole again.
+    void setBlockMap(std::vector<ImageExtent> blockMap);
+
+    // Writes past the page cache with O_DIRECT from now on, so flashing an
+    // image neither evicts what the running system has cached nor stalls it
+    // on writeback. Writes go through an aligned buffer in logical blocks of
+    // the device; partial blocks at their ends keep what the device holds
+    // around them. Returns whether writes to the open device are direct; a
+    // device without O_DIRECT support is written through the page cache.
+    bool setDirectIO(bool directIO);
+
+    // Selects how writeImageFile moves images; the io_uring engine keeps
+    // queueDepth buffers of the image being read or written at once, so
+    // reading the file overlaps writing the device and the device gets
+    // several writes to work on. The threaded engine overlaps reading and
+    // writing with queueDepth buffers, at least two, but one write at a
+    // time. Returns false if the kernel has no io_uring or forbids it;
+    // images are written synchronously then.
+    bool setWriteEngine(WriteEngine engine, unsigned queueDepth = 4);
+
    private:
+    class AsyncImageWrite;
+
     std::string devicePath_;
     int blockDevice_;
     long blockDevSize_;
+    std::string blockIndexPath_;
+    // Fed by the const write methods; hashing doesn't change the device
+    mutable std::unique_ptr<BlockIndexBuilder> blockIndex_;
+    // What the device held before, if its index was still valid
+    mutable std::unique_ptr<BlockIndex> previousIndex_;
+    bool skipUnchanged_;
+    mutable WriteStatistics statistics_;
+    mutable std::vector<unsigned char> readBuffer_;
+    std::vector<ImageExtent> blockMap_;
+    bool directIO_;
+    // Second descriptor of the device for direct writes; dropped if the
+    // device refuses them
+    mutable int directDevice_;
+    size_t logicalBlockSize_;
+    std::unique_ptr<unsigned char, decltype(&free)> directBuffer_;
+    WriteEngine engine_;
+    unsigned queueDepth_;
+    // Set while the io_uring engine is selected
+    mutable std::unique_ptr<IoUring> ring_;
+    // Set while the io_uring engine hands a buffer to writeChunk, whose
+    // writes are queued then
+    mutable AsyncImageWrite* asyncWrite_;
+
+    void writeMappedChunk(const unsigned char* data, size_t nBytes,
+                          off_t offset) const;
+
+    ssize_t writeMappedImageFile(std::ifstream& imageStream,
+                                 std::vector<char>& buffer) const;
+
+    int openImageFile(const std::string& imagePath,
+                      uint64_t& imageLength) const;
+
+    std::vector<ImageExtent> splitImageReads(uint64_t imageLength,
+                                             size_t bufferSize) const;
+
+    ssize_t writeImageFileAsync(const std::string& imagePath,
+                                size_t bufferSize) const;
+
+    ssize_t writeImageFileThreaded(const std::string& imagePath,
+                                   size_t bufferSize) const;
+
+    // Forgets the index being built and the previous one, once the former is
+    // stored or the device may not hold what it claims, e.g. after a failed
+    // write
+    void dropBlockIndex() const;
+
+    void indexWritten(const unsigned char* data, size_t nBytes,
+                      off_t offset) const;
+
+    void writeRange(const unsigned char* data, size_t nBytes,
+                    off_t offset) const;
+
+    void writeRangeSync(const unsigned char* data, size_t nBytes,
+                        off_t offset) const;
+
+    int compareWithPreviousIndex(size_t nBytes, off_t offset) const;
+
+    void readRange(size_t nBytes, off_t offset) const;
+
+    bool readRangeDirect(size_t nBytes, off_t offset) const;
+
+    bool writeRangeDirect(const unsigned char* data, size_t nBytes,
+                          off_t offset) const;
+
+    bool transferDirect(bool write, unsigned char* buffer, size_t nBytes,
+                        off_t offset) const;
+
+    bool openDirectDevice();
+
+    void closeDirectDevice() const;
 
     void openBlockDevice();
 
@@ -59,8 +220,6 @@ class ImageWriter {
 
     unsigned long obtainBlockDeviceSize() const;
 
-    size_t writeBuffer(const std::vector<char>& buffer, size_t nBytes) const;
-
     std::ifstream obtainImageStream(const std::string& imagePath) const;
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,1159 @@
+#include "ArtifactParser.h"
+#include "SeededDownload.h"
+
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+const std::string test_key_path("artifact_parser_test_pubkey.pem");
+
+class ArtifactParserTest : public ::testing::Test {
+   protected:
+    static EVP_PKEY* signingKey;
+    static std::array<unsigned char, 16> aesKey;
+    static std::array<unsigned char, 12> iv;
+
+    // Same layout as ArtifactCreator: signature, sequence number, uuid,
+    // uri length, uri, extensions length, extensions, payload
+    static std::vector<unsigned char> buildPlaintext(
+        const std::vector<unsigned char>& payload, const std::string& uri,
+        uint64_t sequenceNumber,
+        const std::vector<unsigned char>& extensions = {}) {
+        std::vector<unsigned char> plain(URI_OFFSET + uri.size() +
+                                         EXTENSIONS_LENGTH_SIZE);
+        std::memcpy(plain.data() + SEQUENCE_NUMBER_OFFSET, &sequenceNumber, 8);
+        for (int i = 0; i < 16; i++) {
+            plain[HARDWARE_UUID_OFFSET + i] = 'a' + i;
+        }
+        uint16_t uriLength = uri.size();
+        std::memcpy(plain.data() + URI_LENGTH_OFFSET, &uriLength, 2);
+        std::copy(uri.begin(), uri.end(), plain.begin() + URI_OFFSET);
+        uint32_t extensionsLength = extensions.size();
+        std::memcpy(plain.data() + URI_OFFSET + uri.size(), &extensionsLength,
+                    4);
+        plain.insert(plain.end(), extensions.begin(), extensions.end());
+        plain.insert(plain.end(), payload.begin(), payload.end());
+
+        EVP_MD_CTX* mdctx = EVP_MD_CTX_new();
+        size_t sigLength = 256;
+        EVP_DigestSignInit(mdctx, nullptr, EVP_sha256(), nullptr, signingKey);
+        EVP_DigestSignUpdate(mdctx, plain.data() + 256, plain.size() - 256);
+        EVP_DigestSignFinal(mdctx, plain.data(), &sigLength);
+        EVP_MD_CTX_free(mdctx);
+        return plain;
+    }
+
+    static std::vector<unsigned char> encrypt(
+        const std::vector<unsigned char>& plain) {
+        std::vector<unsigned char> ciphertext(plain.size() + 16);
+        int len;
+        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+        EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), nullptr, aesKey.data(),
+                           iv.data());
+        EVP_EncryptUpdate(ctx, ciphertext.data(), &len, plain.data(),
+                          plain.size());
+        EVP_EncryptFinal_ex(ctx, ciphertext.data() + len, &len);
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16,
+                            ciphertext.data() + plain.size());
+        EVP_CIPHER_CTX_free(ctx);
+        return ciphertext;
+    }
+
+    static std::vector<unsigned char> randomPayload(size_t size) {
+        std::vector<unsigned char> payload(size);
+        RAND_bytes(payload.data(), payload.size());
+        return payload;
+    }
+
+    // Mostly zeroes with some random blocks, like a filesystem image
+    static std::vector<unsigned char> imageLikePayload(size_t size) {
+        std::vector<unsigned char> payload(size);
+        for (size_t offset = 0; offset < size; offset += 16 * 4096) {
+            RAND_bytes(payload.data() + offset,
+                       std::min<size_t>(4096, size - offset));
+        }
+        return payload;
+    }
+
+    static std::vector<unsigned char> extension(
+        ExtensionType type, const std::vector<unsigned char>& value) {
+        std::vector<unsigned char> tlv(EXTENSION_HEADER_SIZE);
+        uint16_t typeValue = (uint16_t)type;
+        uint32_t length = value.size();
+        std::memcpy(tlv.data(), &typeValue, 2);
+        std::memcpy(tlv.data() + 2, &length, 4);
+        tlv.insert(tlv.end(), value.begin(), value.end());
+        return tlv;
+    }
+
+    // Value of a BlockMap extension
+    static std::vector<unsigned char> blockMapValue(
+        uint32_t blockSize, uint64_t imageLength,
+        const std::vector<std::pair<uint64_t, uint64_t>>& extents) {
+        std::vector<unsigned char> value(12 + 16 * extents.size());
+        std::memcpy(value.data(), &blockSize, 4);
+        std::memcpy(value.data() + 4, &imageLength, 8);
+        for (size_t i = 0; i < extents.size(); i++) {
+            std::memcpy(value.data() + 12 + 16 * i, &extents[i].first, 8);
+            std::memcpy(value.data() + 20 + 16 * i, &extents[i].second, 8);
+        }
+        return value;
+    }
+
+    static std::vector<unsigned char> xzCompress(
+        const unsigned char* data, size_t size, uint32_t preset = 6) {
+        std::vector<unsigned char> compressed(lzma_stream_buffer_bound(size));
+        size_t length = 0;
+        lzma_easy_buffer_encode(preset, LZMA_CHECK_CRC32, nullptr, data, size,
+                                compressed.data(), &length, compressed.size());
+        compressed.resize(length);
+        return compressed;
+    }
+
+    static std::vector<unsigned char> xzCompress(
+        const std::vector<unsigned char>& data) {
+        return xzCompress(data.data(), data.size());
+    }
+
+    // Like ArtifactCreator with -frameSize: independent xz streams of
+    // frameSize bytes each, back to back
+    static std::vector<unsigned char> xzCompressFrames(
+        const std::vector<unsigned char>& data, size_t frameSize,
+        std::vector<PayloadFrame>& frames, uint32_t preset = 6) {
+        std::vector<unsigned char> compressed;
+        frames.clear();
+        for (size_t offset = 0; offset < data.size(); offset += frameSize) {
+            size_t length = std::min(frameSize, data.size() - offset);
+            auto frame = xzCompress(data.data() + offset, length, preset);
+            frames.push_back({frame.size(), length});
+            compressed.insert(compressed.end(), frame.begin(), frame.end());
+        }
+        return compressed;
+    }
+
+    static std::vector<unsigned char> compressionExtensions(
+        const std::vector<PayloadFrame>& frames) {
+        auto extensions =
+            extension(ExtensionType::PayloadCompression,
+                      {(unsigned char)PayloadCompression::Xz});
+        std::vector<unsigned char> index(frames.size() * 16);
+        for (size_t i = 0; i < frames.size(); i++) {
+            std::memcpy(index.data() + i * 16, &frames[i].compressedLength, 8);
+            std::memcpy(index.data() + i * 16 + 8,
+                        &frames[i].decompressedLength, 8);
+        }
+        auto frameIndex = extension(ExtensionType::PayloadFrameIndex, index);
+        extensions.insert(extensions.end(), frameIndex.begin(),
+                          frameIndex.end());
+        return extensions;
+    }
+
+    // One instruction of a delta payload, as ArtifactCreator writes it
+    static std::vector<unsigned char> deltaInstruction(
+        DeltaOp op, uint64_t sourceOffset, uint64_t length,
+        const std::vector<unsigned char>& data = {}) {
+        std::vector<unsigned char> instruction{(unsigned char)op};
+        if (op != DeltaOp::Insert) {
+            instruction.resize(1 + 8);
+            std::memcpy(instruction.data() + 1, &sourceOffset, 8);
+        }
+        size_t lengthOffset = instruction.size();
+        instruction.resize(lengthOffset + 8);
+        std::memcpy(instruction.data() + lengthOffset, &length, 8);
+        instruction.insert(instruction.end(), data.begin(), data.end());
+        return instruction;
+    }
+
+    static DeltaSource deltaSourceOf(const std::vector<unsigned char>& image) {
+        DeltaSource source{image.size(), {}};
+        SHA256(image.data(), image.size(), source.sha256.data());
+        return source;
+    }
+
+    static std::vector<unsigned char> applyDelta(
+        const std::string& sourcePath, const DeltaSource& source,
+        const std::vector<unsigned char>& delta, size_t chunkSize) {
+        std::vector<unsigned char> image;
+        DeltaApplier applier(
+            sourcePath, source, [&](const unsigned char* data, size_t length) {
+                image.insert(image.end(), data, data + length);
+            });
+        for (size_t offset = 0; offset < delta.size(); offset += chunkSize) {
+            applier.Update(delta.data() + offset,
+                           std::min(chunkSize, delta.size() - offset));
+        }
+        applier.Finish();
+        EXPECT_EQ(applier.OutputLength(), image.size());
+        return image;
+    }
+
+    static std::vector<unsigned char> sparseChunk(
+        SparseChunk type, uint64_t length, uint32_t pattern = 0,
+        const std::vector<unsigned char>& data = {}) {
+        std::vector<unsigned char> chunk{(unsigned char)type};
+        chunk.insert(chunk.end(), (unsigned char*)&length,
+                     (unsigned char*)&length + 8);
+        if (type == SparseChunk::Fill) {
+            chunk.insert(chunk.end(), (unsigned char*)&pattern,
+                         (unsigned char*)&pattern + 4);
+        }
+        chunk.insert(chunk.end(), data.begin(), data.end());
+        return chunk;
+    }
+
+    // The image, with don't-care bytes as 0xdc
+    static std::vector<unsigned char> expandSparse(
+        const std::vector<unsigned char>& sparse, uint64_t imageLength,
+        size_t chunkSize) {
+        std::vector<unsigned char> image;
+        SparseImageExpander expander(
+            imageLength,
+            [&](const unsigned char* data, size_t length) {
+                image.insert(image.end(), data, data + length);
+            },
+            [&](uint32_t pattern, uint64_t length) {
+                for (uint64_t i = 0; i < length; i++) {
+                    image.push_back((unsigned char)(pattern >> (8 * (i % 4))));
+                }
+            },
+            [&](uint64_t length) { image.resize(image.size() + length, 0xdc); });
+        for (size_t offset = 0; offset < sparse.size(); offset += chunkSize) {
+            expander.Update(sparse.data() + offset,
+                            std::min(chunkSize, sparse.size() - offset));
+        }
+        expander.Finish();
+        EXPECT_EQ(expander.OutputLength(), image.size());
+        return image;
+    }
+
+    // Like ArtifactCreator's manifest of an uncompressed payload
+    static std::vector<unsigned char> buildManifest(
+        const std::vector<unsigned char>& payload, uint64_t payloadOffset,
+        uint32_t blockSize) {
+        std::vector<unsigned char> manifest(MANIFEST_HEADER_SIZE);
+        uint64_t payloadLength = payload.size();
+        std::memcpy(manifest.data(), &payloadOffset, 8);
+        std::memcpy(manifest.data() + 8, &payloadLength, 8);
+        std::memcpy(manifest.data() + 16, &blockSize, 4);
+        for (size_t offset = 0; offset < payload.size(); offset += blockSize) {
+            size_t length = std::min<size_t>(blockSize, payload.size() - offset);
+            RollingChecksum checksum;
+            checksum.Reset(payload.data() + offset, length);
+            uint32_t weak = checksum.Value();
+            std::array<unsigned char, 32> strong{};
+            SHA256(payload.data() + offset, length, strong.data());
+            manifest.insert(manifest.end(), (unsigned char*)&weak,
+                            (unsigned char*)&weak + 4);
+            manifest.insert(manifest.end(), strong.begin(), strong.end());
+        }
+        return manifest;
+    }
+
+    // Feeds the ciphertext in chunks of the given size and collects the
+    // payload handed to the sink
+    static bool streamArtifact(const std::vector<unsigned char>& ciphertext,
+                               size_t chunkSize,
+                               std::vector<unsigned char>& payload,
+                               ArtifactHeader* header = nullptr,
+                               unsigned int decompressionThreads = 1) {
+        payload.clear();
+        ArtifactStreamParser parser(
+            test_key_path, aesKey, iv,
+            [&](const unsigned char* data, size_t length) {
+                payload.insert(payload.end(), data, data + length);
+            });
+        parser.SetDecompressionThreads(decompressionThreads);
+        for (size_t offset = 0; offset < ciphertext.size();
+             offset += chunkSize) {
+            size_t length = std::min(chunkSize, ciphertext.size() - offset);
+            parser.Update(ciphertext.data() + offset, length);
+        }
+        bool ok = parser.Finish();
+        if (header != nullptr) {
+            *header = parser.Header();
+        }
+        return ok;
+    }
+
+   public:
+    static void SetUpTestSuite() {
+        EVP_PKEY_CTX* keyCtx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr);
+        EVP_PKEY_keygen_init(keyCtx);
+        EVP_PKEY_CTX_set_rsa_keygen_bits(keyCtx, 2048);
+        EVP_PKEY_keygen(keyCtx, &signingKey);
+        EVP_PKEY_CTX_free(keyCtx);
+
+        FILE* keyFile = fopen(test_key_path.c_str(), "wb");
+        PEM_write_PUBKEY(keyFile, signingKey);
+        fclose(keyFile);
+
+        RAND_bytes(aesKey.data(), aesKey.size());
+        RAND_bytes(iv.data(), iv.size());
+    }
+
+    static void TearDownTestSuite() {
+        EVP_PKEY_free(signingKey);
+        std::remove(test_key_path.c_str());
+    }
+};
+
+EVP_PKEY* ArtifactParserTest::signingKey = nullptr;
+std::array<unsigned char, 16> ArtifactParserTest::aesKey{};
+std::array<unsigned char, 12> ArtifactParserTest::iv{};
+
+TEST_F(ArtifactParserTest, streamParserTestChunkSizes) {
+    auto payload = randomPayload(300 * 1024 + 5);
+    auto ciphertext = encrypt(buildPlaintext(payload, "https://example", 42));
+
+    for (size_t chunkSize : {1, 7, 16, 17, 282, 4096, 65536 + 3, 1 << 20}) {
+        std::vector<unsigned char> streamed;
+        ArtifactHeader header{};
+        ASSERT_TRUE(streamArtifact(ciphertext, chunkSize, streamed, &header))
+            << "chunk size " << chunkSize;
+        ASSERT_EQ(streamed, payload) << "chunk size " << chunkSize;
+        ASSERT_EQ(header.sequenceNumber, 42);
+        ASSERT_EQ(header.uri, "https://example");
+        ASSERT_EQ(header.hardwareUUID[0], 'a');
+    }
+}
+
+TEST_F(ArtifactParserTest, streamParserTestMatchesParseArtifact) {
+    auto payload = randomPayload(10000);
+    auto ciphertext = encrypt(buildPlaintext(payload, "", 7));
+
+    ArtifactParser parser(test_key_path, aesKey, iv);
+    auto plain = parser.DecryptArtifact(ciphertext);
+    ASSERT_TRUE(parser.VerifySignature(plain));
+    auto artifact = parser.ParseArtifact(plain);
+
+    std::vector<unsigned char> streamed;
+    ASSERT_TRUE(streamArtifact(ciphertext, 1000, streamed));
+    ASSERT_EQ(streamed, artifact.firmwarePayload);
+}
+
+TEST_F(ArtifactParserTest, streamParserTestTamperedCiphertext) {
+    auto ciphertext = encrypt(buildPlaintext(randomPayload(5000), "", 1));
+    ciphertext[ciphertext.size() / 2] ^= 1;
+
+    std::vector<unsigned char> streamed;
+    ASSERT_FALSE(streamArtifact(ciphertext, 333, streamed));
+}
+
+TEST_F(ArtifactParserTest, streamParserTestTamperedTag) {
+    auto ciphertext = encrypt(buildPlaintext(randomPayload(5000), "", 1));
+    ciphertext.back() ^= 1;
+
+    std::vector<unsigned char> streamed;
+    ASSERT_FALSE(streamArtifact(ciphertext, 333, streamed));
+}
+
+TEST_F(ArtifactParserTest, streamParserTestInvalidSignature) {
+    auto plain = buildPlaintext(randomPayload(5000), "", 1);
+    plain[0] ^= 1;
+    auto ciphertext = encrypt(plain);
+
+    std::vector<unsigned char> streamed;
+    ASSERT_FALSE(streamArtifact(ciphertext, 333, streamed));
+}
+
+TEST_F(ArtifactParserTest, streamParserTestTruncatedArtifact) {
+    auto ciphertext = encrypt(buildPlaintext(randomPayload(5000), "", 1));
+    ciphertext.resize(ciphertext.size() - 20);
+
+    std::vector<unsigned char> streamed;
+    ASSERT_FALSE(streamArtifact(ciphertext, 333, streamed));
+
+    ciphertext.resize(100);
+    ASSERT_FALSE(streamArtifact(ciphertext, 333, streamed));
+}
+
+TEST_F(ArtifactParserTest, streamParserTestCompressedPayload) {
+    auto image = imageLikePayload(3 * 1024 * 1024 + 11);
+    auto compressed = xzCompress(image);
+    ASSERT_LT(compressed.size(), image.size() / 4);
+    auto ciphertext = encrypt(buildPlaintext(
+        compressed, "", 4,
+        extension(ExtensionType::PayloadCompression,
+                  {(unsigned char)PayloadCompression::Xz})));
+
+    for (size_t chunkSize : {1000, 65536 + 3, 1 << 20}) {
+        std::vector<unsigned char> streamed;
+        ArtifactHeader header{};
+        ASSERT_TRUE(streamArtifact(ciphertext, chunkSize, streamed, &header))
+            << "chunk size " << chunkSize;
+        ASSERT_EQ(header.payloadCompression, PayloadCompression::Xz);
+        ASSERT_EQ(streamed, image) << "chunk size " << chunkSize;
+    }
+}
+
+TEST_F(ArtifactParserTest, streamParserTestTruncatedCompressedPayload) {
+    auto compressed = xzCompress(imageLikePayload(200000));
+    compressed.resize(compressed.size() - 10);
+    // Signed as it is, so only the decompression notices
+    auto ciphertext = encrypt(buildPlaintext(
+        compressed, "", 4,
+        extension(ExtensionType::PayloadCompression,
+                  {(unsigned char)PayloadCompression::Xz})));
+
+    std::vector<unsigned char> streamed;
+    ASSERT_FALSE(streamArtifact(ciphertext, 4096, streamed));
+}
+
+TEST_F(ArtifactParserTest, streamParserTestCorruptCompressedPayload) {
+    auto compressed = xzCompress(imageLikePayload(200000));
+    compressed[compressed.size() / 2] ^= 0xff;
+    auto ciphertext = encrypt(buildPlaintext(
+        compressed, "", 4,
+        extension(ExtensionType::PayloadCompression,
+                  {(unsigned char)PayloadCompression::Xz})));
+
+    std::vector<unsigned char> streamed;
+    ASSERT_THROW(streamArtifact(ciphertext, 4096, streamed),
+                 decompression_exception);
+}
+
+TEST_F(ArtifactParserTest, parseArtifactViewTestExtensions) {
+    ArtifactParser parser(test_key_path, aesKey, iv);
+    auto payload = randomPayload(1000);
+
+    // Unknown extensions are skipped
+    auto extensions = extension((ExtensionType)0x7777, {1, 2, 3});
+    auto compression = extension(ExtensionType::PayloadCompression,
+                                 {(unsigned char)PayloadCompression::Xz});
+    extensions.insert(extensions.end(), compression.begin(), compression.end());
+    auto plain = buildPlaintext(payload, "uri", 2, extensions);
+    auto view = parser.ParseArtifactView(plain);
+    ASSERT_EQ(view.header.payloadCompression, PayloadCompression::Xz);
+    ASSERT_EQ(view.header.extensions.size, extensions.size());
+    ASSERT_TRUE(std::equal(view.firmwarePayload.begin(),
+                           view.firmwarePayload.end(), payload.begin(),
+                           payload.end()));
+    ASSERT_EQ(ArtifactParser::SplitExtensions(view.header.extensions).size(), 2);
+
+    auto unsupported = buildPlaintext(
+        payload, "", 2, extension(ExtensionType::PayloadCompression, {9}));
+    ASSERT_THROW(parser.ParseArtifactView(unsupported), parse_exception);
+
+    // A value running past the extension block
+    auto overrun = extension(ExtensionType::PayloadCompression, {1});
+    overrun[2] = 2;
+    auto overrunPlain = buildPlaintext(payload, "", 2, overrun);
+    ASSERT_THROW(parser.ParseArtifactView(overrunPlain), parse_exception);
+}
+
+TEST_F(ArtifactParserTest, decompressorTestChunkedOutput) {
+    auto image = imageLikePayload(1024 * 1024);
+    auto compressed = xzCompress(image);
+    // Two streams back to back decompress into one payload
+    compressed.insert(compressed.end(), compressed.begin(), compressed.end());
+
+    std::vector<unsigned char> decompressed;
+    size_t largestChunk = 0;
+    PayloadDecompressor decompressor(
+        PayloadCompression::Xz, [&](const unsigned char* data, size_t length) {
+            largestChunk = std::max(largestChunk, length);
+            decompressed.insert(decompressed.end(), data, data + length);
+        });
+    decompressor.Update(compressed.data(), compressed.size());
+    decompressor.Finish();
+
+    ASSERT_EQ(decompressed.size(), 2 * image.size());
+    ASSERT_TRUE(std::equal(image.begin(), image.end(), decompressed.begin()));
+    ASSERT_TRUE(std::equal(image.begin(), image.end(),
+                           decompressed.begin() + image.size()));
+    ASSERT_EQ(decompressor.DecompressedLength(), 2 * image.size());
+    ASSERT_LE(largestChunk, DECOMPRESSION_CHUNK_SIZE);
+
+    ASSERT_THROW(PayloadDecompressor(PayloadCompression::None, nullptr),
+                 decompression_exception);
+}
+
+TEST_F(ArtifactParserTest, streamParserTestFramedPayload) {
+    auto image = imageLikePayload(5 * 1024 * 1024 + 3);
+    std::vector<PayloadFrame> frames;
+    auto compressed = xzCompressFrames(image, 512 * 1024, frames);
+    ASSERT_EQ(frames.size(), 11);
+    auto ciphertext =
+        encrypt(buildPlaintext(compressed, "", 4, compressionExtensions(frames)));
+
+    // One thread decodes the frames as one concatenated stream
+    for (unsigned int threads : {1, 2, 4}) {
+        for (size_t chunkSize : {1000, 65536 + 3, 1 << 20}) {
+            std::vector<unsigned char> streamed;
+            ArtifactHeader header{};
+            ASSERT_TRUE(streamArtifact(ciphertext, chunkSize, streamed, &header,
+                                       threads))
+                << threads << " threads, chunk size " << chunkSize;
+            ASSERT_EQ(header.payloadFrames.size(), frames.size());
+            ASSERT_EQ(streamed, image)
+                << threads << " threads, chunk size " << chunkSize;
+        }
+    }
+}
+
+TEST_F(ArtifactParserTest, decompressorTestFrameIndexMismatch) {
+    auto image = imageLikePayload(1024 * 1024);
+    std::vector<PayloadFrame> frames;
+    auto compressed = xzCompressFrames(image, 256 * 1024, frames);
+    auto sink = [](const unsigned char*, size_t) {};
+
+    auto wrongLength = frames;
+    wrongLength[1].decompressedLength++;
+    ASSERT_THROW(
+        {
+            PayloadDecompressor decompressor(PayloadCompression::Xz, sink,
+                                             wrongLength, 2);
+            decompressor.Update(compressed.data(), compressed.size());
+            decompressor.Finish();
+        },
+        decompression_exception);
+
+    // The payload ends before the last frame
+    ASSERT_THROW(
+        {
+            PayloadDecompressor decompressor(PayloadCompression::Xz, sink,
+                                             frames, 2);
+            decompressor.Update(compressed.data(),
+                                compressed.size() - frames.back().compressedLength);
+            decompressor.Finish();
+        },
+        decompression_exception);
+
+    // Data after the last frame
+    ASSERT_THROW(
+        {
+            PayloadDecompressor decompressor(PayloadCompression::Xz, sink,
+                                             frames, 2);
+            compressed.push_back(0);
+            decompressor.Update(compressed.data(), compressed.size());
+        },
+        decompression_exception);
+
+    auto tooLarge = frames;
+    tooLarge[0].decompressedLength = MAX_FRAME_LENGTH + 1;
+    ASSERT_THROW(PayloadDecompressor(PayloadCompression::Xz, sink, tooLarge, 2),
+                 decompression_exception);
+}
+
+TEST_F(ArtifactParserTest, deltaApplierTestInstructions) {
+    auto source = randomPayload(200000);
+    const std::string path = "artifact_parser_test_delta_source.bin";
+    std::ofstream(path, std::ios::binary)
+        .write((const char*)source.data(), source.size());
+
+    std::vector<unsigned char> expected;
+    std::vector<unsigned char> delta;
+    auto append = [&](const std::vector<unsigned char>& instruction) {
+        delta.insert(delta.end(), instruction.begin(), instruction.end());
+    };
+    // Larger than DELTA_CHUNK_SIZE, so copied in several reads
+    append(deltaInstruction(DeltaOp::Copy, 1000, 150000));
+    expected.insert(expected.end(), source.begin() + 1000,
+                    source.begin() + 151000);
+    auto diff = randomPayload(70000);
+    append(deltaInstruction(DeltaOp::Add, 5, diff.size(), diff));
+    for (size_t i = 0; i < diff.size(); i++) {
+        expected.push_back(source[5 + i] + diff[i]);
+    }
+    auto inserted = randomPayload(3000);
+    append(deltaInstruction(DeltaOp::Insert, 0, inserted.size(), inserted));
+    expected.insert(expected.end(), inserted.begin(), inserted.end());
+    append(deltaInstruction(DeltaOp::Insert, 0, 0));
+    append(deltaInstruction(DeltaOp::Copy, 0, source.size()));
+    expected.insert(expected.end(), source.begin(), source.end());
+
+    auto deltaSource = deltaSourceOf(source);
+    for (size_t chunkSize : {1, 7, 4096, 65536 + 3, 1 << 20}) {
+        ASSERT_EQ(applyDelta(path, deltaSource, delta, chunkSize), expected)
+            << "chunk size " << chunkSize;
+    }
+
+    DeltaApplier applier(path, deltaSource, nullptr);
+    ASSERT_TRUE(applier.VerifySource());
+    std::remove(path.c_str());
+}
+
+TEST_F(ArtifactParserTest, deltaApplierTestMalformed) {
+    auto source = randomPayload(10000);
+    const std::string path = "artifact_parser_test_delta_source.bin";
+    std::ofstream(path, std::ios::binary)
+        .write((const char*)source.data(), source.size());
+    auto deltaSource = deltaSourceOf(source);
+
+    // Only the hashed part of the source may be used
+    ASSERT_THROW(
+        applyDelta(path, {5000, deltaSource.sha256},
+                   deltaInstruction(DeltaOp::Copy, 4000, 1001), 4096),
+        delta_exception);
+    ASSERT_THROW(applyDelta(path, deltaSource,
+                            deltaInstruction(DeltaOp::Add, UINT64_MAX, 2,
+                                             {0, 0}),
+                            4096),
+                 delta_exception);
+    ASSERT_THROW(applyDelta(path, deltaSource, {0x42, 0, 0}, 4096),
+                 delta_exception);
+
+    auto truncated = deltaInstruction(DeltaOp::Insert, 0, 100,
+                                      std::vector<unsigned char>(50));
+    ASSERT_THROW(applyDelta(path, deltaSource, truncated, 4096),
+                 delta_exception);
+    truncated = deltaInstruction(DeltaOp::Copy, 0, 100);
+    truncated.resize(12);
+    ASSERT_THROW(applyDelta(path, deltaSource, truncated, 4096),
+                 delta_exception);
+
+    // A different source, or one shorter than the delta was made against
+    auto changed = deltaSource;
+    changed.sha256[0] ^= 1;
+    ASSERT_FALSE(DeltaApplier(path, changed, nullptr).VerifySource());
+    ASSERT_FALSE(
+        DeltaApplier(path, {source.size() + 1, deltaSource.sha256}, nullptr)
+            .VerifySource());
+    std::remove(path.c_str());
+
+    ASSERT_THROW(DeltaApplier("/nonexistent/rootfs", deltaSource, nullptr),
+                 delta_source_exception);
+}
+
+TEST_F(ArtifactParserTest, parseArtifactViewTestDeltaSource) {
+    ArtifactParser parser(test_key_path, aesKey, iv);
+    auto payload = randomPayload(1000);
+    auto image = randomPayload(5000);
+    auto deltaSource = deltaSourceOf(image);
+
+    std::vector<unsigned char> value(8);
+    std::memcpy(value.data(), &deltaSource.length, 8);
+    value.insert(value.end(), deltaSource.sha256.begin(),
+                 deltaSource.sha256.end());
+    auto plain = buildPlaintext(payload, "", 2,
+                                extension(ExtensionType::DeltaSource, value));
+    auto view = parser.ParseArtifactView(plain);
+    ASSERT_TRUE(view.header.deltaSource.has_value());
+    ASSERT_EQ(view.header.deltaSource->length, image.size());
+    ASSERT_EQ(view.header.deltaSource->sha256, deltaSource.sha256);
+
+    std::vector<unsigned char> streamed;
+    ArtifactHeader header{};
+    ASSERT_TRUE(streamArtifact(encrypt(plain), 4096, streamed, &header));
+    ASSERT_TRUE(header.deltaSource.has_value());
+    ASSERT_EQ(header.deltaSource->sha256, deltaSource.sha256);
+    ASSERT_EQ(streamed, payload);
+
+    value.pop_back();
+    auto malformed = buildPlaintext(
+        payload, "", 2, extension(ExtensionType::DeltaSource, value));
+    ASSERT_THROW(parser.ParseArtifactView(malformed), parse_exception);
+
+    auto full = buildPlaintext(payload, "", 2);
+    ASSERT_FALSE(parser.ParseArtifactView(full).header.deltaSource.has_value());
+}
+
+TEST_F(ArtifactParserTest, sparseImageExpanderTestChunks) {
+    std::vector<unsigned char> sparse;
+    std::vector<unsigned char> expected;
+    auto append = [&](const std::vector<unsigned char>& chunk) {
+        sparse.insert(sparse.end(), chunk.begin(), chunk.end());
+    };
+    auto data = randomPayload(70000);
+    append(sparseChunk(SparseChunk::Data, data.size(), 0, data));
+    expected.insert(expected.end(), data.begin(), data.end());
+    append(sparseChunk(SparseChunk::Fill, 1 << 20));
+    expected.resize(expected.size() + (1 << 20), 0);
+    append(sparseChunk(SparseChunk::DontCare, 12288));
+    expected.resize(expected.size() + 12288, 0xdc);
+    append(sparseChunk(SparseChunk::Fill, 6, 0x04030201));
+    for (unsigned char byte : {1, 2, 3, 4, 1, 2}) {
+        expected.push_back(byte);
+    }
+    append(sparseChunk(SparseChunk::Data, 0));
+    append(sparseChunk(SparseChunk::Data, 3, 0, {7, 8, 9}));
+    expected.insert(expected.end(), {7, 8, 9});
+
+    for (size_t chunkSize : {1, 5, 13, 4096, 1 << 20}) {
+        ASSERT_EQ(expandSparse(sparse, expected.size(), chunkSize), expected)
+            << "chunk size " << chunkSize;
+    }
+}
+
+TEST_F(ArtifactParserTest, sparseImageExpanderTestMalformed) {
+    auto fill = sparseChunk(SparseChunk::Fill, 4096);
+    ASSERT_THROW(expandSparse({0x42, 0, 0}, 4096, 4096), sparse_exception);
+    // Beyond the image, or short of it
+    ASSERT_THROW(expandSparse(fill, 4095, 4096), sparse_exception);
+    ASSERT_THROW(expandSparse(fill, 4097, 4096), sparse_exception);
+    ASSERT_THROW(expandSparse(sparseChunk(SparseChunk::DontCare, UINT64_MAX),
+                              4096, 4096),
+                 sparse_exception);
+
+    auto truncated = sparseChunk(SparseChunk::Data, 100, 0,
+                                 std::vector<unsigned char>(50));
+    ASSERT_THROW(expandSparse(truncated, 100, 4096), sparse_exception);
+    fill.pop_back();
+    ASSERT_THROW(expandSparse(fill, 4096, 4096), sparse_exception);
+}
+
+TEST_F(ArtifactParserTest, parseArtifactViewTestSparseImage) {
+    ArtifactParser parser(test_key_path, aesKey, iv);
+    auto payload = sparseChunk(SparseChunk::Fill, 1 << 30);
+    uint64_t imageLength = 1 << 30;
+    std::vector<unsigned char> value((unsigned char*)&imageLength,
+                                     (unsigned char*)&imageLength + 8);
+    auto plain = buildPlaintext(payload, "", 2,
+                                extension(ExtensionType::SparseImage, value));
+    auto view = parser.ParseArtifactView(plain);
+    ASSERT_EQ(view.header.sparseImageLength, imageLength);
+
+    std::vector<unsigned char> streamed;
+    ArtifactHeader header{};
+    ASSERT_TRUE(streamArtifact(encrypt(plain), 4096, streamed, &header));
+    ASSERT_EQ(header.sparseImageLength, imageLength);
+    ASSERT_EQ(streamed, payload);
+
+    value.pop_back();
+    auto malformed = buildPlaintext(
+        payload, "", 2, extension(ExtensionType::SparseImage, value));
+    ASSERT_THROW(parser.ParseArtifactView(malformed), parse_exception);
+    auto full = buildPlaintext(payload, "", 2);
+    ASSERT_FALSE(
+        parser.ParseArtifactView(full).header.sparseImageLength.has_value());
+}
+
+TEST_F(ArtifactParserTest, parseArtifactViewTestBlockMap) {
+    ArtifactParser parser(test_key_path, aesKey, iv);
+    auto payload = imageLikePayload(10 * 4096 + 100);
+    // The last extent ends in the short last block
+    auto value = blockMapValue(4096, payload.size(), {{0, 2}, {5, 3}, {10, 1}});
+    auto plain = buildPlaintext(payload, "", 2,
+                                extension(ExtensionType::BlockMap, value));
+    auto view = parser.ParseArtifactView(plain);
+    ASSERT_TRUE(view.header.blockMap.has_value());
+    ASSERT_EQ(view.header.blockMap->blockSize, 4096);
+    ASSERT_EQ(view.header.blockMap->imageLength, payload.size());
+    ASSERT_EQ(view.header.blockMap->extents.size(), 3);
+    ASSERT_EQ(view.header.blockMap->extents[1].firstBlock, 5);
+    ASSERT_EQ(view.header.blockMap->extents[1].blockCount, 3);
+
+    std::vector<unsigned char> streamed;
+    ArtifactHeader header{};
+    ASSERT_TRUE(streamArtifact(encrypt(plain), 4096, streamed, &header));
+    ASSERT_TRUE(header.blockMap.has_value());
+    ASSERT_EQ(header.blockMap->extents.size(), 3);
+    ASSERT_EQ(streamed, payload);
+
+    // Signed like the rest of the header
+    auto tampered = plain;
+    auto mapOffset = std::search(tampered.begin() + 256, tampered.end(),
+                                 value.begin(), value.end());
+    ASSERT_NE(mapOffset, tampered.end());
+    mapOffset[20] += 1;
+    ASSERT_TRUE(parser.ParseArtifactView(tampered).header.blockMap);
+    ASSERT_FALSE(parser.VerifySignature(tampered));
+
+    for (const auto& malformed : {
+             blockMapValue(4096, payload.size(), {{5, 3}, {0, 2}}),
+             blockMapValue(4096, payload.size(), {{0, 6}, {5, 3}}),
+             blockMapValue(4096, payload.size(), {{10, 2}}),
+             blockMapValue(4096, payload.size(), {{12, 0}}),
+             blockMapValue(4096, payload.size(), {{1, UINT64_MAX}}),
+             blockMapValue(4000, payload.size(), {{0, 1}}),
+             blockMapValue(256, payload.size(), {{0, 1}}),
+             std::vector<unsigned char>(11)}) {
+        auto artifact = buildPlaintext(
+            payload, "", 2, extension(ExtensionType::BlockMap, malformed));
+        ASSERT_THROW(parser.ParseArtifactView(artifact), parse_exception);
+    }
+    auto full = buildPlaintext(payload, "", 2);
+    ASSERT_FALSE(parser.ParseArtifactView(full).header.blockMap.has_value());
+}
+
+TEST_F(ArtifactParserTest, seededDownloadTestRollingChecksum) {
+    auto data = randomPayload(20000);
+    const size_t window = 512;
+    RollingChecksum rolling;
+    rolling.Reset(data.data(), window);
+    for (size_t offset = 0; offset + window < data.size(); offset++) {
+        RollingChecksum fresh;
+        fresh.Reset(data.data() + offset, window);
+        ASSERT_EQ(rolling.Value(), fresh.Value()) << "offset " << offset;
+        rolling.Roll(data[offset], data[offset + window]);
+    }
+}
+
+TEST_F(ArtifactParserTest, seededDownloadTestFindBlocks) {
+    const uint32_t blockSize = 4096;
+    auto payload = randomPayload(64 * blockSize + 1000);
+    auto block = [&](size_t index) {
+        return std::vector<unsigned char>(
+            payload.begin() + index * blockSize,
+            payload.begin() + (index + 1) * blockSize);
+    };
+
+    // The old image: a few bytes inserted after block 9, so the blocks after
+    // it are at unaligned offsets, block 30 changed, and no blocks from 51 on
+    std::vector<unsigned char> source;
+    for (size_t i = 0; i < 51; i++) {
+        if (i == 10) {
+            auto inserted = randomPayload(100);
+            source.insert(source.end(), inserted.begin(), inserted.end());
+        }
+        auto content = block(i);
+        if (i == 30) {
+            content[2000] ^= 1;
+        }
+        source.insert(source.end(), content.begin(), content.end());
+    }
+    const std::string path = "artifact_parser_test_seed_source.bin";
+    std::ofstream(path, std::ios::binary)
+        .write((const char*)source.data(), source.size());
+
+    auto manifestData = buildManifest(payload, 300, blockSize);
+    auto manifest =
+        BlockManifest::Parse(manifestData.data(), manifestData.size());
+    ASSERT_EQ(manifest.BlockCount(), 65);
+    ASSERT_EQ(manifest.BlockLength(64), 1000);
+
+    auto found = manifest.FindBlocks(path);
+    ASSERT_EQ(found.size(), manifest.BlockCount());
+    for (size_t i = 0; i < found.size(); i++) {
+        bool expected = i < 51 && i != 30;
+        ASSERT_EQ(found[i] != SEED_NOT_FOUND, expected) << "block " << i;
+        if (expected) {
+            ASSERT_EQ(found[i], i * blockSize + (i >= 10 ? 100 : 0));
+        }
+    }
+    std::remove(path.c_str());
+
+    ASSERT_THROW(manifest.FindBlocks("/nonexistent/rootfs"), seed_exception);
+}
+
+TEST_F(ArtifactParserTest, seededDownloadTestRebuildsArtifact) {
+    const uint32_t blockSize = 4096;
+    auto payload = randomPayload(1024 * 1024 + 77);
+    auto source = payload;
+    // Changed blocks of the new image; the unchanged ones between 73 and 75
+    // and between the header and block 1 are downloaded along with them
+    for (size_t offset : {5000, 300000, 308000, 700000}) {
+        source[offset] ^= 0xff;
+    }
+    const std::string path = "artifact_parser_test_seed_source.bin";
+    std::ofstream(path, std::ios::binary)
+        .write((const char*)source.data(), source.size());
+
+    auto plain = buildPlaintext(payload, "", 7);
+    auto ciphertext = encrypt(plain);
+    // Not a multiple of the AES block size
+    uint64_t payloadOffset = plain.size() - payload.size();
+    ASSERT_NE(payloadOffset % 16, 0);
+    auto manifestData = buildManifest(payload, payloadOffset, blockSize);
+    auto manifest =
+        BlockManifest::Parse(manifestData.data(), manifestData.size());
+    auto ranges = PlanSeededDownload(manifest, manifest.FindBlocks(path));
+
+    std::vector<unsigned char> rebuilt;
+    uint64_t downloaded = 0;
+    SeedSource seedSource(path, aesKey, iv);
+    for (const auto& range : ranges) {
+        ASSERT_EQ(range.offset, rebuilt.size());
+        if (range.local) {
+            seedSource.Emit(range, [&](const unsigned char* data, size_t length) {
+                rebuilt.insert(rebuilt.end(), data, data + length);
+            });
+        } else {
+            rebuilt.insert(rebuilt.end(), ciphertext.begin() + range.offset,
+                           ciphertext.begin() + range.offset + range.length);
+            downloaded += range.length;
+        }
+    }
+    ASSERT_EQ(rebuilt, ciphertext);
+    // Header, tag, the changed blocks and the last, short one
+    ASSERT_LT(downloaded, 6 * blockSize + SEED_MERGE_GAP + payloadOffset);
+    ASSERT_EQ(std::count_if(ranges.begin(), ranges.end(),
+                            [](const SeedRange& range) { return !range.local; }),
+              4);
+
+    std::vector<unsigned char> streamed;
+    ASSERT_TRUE(streamArtifact(rebuilt, 65536, streamed));
+    ASSERT_EQ(streamed, payload);
+    std::remove(path.c_str());
+}
+
+TEST_F(ArtifactParserTest, seededDownloadTestMalformedManifest) {
+    auto manifest = buildManifest(randomPayload(10000), 300, 4096);
+    ASSERT_NO_THROW(BlockManifest::Parse(manifest.data(), manifest.size()));
+    ASSERT_THROW(BlockManifest::Parse(manifest.data(), 10), seed_exception);
+    ASSERT_THROW(BlockManifest::Parse(manifest.data(), manifest.size() - 1),
+                 seed_exception);
+
+    auto tooSmallBlocks = buildManifest(randomPayload(10000), 300, 16);
+    ASSERT_THROW(
+        BlockManifest::Parse(tooSmallBlocks.data(), tooSmallBlocks.size()),
+        seed_exception);
+
+    // More blocks than the payload length says
+    uint64_t payloadLength = 5000;
+    std::memcpy(manifest.data() + 8, &payloadLength, 8);
+    ASSERT_THROW(BlockManifest::Parse(manifest.data(), manifest.size()),
+                 seed_exception);
+
+    ASSERT_THROW(SeedSource("/nonexistent/rootfs", aesKey, iv), seed_exception);
+}
+
+// Not a pass/fail criterion, the figures depend on the cores the machine can spare
+TEST_F(ArtifactParserTest, BenchmarkFramedDecompression) {
+    // A rootfs-like mix of empty blocks, incompressible blocks (binaries,
+    // compressed files) and text
+    const size_t imageSize = 64 * 1024 * 1024;
+    std::vector<unsigned char> image(imageSize);
+    const std::string words[] = {"usr ", "lib ", "bin/", "etc/", "config=",
+                                 "true\n", "0x1f ", "ELF ", "systemd "};
+    unsigned int seed = 1;
+    for (size_t block = 0; block < imageSize; block += 4096) {
+        seed = seed * 1103515245 + 12345;
+        if (seed % 4 == 1) {
+            RAND_bytes(image.data() + block, 4096);
+        } else if (seed % 4 >= 2) {
+            for (size_t offset = block; offset < block + 4096;) {
+                seed = seed * 1103515245 + 12345;
+                const std::string& word = words[(seed >> 16) % 9];
+                size_t length = std::min(word.size(), block + 4096 - offset);
+                std::memcpy(image.data() + offset, word.data(), length);
+                offset += length;
+            }
+        }
+    }
+    std::vector<PayloadFrame> frames;
+    auto compressed = xzCompressFrames(image, 4 * 1024 * 1024, frames, 1);
+    std::cout << "[ MEASURE  ] " << imageSize / (1024 * 1024) << " MiB image, "
+              << compressed.size() / (1024 * 1024) << " MiB compressed in "
+              << frames.size() << " frames" << std::endl;
+
+    for (unsigned int threads : {1, 2, 4, 8}) {
+        size_t received = 0;
+        auto start = std::chrono::steady_clock::now();
+        PayloadDecompressor decompressor(
+            PayloadCompression::Xz,
+            [&](const unsigned char* data, size_t length) {
+                ASSERT_EQ(std::memcmp(data, image.data() + received, length), 0);
+                received += length;
+            },
+            frames, threads);
+        for (size_t offset = 0; offset < compressed.size(); offset += 64 * 1024) {
+            decompressor.Update(compressed.data() + offset,
+                                std::min<size_t>(64 * 1024, compressed.size() - offset));
+        }
+        decompressor.Finish();
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        ASSERT_EQ(received, imageSize);
+        std::cout << "[ MEASURE  ] " << threads << " threads: "
+                  << imageSize / seconds / (1024 * 1024) << " MiB/s" << std::endl;
+    }
+}
+
+TEST_F(ArtifactParserTest, decryptorTestTagSplitAcrossChunks) {
+    auto plain = randomPayload(1000);
+    auto ciphertext = encrypt(plain);
+
+    for (size_t split = 0; split <= 16; split++) {
+        AESGCMDecryptor decryptor(aesKey, iv);
+        std::vector<unsigned char> out(ciphertext.size());
+        size_t head = ciphertext.size() - split;
+        size_t decrypted = decryptor.Update(ciphertext.data(), head, out.data());
+        // Remaining tag bytes arrive one at a time
+        for (size_t i = head; i < ciphertext.size(); i++) {
+            decrypted += decryptor.Update(ciphertext.data() + i, 1,
+                                          out.data() + decrypted);
+        }
+        out.resize(decrypted);
+        ASSERT_TRUE(decryptor.Finalize()) << "split " << split;
+        ASSERT_EQ(out, plain) << "split " << split;
+    }
+}
+
+TEST_F(ArtifactParserTest, decryptorTestExplicitTag) {
+    auto plain = randomPayload(4000);
+    auto ciphertext = encrypt(plain);
+    std::array<unsigned char, 16> tag{};
+    std::copy(ciphertext.end() - 16, ciphertext.end(), tag.begin());
+
+    AESGCMDecryptor decryptor(aesKey, iv);
+    std::vector<unsigned char> out(plain.size());
+    decryptor.UpdateCiphertext(ciphertext.data(), 1234, out.data());
+    decryptor.UpdateCiphertext(ciphertext.data() + 1234, plain.size() - 1234,
+                               out.data() + 1234);
+    ASSERT_TRUE(decryptor.Finalize(tag));
+    ASSERT_EQ(out, plain);
+
+    AESGCMDecryptor tampered(aesKey, iv);
+    tag[3] ^= 1;
+    tampered.UpdateCiphertext(ciphertext.data(), plain.size(), out.data());
+    ASSERT_FALSE(tampered.Finalize(tag));
+}
+
+TEST_F(ArtifactParserTest, decryptTestOneShot) {
+    auto plain = randomPayload(4000);
+    auto ciphertext = encrypt(plain);
+    ASSERT_EQ(ArtifactCryptoHelper::AESGCMDecrypt(ciphertext, aesKey, iv),
+              plain);
+
+    ciphertext[10] ^= 1;
+    ASSERT_TRUE(
+        ArtifactCryptoHelper::AESGCMDecrypt(ciphertext, aesKey, iv).empty());
+
+    std::vector<unsigned char> tooShort(10);
+    ASSERT_TRUE(
+        ArtifactCryptoHelper::AESGCMDecrypt(tooShort, aesKey, iv).empty());
+}
+
+TEST_F(ArtifactParserTest, incrementalVerificationTestChunked) {
+    auto plain = buildPlaintext(randomPayload(70000), "uri", 3);
+    ArtifactParser parser(test_key_path, aesKey, iv);
+
+    for (size_t chunkSize : {1, 100, 255, 256, 257, 4096}) {
+        parser.BeginVerification();
+        for (size_t offset = 0; offset < plain.size(); offset += chunkSize) {
+            size_t length = std::min(chunkSize, plain.size() - offset);
+            parser.UpdateVerification(plain.data() + offset, length);
+        }
+        ASSERT_TRUE(parser.FinishVerification()) << "chunk size " << chunkSize;
+    }
+
+    plain.back() ^= 1;
+    parser.BeginVerification();
+    parser.UpdateVerification(plain.data(), plain.size());
+    ASSERT_FALSE(parser.FinishVerification());
+    ASSERT_FALSE(parser.VerifySignature(plain));
+}
+
+TEST_F(ArtifactParserTest, incrementalVerificationTestNotStarted) {
+    ArtifactParser parser(test_key_path, aesKey, iv);
+    unsigned char byte = 0;
+    ASSERT_THROW(parser.UpdateVerification(&byte, 1),
+                 verify_signature_exception);
+    ASSERT_THROW(parser.FinishVerification(), verify_signature_exception);
+}
+
+TEST_F(ArtifactParserTest, verifySignatureTestShortPlaintext) {
+    ArtifactParser parser(test_key_path, aesKey, iv);
+    std::vector<unsigned char> shortPlain(100, 0);
+    ASSERT_FALSE(parser.VerifySignature(shortPlain));
+}
+
+TEST_F(ArtifactParserTest, parseArtifactViewTestPointsIntoBuffer) {
+    auto payload = randomPayload(5000);
+    auto plain = buildPlaintext(payload, "https://x", 9);
+    ArtifactParser parser(test_key_path, aesKey, iv);
+
+    auto view = parser.ParseArtifactView(plain);
+    ASSERT_EQ(view.rsaSignature.data, plain.data());
+    ASSERT_EQ(view.rsaSignature.size, 256);
+    ASSERT_EQ(view.header.sequenceNumber, 9);
+    ASSERT_EQ(view.header.hardwareUUID.data, plain.data() + HARDWARE_UUID_OFFSET);
+    ASSERT_EQ(view.header.uri, "https://x");
+    ASSERT_EQ(view.firmwarePayload.data,
+              plain.data() + URI_OFFSET + 9 + EXTENSIONS_LENGTH_SIZE);
+    ASSERT_EQ(view.header.extensions.size, 0);
+    ASSERT_EQ(view.header.payloadCompression, PayloadCompression::None);
+    ASSERT_TRUE(std::equal(view.firmwarePayload.begin(),
+                           view.firmwarePayload.end(), payload.begin(),
+                           payload.end()));
+
+    auto artifact = parser.ParseArtifact(plain);
+    ASSERT_EQ(artifact.firmwarePayload, payload);
+    ASSERT_EQ(artifact.header.uri, "https://x");
+}
+
+TEST_F(ArtifactParserTest, parseArtifactViewTestMalformed) {
+    ArtifactParser parser(test_key_path, aesKey, iv);
+    std::vector<unsigned char> tooShort(URI_OFFSET - 1);
+    ASSERT_THROW(parser.ParseArtifactView(tooShort), parse_exception);
+
+    auto plain = buildPlaintext({}, "abcdef", 1);
+    plain.resize(plain.size() - 1);
+    ASSERT_THROW(parser.ParseArtifactView(plain), parse_exception);
+
+    // A uri that overruns the artifact, and one that leaves no room for the extension length
+    std::vector<unsigned char> longUri(URI_OFFSET + 10);
+    uint16_t uriLength = 0xffff;
+    std::memcpy(longUri.data() + URI_LENGTH_OFFSET, &uriLength, sizeof(uriLength));
+    ASSERT_THROW(parser.ParseArtifactView(longUri), parse_exception);
+    uriLength = 8;
+    std::memcpy(longUri.data() + URI_LENGTH_OFFSET, &uriLength, sizeof(uriLength));
+    ASSERT_THROW(parser.ParseArtifactView(longUri), parse_exception);
+}
+
+TEST_F(ArtifactParserTest, parseArtifactViewTestMappedFile) {
+    auto payload = randomPayload(20000);
+    auto plain = buildPlaintext(payload, "", 5);
+    const std::string path = "artifact_parser_test_mapped.bin";
+    std::ofstream(path, std::ios::binary)
+        .write((const char*)plain.data(), plain.size());
+
+    {
+        MappedFile mapped(path);
+        ASSERT_EQ(mapped.size(), plain.size());
+        ArtifactParser parser(test_key_path, aesKey, iv);
+        auto view = parser.ParseArtifactView(mapped);
+        ASSERT_EQ(view.header.sequenceNumber, 5);
+        ASSERT_EQ(view.firmwarePayload.data,
+                  mapped.data() + URI_OFFSET + EXTENSIONS_LENGTH_SIZE);
+        ASSERT_TRUE(std::equal(view.firmwarePayload.begin(),
+                               view.firmwarePayload.end(), payload.begin(),
+                               payload.end()));
+    }
+    std::remove(path.c_str());
+
+    ASSERT_THROW(MappedFile("/nonexistent/artifact"), map_file_exception);
+}
+
+TEST_F(ArtifactParserTest, decryptInPlaceTest) {
+    auto plain = randomPayload(50000);
+    auto ciphertext = encrypt(plain);
+    const unsigned char* buffer = ciphertext.data();
+
+    ArtifactParser parser(test_key_path, aesKey, iv);
+    auto decrypted = parser.DecryptArtifact(std::move(ciphertext));
+    // Same allocation, shortened to the plaintext
+    ASSERT_EQ(decrypted.data(), buffer);
+    ASSERT_EQ(decrypted, plain);
+
+    auto tampered = encrypt(plain);
+    tampered[100] ^= 1;
+    ASSERT_TRUE(parser.DecryptArtifact(std::move(tampered)).empty());
+}
+
+TEST_F(ArtifactParserTest, decryptIntoCallerBufferTest) {
+    auto plain = randomPayload(3000);
+    auto ciphertext = encrypt(plain);
+    ArtifactParser parser(test_key_path, aesKey, iv);
+
+    std::vector<unsigned char> out(plain.size());
+    ASSERT_EQ(parser.DecryptArtifact(ciphertext.data(), ciphertext.size(),
+                                     out.data(), out.size()),
+              plain.size());
+    ASSERT_EQ(out, plain);
+
+    ASSERT_THROW(parser.DecryptArtifact(ciphertext.data(), ciphertext.size(),
+                                        out.data(), out.size() - 1),
+                 decryption_exception);
+
+    ciphertext.back() ^= 1;
+    ASSERT_EQ(parser.DecryptArtifact(ciphertext.data(), ciphertext.size(),
+                                     out.data(), out.size()),
+              -1);
+    ASSERT_EQ(ArtifactCryptoHelper::AESGCMDecryptInPlace(ciphertext.data(), 10,
+                                                        aesKey, iv),
+              -1);
+}
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,959 @@
+#include "UpdateDownloadClient.h"
+
+#include <malloc.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <future>
+#include <random>
+
+#include "gtest/gtest.h"
+#include "http_test_server.h"
+
+// Heap use of the test thread (the test server's copies don't count), so the
+// growth of download buffers can be measured. Only allocations of at least
+// largeAllocation bytes are counted.
+static thread_local bool tracking = false;
+static std::atomic<size_t> largeAllocations{0};
+static std::atomic<size_t> liveBytes{0};
+static std::atomic<size_t> peakBytes{0};
+static const size_t largeAllocation = 64 * 1024;
+
+void* operator new(size_t size) {
+    void* p = malloc(size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    if (tracking) {
+        size_t live = liveBytes += malloc_usable_size(p);
+        size_t peak = peakBytes;
+        while (live > peak && !peakBytes.compare_exchange_weak(peak, live)) {
+        }
+        if (size >= largeAllocation) {
+            largeAllocations++;
+        }
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    if (p != nullptr && tracking) {
+        liveBytes -= std::min<size_t>(liveBytes, malloc_usable_size(p));
+    }
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+
+struct HeapUsage {
+    size_t largeAllocations;
+    size_t peakBytes;
+    // Peak resident set size since the measurement started, in kB
+    long peakRssKb;
+};
+
+class DownloadClientTest : public ::testing::Test {
+   protected:
+    static std::string randomBody(size_t size) {
+        std::string body(size, 0);
+        std::mt19937 rng(size);
+        for (auto& c : body) {
+            c = (char)rng();
+        }
+        return body;
+    }
+
+    static UpdateDownloadClient makeClient(const HttpTestServer& server) {
+        return UpdateDownloadClient(server.address(),
+                                    std::chrono::milliseconds(10), "", "", "",
+                                    1);
+    }
+
+    static constexpr const char* serverCert = "download_client_test_server.pem";
+    static constexpr const char* serverKey =
+        "download_client_test_server_key.pem";
+    static constexpr const char* clientCert = "download_client_test_client.pem";
+    static constexpr const char* clientKey =
+        "download_client_test_client_key.pem";
+
+    // Certificates of an HTTPS test server, and of the clients talking to it
+    static void writeTlsCertificates() {
+        writeSelfSignedCertificate(serverCert, serverKey);
+        writeSelfSignedCertificate(clientCert, clientKey);
+    }
+
+    // A client of an HTTPS test server, trusting its certificate
+    static UpdateDownloadClient makeTlsClient(const HttpTestServer& server) {
+        return UpdateDownloadClient(server.address(),
+                                    std::chrono::milliseconds(10), serverCert,
+                                    clientCert, clientKey, 1);
+    }
+
+    // Writes an RSA key and a certificate for it, signed by itself, as PEM
+    static void writeSelfSignedCertificate(const std::string& certPath,
+                                           const std::string& keyPath) {
+        EVP_PKEY* key = nullptr;
+        EVP_PKEY_CTX* keyCtx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr);
+        EVP_PKEY_keygen_init(keyCtx);
+        EVP_PKEY_CTX_set_rsa_keygen_bits(keyCtx, 2048);
+        EVP_PKEY_keygen(keyCtx, &key);
+        EVP_PKEY_CTX_free(keyCtx);
+
+        X509* cert = X509_new();
+        X509_set_version(cert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 60 * 60);
+        X509_set_pubkey(cert, key);
+        X509_NAME* name = X509_get_subject_name(cert);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                   (const unsigned char*)"localhost", -1, -1,
+                                   0);
+        X509_set_issuer_name(cert, name);
+        X509_sign(cert, key, EVP_sha256());
+
+        FILE* certFile = fopen(certPath.c_str(), "w");
+        PEM_write_X509(certFile, cert);
+        fclose(certFile);
+        FILE* keyFile = fopen(keyPath.c_str(), "w");
+        PEM_write_PrivateKey(keyFile, key, nullptr, nullptr, 0, nullptr,
+                             nullptr);
+        fclose(keyFile);
+        X509_free(cert);
+        EVP_PKEY_free(key);
+    }
+
+    static void startMeasurement() {
+        // Resets VmHWM to the current RSS
+        std::ofstream("/proc/self/clear_refs") << "5";
+        largeAllocations = 0;
+        liveBytes = 0;
+        peakBytes = 0;
+        tracking = true;
+    }
+
+    static HeapUsage stopMeasurement() {
+        tracking = false;
+        long hwm = -1;
+        std::ifstream status("/proc/self/status");
+        std::string key;
+        while (status >> key) {
+            if (key == "VmHWM:") {
+                status >> hwm;
+                break;
+            }
+        }
+        return HeapUsage{largeAllocations, peakBytes, hwm};
+    }
+
+   public:
+    static void SetUpTestSuite() { UpdateDownloadClient::GlobalInit(); }
+
+    static void TearDownTestSuite() { UpdateDownloadClient::GlobalCleanup(); }
+};
+
+TEST_F(DownloadClientTest, fetchArtifactTestPreallocatesFromContentLength) {
+    const std::string body = randomBody(16 * 1024 * 1024);
+    bool chunked = false;
+    HttpTestServer server([&](const HttpRequest&) {
+        HttpResponse response;
+        response.body = body;
+        response.chunked = chunked;
+        return response;
+    });
+    auto client = makeClient(server);
+
+    // Without Content-Length the buffer can only grow geometrically
+    chunked = true;
+    startMeasurement();
+    auto unknownLength = client.FetchArtifact(1);
+    HeapUsage before = stopMeasurement();
+    ASSERT_EQ(unknownLength.httpCode, 200);
+    ASSERT_EQ(unknownLength.artifact.size(), body.size());
+    unknownLength = {};
+
+    chunked = false;
+    startMeasurement();
+    auto knownLength = client.FetchArtifact(1);
+    HeapUsage after = stopMeasurement();
+    ASSERT_EQ(knownLength.httpCode, 200);
+    ASSERT_EQ(knownLength.artifact.size(), body.size());
+    ASSERT_EQ(memcmp(knownLength.artifact.data(), body.data(), body.size()), 0);
+
+    std::cout << "[ MEASURE  ] 16 MiB artifact, chunked: "
+              << before.largeAllocations << " large allocations, peak heap "
+              << before.peakBytes / 1024 << " kB, peak RSS "
+              << before.peakRssKb << " kB" << std::endl;
+    std::cout << "[ MEASURE  ] 16 MiB artifact, Content-Length: "
+              << after.largeAllocations << " large allocations, peak heap "
+              << after.peakBytes / 1024 << " kB, peak RSS " << after.peakRssKb
+              << " kB" << std::endl;
+
+    ASSERT_EQ(after.largeAllocations, 1u);
+    ASSERT_LT(after.peakBytes, body.size() + largeAllocation);
+    ASSERT_GT(before.largeAllocations, after.largeAllocations);
+    ASSERT_GT(before.peakBytes, after.peakBytes);
+}
+
+TEST_F(DownloadClientTest, fetchArtifactTestSinkAndLengthHint) {
+    const std::string body = randomBody(1024 * 1024 + 17);
+    HttpTestServer server([&](const HttpRequest& request) {
+        HttpResponse response;
+        if (request.path != "/getUpdate" || request.query.at("updateId") != "7") {
+            response.status = 404;
+            response.body = "not found";
+            return response;
+        }
+        response.body = body;
+        return response;
+    });
+    auto client = makeClient(server);
+
+    std::string received;
+    curl_off_t announced = -1;
+    long httpCode = client.FetchArtifact(
+        7,
+        [&](const unsigned char* data, size_t length) {
+            received.append((const char*)data, length);
+            return true;
+        },
+        [&](curl_off_t length) { announced = length; });
+    ASSERT_EQ(httpCode, 200);
+    ASSERT_EQ(announced, (curl_off_t)body.size());
+    ASSERT_EQ(received, body);
+
+    // Bodies of error responses never reach the sink
+    received.clear();
+    httpCode = client.FetchArtifact(8, [&](const unsigned char* data,
+                                           size_t length) {
+        received.append((const char*)data, length);
+        return true;
+    });
+    ASSERT_EQ(httpCode, 404);
+    ASSERT_TRUE(received.empty());
+    ASSERT_TRUE(client.FetchArtifact(8).artifact.empty());
+}
+
+TEST_F(DownloadClientTest, fetchArtifactTestSinkAborts) {
+    HttpTestServer server([&](const HttpRequest&) {
+        HttpResponse response;
+        response.body = randomBody(1024 * 1024);
+        return response;
+    });
+    auto client = makeClient(server);
+
+    ASSERT_THROW(client.FetchArtifact(
+                     1, [](const unsigned char*, size_t) { return false; }),
+                 fetch_exception);
+    ASSERT_THROW(client.FetchArtifact(1,
+                                      [](const unsigned char*, size_t) -> bool {
+                                          throw decryption_exception("bad");
+                                      }),
+                 decryption_exception);
+}
+
+TEST_F(DownloadClientTest, fetchArtifactToFileTest) {
+    const std::string body = randomBody(3 * 1024 * 1024 + 5);
+    HttpTestServer server([&](const HttpRequest& request) {
+        HttpResponse response;
+        if (request.query.at("updateId") != "1") {
+            response.status = 404;
+            return response;
+        }
+        response.body = body;
+        return response;
+    });
+    auto client = makeClient(server);
+    const std::string path = "download_client_test_staged.artifact";
+
+    ASSERT_EQ(client.FetchArtifactToFile(1, path), 200);
+    ASSERT_NE(access((path + ".part").c_str(), F_OK), 0);
+    {
+        MappedFile staged(path);
+        ASSERT_EQ(staged.size(), body.size());
+        ASSERT_EQ(memcmp(staged.data(), body.data(), body.size()), 0);
+    }
+    std::remove(path.c_str());
+
+    ASSERT_EQ(client.FetchArtifactToFile(2, path), 404);
+    ASSERT_NE(access(path.c_str(), F_OK), 0);
+    ASSERT_NE(access((path + ".part").c_str(), F_OK), 0);
+
+    ASSERT_THROW(client.FetchArtifactToFile(1, "/nonexistent/dir/artifact"),
+                 fetch_exception);
+}
+
+TEST_F(DownloadClientTest, fetchArtifactToFileTestResumesAfterDrop) {
+    const std::string body = randomBody(10 * 1024 * 1024 + 3);
+    const size_t dropAfter = 6 * 1024 * 1024 + 100;
+    std::vector<HttpRequest> requests;
+    HttpTestServer server([&](const HttpRequest& request) {
+        requests.push_back(request);
+        HttpResponse response = serveContent(request, body, "\"v1\"");
+        if (requests.size() == 1) {
+            response.dropAfter = dropAfter;
+        }
+        return response;
+    });
+    auto client = makeClient(server);
+    const std::string path = "download_client_test_resumed.artifact";
+
+    ASSERT_FALSE(UpdateDownloadClient::HasPartialDownload(1, path));
+    ASSERT_THROW(client.FetchArtifactToFile(1, path), fetch_exception);
+    ASSERT_NE(access(path.c_str(), F_OK), 0);
+    ASSERT_EQ(access((path + ".part").c_str(), F_OK), 0);
+    ASSERT_EQ(access((path + ".progress").c_str(), F_OK), 0);
+    ASSERT_TRUE(UpdateDownloadClient::HasPartialDownload(1, path));
+    ASSERT_FALSE(UpdateDownloadClient::HasPartialDownload(2, path));
+
+    ASSERT_EQ(client.FetchArtifactToFile(1, path), 200);
+    ASSERT_FALSE(UpdateDownloadClient::HasPartialDownload(1, path));
+    ASSERT_EQ(requests.size(), 2);
+    ASSERT_EQ(requests[1].headers["range"],
+              "bytes=" + std::to_string(dropAfter) + "-");
+    ASSERT_EQ(requests[1].headers["if-range"], "\"v1\"");
+    ASSERT_NE(access((path + ".part").c_str(), F_OK), 0);
+    ASSERT_NE(access((path + ".progress").c_str(), F_OK), 0);
+    {
+        MappedFile staged(path);
+        ASSERT_EQ(staged.size(), body.size());
+        ASSERT_EQ(memcmp(staged.data(), body.data(), body.size()), 0);
+    }
+    std::remove(path.c_str());
+}
+
+TEST_F(DownloadClientTest, fetchArtifactToFileTestRestartsForChangedArtifact) {
+    std::string body = randomBody(2 * 1024 * 1024);
+    std::string etag = "\"v1\"";
+    bool rangeSupport = true;
+    bool drop = true;
+    HttpTestServer server([&](const HttpRequest& request) {
+        HttpRequest served = request;
+        if (!rangeSupport) {
+            served.headers.erase("range");
+        }
+        HttpResponse response = serveContent(served, body, etag);
+        if (drop) {
+            response.dropAfter = 1024 * 1024;
+        }
+        return response;
+    });
+    auto client = makeClient(server);
+    const std::string path = "download_client_test_changed.artifact";
+    auto expectStaged = [&]() {
+        MappedFile staged(path);
+        ASSERT_EQ(staged.size(), body.size());
+        ASSERT_EQ(memcmp(staged.data(), body.data(), body.size()), 0);
+    };
+
+    // If-Range doesn't match the new ETag, so the whole new artifact is sent
+    ASSERT_THROW(client.FetchArtifactToFile(1, path), fetch_exception);
+    body = randomBody(1024 * 1024 + 1);
+    etag = "\"v2\"";
+    drop = false;
+    ASSERT_EQ(client.FetchArtifactToFile(1, path), 200);
+    expectStaged();
+    std::remove(path.c_str());
+
+    // Servers without range support answer with the whole artifact as well
+    drop = true;
+    ASSERT_THROW(client.FetchArtifactToFile(1, path), fetch_exception);
+    rangeSupport = false;
+    drop = false;
+    ASSERT_EQ(client.FetchArtifactToFile(1, path), 200);
+    expectStaged();
+    std::remove(path.c_str());
+
+    // Progress of another update is not continued
+    drop = true;
+    ASSERT_THROW(client.FetchArtifactToFile(1, path), fetch_exception);
+    drop = false;
+    rangeSupport = true;
+    body = randomBody(3 * 1024 * 1024);
+    ASSERT_EQ(client.FetchArtifactToFile(2, path), 200);
+    expectStaged();
+    std::remove(path.c_str());
+}
+
+TEST_F(DownloadClientTest, fetchArtifactToFileTestAfterDiscard) {
+    const std::string body = randomBody(2 * 1024 * 1024 + 9);
+    std::vector<HttpRequest> requests;
+    bool drop = false;
+    HttpTestServer server([&](const HttpRequest& request) {
+        requests.push_back(request);
+        HttpResponse response = serveContent(request, body, "\"v1\"");
+        if (drop) {
+            response.dropAfter = 1024 * 1024;
+        }
+        return response;
+    });
+    auto client = makeClient(server);
+    const std::string path = "download_client_test_discarded.artifact";
+    auto expectStaged = [&]() {
+        MappedFile staged(path);
+        ASSERT_EQ(staged.size(), body.size());
+        ASSERT_EQ(memcmp(staged.data(), body.data(), body.size()), 0);
+    };
+
+    // A staged artifact that got corrupt, as one failing its tag check would be
+    ASSERT_EQ(client.FetchArtifactToFile(1, path), 200);
+    {
+        std::fstream staged(path, std::ios::in | std::ios::out | std::ios::binary);
+        staged.seekp(1000);
+        staged.put((char)(body[1000] ^ 1));
+    }
+    UpdateDownloadClient::DiscardStagedArtifact(path);
+    ASSERT_NE(access(path.c_str(), F_OK), 0);
+    ASSERT_EQ(client.FetchArtifactToFile(1, path), 200);
+    ASSERT_EQ(requests.size(), 2);
+    ASSERT_EQ(requests[1].headers.count("range"), 0);
+    expectStaged();
+
+    // The progress of a discarded partial download isn't continued either
+    drop = true;
+    ASSERT_THROW(client.FetchArtifactToFile(1, path), fetch_exception);
+    ASSERT_EQ(access((path + ".progress").c_str(), F_OK), 0);
+    UpdateDownloadClient::DiscardStagedArtifact(path);
+    ASSERT_NE(access((path + ".part").c_str(), F_OK), 0);
+    ASSERT_NE(access((path + ".progress").c_str(), F_OK), 0);
+    drop = false;
+    ASSERT_EQ(client.FetchArtifactToFile(1, path), 200);
+    ASSERT_EQ(requests.size(), 4);
+    ASSERT_EQ(requests[3].headers.count("range"), 0);
+    expectStaged();
+    std::remove(path.c_str());
+}
+
+TEST_F(DownloadClientTest, fetchArtifactRangeTest) {
+    std::string body = randomBody(1024 * 1024);
+    std::string etag = "\"v1\"";
+    bool rangeSupport = true;
+    std::string manifest = randomBody(100);
+    std::vector<std::string> ifRanges;
+    HttpTestServer server([&](const HttpRequest& request) {
+        if (request.query.count("manifest") != 0) {
+            HttpResponse response;
+            if (request.query.at("updateId") == "1") {
+                response.body = manifest;
+            } else {
+                response.status = 404;
+            }
+            return response;
+        }
+        HttpRequest served = request;
+        if (!rangeSupport) {
+            served.headers.erase("range");
+        }
+        auto ifRange = request.headers.find("if-range");
+        ifRanges.push_back(ifRange != request.headers.end() ? ifRange->second
+                                                            : "");
+        return serveContent(served, body, etag);
+    });
+    auto client = makeClient(server);
+
+    auto manifestResp = client.FetchManifest(1);
+    ASSERT_EQ(manifestResp.httpCode, 200);
+    ASSERT_EQ(std::string(manifestResp.manifest.begin(),
+                          manifestResp.manifest.end()),
+              manifest);
+    manifestResp = client.FetchManifest(2);
+    ASSERT_EQ(manifestResp.httpCode, 404);
+    ASSERT_TRUE(manifestResp.manifest.empty());
+
+    std::string rangeETag;
+    std::string received;
+    auto sink = [&](const unsigned char* data, size_t length) {
+        received.append((const char*)data, length);
+        return true;
+    };
+    ASSERT_EQ(client.FetchArtifactRange(1, 1000, 1999, rangeETag, sink), 206);
+    ASSERT_EQ(client.FetchArtifactRange(1, 500000, 500000, rangeETag, sink),
+              206);
+    ASSERT_EQ(received, body.substr(1000, 1000) + body.substr(500000, 1));
+    // Later ranges must come from the same artifact as the first
+    ASSERT_EQ(rangeETag, etag);
+    ASSERT_EQ(ifRanges, std::vector<std::string>({"", etag}));
+
+    etag = "\"v2\"";
+    ASSERT_THROW(client.FetchArtifactRange(1, 0, 99, rangeETag, sink),
+                 fetch_exception);
+    rangeETag.clear();
+    rangeSupport = false;
+    ASSERT_THROW(client.FetchArtifactRange(1, 0, 99, rangeETag, sink),
+                 fetch_exception);
+}
+
+TEST_F(DownloadClientTest, fetchArtifactTestSegmentedInOrder) {
+    const std::string body = randomBody(5 * 1024 * 1024 + 11);
+    HttpTestServer server([&](const HttpRequest& request) {
+        HttpResponse response = serveContent(request, body, "\"v1\"");
+        // Later segments complete first and have to be held back
+        unsigned long long first = 0;
+        auto range = request.headers.find("range");
+        if (range != request.headers.end() &&
+            sscanf(range->second.c_str(), "bytes=%llu-", &first) == 1) {
+            response.delay = std::chrono::milliseconds(
+                first < body.size() / 2 ? 40 : 0);
+        }
+        return response;
+    });
+    auto client = makeClient(server);
+    SegmentedDownloadOptions options;
+    options.connections = 4;
+    options.initialSegmentSize = 256 * 1024;
+    options.minSegmentSize = 64 * 1024;
+    options.maxSegmentSize = 512 * 1024;
+    client.SetSegmentedDownload(options);
+
+    std::string received;
+    curl_off_t announced = -1;
+    long httpCode = client.FetchArtifact(
+        1,
+        [&](const unsigned char* data, size_t length) {
+            received.append((const char*)data, length);
+            return true;
+        },
+        [&](curl_off_t length) { announced = length; });
+    ASSERT_EQ(httpCode, 200);
+    ASSERT_EQ(announced, (curl_off_t)body.size());
+    ASSERT_EQ(received.size(), body.size());
+    ASSERT_TRUE(received == body);
+    ASSERT_GT(server.requestCount(), 4);
+    ASSERT_LE(server.connectionCount(), 5);
+
+    // Resumed staged downloads are segmented as well
+    const std::string path = "download_client_test_segmented.artifact";
+    ASSERT_EQ(client.FetchArtifactToFile(1, path), 200);
+    {
+        MappedFile staged(path);
+        ASSERT_EQ(staged.size(), body.size());
+        ASSERT_EQ(memcmp(staged.data(), body.data(), body.size()), 0);
+    }
+    std::remove(path.c_str());
+}
+
+TEST_F(DownloadClientTest, fetchArtifactTestSegmentedWithoutRangeSupport) {
+    const std::string body = randomBody(3 * 1024 * 1024);
+    HttpTestServer server([&](const HttpRequest&) {
+        HttpResponse response;
+        response.body = body;
+        return response;
+    });
+    auto client = makeClient(server);
+    SegmentedDownloadOptions options;
+    options.connections = 4;
+    client.SetSegmentedDownload(options);
+
+    auto resp = client.FetchArtifact(1);
+    ASSERT_EQ(resp.httpCode, 200);
+    ASSERT_EQ(resp.artifact.size(), body.size());
+    ASSERT_EQ(memcmp(resp.artifact.data(), body.data(), body.size()), 0);
+    ASSERT_EQ(server.requestCount(), 1);
+}
+
+// Not a pass/fail criterion, the figures depend on how busy the machine is
+TEST_F(DownloadClientTest, fetchArtifactBenchmarkSegmentedConnections) {
+    // 50 ms latency, and 2 MiB/s per connection as a TCP window limits it on
+    // such a link. Over TLS like Server.go, so the handshakes of the extra
+    // connections count.
+    const std::string body = randomBody(8 * 1024 * 1024);
+    writeTlsCertificates();
+    HttpTestServer server(
+        [&](const HttpRequest& request) {
+            HttpResponse response = serveContent(request, body, "\"v1\"");
+            response.delay = std::chrono::milliseconds(50);
+            response.bytesPerSecond = 2 * 1024 * 1024;
+            return response;
+        },
+        serverCert, serverKey);
+    auto client = makeTlsClient(server);
+
+    for (int connections : {1, 2, 4, 8}) {
+        SegmentedDownloadOptions options;
+        options.connections = connections;
+        options.initialSegmentSize = 512 * 1024;
+        options.segmentDuration = std::chrono::milliseconds(500);
+        client.SetSegmentedDownload(options);
+
+        size_t received = 0;
+        auto start = std::chrono::steady_clock::now();
+        long httpCode = client.FetchArtifact(
+            1, [&](const unsigned char*, size_t length) {
+                received += length;
+                return true;
+            });
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        ASSERT_EQ(httpCode, 200);
+        ASSERT_EQ(received, body.size());
+        std::cout << "[ MEASURE  ] " << connections << " connections: "
+                  << body.size() / seconds / (1024 * 1024) << " MiB/s"
+                  << std::endl;
+    }
+}
+
+TEST_F(DownloadClientTest, updateCycleTestReusesConnection) {
+    const std::string body = randomBody(256 * 1024);
+    HttpTestServer server([&](const HttpRequest& request) {
+        HttpResponse response;
+        if (request.path == "/whatsNew") {
+            response.body = "[3]";
+        } else if (request.path == "/getDecryptionKey") {
+            nlohmann::json key;
+            key["ct"] = std::vector<int>(256, 1);
+            key["iv"] = std::vector<int>(12, 2);
+            response.body = key.dump();
+        } else {
+            response = serveContent(request, body, "\"v1\"");
+        }
+        return response;
+    });
+    auto client = makeClient(server);
+
+    // Poll, key and artifact of one update cycle share a connection, twice
+    for (int cycle = 1; cycle <= 2; cycle++) {
+        ASSERT_EQ(client.StartPolling(), std::vector<unsigned int>{3});
+        auto key = client.FetchDecryptionKey(3);
+        ASSERT_EQ(key.httpCode, 200);
+        ASSERT_EQ(key.iv[11], 2);
+        auto artifact = client.FetchArtifact(3);
+        ASSERT_EQ(artifact.httpCode, 200);
+        ASSERT_EQ(artifact.artifact.size(), body.size());
+        ASSERT_EQ(server.requestCount(), 3 * cycle);
+        ASSERT_EQ(server.connectionCount(), 1);
+    }
+
+    // Connections opened for segments go back to the share as well
+    SegmentedDownloadOptions options;
+    options.connections = 3;
+    options.initialSegmentSize = 64 * 1024;
+    options.minSegmentSize = 16 * 1024;
+    client.SetSegmentedDownload(options);
+    ASSERT_EQ(client.FetchArtifact(3).artifact.size(), body.size());
+    int connections = server.connectionCount();
+    ASSERT_LE(connections, 3);
+    ASSERT_EQ(client.FetchArtifact(3).artifact.size(), body.size());
+    ASSERT_EQ(server.connectionCount(), connections);
+}
+
+TEST_F(DownloadClientTest, tlsSessionCacheTestResumesAfterRestart) {
+    const std::string cache = "download_client_test_tls_session";
+    writeTlsCertificates();
+    std::remove(cache.c_str());
+
+    HttpTestServer server(
+        [](const HttpRequest&) {
+            HttpResponse response;
+            response.body = "[3]";
+            return response;
+        },
+        serverCert, serverKey);
+    auto startClient = [&](bool withCache) {
+        auto client = std::make_unique<UpdateDownloadClient>(
+            server.address(), std::chrono::milliseconds(10), serverCert,
+            clientCert, clientKey, 1);
+        if (withCache) {
+            EXPECT_TRUE(client->SetTlsSessionCache(cache));
+        }
+        EXPECT_EQ(client->StartPolling(), std::vector<unsigned int>{3});
+        return client->GetTlsSessionStats();
+    };
+
+    TlsSessionStats first = startClient(true);
+    ASSERT_EQ(first.handshakes, 1u);
+    ASSERT_EQ(first.resumed, 0u);
+    ASSERT_EQ(access(cache.c_str(), F_OK), 0);
+
+    // A restarted client resumes the persisted session
+    TlsSessionStats restarted = startClient(true);
+    ASSERT_EQ(restarted.handshakes, 1u);
+    ASSERT_EQ(restarted.resumed, 1u);
+    ASSERT_EQ(server.resumedCount(), 1);
+
+    // Without the cache it is a full handshake again
+    TlsSessionStats uncached = startClient(false);
+    ASSERT_EQ(uncached.resumed, 0u);
+    ASSERT_EQ(server.resumedCount(), 1);
+    ASSERT_EQ(server.connectionCount(), 3);
+}
+
+TEST_F(DownloadClientTest, fetchDecryptionKeyTestDeltaSource) {
+    HttpTestServer server([&](const HttpRequest& request) {
+        HttpResponse response;
+        nlohmann::json key;
+        key["ct"] = std::vector<int>(256, 1);
+        key["iv"] = std::vector<int>(12, 2);
+        if (request.query.count("delta") > 0) {
+            key["source"]["length"] = 1u << 30;
+            key["source"]["sha256"] = std::vector<int>(32, 7);
+        }
+        response.body = key.dump();
+        return response;
+    });
+    auto client = makeClient(server);
+
+    // The key of a delta names its source image, before any of the delta is downloaded
+    client.SetDeltaArtifact(true);
+    auto key = client.FetchDecryptionKey(3);
+    ASSERT_EQ(key.httpCode, 200);
+    ASSERT_TRUE(key.deltaSource.has_value());
+    ASSERT_EQ(key.deltaSource->length, 1u << 30);
+    ASSERT_EQ(key.deltaSource->sha256[31], 7);
+
+    client.SetDeltaArtifact(false);
+    key = client.FetchDecryptionKey(3);
+    ASSERT_EQ(key.httpCode, 200);
+    ASSERT_FALSE(key.deltaSource.has_value());
+}
+
+TEST_F(DownloadClientTest, fetchKeyAndArtifactTestOverlaps) {
+    const std::string body = randomBody(1024 * 1024);
+    int keyStatus = 200;
+    writeTlsCertificates();
+    HttpTestServer server(
+        [&](const HttpRequest& request) {
+            HttpResponse response;
+            if (request.path == "/getDecryptionKey") {
+                nlohmann::json key;
+                key["ct"] = std::vector<int>(256, 1);
+                key["iv"] = std::vector<int>(12, 2);
+                response.status = keyStatus;
+                response.body = key.dump();
+                response.delay = std::chrono::milliseconds(150);
+            } else {
+                response.body = body;
+                response.bytesPerSecond = 2 * 1024 * 1024;
+            }
+            return response;
+        },
+        serverCert, serverKey, true);
+    auto client = makeTlsClient(server);
+
+    std::string received;
+    size_t receivedBeforeKey = 0;
+    DecryptionKeyServerResponse key{};
+    long httpCode = client.FetchKeyAndArtifact(
+        5,
+        [&](const DecryptionKeyServerResponse& response) {
+            key = response;
+            receivedBeforeKey = received.size();
+        },
+        [&](const unsigned char* data, size_t length) {
+            received.append((const char*)data, length);
+            return true;
+        },
+        body.size());
+    ASSERT_EQ(httpCode, 200);
+    ASSERT_EQ(key.httpCode, 200);
+    ASSERT_EQ(key.iv[0], 2);
+    ASSERT_TRUE(received == body);
+    // The artifact streamed while the key response was still pending, both
+    // multiplexed over one HTTP/2 connection
+    ASSERT_GT(receivedBeforeKey, 0u);
+    ASSERT_LT(receivedBeforeKey, body.size());
+    ASSERT_EQ(server.connectionCount(), 1);
+    ASSERT_EQ(server.http2Count(), 1);
+
+    // Beyond maxBeforeKey the artifact waits for the key, and continues once it is handled
+    received.clear();
+    receivedBeforeKey = 0;
+    httpCode = client.FetchKeyAndArtifact(
+        5,
+        [&](const DecryptionKeyServerResponse&) { receivedBeforeKey = received.size(); },
+        [&](const unsigned char* data, size_t length) {
+            received.append((const char*)data, length);
+            return true;
+        },
+        64 * 1024);
+    ASSERT_EQ(httpCode, 200);
+    ASSERT_TRUE(received == body);
+    ASSERT_LE(receivedBeforeKey, 64u * 1024);
+
+    // A failing key handler aborts the artifact
+    keyStatus = 404;
+    ASSERT_THROW(client.FetchKeyAndArtifact(
+                     5,
+                     [](const DecryptionKeyServerResponse& response) {
+                         if (response.httpCode != 200) {
+                             throw fetch_exception("no key");
+                         }
+                     },
+                     [](const unsigned char*, size_t) { return true; }, body.size()),
+                 fetch_exception);
+}
+
+TEST_F(DownloadClientTest, startPollingTestLongPoll) {
+    std::mutex mutex;
+    std::condition_variable published;
+    bool available = false;
+    std::vector<std::string> waits;
+    HttpTestServer server([&](const HttpRequest& request) {
+        HttpResponse response;
+        std::unique_lock<std::mutex> lock(mutex);
+        waits.push_back(request.query.count("wait") ? request.query.at("wait")
+                                                     : "");
+        // Held like Server.go does, until an update is published
+        published.wait_for(lock, std::chrono::seconds(2),
+                           [&] { return available; });
+        if (!available) {
+            response.status = 204;
+            return response;
+        }
+        response.body = "[4]";
+        return response;
+    });
+    auto client = UpdateDownloadClient(server.address(),
+                                       std::chrono::milliseconds(50), "", "",
+                                       "", 1);
+    client.SetLongPoll(std::chrono::seconds(2));
+
+    auto polling = std::async(std::launch::async,
+                              [&client] { return client.StartPolling(); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    auto publishedAt = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        available = true;
+    }
+    published.notify_all();
+    ASSERT_EQ(polling.get(), std::vector<unsigned int>{4});
+    double latency = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - publishedAt)
+                         .count();
+    std::cout << "[ MEASURE  ] long poll noticed the update after "
+              << latency * 1000 << " ms with " << server.requestCount()
+              << " request(s)" << std::endl;
+
+    // Polling every 50 ms would have taken 6 requests, and up to 50 ms more
+    ASSERT_EQ(server.requestCount(), 1);
+    ASSERT_LT(latency, 0.05);
+    ASSERT_EQ(waits[0], "2");
+}
+
+TEST_F(DownloadClientTest, startPollingTestFallsBackToPolling) {
+    // A server that doesn't hold requests answers right away
+    HttpTestServer server([&](const HttpRequest&) {
+        HttpResponse response;
+        if (server.requestCount() < 4) {
+            response.status = 204;
+            return response;
+        }
+        response.body = "[4]";
+        return response;
+    });
+    auto client = UpdateDownloadClient(server.address(),
+                                       std::chrono::milliseconds(50), "", "",
+                                       "", 1);
+    client.SetLongPoll(std::chrono::seconds(60));
+
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_EQ(client.StartPolling(), std::vector<unsigned int>{4});
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    ASSERT_EQ(server.requestCount(), 4);
+    // Still spaced by the poll interval
+    ASSERT_GE(seconds, 0.15);
+}
+
+// Answers /whatsNew like Server.go does, with the ETag of the available list
+// and only the updates newer than since
+static HttpResponse whatsNewResponse(const HttpRequest& request,
+                                     const std::vector<unsigned int>& available) {
+    HttpResponse response;
+    if (available.empty()) {
+        response.status = 204;
+        return response;
+    }
+    std::string etag = "\"";
+    for (auto id : available) {
+        etag += std::to_string(id) + "-";
+    }
+    etag += "\"";
+    response.headers["ETag"] = etag;
+    if (request.headers.count("if-none-match") &&
+        request.headers.at("if-none-match") == etag) {
+        response.status = 304;
+        return response;
+    }
+    unsigned long since = request.query.count("since")
+                              ? std::stoul(request.query.at("since"))
+                              : 0;
+    response.body = "[";
+    for (auto id : available) {
+        if (id > since) {
+            response.body += (response.body.size() > 1 ? "," : "") +
+                             std::to_string(id);
+        }
+    }
+    response.body += "]";
+    return response;
+}
+
+TEST_F(DownloadClientTest, startPollingTestConditionalAndSince) {
+    std::mutex mutex;
+    std::vector<unsigned int> available{3, 5};
+    std::vector<HttpRequest> requests;
+    std::vector<HttpResponse> responses;
+    HttpTestServer server([&](const HttpRequest& request) {
+        std::lock_guard<std::mutex> lock(mutex);
+        requests.push_back(request);
+        responses.push_back(whatsNewResponse(request, available));
+        return responses.back();
+    });
+    auto client = UpdateDownloadClient(server.address(),
+                                       std::chrono::milliseconds(10), "", "",
+                                       "", 1);
+
+    ASSERT_EQ(client.StartPolling(), (std::vector<unsigned int>{3, 5}));
+    ASSERT_EQ(requests[0].query.count("since"), 0);
+    ASSERT_EQ(requests[0].headers.count("if-none-match"), 0);
+
+    // Nothing changed: a 304 without body, and the known updates
+    ASSERT_EQ(client.StartPolling(), (std::vector<unsigned int>{3, 5}));
+    ASSERT_EQ(requests[1].query.at("since"), "5");
+    ASSERT_EQ(requests[1].headers.at("if-none-match"),
+              responses[0].headers.at("ETag"));
+    ASSERT_EQ(responses[1].status, 304);
+    ASSERT_TRUE(responses[1].body.empty());
+
+    // Only the new update is sent
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        available.push_back(7);
+    }
+    ASSERT_EQ(client.StartPolling(), (std::vector<unsigned int>{3, 5, 7}));
+    ASSERT_EQ(responses[2].body, "[7]");
+    ASSERT_EQ(server.requestCount(), 3);
+}
+
+TEST_F(DownloadClientTest, startPollingTestWithdrawnUpdate) {
+    std::mutex mutex;
+    std::vector<unsigned int> available{3, 5};
+    HttpTestServer server([&](const HttpRequest& request) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return whatsNewResponse(request, available);
+    });
+    auto client = UpdateDownloadClient(server.address(),
+                                       std::chrono::milliseconds(10), "", "",
+                                       "", 1);
+    ASSERT_EQ(client.StartPolling(), (std::vector<unsigned int>{3, 5}));
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        available = {3};
+    }
+    // The changed list has nothing newer than 5, so the client asks for all
+    // of it again
+    ASSERT_EQ(client.StartPolling(), std::vector<unsigned int>{3});
+    ASSERT_EQ(server.requestCount(), 3);
+}
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,286 @@
+#ifndef UPDATECLIENT_HPACK_DECODER_H
+#define UPDATECLIENT_HPACK_DECODER_H
+
+#include <cstdint>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Decodes the header blocks libcurl sends over HTTP/2 (RFC 7541), so
+// HttpTestServer can answer HTTP/2 requests. Only what a server needs to read
+// requests is there; responses are sent as plain literals, which need no
+// encoder state.
+class HpackDecoder {
+   public:
+    using Header = std::pair<std::string, std::string>;
+
+    // Throws std::runtime_error for a malformed block
+    std::vector<Header> decode(const std::string& block) {
+        std::vector<Header> headers;
+        size_t pos = 0;
+        while (pos < block.size()) {
+            uint8_t first = block[pos];
+            if (first & 0x80) {
+                headers.push_back(entry(integer(block, pos, 7)));
+            } else if (first & 0x40) {
+                headers.push_back(literal(block, pos, 6));
+                insert(headers.back());
+            } else if (first & 0x20) {
+                maxSize_ = integer(block, pos, 5);
+                evict(0);
+            } else {
+                // Without indexing, or never indexed
+                headers.push_back(literal(block, pos, 4));
+            }
+        }
+        return headers;
+    }
+
+   private:
+    struct StaticEntry {
+        const char* name;
+        const char* value;
+    };
+
+    static constexpr StaticEntry staticTable[] = {
+        {":authority", ""},
+        {":method", "GET"},
+        {":method", "POST"},
+        {":path", "/"},
+        {":path", "/index.html"},
+        {":scheme", "http"},
+        {":scheme", "https"},
+        {":status", "200"},
+        {":status", "204"},
+        {":status", "206"},
+        {":status", "304"},
+        {":status", "400"},
+        {":status", "404"},
+        {":status", "500"},
+        {"accept-charset", ""},
+        {"accept-encoding", "gzip, deflate"},
+        {"accept-language", ""},
+        {"accept-ranges", ""},
+        {"accept", ""},
+        {"access-control-allow-origin", ""},
+        {"age", ""},
+        {"allow", ""},
+        {"authorization", ""},
+        {"cache-control", ""},
+        {"content-disposition", ""},
+        {"content-encoding", ""},
+        {"content-language", ""},
+        {"content-length", ""},
+        {"content-location", ""},
+        {"content-range", ""},
+        {"content-type", ""},
+        {"cookie", ""},
+        {"date", ""},
+        {"etag", ""},
+        {"expect", ""},
+        {"expires", ""},
+        {"from", ""},
+        {"host", ""},
+        {"if-match", ""},
+        {"if-modified-since", ""},
+        {"if-none-match", ""},
+        {"if-range", ""},
+        {"if-unmodified-since", ""},
+        {"last-modified", ""},
+        {"link", ""},
+        {"location", ""},
+        {"max-forwards", ""},
+        {"proxy-authenticate", ""},
+        {"proxy-authorization", ""},
+        {"range", ""},
+        {"referer", ""},
+        {"refresh", ""},
+        {"retry-after", ""},
+        {"server", ""},
+        {"set-cookie", ""},
+        {"strict-transport-security", ""},
+        {"transfer-encoding", ""},
+        {"user-agent", ""},
+        {"vary", ""},
+        {"via", ""},
+        {"www-authenticate", ""},
+    };
+
+    static constexpr uint32_t huffmanCodes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    };
+
+    static constexpr uint8_t huffmanCodeLengths[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    };
+
+    static constexpr size_t staticEntries =
+        sizeof(staticTable) / sizeof(staticTable[0]);
+
+    std::deque<Header> dynamicTable_;
+    size_t size_ = 0;
+    size_t maxSize_ = 4096;
+
+    static size_t entrySize(const Header& header) {
+        return header.first.size() + header.second.size() + 32;
+    }
+
+    Header entry(uint64_t index) const {
+        if (index == 0 || index > staticEntries + dynamicTable_.size()) {
+            throw std::runtime_error("hpack: invalid table index");
+        }
+        if (index <= staticEntries) {
+            return {staticTable[index - 1].name, staticTable[index - 1].value};
+        }
+        return dynamicTable_[index - staticEntries - 1];
+    }
+
+    void evict(size_t room) {
+        while (!dynamicTable_.empty() && size_ + room > maxSize_) {
+            size_ -= entrySize(dynamicTable_.back());
+            dynamicTable_.pop_back();
+        }
+    }
+
+    void insert(const Header& header) {
+        evict(entrySize(header));
+        if (entrySize(header) <= maxSize_) {
+            dynamicTable_.push_front(header);
+            size_ += entrySize(header);
+        }
+    }
+
+    static uint64_t integer(const std::string& block, size_t& pos,
+                            int prefixBits) {
+        uint64_t max = (1u << prefixBits) - 1;
+        uint64_t value = (uint8_t)block[pos++] & max;
+        if (value < max) {
+            return value;
+        }
+        for (int shift = 0; shift < 56; shift += 7) {
+            if (pos >= block.size()) {
+                break;
+            }
+            uint8_t byte = block[pos++];
+            value += (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+        throw std::runtime_error("hpack: truncated integer");
+    }
+
+    static std::string string(const std::string& block, size_t& pos) {
+        if (pos >= block.size()) {
+            throw std::runtime_error("hpack: truncated string");
+        }
+        bool huffman = block[pos] & 0x80;
+        uint64_t length = integer(block, pos, 7);
+        if (length > block.size() - pos) {
+            throw std::runtime_error("hpack: truncated string");
+        }
+        std::string raw = block.substr(pos, length);
+        pos += length;
+        return huffman ? decodeHuffman(raw) : raw;
+    }
+
+    Header literal(const std::string& block, size_t& pos, int prefixBits) {
+        uint64_t index = integer(block, pos, prefixBits);
+        std::string name = index == 0 ? string(block, pos) : entry(index).first;
+        return {name, string(block, pos)};
+    }
+
+    // Bit by bit; codes are at least 5 bits long and the padding is a prefix
+    // of EOS, i.e. all ones
+    static std::string decodeHuffman(const std::string& data) {
+        std::string decoded;
+        uint32_t code = 0;
+        int length = 0;
+        for (unsigned char byte : data) {
+            for (int bit = 7; bit >= 0; bit--) {
+                code = (code << 1) | ((byte >> bit) & 1);
+                length++;
+                if (length < 5) {
+                    continue;
+                }
+                for (int symbol = 0; symbol < 256; symbol++) {
+                    if (huffmanCodeLengths[symbol] == length &&
+                        huffmanCodes[symbol] == code) {
+                        decoded += (char)symbol;
+                        code = 0;
+                        length = 0;
+                        break;
+                    }
+                }
+                if (length > 30) {
+                    throw std::runtime_error("hpack: invalid huffman code");
+                }
+            }
+        }
+        if (length > 7 || code != (1u << length) - 1) {
+            throw std::runtime_error("hpack: invalid huffman padding");
+        }
+        return decoded;
+    }
+};
+
+#endif  // UPDATECLIENT_HPACK_DECODER_H
@@ -0,0 +1,718 @@
+#ifndef UPDATECLIENT_HTTP_TEST_SERVER_H
+#define UPDATECLIENT_HTTP_TEST_SERVER_H
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hpack_decoder.h"
+
+// Stand-in for Server.go so UpdateDownloadClient can be tested offline, over
+// plain HTTP, HTTPS or HTTP/2 over TLS. Every connection gets its own thread
+// and is kept alive until the client closes it.
+struct HttpRequest {
+    std::string method;
+    std::string path;
+    std::map<std::string, std::string> query;
+    // Header names are lower-cased
+    std::map<std::string, std::string> headers;
+};
+
+struct HttpResponse {
+    int status = 200;
+    std::map<std::string, std::string> headers;
+    std::string body;
+    // Send the body with Transfer-Encoding: chunked, i.e. without
+    // Content-Length
+    bool chunked = false;
+    // Added before the response is sent, to emulate a high-latency link
+    std::chrono::milliseconds delay{0};
+    // The connection is closed after this many bytes of a body sent with
+    // Content-Length, to emulate a lost link
+    size_t dropAfter = std::string::npos;
+    // Caps the send rate of a body sent with Content-Length, to emulate a
+    // connection limited by its TCP window on a high-latency path
+    size_t bytesPerSecond = 0;
+};
+
+// Answers a GET for content like Go's http.ServeContent, which Server.go uses:
+// a "Range: bytes=<first>-[<last>]" gets a 206 with that part, unless If-Range
+// names another ETag than etag. An empty etag is not sent.
+inline HttpResponse serveContent(const HttpRequest& request,
+                                 const std::string& content,
+                                 const std::string& etag) {
+    HttpResponse response;
+    if (!etag.empty()) {
+        response.headers["ETag"] = etag;
+    }
+    auto range = request.headers.find("range");
+    auto ifRange = request.headers.find("if-range");
+    bool rangeValid = ifRange == request.headers.end() ||
+                      (!etag.empty() && ifRange->second == etag);
+    unsigned long long first = 0;
+    unsigned long long last = content.size() - 1;
+    if (range == request.headers.end() || !rangeValid ||
+        sscanf(range->second.c_str(), "bytes=%llu-%llu", &first, &last) < 1) {
+        response.body = content;
+        return response;
+    }
+    if (first >= content.size() || last < first) {
+        response.status = 416;
+        response.headers["Content-Range"] =
+            "bytes */" + std::to_string(content.size());
+        return response;
+    }
+    last = std::min<unsigned long long>(last, content.size() - 1);
+    response.status = 206;
+    response.headers["Content-Range"] = "bytes " + std::to_string(first) +
+                                        "-" + std::to_string(last) + "/" +
+                                        std::to_string(content.size());
+    response.body = content.substr(first, last - first + 1);
+    return response;
+}
+
+class HttpTestServer {
+   public:
+    using Handler = std::function<HttpResponse(const HttpRequest&)>;
+
+    explicit HttpTestServer(Handler handler) : handler_(std::move(handler)) {
+        start();
+    }
+
+    // Serves HTTPS with a PEM certificate and key. Client certificates are
+    // requested like Server.go does, but not verified. Sessions can be
+    // resumed for as long as the server lives. With http2, clients that offer
+    // h2 via ALPN get it, like from Go's net/http; the requests of a
+    // connection are then served one frame at a time on its thread.
+    HttpTestServer(Handler handler, const std::string& certPath,
+                   const std::string& keyPath, bool http2 = false)
+        : handler_(std::move(handler)) {
+        sslCtx_ = SSL_CTX_new(TLS_server_method());
+        if (SSL_CTX_use_certificate_file(sslCtx_, certPath.c_str(),
+                                         SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_use_PrivateKey_file(sslCtx_, keyPath.c_str(),
+                                        SSL_FILETYPE_PEM) != 1) {
+            SSL_CTX_free(sslCtx_);
+            throw std::runtime_error("unable to load test server certificate");
+        }
+        SSL_CTX_set_verify(sslCtx_, SSL_VERIFY_PEER,
+                           [](int, X509_STORE_CTX*) { return 1; });
+        // Required to resume sessions with client certificates
+        const unsigned char sessionContext[] = "HttpTestServer";
+        SSL_CTX_set_session_id_context(sslCtx_, sessionContext,
+                                       sizeof(sessionContext) - 1);
+        if (http2) {
+            SSL_CTX_set_alpn_select_cb(sslCtx_, selectHttp2, nullptr);
+        }
+        start();
+    }
+
+    ~HttpTestServer() {
+        stop();
+        if (sslCtx_ != nullptr) {
+            SSL_CTX_free(sslCtx_);
+        }
+    }
+
+    HttpTestServer(const HttpTestServer&) = delete;
+
+    HttpTestServer& operator=(const HttpTestServer&) = delete;
+
+    std::string address() const {
+        return std::string(sslCtx_ != nullptr ? "https" : "http") +
+               "://127.0.0.1:" + std::to_string(port_);
+    }
+
+    int connectionCount() const { return connections_; }
+
+    int requestCount() const { return requests_; }
+
+    // TLS handshakes that resumed a session
+    int resumedCount() const { return resumed_; }
+
+    // Connections that negotiated HTTP/2
+    int http2Count() const { return http2_; }
+
+   private:
+    // A connection, read and written through TLS if the server uses it
+    struct Peer {
+        int fd;
+        SSL* ssl;
+
+        ssize_t read(char* data, size_t length) const {
+            if (ssl == nullptr) {
+                return recv(fd, data, length, 0);
+            }
+            return SSL_read(ssl, data, (int)length);
+        }
+
+        ssize_t write(const char* data, size_t length) const {
+            if (ssl == nullptr) {
+                return send(fd, data, length, MSG_NOSIGNAL);
+            }
+            return SSL_write(ssl, data, (int)length);
+        }
+    };
+
+    Handler handler_;
+    SSL_CTX* sslCtx_ = nullptr;
+    int listenFd_ = -1;
+    int port_ = 0;
+    std::atomic<bool> stopping_{false};
+    std::atomic<int> connections_{0};
+    std::atomic<int> requests_{0};
+    std::atomic<int> resumed_{0};
+    std::atomic<int> http2_{0};
+    std::thread acceptThread_;
+    std::mutex mutex_;
+    std::vector<std::thread> clientThreads_;
+    std::vector<int> clientFds_;
+
+    void start() {
+        listenFd_ = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        if (bind(listenFd_, (sockaddr*)&addr, sizeof(addr)) == -1 ||
+            listen(listenFd_, 64) == -1) {
+            throw std::runtime_error("unable to start test server");
+        }
+        socklen_t len = sizeof(addr);
+        getsockname(listenFd_, (sockaddr*)&addr, &len);
+        port_ = ntohs(addr.sin_port);
+        acceptThread_ = std::thread([this] { acceptLoop(); });
+    }
+
+    void stop() {
+        stopping_ = true;
+        shutdown(listenFd_, SHUT_RDWR);
+        close(listenFd_);
+        acceptThread_.join();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (int fd : clientFds_) {
+                shutdown(fd, SHUT_RDWR);
+            }
+        }
+        for (auto& t : clientThreads_) {
+            t.join();
+        }
+    }
+
+    void acceptLoop() {
+        while (!stopping_) {
+            int fd = accept(listenFd_, nullptr, nullptr);
+            if (fd == -1) {
+                continue;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            connections_++;
+            std::lock_guard<std::mutex> lock(mutex_);
+            clientFds_.push_back(fd);
+            clientThreads_.emplace_back([this, fd] { serve(fd); });
+        }
+    }
+
+    static bool sendAll(const Peer& peer, const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t n = peer.write(data, length);
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    static std::string lower(std::string s) {
+        std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+        return s;
+    }
+
+    static void parseTarget(HttpRequest& request, const std::string& target) {
+        auto queryStart = target.find('?');
+        request.path = target.substr(0, queryStart);
+        if (queryStart != std::string::npos) {
+            std::istringstream query(target.substr(queryStart + 1));
+            std::string pair;
+            while (std::getline(query, pair, '&')) {
+                auto eq = pair.find('=');
+                request.query[pair.substr(0, eq)] =
+                    eq == std::string::npos ? "" : pair.substr(eq + 1);
+            }
+        }
+    }
+
+    static HttpRequest parseRequest(const std::string& head) {
+        HttpRequest request;
+        std::istringstream lines(head);
+        std::string line;
+        std::getline(lines, line);
+        std::istringstream requestLine(line);
+        std::string target;
+        requestLine >> request.method >> target;
+        parseTarget(request, target);
+
+        while (std::getline(lines, line)) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            auto colon = line.find(':');
+            if (colon == std::string::npos) {
+                continue;
+            }
+            std::string value = line.substr(colon + 1);
+            value.erase(0, value.find_first_not_of(' '));
+            request.headers[lower(line.substr(0, colon))] = value;
+        }
+        return request;
+    }
+
+    bool respond(const Peer& peer, const HttpRequest& request) {
+        HttpResponse response = handler_(request);
+        if (response.delay.count() > 0) {
+            std::this_thread::sleep_for(response.delay);
+        }
+
+        std::ostringstream head;
+        head << "HTTP/1.1 " << response.status << " X\r\n";
+        for (auto const& [name, value] : response.headers) {
+            head << name << ": " << value << "\r\n";
+        }
+        bool noBody = response.status == 204 || response.status == 304 ||
+                      request.method == "HEAD";
+        if (response.chunked && !noBody) {
+            head << "Transfer-Encoding: chunked\r\n\r\n";
+        } else if (!noBody) {
+            head << "Content-Length: " << response.body.size() << "\r\n\r\n";
+        } else {
+            head << "\r\n";
+        }
+        std::string headStr = head.str();
+        if (!sendAll(peer, headStr.data(), headStr.size())) {
+            return false;
+        }
+        if (noBody) {
+            return true;
+        }
+        if (!response.chunked) {
+            size_t length = std::min(response.dropAfter, response.body.size());
+            size_t slice = response.bytesPerSecond > 0
+                               ? std::max<size_t>(response.bytesPerSecond / 100, 1)
+                               : length;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t offset = 0; offset < length; offset += slice) {
+                if (response.bytesPerSecond > 0) {
+                    std::this_thread::sleep_until(
+                        start + std::chrono::microseconds(
+                                    offset * 1000000 / response.bytesPerSecond));
+                }
+                if (!sendAll(peer, response.body.data() + offset,
+                             std::min(slice, length - offset))) {
+                    return false;
+                }
+            }
+            return length == response.body.size();
+        }
+        const size_t chunkSize = 64 * 1024;
+        for (size_t offset = 0; offset < response.body.size();
+             offset += chunkSize) {
+            size_t length = std::min(chunkSize, response.body.size() - offset);
+            std::ostringstream size;
+            size << std::hex << length << "\r\n";
+            std::string sizeStr = size.str();
+            if (!sendAll(peer, sizeStr.data(), sizeStr.size()) ||
+                !sendAll(peer, response.body.data() + offset, length) ||
+                !sendAll(peer, "\r\n", 2)) {
+                return false;
+            }
+        }
+        return sendAll(peer, "0\r\n\r\n", 5);
+    }
+
+    static int selectHttp2(SSL*, const unsigned char** out,
+                           unsigned char* outLength, const unsigned char* in,
+                           unsigned int inLength, void*) {
+        static const unsigned char h2[] = {2, 'h', '2'};
+        if (SSL_select_next_proto((unsigned char**)out, outLength, h2,
+                                  sizeof(h2), in,
+                                  inLength) == OPENSSL_NPN_NEGOTIATED) {
+            return SSL_TLSEXT_ERR_OK;
+        }
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+
+    enum Http2FrameType : uint8_t {
+        DATA = 0x0,
+        HEADERS = 0x1,
+        RST_STREAM = 0x3,
+        SETTINGS = 0x4,
+        PING = 0x6,
+        GOAWAY = 0x7,
+        WINDOW_UPDATE = 0x8,
+        CONTINUATION = 0x9
+    };
+
+    static const uint8_t END_STREAM = 0x1;
+    static const uint8_t ACK = 0x1;
+    static const uint8_t END_HEADERS = 0x4;
+    static const uint8_t PADDED = 0x8;
+    static const uint8_t PRIORITY = 0x20;
+
+    // A response on its way to the client
+    struct Http2Stream {
+        HttpResponse response;
+        bool noBody;
+        std::chrono::steady_clock::time_point readyAt;
+        bool headersSent;
+        size_t sent;
+        int64_t window;
+    };
+
+    static bool readAll(const Peer& peer, std::string& data, size_t length) {
+        data.resize(length);
+        size_t offset = 0;
+        while (offset < length) {
+            ssize_t n = peer.read(&data[offset], length - offset);
+            if (n <= 0) {
+                return false;
+            }
+            offset += n;
+        }
+        return true;
+    }
+
+    static bool sendFrame(const Peer& peer, uint8_t type, uint8_t flags,
+                          uint32_t streamId, const std::string& payload) {
+        char head[9] = {(char)(payload.size() >> 16), (char)(payload.size() >> 8),
+                        (char)payload.size(),         (char)type,
+                        (char)flags,                  (char)(streamId >> 24),
+                        (char)(streamId >> 16),       (char)(streamId >> 8),
+                        (char)streamId};
+        return sendAll(peer, head, sizeof(head)) &&
+               sendAll(peer, payload.data(), payload.size());
+    }
+
+    static uint32_t readUint32(const std::string& data, size_t offset) {
+        return (uint32_t)(uint8_t)data[offset] << 24 |
+               (uint32_t)(uint8_t)data[offset + 1] << 16 |
+               (uint32_t)(uint8_t)data[offset + 2] << 8 |
+               (uint8_t)data[offset + 3];
+    }
+
+    // A literal without indexing and a new name for every header, so the
+    // client's decoder needs no state of ours
+    static std::string encodeHeaders(const HttpResponse& response,
+                                     bool noBody) {
+        std::string block;
+        auto string = [&block](const std::string& s) {
+            size_t length = s.size();
+            if (length < 127) {
+                block += (char)length;
+            } else {
+                block += (char)127;
+                for (length -= 127; length >= 128; length >>= 7) {
+                    block += (char)(0x80 | (length & 0x7f));
+                }
+                block += (char)length;
+            }
+            block += s;
+        };
+        auto literal = [&](const std::string& name, const std::string& value) {
+            block += '\0';
+            string(lower(name));
+            string(value);
+        };
+        literal(":status", std::to_string(response.status));
+        for (auto const& [name, value] : response.headers) {
+            literal(name, value);
+        }
+        if (!noBody && !response.chunked) {
+            literal("content-length", std::to_string(response.body.size()));
+        }
+        return block;
+    }
+
+    HttpRequest parseHttp2Request(HpackDecoder& decoder,
+                                  const std::string& block) {
+        HttpRequest request;
+        for (auto const& [name, value] : decoder.decode(block)) {
+            if (name == ":method") {
+                request.method = value;
+            } else if (name == ":path") {
+                parseTarget(request, value);
+            } else if (name[0] != ':') {
+                request.headers[name] = value;
+            }
+        }
+        return request;
+    }
+
+    // Sends the next frame of stream, if it is due and the flow-control
+    // windows allow. Returns false once the connection is to be closed.
+    static bool sendHttp2Frame(const Peer& peer, uint32_t streamId,
+                               Http2Stream& stream, int64_t& connectionWindow,
+                               size_t maxFrameSize, bool& done) {
+        const HttpResponse& response = stream.response;
+        if (!stream.headersSent) {
+            stream.headersSent = true;
+            done = stream.noBody;
+            return sendFrame(peer, HEADERS,
+                             END_HEADERS | (stream.noBody ? END_STREAM : 0),
+                             streamId, encodeHeaders(response, stream.noBody));
+        }
+        size_t length = std::min(response.dropAfter, response.body.size());
+        if (stream.sent == length && length < response.body.size()) {
+            return false;
+        }
+        size_t due = length;
+        if (response.bytesPerSecond > 0) {
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - stream.readyAt);
+            due = std::min<size_t>(
+                length, elapsed.count() * response.bytesPerSecond / 1000000);
+        }
+        size_t chunk = std::min<int64_t>(
+            {(int64_t)(std::max(due, stream.sent) - stream.sent),
+             (int64_t)maxFrameSize, stream.window, connectionWindow});
+        if (chunk == 0 && length > 0) {
+            return true;
+        }
+        done = stream.sent + chunk == response.body.size();
+        if (!sendFrame(peer, DATA, done ? END_STREAM : 0, streamId,
+                       response.body.substr(stream.sent, chunk))) {
+            return false;
+        }
+        stream.sent += chunk;
+        stream.window -= chunk;
+        connectionWindow -= chunk;
+        return true;
+    }
+
+    // Responses are interleaved a frame at a time, so a delayed or throttled
+    // one doesn't hold up the others on the connection
+    void serveHttp2(const Peer& peer) {
+        std::string frame;
+        if (!readAll(peer, frame, 24) ||
+            frame != "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" ||
+            !sendFrame(peer, SETTINGS, 0, 0, "")) {
+            return;
+        }
+        HpackDecoder decoder;
+        std::map<uint32_t, Http2Stream> streams;
+        int64_t connectionWindow = 65535;
+        int64_t initialWindow = 65535;
+        size_t maxFrameSize = 16384;
+        std::string headerBlock;
+        while (!stopping_) {
+            auto now = std::chrono::steady_clock::now();
+            // Woken up every few ms while a throttled response waits for its
+            // next frame, otherwise by the client
+            std::chrono::milliseconds wait{100};
+            for (auto it = streams.begin(); it != streams.end();) {
+                Http2Stream& stream = it->second;
+                if (now < stream.readyAt) {
+                    wait = std::min(
+                        wait, std::chrono::duration_cast<std::chrono::milliseconds>(
+                                  stream.readyAt - now));
+                    ++it;
+                    continue;
+                }
+                size_t sent = stream.sent;
+                bool done = false;
+                if (!sendHttp2Frame(peer, it->first, stream, connectionWindow,
+                                    maxFrameSize, done)) {
+                    return;
+                }
+                if (done) {
+                    it = streams.erase(it);
+                    wait = std::chrono::milliseconds(0);
+                    continue;
+                }
+                if (stream.sent > sent) {
+                    wait = std::chrono::milliseconds(0);
+                } else if (stream.response.bytesPerSecond > 0) {
+                    wait = std::min(wait, std::chrono::milliseconds(10));
+                }
+                ++it;
+            }
+
+            if (SSL_pending(peer.ssl) == 0) {
+                pollfd pollFd{peer.fd, POLLIN, 0};
+                int ready = poll(&pollFd, 1, (int)wait.count());
+                if (ready == 0) {
+                    continue;
+                }
+                if (ready < 0) {
+                    return;
+                }
+            }
+
+            std::string payload;
+            if (!readAll(peer, frame, 9)) {
+                return;
+            }
+            size_t length = (uint8_t)frame[0] << 16 | (uint8_t)frame[1] << 8 |
+                            (uint8_t)frame[2];
+            uint8_t type = frame[3];
+            uint8_t flags = frame[4];
+            uint32_t streamId = readUint32(frame, 5) & 0x7fffffff;
+            if (!readAll(peer, payload, length)) {
+                return;
+            }
+
+            if (type == HEADERS || type == CONTINUATION) {
+                size_t start = 0;
+                size_t end = payload.size();
+                if (type == HEADERS && (flags & PADDED) && end > 0) {
+                    start = 1;
+                    end -= std::min<size_t>((uint8_t)payload[0], end - 1);
+                }
+                if (type == HEADERS && (flags & PRIORITY)) {
+                    start += 5;
+                }
+                headerBlock += payload.substr(start, end - std::min(start, end));
+                if (!(flags & END_HEADERS)) {
+                    continue;
+                }
+                HttpRequest request = parseHttp2Request(decoder, headerBlock);
+                headerBlock.clear();
+                requests_++;
+                HttpResponse response = handler_(request);
+                bool noBody = response.status == 204 ||
+                              response.status == 304 || request.method == "HEAD";
+                auto readyAt = std::chrono::steady_clock::now() + response.delay;
+                streams[streamId] = Http2Stream{std::move(response), noBody,
+                                                readyAt, false, 0, initialWindow};
+            } else if (type == SETTINGS && !(flags & ACK)) {
+                for (size_t offset = 0; offset + 6 <= payload.size();
+                     offset += 6) {
+                    uint16_t id = (uint8_t)payload[offset] << 8 |
+                                  (uint8_t)payload[offset + 1];
+                    uint32_t value = readUint32(payload, offset + 2);
+                    if (id == 0x4) {
+                        for (auto& [_, stream] : streams) {
+                            stream.window += (int64_t)value - initialWindow;
+                        }
+                        initialWindow = value;
+                    } else if (id == 0x5) {
+                        maxFrameSize = value;
+                    }
+                }
+                if (!sendFrame(peer, SETTINGS, ACK, 0, "")) {
+                    return;
+                }
+            } else if (type == WINDOW_UPDATE && payload.size() == 4) {
+                uint32_t increment = readUint32(payload, 0) & 0x7fffffff;
+                if (streamId == 0) {
+                    connectionWindow += increment;
+                } else if (streams.find(streamId) != streams.end()) {
+                    streams.find(streamId)->second.window += increment;
+                }
+            } else if (type == PING && !(flags & ACK)) {
+                if (!sendFrame(peer, PING, ACK, 0, payload)) {
+                    return;
+                }
+            } else if (type == RST_STREAM) {
+                streams.erase(streamId);
+            } else if (type == GOAWAY) {
+                return;
+            }
+            // Request bodies, priorities and pushes are of no use here
+        }
+    }
+
+    void serve(int fd) {
+        Peer peer{fd, nullptr};
+        if (sslCtx_ != nullptr) {
+            peer.ssl = SSL_new(sslCtx_);
+            SSL_set_fd(peer.ssl, fd);
+            if (SSL_accept(peer.ssl) != 1) {
+                SSL_free(peer.ssl);
+                finish(fd);
+                return;
+            }
+            if (SSL_session_reused(peer.ssl)) {
+                resumed_++;
+            }
+            const unsigned char* protocol = nullptr;
+            unsigned int protocolLength = 0;
+            SSL_get0_alpn_selected(peer.ssl, &protocol, &protocolLength);
+            if (protocolLength == 2 && memcmp(protocol, "h2", 2) == 0) {
+                http2_++;
+                serveHttp2(peer);
+                SSL_free(peer.ssl);
+                finish(fd);
+                return;
+            }
+        }
+        std::string buffer;
+        char chunk[4096];
+        while (!stopping_) {
+            auto end = buffer.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                ssize_t n = peer.read(chunk, sizeof(chunk));
+                if (n <= 0) {
+                    break;
+                }
+                buffer.append(chunk, n);
+                continue;
+            }
+            HttpRequest request = parseRequest(buffer.substr(0, end));
+            buffer.erase(0, end + 4);
+
+            // Request bodies are not used by the client, skip them
+            auto contentLength = request.headers.find("content-length");
+            if (contentLength != request.headers.end()) {
+                size_t bodyLength = std::stoul(contentLength->second);
+                while (buffer.size() < bodyLength) {
+                    ssize_t n = peer.read(chunk, sizeof(chunk));
+                    if (n <= 0) {
+                        break;
+                    }
+                    buffer.append(chunk, n);
+                }
+                buffer.erase(0, std::min(bodyLength, buffer.size()));
+            }
+
+            requests_++;
+            if (!respond(peer, request)) {
+                break;
+            }
+        }
+        if (peer.ssl != nullptr) {
+            SSL_free(peer.ssl);
+        }
+        finish(fd);
+    }
+
+    void finish(int fd) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        clientFds_.erase(std::find(clientFds_.begin(), clientFds_.end(), fd));
+        close(fd);
+    }
+};
+
+#endif  // UPDATECLIENT_HTTP_TEST_SERVER_H
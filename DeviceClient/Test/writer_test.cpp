@@ -1,10 +1,19 @@
 #include "writer.h"
 
+#include <openssl/sha.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#include <chrono>
 #include <fstream>
+#include <random>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 #include "gtest/gtest.h"
+#include "spsc_ring.h"
 
 struct ImageFile {
     ImageFile(const std::string& imagePath, int megabytes)
@@ -123,6 +132,92 @@ class ImageWriterTest : public ::testing::Test {
         return result;
     }
 
+    const std::string indexPath = "virtual_device/block_index_test.index";
+    const std::string imagePath = "virtual_device/block_index_test.ext4";
+    const std::string mountPoint = "virtual_device/block_index_test_mnt";
+
+    void TearDown() override {
+        unlink(indexPath.c_str());
+        unlink(imagePath.c_str());
+        rmdir(mountPoint.c_str());
+    }
+
+    // A small ext4 filesystem followed by a few bytes, so the last block is
+    // short
+    std::vector<unsigned char> createExt4Image() {
+        std::ostringstream cmdStream;
+        cmdStream << "mkfs.ext4 -q -F -b 4096 " << imagePath << " 3M 2>&1";
+        execCmd(cmdStream.str().c_str());
+        std::ifstream imageFile(imagePath, std::ios::binary);
+        std::vector<unsigned char> image(
+            (std::istreambuf_iterator<char>(imageFile)),
+            std::istreambuf_iterator<char>());
+        for (int i = 0; i < 1000; i++) {
+            image.push_back((unsigned char)i);
+        }
+        return image;
+    }
+
+    static void writeInChunks(ImageWriter& writer,
+                              const std::vector<unsigned char>& image,
+                              size_t chunkSize = 100000) {
+        for (size_t offset = 0; offset < image.size(); offset += chunkSize) {
+            size_t length = std::min(chunkSize, image.size() - offset);
+            writer.writeChunk(image.data() + offset, length, offset);
+        }
+    }
+
+    // Bytes of the device's first length bytes in the page cache
+    static size_t cachedBytes(const std::string& devicePath, size_t length) {
+        int device = open(devicePath.c_str(), O_RDONLY);
+        void* map = mmap(nullptr, length, PROT_READ, MAP_SHARED, device, 0);
+        long pageSize = sysconf(_SC_PAGESIZE);
+        std::vector<unsigned char> resident((length + pageSize - 1) /
+                                            pageSize);
+        mincore(map, length, resident.data());
+        munmap(map, length);
+        close(device);
+        return std::count_if(resident.begin(), resident.end(),
+                             [](unsigned char page) { return page & 1; }) *
+               pageSize;
+    }
+
+    // Benchmarks print their figures but don't assert on them: the loop
+    // device is backed by whatever the test directory is on, not by an SD
+    // card. Their images are kept small so the default suite stays quick.
+    static constexpr size_t benchmarkImageSize = 32 * 1024 * 1024;
+
+    // Random, so the page cache can't be served from a few pages
+    static std::vector<unsigned char> randomImage(unsigned int seed) {
+        std::vector<unsigned char> image(benchmarkImageSize);
+        std::mt19937 random(seed);
+        for (auto& byte : image) {
+            byte = (unsigned char)random();
+        }
+        return image;
+    }
+
+    void storeImage(const std::vector<unsigned char>& image) {
+        std::ofstream imageFile(imagePath, std::ios::binary);
+        imageFile.write((const char*)image.data(), image.size());
+    }
+
+    // Seconds writer takes to write imagePath and sync it
+    double timeImageFileWrite(ImageWriter& writer) {
+        auto start = std::chrono::steady_clock::now();
+        writer.writeImageFile(imagePath, 1024 * 1024);
+        writer.syncBlockDevice();
+        std::chrono::duration<double> seconds =
+            std::chrono::steady_clock::now() - start;
+        return seconds.count();
+    }
+
+    static BlockHash sha256(const unsigned char* data, size_t length) {
+        BlockHash hash{};
+        SHA256(data, length, hash.data());
+        return hash;
+    }
+
     static const std::vector<ImageFile> loopImageFiles;
     static std::vector<LoopDevice> loopDevices;
 
@@ -368,6 +463,691 @@ TEST_F(ImageWriterTest, writeImageFileTestValidRootFS) {
     ASSERT_TRUE(exists);
 }
 
+TEST_F(ImageWriterTest, writeChunkTestReadBack) {
+    std::vector<unsigned char> image(3 * 1024 * 1024 + 123);
+    for (size_t i = 0; i < image.size(); i++) {
+        image[i] = (unsigned char)(i * 7 + i / 4096);
+    }
+    std::string devicePath;
+    {
+        ImageWriter writer{loopDevices[0].deviceName};
+        size_t chunkSize = 100000;
+        size_t written = 0;
+        for (size_t offset = 0; offset < image.size(); offset += chunkSize) {
+            size_t length = std::min(chunkSize, image.size() - offset);
+            written += writer.writeChunk(image.data() + offset, length, offset);
+        }
+        ASSERT_EQ(written, image.size());
+        ASSERT_NO_THROW(writer.syncBlockDevice());
+        devicePath = writer.getDevicePath();
+    }
+    std::ifstream device(devicePath, std::ios::binary);
+    std::vector<unsigned char> readBack(image.size());
+    device.read((char*)readBack.data(), readBack.size());
+    ASSERT_EQ(readBack, image);
+}
+
+TEST_F(ImageWriterTest, writeChunkTestExceedsDevice) {
+    ImageWriter writer{loopDevices[1].deviceName};
+    std::vector<unsigned char> chunk(4096, 1);
+    ASSERT_THROW(writer.writeChunk(chunk.data(), chunk.size(),
+                                   writer.getBlockDeviceSize() - 100),
+                 BlockdeviceException);
+    ASSERT_EQ(writer.writeChunk(chunk.data(), chunk.size(),
+                                writer.getBlockDeviceSize() - chunk.size()),
+              chunk.size());
+}
+
+TEST_F(ImageWriterTest, buildBlockIndexTestWhileWriting) {
+    std::vector<unsigned char> image = createExt4Image();
+    ASSERT_EQ(image.size(), 3 * 1024 * 1024 + 1000);
+    std::string devicePath = loopDevices[1].deviceName;
+    {
+        ImageWriter writer{devicePath};
+        writer.buildBlockIndex(indexPath);
+        writeInChunks(writer, image);
+        writer.syncBlockDevice();
+    }
+
+    BlockIndex index(indexPath);
+    ASSERT_EQ(index.getBlockSize(), BLOCK_INDEX_BLOCK_SIZE);
+    ASSERT_EQ(index.getImageLength(), image.size());
+    ASSERT_EQ(index.getBlockCount(), 3 * 1024 / 4 + 1);
+    ASSERT_EQ(index.getImageDigest(), sha256(image.data(), image.size()));
+    for (size_t block = 0; block < index.getBlockCount(); block++) {
+        size_t offset = block * BLOCK_INDEX_BLOCK_SIZE;
+        size_t length = std::min<size_t>(BLOCK_INDEX_BLOCK_SIZE,
+                                         image.size() - offset);
+        ASSERT_EQ(index.getBlockHash(block),
+                  sha256(image.data() + offset, length));
+    }
+    ASSERT_THROW(index.getBlockHash(index.getBlockCount()),
+                 BlockIndexException);
+
+    // Any block with the same content will do
+    for (size_t block : {0, 1, 200, 767}) {
+        uint64_t offset = index.find(index.getBlockHash(block));
+        ASSERT_NE(offset, BLOCK_INDEX_NOT_FOUND);
+        ASSERT_EQ(sha256(image.data() + offset, BLOCK_INDEX_BLOCK_SIZE),
+                  index.getBlockHash(block));
+    }
+    ASSERT_EQ(index.find(index.getBlockHash(768)), BLOCK_INDEX_NOT_FOUND);
+    ASSERT_EQ(index.find(BlockHash{}), BLOCK_INDEX_NOT_FOUND);
+
+    ASSERT_TRUE(index.isValidFor(devicePath));
+    mkdir(mountPoint.c_str(), 0700);
+    mountDevice(devicePath, mountPoint);
+    unmountDevice(devicePath);
+    ASSERT_FALSE(index.isValidFor(devicePath));
+}
+
+TEST_F(ImageWriterTest, buildBlockIndexTestRemovesStaleIndex) {
+    std::vector<unsigned char> image = createExt4Image();
+    ImageWriter writer{loopDevices[1].deviceName};
+    writer.buildBlockIndex(indexPath);
+    writeInChunks(writer, image);
+    writer.syncBlockDevice();
+    ASSERT_NO_THROW(BlockIndex{indexPath});
+
+    // The index goes as soon as the partition is about to change
+    writer.buildBlockIndex(indexPath);
+    ASSERT_THROW(BlockIndex{indexPath}, BlockIndexException);
+    // Closing the device before syncing leaves no index either
+    writeInChunks(writer, image);
+    writer.closeBlockDevice();
+    ASSERT_THROW(BlockIndex{indexPath}, BlockIndexException);
+}
+
+TEST_F(ImageWriterTest, buildBlockIndexTestOutOfOrder) {
+    std::vector<unsigned char> image = createExt4Image();
+    ImageWriter writer{loopDevices[1].deviceName};
+    writer.buildBlockIndex(indexPath);
+    writer.writeChunk(image.data() + 4096, image.size() - 4096, 4096);
+    writer.writeChunk(image.data(), 4096, 0);
+    writer.syncBlockDevice();
+    ASSERT_THROW(BlockIndex{indexPath}, BlockIndexException);
+}
+
+TEST_F(ImageWriterTest, buildBlockIndexTestWithoutFilesystem) {
+    // Nothing could tell whether the partition changed later
+    std::vector<unsigned char> image(1024 * 1024, 0);
+    ImageWriter writer{loopDevices[1].deviceName};
+    writer.buildBlockIndex(indexPath);
+    writeInChunks(writer, image);
+    writer.syncBlockDevice();
+    ASSERT_THROW(BlockIndex{indexPath}, BlockIndexException);
+}
+
+TEST_F(ImageWriterTest, blockIndexTestMalformed) {
+    {
+        std::ofstream indexFile(indexPath, std::ios::binary);
+        indexFile << "BLKINDEX";
+    }
+    ASSERT_THROW(BlockIndex{indexPath}, BlockIndexException);
+
+    std::vector<unsigned char> image = createExt4Image();
+    {
+        ImageWriter writer{loopDevices[1].deviceName};
+        writer.buildBlockIndex(indexPath);
+        writeInChunks(writer, image);
+        writer.syncBlockDevice();
+    }
+    // One hash short of the image length
+    ASSERT_EQ(truncate(indexPath.c_str(), 128 + 768 * 32), 0);
+    ASSERT_THROW(BlockIndex{indexPath}, BlockIndexException);
+}
+
+TEST_F(ImageWriterTest, writeChunkTestSkipUnchanged) {
+    std::vector<unsigned char> image(8 * 1024 * 1024 + 100);
+    std::mt19937 random(7);
+    for (auto& byte : image) {
+        byte = (unsigned char)random();
+    }
+    std::string devicePath = loopDevices[0].deviceName;
+    {
+        ImageWriter writer{devicePath};
+        writeInChunks(writer, image);
+        writer.syncBlockDevice();
+        WriteStatistics statistics = writer.getWriteStatistics();
+        ASSERT_EQ(statistics.bytesWritten, image.size());
+        ASSERT_EQ(statistics.bytesSkipped, 0);
+        ASSERT_EQ(statistics.bytesRead, 0);
+    }
+
+    // Three blocks change, one of them across a chunk boundary
+    image[5] ^= 1;
+    image[100000 + 10] ^= 1;
+    image[image.size() - 4096 - 200] ^= 1;
+    {
+        ImageWriter writer{devicePath};
+        writer.setSkipUnchanged(true);
+        writeInChunks(writer, image);
+        writer.syncBlockDevice();
+        WriteStatistics statistics = writer.getWriteStatistics();
+        // Of the block across chunks only the part in the second chunk
+        // changed
+        ASSERT_EQ(statistics.bytesWritten, 4096 + 2400 + 4096);
+        ASSERT_EQ(statistics.bytesSkipped, image.size() - 10592);
+        ASSERT_EQ(statistics.bytesRead, image.size());
+    }
+    std::ifstream device(devicePath, std::ios::binary);
+    std::vector<unsigned char> readBack(image.size());
+    device.read((char*)readBack.data(), readBack.size());
+    ASSERT_EQ(readBack, image);
+}
+
+TEST_F(ImageWriterTest, writeChunkTestSkipUnchangedByIndex) {
+    std::vector<unsigned char> image = createExt4Image();
+    std::string devicePath = loopDevices[1].deviceName;
+    {
+        ImageWriter writer{devicePath};
+        writer.buildBlockIndex(indexPath);
+        writeInChunks(writer, image);
+        writer.syncBlockDevice();
+    }
+
+    image[500 * 4096 + 7] ^= 1;
+    {
+        ImageWriter writer{devicePath};
+        writer.setSkipUnchanged(true);
+        writer.buildBlockIndex(indexPath);
+        writeInChunks(writer, image, 65536);
+        writer.syncBlockDevice();
+        WriteStatistics statistics = writer.getWriteStatistics();
+        ASSERT_EQ(statistics.bytesWritten, 4096);
+        ASSERT_EQ(statistics.bytesSkipped, image.size() - 4096);
+        // Only the short last block isn't covered by the index
+        ASSERT_EQ(statistics.bytesRead, 1000);
+    }
+    BlockIndex index(indexPath);
+    ASSERT_TRUE(index.isValidFor(devicePath));
+    ASSERT_EQ(index.getImageDigest(), sha256(image.data(), image.size()));
+
+    std::ifstream device(devicePath, std::ios::binary);
+    std::vector<unsigned char> readBack(image.size());
+    device.read((char*)readBack.data(), readBack.size());
+    ASSERT_EQ(readBack, image);
+}
+
+TEST_F(ImageWriterTest, writeImageFileBenchmarkSkipUnchanged) {
+    std::vector<unsigned char> image = randomImage(11);
+    auto writeImage = [&](bool skipUnchanged) {
+        storeImage(image);
+        ImageWriter writer{loopDevices[0].deviceName};
+        writer.setSkipUnchanged(skipUnchanged);
+        double seconds = timeImageFileWrite(writer);
+        return std::make_pair(seconds, writer.getWriteStatistics());
+    };
+
+    auto full = writeImage(false);
+    auto unchanged = writeImage(true);
+    ASSERT_EQ(unchanged.second.bytesSkipped, benchmarkImageSize);
+    // One byte in every 20th block
+    for (size_t offset = 0; offset < benchmarkImageSize; offset += 20 * 4096) {
+        image[offset] ^= 1;
+    }
+    auto fewChanged = writeImage(true);
+    ASSERT_EQ(fewChanged.second.bytesWritten,
+              (benchmarkImageSize / 4096 + 19) / 20 * 4096);
+
+    std::cout << "full write:             " << full.first << " s" << std::endl
+              << "skip, nothing changed:  " << unchanged.first << " s ("
+              << full.first / unchanged.first << "x)" << std::endl
+              << "skip, 5% changed:       " << fewChanged.first << " s ("
+              << full.first / fewChanged.first << "x)" << std::endl;
+}
+
+TEST_F(ImageWriterTest, fillRangeTestPattern) {
+    std::vector<unsigned char> image = createExt4Image();
+    image.resize(1024 * 1024);
+    std::vector<unsigned char> expected = image;
+    // Longer than one fill buffer, and not a multiple of the pattern
+    const uint64_t fillLength = 3 * 1024 * 1024 - 6;
+    for (uint64_t i = 0; i < fillLength; i++) {
+        expected.push_back((unsigned char)(i % 4 + 1));
+    }
+    std::string devicePath = loopDevices[1].deviceName;
+    {
+        ImageWriter writer{devicePath};
+        writer.buildBlockIndex(indexPath);
+        writer.writeChunk(image.data(), image.size(), 0);
+        ASSERT_EQ(writer.fillRange(0x04030201, fillLength, image.size()),
+                  fillLength);
+        ASSERT_THROW(writer.fillRange(0, 1, writer.getBlockDeviceSize()),
+                     BlockdeviceException);
+        writer.syncBlockDevice();
+        ASSERT_EQ(writer.getWriteStatistics().bytesWritten, expected.size());
+    }
+    std::ifstream device(devicePath, std::ios::binary);
+    std::vector<unsigned char> readBack(expected.size());
+    device.read((char*)readBack.data(), readBack.size());
+    ASSERT_EQ(readBack, expected);
+
+    // Filled like written
+    BlockIndex index(indexPath);
+    ASSERT_EQ(index.getImageDigest(), sha256(expected.data(), expected.size()));
+}
+
+TEST_F(ImageWriterTest, discardRangeTestDropsIndex) {
+    std::vector<unsigned char> image = createExt4Image();
+    ImageWriter writer{loopDevices[1].deviceName};
+    writer.buildBlockIndex(indexPath);
+    writer.writeChunk(image.data(), 1024 * 1024, 0);
+    ASSERT_EQ(writer.discardRange(1024 * 1024 + 100, 1024 * 1024),
+              1024 * 1024 + 100);
+    writer.writeChunk(image.data() + 2 * 1024 * 1024 + 100, 1000,
+                      2 * 1024 * 1024 + 100);
+    writer.syncBlockDevice();
+    WriteStatistics statistics = writer.getWriteStatistics();
+    ASSERT_EQ(statistics.bytesWritten, 1024 * 1024 + 1000);
+    ASSERT_EQ(statistics.bytesDiscarded, 1024 * 1024 + 100);
+    // Nothing tells what the partition holds in the discarded range
+    ASSERT_THROW(BlockIndex{indexPath}, BlockIndexException);
+}
+
+TEST_F(ImageWriterTest, writeChunkTestBlockMap) {
+    std::vector<unsigned char> image(64 * 1024);
+    std::mt19937 random(5);
+    for (auto& byte : image) {
+        byte = (unsigned char)random();
+    }
+    // Extents across chunk boundaries, and one past the image
+    const std::vector<ImageExtent> blockMap{
+        {0, 4096}, {10000, 20000}, {40960, 8192}, {1024 * 1024, 4096}};
+    std::string devicePath = loopDevices[1].deviceName;
+    {
+        ImageWriter writer{devicePath};
+        writer.fillRange(0xaaaaaaaa, image.size(), 0);
+        writer.buildBlockIndex(indexPath);
+        ASSERT_THROW(writer.setBlockMap({{4096, 4096}, {0, 4096}}),
+                     ImageFileException);
+        ASSERT_THROW(writer.setBlockMap({{0, 4096}, {4095, 4096}}),
+                     ImageFileException);
+        writer.setBlockMap(blockMap);
+        writeInChunks(writer, image, 5000);
+        writer.syncBlockDevice();
+        WriteStatistics statistics = writer.getWriteStatistics();
+        ASSERT_EQ(statistics.bytesWritten - image.size(), 4096 + 20000 + 8192);
+        ASSERT_EQ(statistics.bytesDiscarded,
+                  image.size() - (4096 + 20000 + 8192));
+    }
+    // Only the mapped extents are defined
+    std::ifstream device(devicePath, std::ios::binary);
+    std::vector<unsigned char> readBack(image.size());
+    device.read((char*)readBack.data(), readBack.size());
+    for (size_t i = 0; i < 3; i++) {
+        auto begin = blockMap[i].offset;
+        auto end = blockMap[i].offset + blockMap[i].length;
+        ASSERT_TRUE(std::equal(image.begin() + begin, image.begin() + end,
+                               readBack.begin() + begin));
+    }
+    ASSERT_THROW(BlockIndex{indexPath}, BlockIndexException);
+}
+
+TEST_F(ImageWriterTest, writeImageFileTestBlockMap) {
+    std::vector<unsigned char> image = createExt4Image();
+    {
+        std::ofstream imageFile(imagePath, std::ios::binary);
+        imageFile.write((const char*)image.data(), image.size());
+    }
+    // The last extent ends in the short last block
+    const std::vector<ImageExtent> blockMap{
+        {0, 8192}, {100 * 4096, 3 * 4096}, {768 * 4096, 4096}};
+    std::string devicePath = loopDevices[1].deviceName;
+    {
+        ImageWriter writer{devicePath};
+        writer.setBlockMap(blockMap);
+        ASSERT_EQ(writer.writeImageFile(imagePath, 5000), (ssize_t)image.size());
+        WriteStatistics statistics = writer.getWriteStatistics();
+        ASSERT_EQ(statistics.bytesWritten, 8192 + 3 * 4096 + 1000);
+        ASSERT_EQ(statistics.bytesWritten + statistics.bytesDiscarded,
+                  image.size());
+
+        writer.setBlockMap({});
+        ASSERT_EQ(writer.writeImageFile(imagePath, 5000), (ssize_t)image.size());
+        ASSERT_EQ(writer.getWriteStatistics().bytesWritten,
+                  statistics.bytesWritten + image.size());
+    }
+    std::ifstream device(devicePath, std::ios::binary);
+    std::vector<unsigned char> readBack(image.size());
+    device.read((char*)readBack.data(), readBack.size());
+    ASSERT_EQ(readBack, image);
+}
+
+// A filesystem a fifth full, with its data in a few runs
+TEST_F(ImageWriterTest, writeImageFileBenchmarkBlockMap) {
+    storeImage(randomImage(13));
+    const uint64_t extentLength = benchmarkImageSize / 40 / 4096 * 4096;
+    std::vector<ImageExtent> blockMap;
+    for (uint64_t offset = 0; offset < benchmarkImageSize;
+         offset += benchmarkImageSize / 8) {
+        blockMap.push_back({offset, extentLength});
+    }
+    auto writeImage = [&](const std::vector<ImageExtent>& blockMap) {
+        ImageWriter writer{loopDevices[0].deviceName};
+        writer.setBlockMap(blockMap);
+        double seconds = timeImageFileWrite(writer);
+        return std::make_pair(seconds, writer.getWriteStatistics());
+    };
+
+    auto full = writeImage({});
+    auto mapped = writeImage(blockMap);
+    ASSERT_EQ(mapped.second.bytesWritten, blockMap.size() * extentLength);
+
+    std::cout << "full write:   " << full.first << " s" << std::endl
+              << "block map:    " << mapped.first << " s ("
+              << full.first / mapped.first << "x)" << std::endl;
+}
+
+TEST_F(ImageWriterTest, writeChunkTestDirectIO) {
+    std::vector<unsigned char> image = createExt4Image();
+    std::string devicePath = loopDevices[1].deviceName;
+    {
+        ImageWriter writer{devicePath};
+        ASSERT_TRUE(writer.setDirectIO(true));
+        writer.buildBlockIndex(indexPath);
+        // Neither chunks nor offsets are aligned to logical blocks
+        writeInChunks(writer, image, 100001);
+        writer.syncBlockDevice();
+        ASSERT_EQ(writer.getWriteStatistics().bytesWritten, image.size());
+
+        // Partial blocks at both ends, and within one block
+        for (auto& byte : image) {
+            byte ^= 0xff;
+        }
+        writer.writeChunk(image.data() + 7, 2 * 1024 * 1024, 7);
+        writer.writeChunk(image.data() + 3 * 1024 * 1024 + 100, 300,
+                          3 * 1024 * 1024 + 100);
+        for (size_t i = 0; i < image.size(); i++) {
+            bool rewritten = (i >= 7 && i < 2 * 1024 * 1024 + 7) ||
+                             (i >= 3 * 1024 * 1024 + 100 &&
+                              i < 3 * 1024 * 1024 + 400);
+            if (!rewritten) {
+                image[i] ^= 0xff;
+            }
+        }
+        ASSERT_FALSE(writer.setDirectIO(false));
+    }
+    std::ifstream device(devicePath, std::ios::binary);
+    std::vector<unsigned char> readBack(image.size());
+    device.read((char*)readBack.data(), readBack.size());
+    ASSERT_EQ(readBack, image);
+    // Hashed like buffered writes, and stamped after them
+    BlockIndex index(indexPath);
+    ASSERT_EQ(index.getImageLength(), image.size());
+    ASSERT_EQ(index.getBlockHash(600), sha256(image.data() + 600 * 4096, 4096));
+}
+
+TEST_F(ImageWriterTest, writeChunkTestDirectIOSkipUnchanged) {
+    std::vector<unsigned char> image(4 * 1024 * 1024 + 100);
+    std::mt19937 random(11);
+    for (auto& byte : image) {
+        byte = (unsigned char)random();
+    }
+    std::string devicePath = loopDevices[0].deviceName;
+    {
+        ImageWriter writer{devicePath};
+        ASSERT_TRUE(writer.setDirectIO(true));
+        writeInChunks(writer, image);
+        writer.syncBlockDevice();
+    }
+
+    // Read back past the page cache as well, in unaligned chunks
+    image[5] ^= 1;
+    image[image.size() - 50] ^= 1;
+    {
+        ImageWriter writer{devicePath};
+        ASSERT_TRUE(writer.setDirectIO(true));
+        writer.setSkipUnchanged(true);
+        writeInChunks(writer, image, 100001);
+        writer.syncBlockDevice();
+        WriteStatistics statistics = writer.getWriteStatistics();
+        ASSERT_EQ(statistics.bytesWritten, 4096 + 100);
+        ASSERT_EQ(statistics.bytesRead, image.size());
+    }
+    std::ifstream device(devicePath, std::ios::binary);
+    std::vector<unsigned char> readBack(image.size());
+    device.read((char*)readBack.data(), readBack.size());
+    ASSERT_EQ(readBack, image);
+}
+
+// What is left in the page cache depends on memory pressure as well
+TEST_F(ImageWriterTest, writeImageFileBenchmarkDirectIO) {
+    storeImage(randomImage(19));
+    std::string devicePath = loopDevices[0].deviceName;
+    auto writeImage = [&](bool directIO) {
+        ImageWriter writer{devicePath};
+        {
+            int device = open(devicePath.c_str(), O_RDONLY);
+            ioctl(device, BLKFLSBUF);
+            close(device);
+        }
+        EXPECT_EQ(writer.setDirectIO(directIO), directIO);
+        double seconds = timeImageFileWrite(writer);
+        return std::make_pair(benchmarkImageSize / seconds / (1024 * 1024),
+                              cachedBytes(devicePath, benchmarkImageSize));
+    };
+
+    auto buffered = writeImage(false);
+    auto direct = writeImage(true);
+    std::cout << "buffered: " << buffered.first << " MiB/s, "
+              << buffered.second / (1024 * 1024) << " MiB cached" << std::endl
+              << "direct:   " << direct.first << " MiB/s, "
+              << direct.second / (1024 * 1024) << " MiB cached" << std::endl;
+}
+
+TEST_F(ImageWriterTest, writeImageFileTestIoUring) {
+    std::vector<unsigned char> image = createExt4Image();
+    {
+        std::ofstream imageFile(imagePath, std::ios::binary);
+        imageFile.write((const char*)image.data(), image.size());
+    }
+    std::string devicePath = loopDevices[1].deviceName;
+    ImageWriter writer{devicePath};
+    ASSERT_TRUE(writer.setWriteEngine(WriteEngine::IoUring, 3));
+    writer.buildBlockIndex(indexPath);
+    ASSERT_EQ(writer.writeImageFile(imagePath, 5000), (ssize_t)image.size());
+    writer.syncBlockDevice();
+    ASSERT_EQ(writer.getWriteStatistics().bytesWritten, image.size());
+    BlockIndex index(indexPath);
+    ASSERT_EQ(index.getImageDigest(), sha256(image.data(), image.size()));
+
+    // Queued writes of the runs that differ
+    writer.setSkipUnchanged(true);
+    image[5 * 4096] ^= 1;
+    image[image.size() - 1] ^= 1;
+    {
+        std::ofstream imageFile(imagePath, std::ios::binary);
+        imageFile.write((const char*)image.data(), image.size());
+    }
+    writer.buildBlockIndex(indexPath);
+    writer.writeImageFile(imagePath, 64 * 1024);
+    writer.syncBlockDevice();
+    WriteStatistics statistics = writer.getWriteStatistics();
+    ASSERT_EQ(statistics.bytesWritten, image.size() + 4096 + 1000);
+
+    // Direct, from the aligned buffers and through the synchronous path
+    for (size_t bufferSize : {64 * 1024, 5000}) {
+        for (auto& byte : image) {
+            byte ^= 0xff;
+        }
+        {
+            std::ofstream imageFile(imagePath, std::ios::binary);
+            imageFile.write((const char*)image.data(), image.size());
+        }
+        ASSERT_TRUE(writer.setDirectIO(true));
+        writer.writeImageFile(imagePath, bufferSize);
+        writer.syncBlockDevice();
+        std::ifstream device(devicePath, std::ios::binary);
+        std::vector<unsigned char> readBack(image.size());
+        device.read((char*)readBack.data(), readBack.size());
+        ASSERT_EQ(readBack, image);
+    }
+}
+
+TEST_F(ImageWriterTest, writeImageFileTestIoUringBlockMap) {
+    std::vector<unsigned char> image = createExt4Image();
+    {
+        std::ofstream imageFile(imagePath, std::ios::binary);
+        imageFile.write((const char*)image.data(), image.size());
+    }
+    std::string devicePath = loopDevices[1].deviceName;
+    {
+        ImageWriter writer{devicePath};
+        ASSERT_TRUE(writer.setWriteEngine(WriteEngine::IoUring));
+        writer.setBlockMap({{0, 8192}, {100 * 4096, 3 * 4096}, {768 * 4096, 4096}});
+        ASSERT_EQ(writer.writeImageFile(imagePath, 5000),
+                  (ssize_t)image.size());
+        WriteStatistics statistics = writer.getWriteStatistics();
+        ASSERT_EQ(statistics.bytesWritten, 8192 + 3 * 4096 + 1000);
+        ASSERT_EQ(statistics.bytesWritten + statistics.bytesDiscarded,
+                  image.size());
+    }
+    std::ifstream device(devicePath, std::ios::binary);
+    std::vector<unsigned char> readBack(image.size());
+    device.read((char*)readBack.data(), readBack.size());
+    ASSERT_TRUE(std::equal(image.begin() + 100 * 4096,
+                           image.begin() + 103 * 4096,
+                           readBack.begin() + 100 * 4096));
+}
+
+TEST_F(ImageWriterTest, setWriteEngineTestFallback) {
+    std::vector<unsigned char> image = createExt4Image();
+    {
+        std::ofstream imageFile(imagePath, std::ios::binary);
+        imageFile.write((const char*)image.data(), image.size());
+    }
+    ImageWriter writer{loopDevices[1].deviceName};
+    // No queue at all is refused by io_uring_setup
+    ASSERT_FALSE(writer.setWriteEngine(WriteEngine::IoUring, 0));
+    ASSERT_EQ(writer.writeImageFile(imagePath, 100000), (ssize_t)image.size());
+    ASSERT_TRUE(writer.setWriteEngine(WriteEngine::Synchronous));
+}
+
+TEST_F(ImageWriterTest, writeImageFileTestIoUringReadFails) {
+    ImageWriter writer{loopDevices[1].deviceName};
+    ASSERT_TRUE(writer.setWriteEngine(WriteEngine::IoUring));
+    std::vector<unsigned char> image = createExt4Image();
+    writer.buildBlockIndex(indexPath);
+    writer.writeChunk(image.data(), image.size(), 0);
+    // A directory has a size, but can't be read
+    ASSERT_THROW(writer.writeImageFile("virtual_device", 5000),
+                 ImageFileException);
+    writer.syncBlockDevice();
+    ASSERT_THROW(BlockIndex{indexPath}, BlockIndexException);
+}
+
+TEST_F(ImageWriterTest, writeImageFileTestThreaded) {
+    std::vector<unsigned char> image = createExt4Image();
+    {
+        std::ofstream imageFile(imagePath, std::ios::binary);
+        imageFile.write((const char*)image.data(), image.size());
+    }
+    std::string devicePath = loopDevices[1].deviceName;
+    ImageWriter writer{devicePath};
+    ASSERT_TRUE(writer.setWriteEngine(WriteEngine::Threaded, 3));
+    writer.buildBlockIndex(indexPath);
+    ASSERT_EQ(writer.writeImageFile(imagePath, 5000), (ssize_t)image.size());
+    writer.syncBlockDevice();
+    ASSERT_EQ(writer.getWriteStatistics().bytesWritten, image.size());
+    BlockIndex index(indexPath);
+    ASSERT_EQ(index.getImageDigest(), sha256(image.data(), image.size()));
+
+    // More buffers than reads, and the fewest the engine uses
+    for (unsigned queueDepth : {64u, 1u}) {
+        for (auto& byte : image) {
+            byte ^= 0xff;
+        }
+        {
+            std::ofstream imageFile(imagePath, std::ios::binary);
+            imageFile.write((const char*)image.data(), image.size());
+        }
+        ASSERT_TRUE(writer.setWriteEngine(WriteEngine::Threaded, queueDepth));
+        writer.writeImageFile(imagePath, 64 * 1024);
+        writer.syncBlockDevice();
+        std::ifstream device(devicePath, std::ios::binary);
+        std::vector<unsigned char> readBack(image.size());
+        device.read((char*)readBack.data(), readBack.size());
+        ASSERT_EQ(readBack, image);
+    }
+
+    // Gaps of the block map are discarded in order
+    writer.setBlockMap({{0, 8192}, {100 * 4096, 3 * 4096}, {768 * 4096, 4096}});
+    WriteStatistics before = writer.getWriteStatistics();
+    ASSERT_EQ(writer.writeImageFile(imagePath, 5000), (ssize_t)image.size());
+    WriteStatistics statistics = writer.getWriteStatistics();
+    ASSERT_EQ(statistics.bytesWritten - before.bytesWritten,
+              8192 + 3 * 4096 + 1000);
+    ASSERT_EQ(statistics.bytesWritten - before.bytesWritten +
+                  statistics.bytesDiscarded - before.bytesDiscarded,
+              image.size());
+}
+
+TEST_F(ImageWriterTest, writeImageFileTestThreadedReadFails) {
+    ImageWriter writer{loopDevices[1].deviceName};
+    ASSERT_TRUE(writer.setWriteEngine(WriteEngine::Threaded));
+    std::vector<unsigned char> image = createExt4Image();
+    writer.buildBlockIndex(indexPath);
+    writer.writeChunk(image.data(), image.size(), 0);
+    // A directory has a size, but can't be read
+    ASSERT_THROW(writer.writeImageFile("virtual_device", 5000),
+                 ImageFileException);
+    writer.syncBlockDevice();
+    ASSERT_THROW(BlockIndex{indexPath}, BlockIndexException);
+}
+
+TEST(SpscRingTest, passesValuesInOrder) {
+    SpscRing<unsigned> ring(3);
+    unsigned value = 0;
+    ASSERT_FALSE(ring.tryPop(value));
+    for (unsigned i = 0; i < 3; i++) {
+        ASSERT_TRUE(ring.tryPush(i));
+    }
+    ASSERT_FALSE(ring.tryPush(3));
+
+    // Wrapping around many times between two threads
+    const unsigned count = 100000;
+    std::thread producer([&] {
+        for (unsigned i = 3; i < count; i++) {
+            while (!ring.tryPush(i)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+    for (unsigned i = 0; i < count; i++) {
+        while (!ring.tryPop(value)) {
+            std::this_thread::yield();
+        }
+        ASSERT_EQ(value, i);
+    }
+    producer.join();
+    ASSERT_FALSE(ring.tryPop(value));
+}
+
+TEST_F(ImageWriterTest, writeImageFileBenchmarkIoUring) {
+    storeImage(randomImage(23));
+    {
+        // The kernel lacks io_uring or seccomp forbids it; the writer falls
+        // back to the synchronous engine then, there is nothing to compare
+        ImageWriter writer{loopDevices[0].deviceName};
+        if (!writer.setWriteEngine(WriteEngine::IoUring)) {
+            GTEST_SKIP() << "io_uring is not available";
+        }
+    }
+    auto writeImage = [&](WriteEngine engine) {
+        ImageWriter writer{loopDevices[0].deviceName};
+        EXPECT_TRUE(writer.setWriteEngine(engine));
+        writer.setDirectIO(true);
+        return benchmarkImageSize / timeImageFileWrite(writer) / (1024 * 1024);
+    };
+
+    double synchronous = writeImage(WriteEngine::Synchronous);
+    double threaded = writeImage(WriteEngine::Threaded);
+    double ioUring = writeImage(WriteEngine::IoUring);
+    std::cout << "synchronous: " << synchronous << " MiB/s" << std::endl
+              << "threaded:    " << threaded << " MiB/s" << std::endl
+              << "io_uring:    " << ioUring << " MiB/s" << std::endl;
+}
 
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
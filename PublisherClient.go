@@ -4,13 +4,16 @@ import (
 	"bytes"
 	"crypto/rand"
 	"crypto/rsa"
+	"crypto/sha256"
 	"crypto/tls"
 	"crypto/x509"
+	"encoding/hex"
 	"encoding/json"
 	"encoding/pem"
 	"errors"
 	"flag"
 	"fmt"
+	"io"
 	"io/ioutil"
 	"log"
 	"net/http"
@@ -101,6 +104,42 @@ type PublisherClient struct {
 }
 
 func (client PublisherClient) UploadArtifact(updateId uint32, artifactPath string) error {
+	return client.uploadArtifact(updateId, artifactPath, nil)
+}
+
+// Uploads the delta artifact of an update, encrypted with the same aes-key as the full one but
+// with its own iv. Length and SHA-256 of the source image go along, so devices can check their
+// active partition against it before they download the delta.
+func (client PublisherClient) UploadDeltaArtifact(updateId uint32, artifactPath string, ivPath string,
+	sourcePath string) error {
+	iv, err := ioutil.ReadFile(ivPath)
+	if err != nil {
+		return err
+	}
+	source, err := os.Open(sourcePath)
+	if err != nil {
+		return err
+	}
+	defer source.Close()
+	digest := sha256.New()
+	sourceLength, err := io.Copy(digest, source)
+	if err != nil {
+		return err
+	}
+	return client.uploadArtifact(updateId, artifactPath, map[string]string{
+		"delta":        "1",
+		"iv":           hex.EncodeToString(iv),
+		"sourceLength": fmt.Sprint(sourceLength),
+		"sourceSha256": hex.EncodeToString(digest.Sum(nil)),
+	})
+}
+
+// Uploads the block manifest ArtifactCreator wrote next to the full artifact
+func (client PublisherClient) UploadManifest(updateId uint32, manifestPath string) error {
+	return client.uploadArtifact(updateId, manifestPath, map[string]string{"manifest": "1"})
+}
+
+func (client PublisherClient) uploadArtifact(updateId uint32, artifactPath string, params map[string]string) error {
 	println("Sending id: ", updateId, "\n")
 	artifact, err := ioutil.ReadFile(artifactPath)
 	if err != nil {
@@ -109,6 +148,9 @@ func (client PublisherClient) UploadArtifact(updateId uint32, artifactPath strin
 	req, err := http.NewRequest("POST", "https://localhost:8090/uploadArtifact", bytes.NewBuffer(artifact))
 	q := req.URL.Query()
 	q.Add("updateId", fmt.Sprint(updateId))
+	for key, value := range params {
+		q.Add(key, value)
+	}
 	req.URL.RawQuery = q.Encode()
 	resp, err := client.httpClient.Do(req)
 	if err != nil {
@@ -184,6 +226,10 @@ func main() {
 	keyFlag := flag.String("key", "", "Specify path ot aes-key")
 	certsFlag := flag.String("certs", "", "Specify path to client-cert-dirs")
 	availableFlag := flag.String("available", "", "Specify the time of availability of the update")
+	deltaFlag := flag.String("delta", "", "Specify the delta artifact, created with the same aes-key")
+	deltaIvFlag := flag.String("deltaIv", "", "Specify path to the iv of the delta artifact")
+	deltaSourceFlag := flag.String("deltaSource", "", "Specify the image the delta artifact was made against")
+	manifestFlag := flag.String("manifest", "", "Specify the block manifest of the artifact")
 
 	flag.Parse()
 
@@ -207,9 +253,27 @@ func main() {
 		panic(err)
 	}
 	updateId, err := pubClient.SendPrepareUpdateMessage(m, av)
+	if err != nil {
+		log.Fatal(err)
+	}
 	fmt.Println(updateId)
 
 	err = pubClient.UploadArtifact(updateId, *artifactFlag)
+	if err != nil {
+		log.Fatal(err)
+	}
+	if *deltaFlag != "" {
+		err = pubClient.UploadDeltaArtifact(updateId, *deltaFlag, *deltaIvFlag, *deltaSourceFlag)
+		if err != nil {
+			log.Fatal(err)
+		}
+	}
+	if *manifestFlag != "" {
+		err = pubClient.UploadManifest(updateId, *manifestFlag)
+		if err != nil {
+			log.Fatal(err)
+		}
+	}
 	err = SaveCiphertexts("aesCiphertexts", m)
 	if err != nil {
 		log.Fatal(err)
@@ -4,8 +4,10 @@ import (
 	"crypto/tls"
 	"crypto/x509"
 	"encoding/binary"
+	"encoding/hex"
 	"encoding/json"
 	"fmt"
+	"hash/fnv"
 	"io/ioutil"
 	"log"
 	"net/http"
@@ -14,6 +16,7 @@ import (
 	"sort"
 	"strconv"
 	"strings"
+	"sync"
 	"time"
 )
 
@@ -29,6 +32,60 @@ type PrepareUpdateData struct {
 
 var pendingUpdates = make(map[string][]PendingUpdate)
 
+// Guards pendingUpdates; updatesChanged is closed and replaced whenever setup rebuilds it
+var updatesMutex sync.Mutex
+var updatesChanged = make(chan struct{})
+
+// Upper bound for the wait parameter of /whatsNew
+const maxLongPollWait = 5 * time.Minute
+
+// Optional delta artifact of an update, stored next to the full one. It is encrypted with the
+// same key as the full artifact, but with its own iv.
+const deltaArtifactName = "delta.artifact"
+const deltaIVName = "delta.iv"
+
+// The image the delta artifact was made against, handed out with its key so devices can check
+// their active partition before downloading the delta
+const deltaSourceName = "delta.source"
+
+type DeltaSource struct {
+	Length uint64   `json:"length"`
+	SHA256 [32]byte `json:"sha256"`
+}
+
+// Requests with delta=1 are about the delta artifact of an update
+func wantsDelta(req *http.Request) bool {
+	return req.URL.Query().Get("delta") == "1"
+}
+
+// Optional block manifest of the full artifact, which devices use to download only the blocks
+// they don't have already
+const manifestName = "manifest"
+
+// Requests with manifest=1 are about the manifest of an update
+func wantsManifest(req *http.Request) bool {
+	return req.URL.Query().Get("manifest") == "1"
+}
+
+// Returns the IDs of the device's updates that are available now, the time at which the next
+// scheduled one becomes available (zero if none), and a channel closed on the next change
+func availableUpdates(deviceName string) ([]uint32, time.Time, chan struct{}) {
+	updatesMutex.Lock()
+	defer updatesMutex.Unlock()
+
+	avUpdates := make([]uint32, 0)
+	var next time.Time
+	now := time.Now().Unix()
+	for _, upd := range pendingUpdates[deviceName] {
+		if now > upd.Timestamp {
+			avUpdates = append(avUpdates, upd.UpdateId)
+		} else if scheduled := time.Unix(upd.Timestamp+1, 0); next.IsZero() || scheduled.Before(next) {
+			next = scheduled
+		}
+	}
+	return avUpdates, next, updatesChanged
+}
+
 func reserveID() (uint32, error) {
 	storageDir := "artifacts"
 	var fileNames []uint32
@@ -61,8 +118,9 @@ func reserveID() (uint32, error) {
 }
 
 type DecryptionKeyIVPair struct {
-	CT [256]byte `json:"ct"`
-	IV [12]byte  `json:"iv"`
+	CT     [256]byte    `json:"ct"`
+	IV     [12]byte     `json:"iv"`
+	Source *DeltaSource `json:"source,omitempty"`
 }
 
 type DecryptionKeyCiphertext struct {
@@ -106,6 +164,9 @@ func getDecryptionKey(w http.ResponseWriter, req *http.Request) {
 		return
 	}
 	ivPath := fmt.Sprintf("artifacts/%d/%s_iv", updateId, deviceName)
+	if wantsDelta(req) {
+		ivPath = fmt.Sprintf("artifacts/%d/%s", updateId, deltaIVName)
+	}
 
 	iv, err := ioutil.ReadFile(ivPath)
 
@@ -122,6 +183,24 @@ func getDecryptionKey(w http.ResponseWriter, req *http.Request) {
 	copy(decryptionIVpair.IV[:], iv)
 	copy(decryptionIVpair.CT[:], key)
 
+	if wantsDelta(req) {
+		// A delta without its source can't be checked by the device before the download
+		rawSource, err := ioutil.ReadFile(fmt.Sprintf("artifacts/%d/%s", updateId, deltaSourceName))
+		if err != nil {
+			if os.IsNotExist(err) {
+				w.WriteHeader(404)
+			} else {
+				w.WriteHeader(503)
+			}
+			return
+		}
+		decryptionIVpair.Source = &DeltaSource{}
+		if err := json.Unmarshal(rawSource, decryptionIVpair.Source); err != nil {
+			w.WriteHeader(503)
+			return
+		}
+	}
+
 	jsonB, err := json.Marshal(decryptionIVpair)
 	if err != nil {
 		w.WriteHeader(503)
@@ -202,6 +281,17 @@ func PrepareUpdateDirectory(keyList []DecryptionKeyCiphertext, available int64)
 	return newId, nil
 }
 
+// Identifies a list of available updates for If-None-Match
+func updatesETag(updates []uint32) string {
+	hash := fnv.New64a()
+	binary.Write(hash, binary.LittleEndian, updates)
+	return fmt.Sprintf("\"%x\"", hash.Sum64())
+}
+
+// With wait=<seconds>, the request is held until an update becomes available or the wait is
+// over, so devices notice new updates right away without polling in short intervals.
+// If-None-Match with the ETag of the last answer gets a 304 while nothing changed, and
+// since=<updateId> leaves out the updates up to that ID the device has seen already.
 func whatsNew(w http.ResponseWriter, req *http.Request) {
 
 	if len(req.TLS.PeerCertificates[0].DNSNames) < 1 {
@@ -210,18 +300,48 @@ func whatsNew(w http.ResponseWriter, req *http.Request) {
 	}
 
 	deviceName := req.TLS.PeerCertificates[0].DNSNames[0]
-	updates := pendingUpdates[deviceName]
 
-	if updates == nil {
-		w.WriteHeader(204)
-		return
+	var wait time.Duration
+	if params, ok := req.URL.Query()["wait"]; ok && len(params[0]) > 0 {
+		seconds, err := strconv.Atoi(params[0])
+		if err != nil || seconds < 0 {
+			w.WriteHeader(400)
+			return
+		}
+		wait = time.Duration(seconds) * time.Second
+		if wait > maxLongPollWait {
+			wait = maxLongPollWait
+		}
+	}
+	var since uint64
+	if params, ok := req.URL.Query()["since"]; ok && len(params[0]) > 0 {
+		var err error
+		since, err = strconv.ParseUint(params[0], 10, 32)
+		if err != nil {
+			w.WriteHeader(400)
+			return
+		}
 	}
+	ifNoneMatch := req.Header.Get("If-None-Match")
 
-	avUpdates := make([]uint32, 0)
-	for _, upd := range updates {
-		if time.Now().Unix() > upd.Timestamp {
-			avUpdates = append(avUpdates, upd.UpdateId)
+	deadline := time.NewTimer(wait)
+	defer deadline.Stop()
+
+	avUpdates, next, changed := availableUpdates(deviceName)
+	for (len(avUpdates) == 0 || updatesETag(avUpdates) == ifNoneMatch) && wait > 0 {
+		var scheduled <-chan time.Time
+		if !next.IsZero() {
+			scheduled = time.After(time.Until(next))
 		}
+		select {
+		case <-changed:
+		case <-scheduled:
+		case <-deadline.C:
+			wait = 0
+		case <-req.Context().Done():
+			return
+		}
+		avUpdates, next, changed = availableUpdates(deviceName)
 	}
 
 	if len(avUpdates) == 0 {
@@ -229,7 +349,21 @@ func whatsNew(w http.ResponseWriter, req *http.Request) {
 		return
 	}
 
-	jsonB, err := json.Marshal(avUpdates)
+	etag := updatesETag(avUpdates)
+	w.Header().Set("ETag", etag)
+	if etag == ifNoneMatch {
+		w.WriteHeader(304)
+		return
+	}
+
+	newUpdates := make([]uint32, 0, len(avUpdates))
+	for _, upd := range avUpdates {
+		if uint64(upd) > since {
+			newUpdates = append(newUpdates, upd)
+		}
+	}
+
+	jsonB, err := json.Marshal(newUpdates)
 	if err != nil {
 		fmt.Println(err)
 		w.WriteHeader(500)
@@ -263,6 +397,27 @@ func uploadArtifact(w http.ResponseWriter, req *http.Request) {
 	}
 
 	artifactPath := fmt.Sprintf("%s/%d", updatePath, updateId)
+	var deltaIV []byte
+	var deltaSource []byte
+	if wantsDelta(req) {
+		deltaIV, err = hex.DecodeString(req.URL.Query().Get("iv"))
+		if err != nil || len(deltaIV) != 12 {
+			w.WriteHeader(400)
+			return
+		}
+		var source DeltaSource
+		source.Length, err = strconv.ParseUint(req.URL.Query().Get("sourceLength"), 10, 64)
+		sourceSHA256, hexErr := hex.DecodeString(req.URL.Query().Get("sourceSha256"))
+		if err != nil || hexErr != nil || len(sourceSHA256) != len(source.SHA256) {
+			w.WriteHeader(400)
+			return
+		}
+		copy(source.SHA256[:], sourceSHA256)
+		deltaSource, _ = json.Marshal(source)
+		artifactPath = fmt.Sprintf("%s/%s", updatePath, deltaArtifactName)
+	} else if wantsManifest(req) {
+		artifactPath = fmt.Sprintf("%s/%s", updatePath, manifestName)
+	}
 	if _, err := os.Stat(artifactPath); err == nil {
 		// Artifact already exists
 		fmt.Fprint(w, "File already exists")
@@ -275,6 +430,12 @@ func uploadArtifact(w http.ResponseWriter, req *http.Request) {
 		return
 	}
 	err = ioutil.WriteFile(artifactPath, body, 0777)
+	if err == nil && deltaIV != nil {
+		err = ioutil.WriteFile(fmt.Sprintf("%s/%s", updatePath, deltaIVName), deltaIV, 0777)
+	}
+	if err == nil && deltaSource != nil {
+		err = ioutil.WriteFile(fmt.Sprintf("%s/%s", updatePath, deltaSourceName), deltaSource, 0777)
+	}
 	if err != nil {
 		fmt.Println(err)
 		w.WriteHeader(503)
@@ -312,11 +473,13 @@ func getUpdate(w http.ResponseWriter, req *http.Request) {
 
 	privileged := false
 
+	updatesMutex.Lock()
 	for _, update := range pendingUpdates[deviceName] {
 		if update.UpdateId == updateId {
 			privileged = true
 		}
 	}
+	updatesMutex.Unlock()
 
 	if !privileged {
 		w.WriteHeader(401)
@@ -324,8 +487,16 @@ func getUpdate(w http.ResponseWriter, req *http.Request) {
 	}
 
 	artifactPath := fmt.Sprintf("artifacts/%d/%d", updateId, updateId)
+	variant := "full"
+	if wantsDelta(req) {
+		artifactPath = fmt.Sprintf("artifacts/%d/%s", updateId, deltaArtifactName)
+		variant = "delta"
+	} else if wantsManifest(req) {
+		artifactPath = fmt.Sprintf("artifacts/%d/%s", updateId, manifestName)
+		variant = "manifest"
+	}
 
-	artifact, err := ioutil.ReadFile(artifactPath)
+	artifact, err := os.Open(artifactPath)
 	if err != nil {
 		if os.IsNotExist(err) {
 			w.WriteHeader(404)
@@ -334,12 +505,19 @@ func getUpdate(w http.ResponseWriter, req *http.Request) {
 		}
 		return
 	}
+	defer artifact.Close()
 
-	w.WriteHeader(200)
-	_, err = w.Write(artifact)
+	info, err := artifact.Stat()
 	if err != nil {
-		fmt.Println(err)
+		w.WriteHeader(503)
+		return
 	}
+
+	// ServeContent answers Range requests, so devices can continue interrupted downloads.
+	// The ETag lets If-Range detect an artifact that was replaced in the meantime.
+	w.Header().Set("Content-Type", "application/octet-stream")
+	w.Header().Set("ETag", fmt.Sprintf("\"%d-%s-%d-%d\"", updateId, variant, info.Size(), info.ModTime().UnixNano()))
+	http.ServeContent(w, req, "", info.ModTime(), artifact)
 }
 
 func CreateHTTPSServer(rootCaCert string) (*http.Server, error) {
@@ -382,7 +560,7 @@ func setup() error {
 		}
 	}
 
-	pendingUpdates = make(map[string][]PendingUpdate)
+	updates := make(map[string][]PendingUpdate)
 	err := filepath.Walk(storageDir, func(path string, info os.FileInfo, err error) error {
 
 		if strings.Count(path, "/") == 2 {
@@ -416,6 +594,11 @@ func setup() error {
 				return nil
 			}
 
+			if info.Name() == deltaArtifactName || info.Name() == deltaIVName || info.Name() == deltaSourceName ||
+				info.Name() == manifestName {
+				return nil
+			}
+
 			rawTimestamp, err := ioutil.ReadFile(timeStampPath)
 			if err != nil {
 				return err
@@ -424,15 +607,22 @@ func setup() error {
 			timestamp := int64(binary.LittleEndian.Uint64(rawTimestamp))
 			update := PendingUpdate{UpdateId: updateId, Timestamp: timestamp}
 
-			pendingUpdates[info.Name()] = append(pendingUpdates[info.Name()], update)
-			for _, updates := range pendingUpdates {
-				sort.Slice(updates, func(i int, j int) bool { return updates[i].Timestamp > updates[j].Timestamp })
+			updates[info.Name()] = append(updates[info.Name()], update)
+			for _, deviceUpdates := range updates {
+				sort.Slice(deviceUpdates, func(i int, j int) bool { return deviceUpdates[i].Timestamp > deviceUpdates[j].Timestamp })
 			}
 		}
 
 		return err
 	})
 
+	// Wakes the held /whatsNew requests
+	updatesMutex.Lock()
+	pendingUpdates = updates
+	close(updatesChanged)
+	updatesChanged = make(chan struct{})
+	updatesMutex.Unlock()
+
 	return err
 }
 